@@ -15,6 +15,68 @@
 #include <omp.h>
 #endif
 
+/*
+ * Functions on the frozen indexes.
+ */
+
+static void frozenIndex_construct(CactusDiskFrozenIndex *index, stList *objects, Name (*getName)(void *)) {
+    // The objects must be sorted by name
+    index->length = stList_length(objects);
+    index->names = st_malloc(index->length * sizeof(Name));
+    index->objects = st_malloc(index->length * sizeof(void *));
+    for (int64_t i = 0; i < index->length; i++) {
+        index->objects[i] = stList_get(objects, i);
+        index->names[i] = getName(index->objects[i]);
+        assert(i == 0 || index->names[i-1] < index->names[i]);
+    }
+}
+
+static void frozenIndex_destruct(CactusDiskFrozenIndex *index) {
+    free(index->names);
+    free(index->objects);
+    index->length = 0;
+    index->names = NULL;
+    index->objects = NULL;
+}
+
+/*
+ * Returns the index of the given name in the frozen index, or -1 if not present.
+ */
+static int64_t frozenIndex_find(CactusDiskFrozenIndex *index, Name name) {
+    int64_t low = 0, high = index->length;
+    while (low < high) {
+        int64_t mid = low + (high - low) / 2;
+        if (index->names[mid] < name) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < index->length && index->names[low] == name ? low : -1;
+}
+
+static void *frozenIndex_search(CactusDiskFrozenIndex *index, Name name) {
+    int64_t i = frozenIndex_find(index, name);
+    void *object = NULL;
+    if (i != -1) {
+#if defined(_OPENMP)
+#pragma omp atomic read
+#endif
+        object = index->objects[i];
+    }
+    return object;
+}
+
+static void frozenIndex_remove(CactusDiskFrozenIndex *index, Name name) {
+    int64_t i = frozenIndex_find(index, name);
+    if (i != -1) {
+#if defined(_OPENMP)
+#pragma omp atomic write
+#endif
+        index->objects[i] = NULL;
+    }
+}
+
 /*
  * Functions on meta sequences.
  */
@@ -36,6 +98,9 @@ void cactusDisk_removeSequence(CactusDisk *cactusDisk, Sequence *sequence) {
 #endif
     assert(stSortedSet_search(cactusDisk->sequences, sequence) != NULL);
     stSortedSet_remove(cactusDisk->sequences, sequence);
+    if (cactusDisk->frozen) {
+        frozenIndex_remove(&cactusDisk->frozenSequences, sequence_getName(sequence));
+    }
 #if defined(_OPENMP)
     omp_unset_lock(&(cactusDisk->writelock));
 #endif
@@ -53,40 +118,40 @@ Name cactusDisk_addString(CactusDisk *cactusDisk, const char *string) {
 #if defined(_OPENMP)
     omp_set_lock(&(cactusDisk->writelock));
 #endif
-    stHash_insert(cactusDisk->allStrings, (void *)name, stString_copy(string)); // Cheeky 64bit to pointer conversion
+    sequenceStore_add(cactusDisk->sequenceStore, name, string);
 #if defined(_OPENMP)
     omp_unset_lock(&(cactusDisk->writelock));
 #endif
     return name;
 }
 
-char *cactusDisk_getString(CactusDisk *cactusDisk, Name name, int64_t start, int64_t length, int64_t strand,
-        int64_t totalSequenceLength) {
-    /*
-     * Gets a string from the database.
-     *
-     */
+void cactusDisk_getWindow(CactusDisk *cactusDisk, Name name, int64_t start, int64_t length, int64_t strand,
+        SequenceWindow *window) {
     assert(length >= 0);
-    if (length == 0) {
-        return stString_copy("");
+    if (cactusDisk->frozen && sequenceStore_getFrozenWindow(cactusDisk->sequenceStore, name, start, length, strand, window)) {
+        return; // Lock free
     }
-
 #if defined(_OPENMP)
     omp_set_lock(&(cactusDisk->writelock));
 #endif
-    char *string = stHash_search(cactusDisk->allStrings, (void *)name); // Cheeky 64bit int to pointer conversion
+    sequenceStore_getWindow(cactusDisk->sequenceStore, name, start, length, strand, window);
 #if defined(_OPENMP)
     omp_unset_lock(&(cactusDisk->writelock));
 #endif
+}
 
-    assert(string != NULL);
-    string = stString_getSubString(string, start, length);
-    if(!strand) {
-        char *reverseComplement = stString_reverseComplementString(string);
-        free(string);
-        return reverseComplement;
+char *cactusDisk_getString(CactusDisk *cactusDisk, Name name, int64_t start, int64_t length, int64_t strand,
+        int64_t totalSequenceLength) {
+    /*
+     * Gets a string from the database, decoding it straight into the returned buffer.
+     */
+    assert(length >= 0);
+    if (length == 0) {
+        return stString_copy("");
     }
-    return string;
+    SequenceWindow window;
+    cactusDisk_getWindow(cactusDisk, name, start, length, strand, &window);
+    return sequenceWindow_getString(&window);
 }
 
 ////////////////////////////////////////////////
@@ -109,32 +174,57 @@ static int cactusDisk_constructSequencesP(const void *o1, const void *o2) {
  * The following two functions compress and decompress the data in the cactus disk..
  */
 
+static int64_t cactusDisk_serials = 0;
+
+static int64_t cactusDisk_getNextSerial() {
+    int64_t serial;
+#if defined(_OPENMP)
+#pragma omp atomic capture
+#endif
+    serial = ++cactusDisk_serials;
+    return serial;
+}
+
 CactusDisk *cactusDisk_construct() {
+    return cactusDisk_construct2(NULL);
+}
+
+CactusDisk *cactusDisk_construct2(const char *sequenceStoreFile) {
     CactusDisk *cactusDisk = st_calloc(1, sizeof(CactusDisk));
     cactusDisk->sequences = stSortedSet_construct3(cactusDisk_constructSequencesP, NULL);
-    cactusDisk->flowers = stSortedSet_construct3(cactusDisk_constructFlowersP, NULL);
+    for (int64_t i = 0; i < CACTUS_DISK_FLOWER_SHARDS; i++) {
+        cactusDisk->flowers[i] = stSortedSet_construct3(cactusDisk_constructFlowersP, NULL);
+    }
     cactusDisk->eventTree = NULL;
-    cactusDisk->allStrings = stHash_construct2(NULL, free);
+    cactusDisk->sequenceStore = sequenceStore_construct(sequenceStoreFile);
     cactusDisk->currentName = 1; // Start the naming of objects from 1
+    cactusDisk->serial = cactusDisk_getNextSerial();
 #if defined(_OPENMP)
         omp_init_lock(&(cactusDisk->writelock));
+        for (int64_t i = 0; i < CACTUS_DISK_FLOWER_SHARDS; i++) {
+            omp_init_lock(&(cactusDisk->flowerLocks[i]));
+        }
 #endif
     return cactusDisk;
 }
 
 void cactusDisk_destruct(CactusDisk *cactusDisk) {
-    Flower *flower;
-    while ((flower = stSortedSet_getFirst(cactusDisk->flowers)) != NULL) {
-        flower_destruct(flower, FALSE, FALSE);
+    for (int64_t i = 0; i < CACTUS_DISK_FLOWER_SHARDS; i++) {
+        Flower *flower;
+        while ((flower = stSortedSet_getFirst(cactusDisk->flowers[i])) != NULL) {
+            flower_destruct(flower, FALSE, FALSE);
+        }
+        stSortedSet_destruct(cactusDisk->flowers[i]);
     }
-    stSortedSet_destruct(cactusDisk->flowers);
+    frozenIndex_destruct(&cactusDisk->frozenFlowers);
+    frozenIndex_destruct(&cactusDisk->frozenSequences);
 
     Sequence *sequence;
     while ((sequence = stSortedSet_getFirst(cactusDisk->sequences)) != NULL) {
         sequence_destruct(sequence);
     }
     stSortedSet_destruct(cactusDisk->sequences);
-    stHash_destruct(cactusDisk->allStrings); // cleanup the library of strings we hold in memory
+    sequenceStore_destruct(cactusDisk->sequenceStore); // cleanup the library of strings we hold in memory
 
     if(cactusDisk->eventTree != NULL) {
         eventTree_destruct(cactusDisk->eventTree);
@@ -142,25 +232,45 @@ void cactusDisk_destruct(CactusDisk *cactusDisk) {
 
 #if defined(_OPENMP)
     omp_destroy_lock(&(cactusDisk->writelock));
+    for (int64_t i = 0; i < CACTUS_DISK_FLOWER_SHARDS; i++) {
+        omp_destroy_lock(&(cactusDisk->flowerLocks[i]));
+    }
 #endif
 
     free(cactusDisk);
 }
 
+static int64_t cactusDisk_getFlowerShard(Name flowerName) {
+    return (int64_t)((uint64_t)flowerName % CACTUS_DISK_FLOWER_SHARDS);
+}
+
 Flower *cactusDisk_getFlower(CactusDisk *cactusDisk, Name flowerName) {
+    if (cactusDisk->frozen) {
+        Flower *flower2 = frozenIndex_search(&cactusDisk->frozenFlowers, flowerName);
+        if (flower2 != NULL) {
+            return flower2; // Lock free
+        }
+    }
     Flower flower;
     flower.name = flowerName;
+    int64_t shard = cactusDisk_getFlowerShard(flowerName);
 #if defined(_OPENMP)
-        omp_set_lock(&(cactusDisk->writelock));
+        omp_set_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
-        Flower *flower2 = stSortedSet_search(cactusDisk->flowers, &flower);
+        Flower *flower2 = stSortedSet_search(cactusDisk->flowers[shard], &flower);
 #if defined(_OPENMP)
-        omp_unset_lock(&(cactusDisk->writelock));
+        omp_unset_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
     return flower2;
 }
 
 Sequence *cactusDisk_getSequence(CactusDisk *cactusDisk, Name sequenceName) {
+    if (cactusDisk->frozen) {
+        Sequence *sequence2 = frozenIndex_search(&cactusDisk->frozenSequences, sequenceName);
+        if (sequence2 != NULL) {
+            return sequence2; // Lock free
+        }
+    }
     Sequence sequence;
     sequence.name = sequenceName;
 #if defined(_OPENMP)
@@ -173,29 +283,74 @@ Sequence *cactusDisk_getSequence(CactusDisk *cactusDisk, Name sequenceName) {
     return sequence2;
 }
 
+static Name cactusDisk_freezeFlowerName(void *flower) {
+    return flower_getName(flower);
+}
+
+static Name cactusDisk_freezeSequenceName(void *sequence) {
+    return sequence_getName(sequence);
+}
+
+void cactusDisk_freeze(CactusDisk *cactusDisk) {
+    frozenIndex_destruct(&cactusDisk->frozenFlowers);
+    frozenIndex_destruct(&cactusDisk->frozenSequences);
+
+    stList *flowers = stList_construct();
+    for (int64_t i = 0; i < CACTUS_DISK_FLOWER_SHARDS; i++) {
+        stSortedSetIterator *it = stSortedSet_getIterator(cactusDisk->flowers[i]);
+        Flower *flower;
+        while ((flower = stSortedSet_getNext(it)) != NULL) {
+            stList_append(flowers, flower);
+        }
+        stSortedSet_destructIterator(it);
+    }
+    stList_sort(flowers, cactusDisk_constructFlowersP);
+    frozenIndex_construct(&cactusDisk->frozenFlowers, flowers, cactusDisk_freezeFlowerName);
+    stList_destruct(flowers);
+
+    stList *sequences = stSortedSet_getList(cactusDisk->sequences); // Already in name order
+    frozenIndex_construct(&cactusDisk->frozenSequences, sequences, cactusDisk_freezeSequenceName);
+    stList_destruct(sequences);
+
+    sequenceStore_freeze(cactusDisk->sequenceStore);
+    if (cactusDisk_getEventTree(cactusDisk) != NULL) {
+        eventTree_freeze(cactusDisk_getEventTree(cactusDisk));
+    }
+    cactusDisk->frozen = 1;
+}
+
+bool cactusDisk_isFrozen(CactusDisk *cactusDisk) {
+    return cactusDisk->frozen;
+}
+
 /*
  * Private functions.
  */
 
 void cactusDisk_addFlower(CactusDisk *cactusDisk, Flower *flower) {
+    int64_t shard = cactusDisk_getFlowerShard(flower_getName(flower));
 #if defined(_OPENMP)
-        omp_set_lock(&(cactusDisk->writelock));
+        omp_set_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
-        assert(stSortedSet_search(cactusDisk->flowers, flower) == NULL);
-        stSortedSet_insert(cactusDisk->flowers, flower);
+        assert(stSortedSet_search(cactusDisk->flowers[shard], flower) == NULL);
+        stSortedSet_insert(cactusDisk->flowers[shard], flower);
 #if defined(_OPENMP)
-        omp_unset_lock(&(cactusDisk->writelock));
+        omp_unset_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
 }
 
 void cactusDisk_removeFlower(CactusDisk *cactusDisk, Flower *flower) {
+    int64_t shard = cactusDisk_getFlowerShard(flower_getName(flower));
 #if defined(_OPENMP)
-        omp_set_lock(&(cactusDisk->writelock));
+        omp_set_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
-        assert(stSortedSet_search(cactusDisk->flowers, flower) != NULL);
-        stSortedSet_remove(cactusDisk->flowers, flower);
+        assert(stSortedSet_search(cactusDisk->flowers[shard], flower) != NULL);
+        stSortedSet_remove(cactusDisk->flowers[shard], flower);
+        if (cactusDisk->frozen) {
+            frozenIndex_remove(&cactusDisk->frozenFlowers, flower_getName(flower));
+        }
 #if defined(_OPENMP)
-        omp_unset_lock(&(cactusDisk->writelock));
+        omp_unset_lock(&(cactusDisk->flowerLocks[shard]));
 #endif
 }
 
@@ -207,15 +362,55 @@ void cactusDisk_setEventTree(CactusDisk *cactusDisk, EventTree *eventTree) {
  * Function to get unique ID.
  */
 
+/*
+ * Each thread reserves intervals of this many names at a time and hands them out without locking.
+ */
+#define CACTUS_DISK_NAME_RESERVATION 65536
+
+/*
+ * The current reservation of names for the thread. As a thread may use more than one disk, and a disk
+ * may be allocated at the address of a previously destructed one, the reservation records the
+ * serial number of the disk it was made from.
+ */
+typedef struct _nameReservation {
+    int64_t diskSerial;
+    Name next;
+    Name end;
+    int64_t lockFreeIDs; // IDs issued from the reservation not yet added to the disk's counter
+} NameReservation;
+
+static __thread NameReservation nameReservation = { 0, 0, 0, 0 };
+
 int64_t cactusDisk_getUniqueIDInterval(CactusDisk *cactusDisk, int64_t intervalSize) {
+    // Serve the interval from this thread's reservation, if it fits
+    if (nameReservation.diskSerial == cactusDisk->serial && nameReservation.next + intervalSize <= nameReservation.end) {
+        Name n = nameReservation.next;
+        nameReservation.next += intervalSize;
+        nameReservation.lockFreeIDs += intervalSize;
+        return n;
+    }
+    // Otherwise take an interval from the disk, topping up the reservation if the request is small
+    bool reserve = intervalSize < CACTUS_DISK_NAME_RESERVATION;
+    int64_t lockedIntervalSize = reserve ? CACTUS_DISK_NAME_RESERVATION : intervalSize;
 #if defined(_OPENMP)
     omp_set_lock(&(cactusDisk->writelock));
 #endif
     Name n = cactusDisk->currentName;
-    cactusDisk->currentName += intervalSize;
+    cactusDisk->currentName += lockedIntervalSize;
+    cactusDisk->lockedIDRequests++;
+    if (nameReservation.diskSerial == cactusDisk->serial) {
+        cactusDisk->lockFreeIDs += nameReservation.lockFreeIDs;
+        nameReservation.lockFreeIDs = 0;
+    }
 #if defined(_OPENMP)
     omp_unset_lock(&(cactusDisk->writelock));
 #endif
+    if (reserve) {
+        nameReservation.diskSerial = cactusDisk->serial;
+        nameReservation.next = n + intervalSize;
+        nameReservation.end = n + lockedIntervalSize;
+        nameReservation.lockFreeIDs = 0;
+    }
     return n;
 }
 
@@ -223,6 +418,20 @@ int64_t cactusDisk_getUniqueID(CactusDisk *cactusDisk) {
     return cactusDisk_getUniqueIDInterval(cactusDisk, 1);
 }
 
+void cactusDisk_getUniqueIDCounts(CactusDisk *cactusDisk, int64_t *lockFreeIDs, int64_t *lockedIDRequests) {
+#if defined(_OPENMP)
+    omp_set_lock(&(cactusDisk->writelock));
+#endif
+    *lockFreeIDs = cactusDisk->lockFreeIDs;
+    *lockedIDRequests = cactusDisk->lockedIDRequests;
+#if defined(_OPENMP)
+    omp_unset_lock(&(cactusDisk->writelock));
+#endif
+    if (nameReservation.diskSerial == cactusDisk->serial) { // Include the calling thread's unflushed count
+        *lockFreeIDs += nameReservation.lockFreeIDs;
+    }
+}
+
 EventTree *cactusDisk_getEventTree(CactusDisk *cactusDisk) {
     return cactusDisk->eventTree;
 }
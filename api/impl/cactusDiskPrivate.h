@@ -12,15 +12,37 @@
 #include <omp.h>
 #endif
 
+/*
+ * The flowers are split into this many shards, each with its own lock, to reduce contention
+ * when flowers are added and removed concurrently.
+ */
+#define CACTUS_DISK_FLOWER_SHARDS 64
+
+/*
+ * A read-only array of objects sorted by name, searched without locking once the disk is frozen.
+ */
+typedef struct _cactusDiskFrozenIndex {
+    int64_t length;
+    Name *names;
+    void **objects; // Set to NULL if the object is removed after the index was built
+} CactusDiskFrozenIndex;
+
 struct _cactusDisk {
     stSortedSet *sequences;
-    stSortedSet *flowers;
+    stSortedSet *flowers[CACTUS_DISK_FLOWER_SHARDS]; // Sharded by name, see cactusDisk_getFlowerShard
     EventTree *eventTree;
 #if defined(_OPENMP)
     omp_lock_t writelock; // This lock used to gate access to concurrently accessed variables
+    omp_lock_t flowerLocks[CACTUS_DISK_FLOWER_SHARDS]; // Gates access to each shard of flowers
 #endif
-    stHash *allStrings; // If the strings are being all stored in memory, a map of names to strings
+    bool frozen; // If true the frozen indexes hold the objects present when the disk was frozen
+    CactusDiskFrozenIndex frozenFlowers;
+    CactusDiskFrozenIndex frozenSequences;
+    SequenceStore *sequenceStore; // The packed strings, keyed by name
     Name currentName; // Used as a counter for issuing names
+    int64_t serial; // Distinguishes this disk from any other in the process, see cactusDisk_getUniqueIDInterval
+    int64_t lockFreeIDs; // Number of names issued from per-thread reservations, without taking the lock
+    int64_t lockedIDRequests; // Number of times the lock was taken to issue names
 };
 
 ////////////////////////////////////////////////
@@ -72,6 +94,12 @@ Name cactusDisk_addString(CactusDisk *cactusDisk, const char *string);
 char *cactusDisk_getString(CactusDisk *cactusDisk, Name name,
         int64_t start, int64_t length, int64_t strand, int64_t totalSequenceLength);
 
+/*
+ * Fills in a window onto a string from the bucket of sequence, without copying it.
+ */
+void cactusDisk_getWindow(CactusDisk *cactusDisk, Name name,
+        int64_t start, int64_t length, int64_t strand, SequenceWindow *window);
+
 /*
  * Set the event tree for this disk. (Hopefully this only happens once.)
  */
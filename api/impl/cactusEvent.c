@@ -86,6 +86,9 @@ const char *event_getHeader(Event *event) {
 
 float event_getSubTreeBranchLength(Event *event) {
     assert(event != NULL);
+    if (eventTree_isFrozen(event->eventTree)) {
+        return event->subTreeBranchLength;
+    }
     int64_t i;
     Event *childEvent;
     float branchLength;
@@ -17,6 +17,8 @@ struct _event {
     Event *parent;
     EventTree *eventTree;
     bool isOutgroup;
+    int64_t tourIndex; // The position of the first occurrence of the event in the Euler tour, if the tree is frozen
+    float subTreeBranchLength; // Cached if the tree is frozen
 };
 
 ////////////////////////////////////////////////
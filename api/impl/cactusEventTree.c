@@ -28,6 +28,7 @@ EventTree *eventTree_construct(CactusDisk *cactusDisk, Name rootEventName) {
         eventTree->cactusDisk = cactusDisk;
         cactusDisk_setEventTree(cactusDisk, eventTree);
 	eventTree->events = stSortedSet_construct3(eventTree_constructP, NULL);
+	eventTree->index = NULL;
 	eventTree->rootEvent = event_construct(rootEventName, "ROOT", INT64_MAX, NULL, eventTree); //do this last as reciprocal call made to add the event to the events.
 	return eventTree;
 }
@@ -74,6 +75,15 @@ Event *eventTree_getCommonAncestor(Event *event, Event *event2) {
 	assert(event2 != NULL);
 	assert(event_getEventTree(event) == event_getEventTree(event2));
 
+	EventTreeIndex *index = event_getEventTree(event)->index;
+	if(index != NULL) {
+		int64_t i = event->tourIndex < event2->tourIndex ? event->tourIndex : event2->tourIndex;
+		int64_t j = event->tourIndex < event2->tourIndex ? event2->tourIndex : event->tourIndex;
+		int64_t k = 63 - __builtin_clzll(j - i + 1);
+		int64_t m1 = index->minima[k][i], m2 = index->minima[k][j - (((int64_t)1) << k) + 1];
+		return index->tour[index->depths[m1] <= index->depths[m2] ? m1 : m2];
+	}
+
 	list = constructEmptyList(0, NULL);
 	ancestorEvent = event;
 	while(ancestorEvent != NULL) {
@@ -198,24 +208,86 @@ stTree *eventTree_getStTree(EventTree *eventTree) {
     return event_getStTree(speciesRoot);
 }
 
+static void eventTree_freezeP(EventTreeIndex *index, Event *event, int64_t depth) {
+	event->tourIndex = index->tourLength;
+	index->depths[index->tourLength] = depth;
+	index->tour[index->tourLength++] = event;
+	event->subTreeBranchLength = 0.0;
+	for(int64_t i=0; i<event_getChildNumber(event); i++) {
+		Event *childEvent = event_getChild(event, i);
+		eventTree_freezeP(index, childEvent, depth + 1);
+		index->depths[index->tourLength] = depth;
+		index->tour[index->tourLength++] = event;
+		//Summed in the same order as event_getSubTreeBranchLength
+		event->subTreeBranchLength += childEvent->subTreeBranchLength + event_getBranchLength(childEvent);
+	}
+}
+
+void eventTree_freeze(EventTree *eventTree) {
+	eventTree_unfreeze(eventTree);
+	EventTreeIndex *index = st_calloc(1, sizeof(EventTreeIndex));
+	int64_t maxTourLength = 2 * eventTree_getEventNumber(eventTree) - 1;
+	index->tour = st_malloc(sizeof(Event *) * maxTourLength);
+	index->depths = st_malloc(sizeof(int64_t) * maxTourLength);
+	eventTree_freezeP(index, eventTree_getRootEvent(eventTree), 0);
+	assert(index->tourLength == maxTourLength);
+
+	index->levels = 64 - __builtin_clzll(index->tourLength);
+	index->minima = st_malloc(sizeof(int64_t *) * index->levels);
+	index->minima[0] = st_malloc(sizeof(int64_t) * index->tourLength);
+	for(int64_t i=0; i<index->tourLength; i++) {
+		index->minima[0][i] = i;
+	}
+	for(int64_t k=1; k<index->levels; k++) {
+		int64_t half = ((int64_t)1) << (k - 1);
+		index->minima[k] = st_malloc(sizeof(int64_t) * (index->tourLength - 2 * half + 1));
+		for(int64_t i=0; i + 2 * half <= index->tourLength; i++) {
+			int64_t m1 = index->minima[k-1][i], m2 = index->minima[k-1][i + half];
+			index->minima[k][i] = index->depths[m1] <= index->depths[m2] ? m1 : m2;
+		}
+	}
+	eventTree->index = index;
+}
+
+bool eventTree_isFrozen(EventTree *eventTree) {
+	return eventTree->index != NULL;
+}
+
 /*
  * Private functions.
  */
 
+void eventTree_unfreeze(EventTree *eventTree) {
+	EventTreeIndex *index = eventTree->index;
+	if(index != NULL) {
+		for(int64_t k=0; k<index->levels; k++) {
+			free(index->minima[k]);
+		}
+		free(index->minima);
+		free(index->tour);
+		free(index->depths);
+		free(index);
+		eventTree->index = NULL;
+	}
+}
+
 void eventTree_destruct(EventTree *eventTree) {
 	Event *event;
 	while((event = eventTree_getFirst(eventTree)) != NULL) {
 		event_destruct(event);
 	}
+	eventTree_unfreeze(eventTree);
 	stSortedSet_destruct(eventTree->events);
 	free(eventTree);
 }
 
 void eventTree_addEvent(EventTree *eventTree, Event *event) {
+	eventTree_unfreeze(eventTree);
 	stSortedSet_insert(eventTree->events, event);
 }
 
 void eventTree_removeEvent(EventTree *eventTree, Event *event) {
+	eventTree_unfreeze(eventTree);
 	stSortedSet_remove(eventTree->events, event);
 }
 
@@ -9,10 +9,23 @@
 
 #include "cactusGlobals.h"
 
+/*
+ * The index built by eventTree_freeze. Common ancestors are found as the shallowest event between the
+ * first occurrences of two events in the Euler tour of the tree, by a sparse table of range minima.
+ */
+typedef struct _eventTreeIndex {
+    Event **tour; // The Euler tour of the tree, of 2n - 1 events for a tree of n events
+    int64_t *depths; // The depth of each event of the tour
+    int64_t tourLength;
+    int64_t **minima; // minima[k][i] is the position of the shallowest event of tour[i, i + 2^k)
+    int64_t levels;
+} EventTreeIndex;
+
 struct _eventTree {
     Event *rootEvent;
     stSortedSet *events;
     CactusDisk *cactusDisk;
+    EventTreeIndex *index; // NULL unless the tree is frozen
 };
 
 ////////////////////////////////////////////////
@@ -38,4 +51,9 @@ void eventTree_addEvent(EventTree *eventTree, Event *event);
  */
 void eventTree_removeEvent(EventTree *eventTree, Event *event);
 
+/*
+ * Discards the index built by eventTree_freeze, if any. Called whenever the tree is changed.
+ */
+void eventTree_unfreeze(EventTree *eventTree);
+
 #endif
@@ -46,6 +46,8 @@
 #include "cactusLinkPrivate.h"
 #include "cactusSequence.h"
 #include "cactusSequencePrivate.h"
+#include "cactusSequenceStore.h"
+#include "cactusMetrics.h"
 #include "cactusFlower.h"
 #include "cactusDisk.h"
 #include "cactusDiskPrivate.h"
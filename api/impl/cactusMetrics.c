@@ -0,0 +1,202 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "cactusGlobalsPrivate.h"
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+// mallinfo2 gives the bytes allocated on the heap without overflowing, and is only in glibc from 2.33
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define CACTUS_METRICS_HEAP_BYTES 1
+#endif
+
+static const char *counterNames[CACTUS_COUNTER_NUMBER] = { "pinches", "blocksDestroyed", "flowersAligned", "poaWindows" };
+
+/*
+ * The state of the process at a point in time.
+ */
+typedef struct _metricsSample {
+    double wallTime; // Seconds
+    double cpuTime; // Seconds, over all the threads of the process
+    int64_t peakRss; // Bytes, the peak resident set size of the process so far
+    int64_t heapBytes; // Bytes allocated on the heap, or -1 if not known
+    int64_t counters[CACTUS_COUNTER_NUMBER];
+} MetricsSample;
+
+typedef struct _metricsPhase {
+    char *name;
+    int64_t parent; // Index of the enclosing phase, -1 if the phase is not nested
+    bool ended;
+    MetricsSample start;
+    MetricsSample end;
+} MetricsPhase;
+
+static stList *phases = NULL; // The phases in the order they were started
+static int64_t currentPhase = -1;
+static int64_t counters[CACTUS_COUNTER_NUMBER];
+
+static void metricsPhase_destruct(MetricsPhase *phase) {
+    free(phase->name);
+    free(phase);
+}
+
+static double timevalToSeconds(struct timeval *t) {
+    return t->tv_sec + t->tv_usec / 1000000.0;
+}
+
+static void takeSample(MetricsSample *sample) {
+    struct timespec wallTime;
+    clock_gettime(CLOCK_MONOTONIC, &wallTime);
+    sample->wallTime = wallTime.tv_sec + wallTime.tv_nsec / 1000000000.0;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    sample->cpuTime = timevalToSeconds(&usage.ru_utime) + timevalToSeconds(&usage.ru_stime);
+#if defined(__APPLE__)
+    sample->peakRss = usage.ru_maxrss; // In bytes on OS X
+#else
+    sample->peakRss = usage.ru_maxrss * 1024; // In kilobytes on Linux
+#endif
+
+#if defined(CACTUS_METRICS_HEAP_BYTES)
+    struct mallinfo2 info = mallinfo2();
+    sample->heapBytes = info.uordblks + info.hblkhd;
+#else
+    sample->heapBytes = -1;
+#endif
+
+    for (int64_t i = 0; i < CACTUS_COUNTER_NUMBER; i++) {
+        sample->counters[i] = cactusMetrics_getCounter(i);
+    }
+}
+
+void cactusMetrics_startPhase(const char *phaseName) {
+    if (phases == NULL) {
+        phases = stList_construct3(0, (void (*)(void *)) metricsPhase_destruct);
+    }
+    MetricsPhase *phase = st_calloc(1, sizeof(MetricsPhase));
+    phase->name = stString_copy(phaseName);
+    phase->parent = currentPhase;
+    currentPhase = stList_length(phases);
+    stList_append(phases, phase);
+    takeSample(&phase->start);
+}
+
+void cactusMetrics_endPhase(void) {
+    if (currentPhase == -1) {
+        st_errAbort("Tried to end a metrics phase when none has been started");
+    }
+    MetricsPhase *phase = stList_get(phases, currentPhase);
+    takeSample(&phase->end);
+    phase->ended = 1;
+    currentPhase = phase->parent;
+}
+
+void cactusMetrics_addToCounter(CactusCounter counter, int64_t value) {
+    assert(counter >= 0 && counter < CACTUS_COUNTER_NUMBER);
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
+    counters[counter] += value;
+}
+
+int64_t cactusMetrics_getCounter(CactusCounter counter) {
+    assert(counter >= 0 && counter < CACTUS_COUNTER_NUMBER);
+    int64_t value;
+#if defined(_OPENMP)
+#pragma omp atomic read
+#endif
+    value = counters[counter];
+    return value;
+}
+
+static void writeJsonString(FILE *fileHandle, const char *string) {
+    fputc('"', fileHandle);
+    for (const char *c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fileHandle);
+        }
+        fputc(*c, fileHandle);
+    }
+    fputc('"', fileHandle);
+}
+
+static void writeIndent(FILE *fileHandle, int64_t depth) {
+    for (int64_t i = 0; i < depth; i++) {
+        fprintf(fileHandle, "  ");
+    }
+}
+
+static void writeCounters(FILE *fileHandle, int64_t *counterValues, int64_t *startCounterValues) {
+    fprintf(fileHandle, "{ ");
+    for (int64_t i = 0; i < CACTUS_COUNTER_NUMBER; i++) {
+        fprintf(fileHandle, "%s\"%s\": %" PRIi64, i > 0 ? ", " : "", counterNames[i],
+                counterValues[i] - (startCounterValues != NULL ? startCounterValues[i] : 0));
+    }
+    fprintf(fileHandle, " }");
+}
+
+static void writePhases(FILE *fileHandle, int64_t parent, int64_t depth, MetricsSample *now) {
+    fprintf(fileHandle, "[");
+    bool first = 1;
+    for (int64_t i = 0; i < stList_length(phases); i++) {
+        MetricsPhase *phase = stList_get(phases, i);
+        if (phase->parent != parent) {
+            continue;
+        }
+        MetricsSample *end = phase->ended ? &phase->end : now; // A phase that has not ended is measured up to now
+        fprintf(fileHandle, "%s\n", first ? "" : ",");
+        first = 0;
+        writeIndent(fileHandle, depth + 1);
+        fprintf(fileHandle, "{ \"name\": ");
+        writeJsonString(fileHandle, phase->name);
+        fprintf(fileHandle, ", \"ended\": %s, \"wallTime\": %.3f, \"cpuTime\": %.3f, \"peakRss\": %" PRIi64 ", ",
+                phase->ended ? "true" : "false", end->wallTime - phase->start.wallTime,
+                end->cpuTime - phase->start.cpuTime, end->peakRss);
+        if (phase->start.heapBytes >= 0 && end->heapBytes >= 0) {
+            fprintf(fileHandle, "\"heapBytesChange\": %" PRIi64 ", ", end->heapBytes - phase->start.heapBytes);
+        } else {
+            fprintf(fileHandle, "\"heapBytesChange\": null, ");
+        }
+        fprintf(fileHandle, "\"counters\": ");
+        writeCounters(fileHandle, end->counters, phase->start.counters);
+        fprintf(fileHandle, ",\n");
+        writeIndent(fileHandle, depth + 2);
+        fprintf(fileHandle, "\"phases\": ");
+        writePhases(fileHandle, i, depth + 2, now);
+        fprintf(fileHandle, " }");
+    }
+    if (!first) {
+        fprintf(fileHandle, "\n");
+        writeIndent(fileHandle, depth);
+    }
+    fprintf(fileHandle, "]");
+}
+
+void cactusMetrics_writeJson(FILE *fileHandle) {
+    if (phases == NULL) {
+        phases = stList_construct3(0, (void (*)(void *)) metricsPhase_destruct);
+    }
+    MetricsSample now;
+    takeSample(&now);
+    fprintf(fileHandle, "{\n  \"peakRss\": %" PRIi64 ",\n  \"counters\": ", now.peakRss);
+    writeCounters(fileHandle, now.counters, NULL);
+    fprintf(fileHandle, ",\n  \"phases\": ");
+    writePhases(fileHandle, -1, 1, &now);
+    fprintf(fileHandle, "\n}\n");
+}
+
+void cactusMetrics_reset(void) {
+    if (phases != NULL) {
+        stList_destruct(phases);
+        phases = NULL;
+    }
+    currentPhase = -1;
+    for (int64_t i = 0; i < CACTUS_COUNTER_NUMBER; i++) {
+        counters[i] = 0;
+    }
+}
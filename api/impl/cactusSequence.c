@@ -78,6 +78,13 @@ char *sequence_getString(Sequence *sequence, int64_t start, int64_t length, int6
 	return cactusDisk_getString(sequence->cactusDisk, sequence->stringName, start - sequence_getStart(sequence), length, strand, sequence->length);
 }
 
+void sequence_getWindow(Sequence *sequence, int64_t start, int64_t length, int64_t strand, SequenceWindow *window) {
+	assert(start >= sequence_getStart(sequence));
+	assert(length >= 0);
+	assert(start + length <= sequence_getStart(sequence) + sequence_getLength(sequence));
+	cactusDisk_getWindow(sequence->cactusDisk, sequence->stringName, start - sequence_getStart(sequence), length, strand, window);
+}
+
 const char *sequence_getHeader(Sequence *sequence) {
 	return sequence->header;
 }
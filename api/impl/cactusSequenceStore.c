@@ -0,0 +1,397 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "cactusGlobalsPrivate.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Strings whose packed bases take up at least this many bytes are written to the
+ * backing file (if there is one) and mapped, smaller strings are kept on the heap
+ * to avoid wasting a partial page per string.
+ */
+#define SEQUENCE_STORE_MIN_MAPPED_BYTES 65536
+
+/*
+ * A sorted list of disjoint, half open intervals [starts[i], ends[i]).
+ */
+typedef struct _runs {
+    int64_t number;
+    int64_t capacity;
+    int64_t *starts;
+    int64_t *ends;
+} Runs;
+
+typedef struct _packedString {
+    int64_t length;
+    uint8_t *bases; // 4 bases per byte, base i is held in bits 2*(i%4) and 2*(i%4)+1 of byte i/4
+    int64_t mappedBytes; // If non-zero, bases is a mapping of this many bytes of the backing file
+    Runs nRuns; // Runs of Ns
+    Runs maskRuns; // Runs of lower case characters
+    int64_t exceptionNumber; // Characters other than ACGTN (case insensitive)
+    int64_t exceptionCapacity;
+    int64_t *exceptionPositions;
+    char *exceptionCharacters; // Held in upper case, the case is given by maskRuns
+} PackedString;
+
+struct _sequenceStore {
+    stHash *strings; // Map of names to packed strings
+    int64_t frozenNumber; // Read-only index of the strings present when the store was last frozen,
+    Name *frozenNames; // sorted by name, so it can be searched concurrently without a lock
+    PackedString **frozenStrings;
+    char *backingFile;
+    int backingFileDescriptor;
+    int64_t backingFileLength;
+    int64_t packedSize;
+};
+
+/*
+ * Functions on runs.
+ */
+
+static void runs_append(Runs *runs, int64_t start, int64_t end) {
+    if (runs->number == runs->capacity) {
+        runs->capacity = runs->capacity == 0 ? 16 : runs->capacity * 2;
+        runs->starts = st_realloc(runs->starts, runs->capacity * sizeof(int64_t));
+        runs->ends = st_realloc(runs->ends, runs->capacity * sizeof(int64_t));
+    }
+    runs->starts[runs->number] = start;
+    runs->ends[runs->number++] = end;
+}
+
+static void runs_destruct(Runs *runs) {
+    free(runs->starts);
+    free(runs->ends);
+}
+
+/*
+ * Returns the index of the first run that ends after position, or runs->number if there is none.
+ */
+static int64_t runs_getFirstEndingAfter(const Runs *runs, int64_t position) {
+    int64_t low = 0, high = runs->number;
+    while (low < high) {
+        int64_t mid = low + (high - low) / 2;
+        if (runs->ends[mid] <= position) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Functions on packed strings.
+ */
+
+static void packedString_addException(PackedString *packedString, int64_t position, char c) {
+    if (packedString->exceptionNumber == packedString->exceptionCapacity) {
+        packedString->exceptionCapacity = packedString->exceptionCapacity == 0 ? 16 : packedString->exceptionCapacity * 2;
+        packedString->exceptionPositions = st_realloc(packedString->exceptionPositions,
+                                                      packedString->exceptionCapacity * sizeof(int64_t));
+        packedString->exceptionCharacters = st_realloc(packedString->exceptionCharacters,
+                                                       packedString->exceptionCapacity * sizeof(char));
+    }
+    packedString->exceptionPositions[packedString->exceptionNumber] = position;
+    packedString->exceptionCharacters[packedString->exceptionNumber++] = c;
+}
+
+static int64_t packedString_getPackedBytes(int64_t length) {
+    return (length + 3) / 4;
+}
+
+/*
+ * Packs the string, filling in the side tables, returning a heap array of the packed bases.
+ */
+static uint8_t *packedString_pack(PackedString *packedString, const char *string) {
+    int64_t length = packedString->length;
+    uint8_t *bases = st_calloc(packedString_getPackedBytes(length) > 0 ? packedString_getPackedBytes(length) : 1,
+                               sizeof(uint8_t));
+    int64_t nStart = -1, maskStart = -1;
+    for (int64_t i = 0; i < length; i++) {
+        char c = string[i];
+        // Soft-masking
+        if (islower(c)) {
+            if (maskStart == -1) {
+                maskStart = i;
+            }
+            c = toupper(c);
+        } else if (maskStart != -1) {
+            runs_append(&packedString->maskRuns, maskStart, i);
+            maskStart = -1;
+        }
+        // Ns
+        if (c == 'N') {
+            if (nStart == -1) {
+                nStart = i;
+            }
+            continue;
+        } else if (nStart != -1) {
+            runs_append(&packedString->nRuns, nStart, i);
+            nStart = -1;
+        }
+        uint8_t code;
+        switch (c) {
+            case 'A':
+                code = 0;
+                break;
+            case 'C':
+                code = 1;
+                break;
+            case 'G':
+                code = 2;
+                break;
+            case 'T':
+                code = 3;
+                break;
+            default:
+                packedString_addException(packedString, i, c);
+                code = 0;
+        }
+        bases[i >> 2] |= code << ((i & 3) << 1);
+    }
+    if (maskStart != -1) {
+        runs_append(&packedString->maskRuns, maskStart, length);
+    }
+    if (nStart != -1) {
+        runs_append(&packedString->nRuns, nStart, length);
+    }
+    return bases;
+}
+
+static void packedString_destruct(PackedString *packedString) {
+    if (packedString->mappedBytes > 0) {
+        munmap(packedString->bases, packedString->mappedBytes);
+    } else {
+        free(packedString->bases);
+    }
+    runs_destruct(&packedString->nRuns);
+    runs_destruct(&packedString->maskRuns);
+    free(packedString->exceptionPositions);
+    free(packedString->exceptionCharacters);
+    free(packedString);
+}
+
+/*
+ * Decodes the forward strand bases in [start, start+length) into buffer (not null terminated).
+ */
+static void packedString_decode(const PackedString *packedString, int64_t start, int64_t length, char *buffer) {
+    static const char *codesToBases = "ACGT";
+    assert(start >= 0 && length >= 0 && start + length <= packedString->length);
+    int64_t end = start + length;
+    for (int64_t i = start; i < end; i++) {
+        buffer[i - start] = codesToBases[(packedString->bases[i >> 2] >> ((i & 3) << 1)) & 3];
+    }
+    // Fill in the Ns
+    for (int64_t j = runs_getFirstEndingAfter(&packedString->nRuns, start);
+         j < packedString->nRuns.number && packedString->nRuns.starts[j] < end; j++) {
+        int64_t i = packedString->nRuns.starts[j] > start ? packedString->nRuns.starts[j] : start;
+        int64_t k = packedString->nRuns.ends[j] < end ? packedString->nRuns.ends[j] : end;
+        memset(buffer + i - start, 'N', k - i);
+    }
+    // Fill in the exceptions, binary searching for the first in the range
+    int64_t low = 0, high = packedString->exceptionNumber;
+    while (low < high) {
+        int64_t mid = low + (high - low) / 2;
+        if (packedString->exceptionPositions[mid] < start) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (int64_t j = low; j < packedString->exceptionNumber && packedString->exceptionPositions[j] < end; j++) {
+        buffer[packedString->exceptionPositions[j] - start] = packedString->exceptionCharacters[j];
+    }
+    // Apply the soft-masking
+    for (int64_t j = runs_getFirstEndingAfter(&packedString->maskRuns, start);
+         j < packedString->maskRuns.number && packedString->maskRuns.starts[j] < end; j++) {
+        int64_t i = packedString->maskRuns.starts[j] > start ? packedString->maskRuns.starts[j] : start;
+        int64_t k = packedString->maskRuns.ends[j] < end ? packedString->maskRuns.ends[j] : end;
+        for (; i < k; i++) {
+            buffer[i - start] = tolower(buffer[i - start]);
+        }
+    }
+}
+
+/*
+ * Writes the packed bases to the backing file and maps them, returning the mapping.
+ */
+static uint8_t *sequenceStore_mapBases(SequenceStore *sequenceStore, uint8_t *bases, int64_t packedBytes) {
+    int64_t pageSize = sysconf(_SC_PAGESIZE);
+    int64_t offset = ((sequenceStore->backingFileLength + pageSize - 1) / pageSize) * pageSize;
+    int64_t written = 0;
+    while (written < packedBytes) {
+        ssize_t i = pwrite(sequenceStore->backingFileDescriptor, bases + written, packedBytes - written, offset + written);
+        if (i < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            st_errnoAbort("Failed to write packed sequence to %s", sequenceStore->backingFile);
+        }
+        written += i;
+    }
+    sequenceStore->backingFileLength = offset + packedBytes;
+    void *mapping = mmap(NULL, packedBytes, PROT_READ, MAP_SHARED, sequenceStore->backingFileDescriptor, offset);
+    if (mapping == MAP_FAILED) {
+        st_errnoAbort("Failed to memory-map packed sequence from %s", sequenceStore->backingFile);
+    }
+    return mapping;
+}
+
+/*
+ * Functions on the sequence store.
+ */
+
+SequenceStore *sequenceStore_construct(const char *backingFile) {
+    SequenceStore *sequenceStore = st_calloc(1, sizeof(SequenceStore));
+    sequenceStore->strings = stHash_construct2(NULL, (void (*)(void *))packedString_destruct);
+    sequenceStore->backingFileDescriptor = -1;
+    if (backingFile != NULL) {
+        sequenceStore->backingFile = stString_copy(backingFile);
+        sequenceStore->backingFileDescriptor = open(backingFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sequenceStore->backingFileDescriptor < 0) {
+            st_errnoAbort("Failed to open sequence store backing file %s", backingFile);
+        }
+        // Unlink straight away, the open descriptor and mappings keep the file alive until we are done,
+        // and it is cleaned up even if we exit without destructing the store
+        unlink(backingFile);
+    }
+    return sequenceStore;
+}
+
+void sequenceStore_destruct(SequenceStore *sequenceStore) {
+    free(sequenceStore->frozenNames);
+    free(sequenceStore->frozenStrings);
+    stHash_destruct(sequenceStore->strings); // Unmaps any mapped strings
+    if (sequenceStore->backingFile != NULL) {
+        close(sequenceStore->backingFileDescriptor);
+        free(sequenceStore->backingFile);
+    }
+    free(sequenceStore);
+}
+
+void sequenceStore_add(SequenceStore *sequenceStore, Name name, const char *string) {
+    assert(stHash_search(sequenceStore->strings, (void *)name) == NULL);
+    PackedString *packedString = st_calloc(1, sizeof(PackedString));
+    packedString->length = strlen(string);
+    packedString->bases = packedString_pack(packedString, string);
+    int64_t packedBytes = packedString_getPackedBytes(packedString->length);
+    if (sequenceStore->backingFile != NULL && packedBytes >= SEQUENCE_STORE_MIN_MAPPED_BYTES) {
+        uint8_t *mapping = sequenceStore_mapBases(sequenceStore, packedString->bases, packedBytes);
+        free(packedString->bases);
+        packedString->bases = mapping;
+        packedString->mappedBytes = packedBytes;
+    }
+    sequenceStore->packedSize += packedBytes + sizeof(PackedString) +
+            2 * sizeof(int64_t) * (packedString->nRuns.number + packedString->maskRuns.number) +
+            (sizeof(int64_t) + sizeof(char)) * packedString->exceptionNumber;
+    stHash_insert(sequenceStore->strings, (void *)name, packedString); // Cheeky 64bit to pointer conversion
+}
+
+bool sequenceStore_contains(SequenceStore *sequenceStore, Name name) {
+    return stHash_search(sequenceStore->strings, (void *)name) != NULL;
+}
+
+int64_t sequenceStore_getLength(SequenceStore *sequenceStore, Name name) {
+    PackedString *packedString = stHash_search(sequenceStore->strings, (void *)name);
+    assert(packedString != NULL);
+    return packedString->length;
+}
+
+void sequenceStore_getWindow(SequenceStore *sequenceStore, Name name, int64_t start, int64_t length,
+        bool strand, SequenceWindow *window) {
+    PackedString *packedString = stHash_search(sequenceStore->strings, (void *)name); // Cheeky 64bit int to pointer conversion
+    assert(packedString != NULL);
+    assert(start >= 0 && length >= 0 && start + length <= packedString->length);
+    window->string = packedString;
+    window->start = start;
+    window->length = length;
+    window->strand = strand;
+}
+
+static int sequenceStore_freezeP(const void *a, const void *b) {
+    return cactusMisc_nameCompare(*(const Name *)a, *(const Name *)b);
+}
+
+void sequenceStore_freeze(SequenceStore *sequenceStore) {
+    free(sequenceStore->frozenNames);
+    free(sequenceStore->frozenStrings);
+    sequenceStore->frozenNumber = stHash_size(sequenceStore->strings);
+    sequenceStore->frozenNames = st_malloc(sequenceStore->frozenNumber * sizeof(Name));
+    sequenceStore->frozenStrings = st_malloc(sequenceStore->frozenNumber * sizeof(PackedString *));
+    stHashIterator *it = stHash_getIterator(sequenceStore->strings);
+    void *key;
+    int64_t i = 0;
+    while ((key = stHash_getNext(it)) != NULL) {
+        sequenceStore->frozenNames[i++] = (Name)key;
+    }
+    stHash_destructIterator(it);
+    assert(i == sequenceStore->frozenNumber);
+    qsort(sequenceStore->frozenNames, sequenceStore->frozenNumber, sizeof(Name), sequenceStore_freezeP);
+    for (i = 0; i < sequenceStore->frozenNumber; i++) {
+        sequenceStore->frozenStrings[i] = stHash_search(sequenceStore->strings, (void *)sequenceStore->frozenNames[i]);
+    }
+}
+
+bool sequenceStore_getFrozenWindow(SequenceStore *sequenceStore, Name name, int64_t start, int64_t length,
+        bool strand, SequenceWindow *window) {
+    int64_t low = 0, high = sequenceStore->frozenNumber;
+    while (low < high) {
+        int64_t mid = low + (high - low) / 2;
+        if (sequenceStore->frozenNames[mid] < name) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == sequenceStore->frozenNumber || sequenceStore->frozenNames[low] != name) {
+        return 0; // Added since the store was frozen
+    }
+    PackedString *packedString = sequenceStore->frozenStrings[low];
+    assert(start >= 0 && length >= 0 && start + length <= packedString->length);
+    window->string = packedString;
+    window->start = start;
+    window->length = length;
+    window->strand = strand;
+    return 1;
+}
+
+int64_t sequenceStore_getPackedSize(SequenceStore *sequenceStore) {
+    return sequenceStore->packedSize;
+}
+
+/*
+ * Functions on windows.
+ */
+
+void sequenceWindow_copy(const SequenceWindow *window, int64_t offset, int64_t length, char *buffer) {
+    assert(offset >= 0 && length >= 0 && offset + length <= window->length);
+    if (window->strand) {
+        packedString_decode(window->string, window->start + offset, length, buffer);
+    } else {
+        // The window is the reverse complement, so decode the mirrored forward interval and then flip it
+        packedString_decode(window->string, window->start + window->length - offset - length, length, buffer);
+        for (int64_t i = 0, j = length - 1; i <= j; i++, j--) {
+            char c = buffer[i];
+            buffer[i] = stString_reverseComplementChar(buffer[j]);
+            buffer[j] = stString_reverseComplementChar(c);
+        }
+    }
+    buffer[length] = '\0';
+}
+
+char sequenceWindow_getBase(const SequenceWindow *window, int64_t offset) {
+    char buffer[2];
+    sequenceWindow_copy(window, offset, 1, buffer);
+    return buffer[0];
+}
+
+char *sequenceWindow_getString(const SequenceWindow *window) {
+    char *string = st_malloc((window->length + 1) * sizeof(char));
+    sequenceWindow_copy(window, 0, window->length, string);
+    return string;
+}
@@ -18,6 +18,8 @@
 #include "cactusGlobals.h"
 #include "cactusLink.h"
 #include "cactusSequence.h"
+#include "cactusSequenceStore.h"
+#include "cactusMetrics.h"
 #include "cactusFlower.h"
 #include "cactusDisk.h"
 #include "cactusMisc.h"
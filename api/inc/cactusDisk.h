@@ -25,6 +25,13 @@ extern const char *CACTUS_DISK_EXCEPTION_ID;
  */
 CactusDisk *cactusDisk_construct();
 
+/*
+ * As cactusDisk_construct, but the packed sequence strings of large sequences are held in a
+ * memory-mapped file at the given path rather than on the heap. If sequenceStoreFile is NULL
+ * this is equivalent to cactusDisk_construct.
+ */
+CactusDisk *cactusDisk_construct2(const char *sequenceStoreFile);
+
 /*
  * Destructs the cactus disk and all open flowers and sequences, and
  * then disconnects from the cactus DB.
@@ -33,6 +40,9 @@ void cactusDisk_destruct(CactusDisk *cactusDisk);
 
 /*
  * Retrieves the next unique ID.
+ *
+ * Each thread reserves a large interval of IDs from the disk at a time and then issues them
+ * without locking, so IDs from different threads are unique but not issued in a global order.
  */
 int64_t cactusDisk_getUniqueID(CactusDisk *cactusDisk);
 
@@ -41,6 +51,13 @@ int64_t cactusDisk_getUniqueID(CactusDisk *cactusDisk);
  */
 int64_t cactusDisk_getUniqueIDInterval(CactusDisk *cactusDisk, int64_t intervalSize);
 
+/*
+ * Gets the number of unique IDs issued from per-thread reservations without taking the disk lock, and
+ * the number of times the lock was taken to issue IDs. IDs issued by other threads since they last
+ * took the lock are not included in lockFreeIDs.
+ */
+void cactusDisk_getUniqueIDCounts(CactusDisk *cactusDisk, int64_t *lockFreeIDs, int64_t *lockedIDRequests);
+
 /*
  * Gets a flower the cactusDisk contains. If the flower is not in memory it will be loaded. If not in memory or on disk, returns NULL.
  */
@@ -51,6 +68,22 @@ Flower *cactusDisk_getFlower(CactusDisk *cactusDisk, Name flowerName);
  */
 Sequence *cactusDisk_getSequence(CactusDisk *cactusDisk, Name sequenceName);
 
+/*
+ * Freezes the disk: builds read-only indexes of the flowers, sequences and strings it currently holds,
+ * after which cactusDisk_getFlower, cactusDisk_getSequence and string lookups for these objects take no lock.
+ * Also freezes the event tree, see eventTree_freeze.
+ * Objects added after the freeze are still found, via the locked path, and flowers can still be
+ * added and removed (each shard of flowers has its own lock). Can be called again to re-index.
+ *
+ * This function is NOT thread safe, it must not be called concurrently with any other cactus disk function.
+ */
+void cactusDisk_freeze(CactusDisk *cactusDisk);
+
+/*
+ * Returns non-zero if cactusDisk_freeze has been called.
+ */
+bool cactusDisk_isFrozen(CactusDisk *cactusDisk);
+
 /*
  * Get the event tree.
  */
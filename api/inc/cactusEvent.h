@@ -67,7 +67,7 @@ const char *event_getHeader(Event *event);
 
 /*
  * Gets the branch length of the subtree rooted at this event, excluding the branch length of the event
- * itself.
+ * itself. Cached if the event tree is frozen (see eventTree_freeze).
  */
 float event_getSubTreeBranchLength(Event *event);
 
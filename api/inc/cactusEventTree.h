@@ -49,7 +49,8 @@ Event *eventTree_getEvent(EventTree *eventTree, Name eventName);
 Event *eventTree_getEventByHeader(EventTree *eventTree, const char *eventHeader);
 
 /*
- * Gets the common ancestor of two events.
+ * Gets the common ancestor of two events. Takes constant time if the tree is frozen, else time
+ * proportional to the square of the depth of the events.
  */
 Event *eventTree_getCommonAncestor(Event *event, Event *event2);
 
@@ -104,6 +105,21 @@ void eventTree_check(EventTree *eventTree);
  */
 stTree *eventTree_getStTree(EventTree *eventTree);
 
+/*
+ * Freezes the event tree: builds an index answering eventTree_getCommonAncestor (and so event_isAncestor,
+ * event_isDescendant and event_isSibling) in constant time, and caches the subtree branch length of each
+ * event. Any change to the tree, by constructing or destructing an event, discards the index. Can be called
+ * again to re-index.
+ *
+ * This function is NOT thread safe, it must not be called concurrently with any other function on the tree.
+ */
+void eventTree_freeze(EventTree *eventTree);
+
+/*
+ * Returns non-zero if the tree is frozen and unchanged since.
+ */
+bool eventTree_isFrozen(EventTree *eventTree);
+
 /*
  * Get the CactusDisk that owns this event tree.
  */
@@ -40,6 +40,7 @@ typedef struct _group Link;
 typedef struct _chain Chain;
 typedef struct _flower Flower;
 typedef struct _cactusDisk CactusDisk;
+typedef struct _sequenceStore SequenceStore;
 typedef stSortedSetIterator EventTree_Iterator;
 typedef struct _end_instanceIterator End_InstanceIterator;
 typedef struct _block_instanceIterator Block_InstanceIterator;
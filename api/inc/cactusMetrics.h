@@ -0,0 +1,67 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#ifndef CACTUS_METRICS_H_
+#define CACTUS_METRICS_H_
+
+#include "cactusGlobals.h"
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+//Instrumentation functions.
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+/*
+ * Process-wide instrumentation, made up of timed phases and counters, that can be written out as a JSON report.
+ *
+ * Phases may be nested, and are started and ended by the main thread outside of any parallel region. For each
+ * phase the report gives the wall time, the CPU time of the process over all its threads, the peak resident set
+ * size of the process when the phase ended, the change in the bytes allocated on the heap, and how much each
+ * counter was added to during the phase.
+ *
+ * Counters can be added to from any thread.
+ */
+
+typedef enum _cactusCounter {
+    CACTUS_COUNTER_PINCHES = 0, // Pinches applied by annealing, in CAF and BAR
+    CACTUS_COUNTER_BLOCKS_DESTROYED, // Pinch blocks destroyed by melting, in CAF and BAR
+    CACTUS_COUNTER_FLOWERS_ALIGNED, // Flowers aligned by BAR
+    CACTUS_COUNTER_POA_WINDOWS, // Windows aligned with abPOA
+    CACTUS_COUNTER_NUMBER
+} CactusCounter;
+
+/*
+ * Starts a phase, nested in the current phase if there is one.
+ */
+void cactusMetrics_startPhase(const char *phaseName);
+
+/*
+ * Ends the current phase.
+ */
+void cactusMetrics_endPhase(void);
+
+/*
+ * Adds the value to the counter.
+ */
+void cactusMetrics_addToCounter(CactusCounter counter, int64_t value);
+
+/*
+ * Gets the value of the counter.
+ */
+int64_t cactusMetrics_getCounter(CactusCounter counter);
+
+/*
+ * Writes the phases, ended or not, and the totals of the counters as a JSON object.
+ */
+void cactusMetrics_writeJson(FILE *fileHandle);
+
+/*
+ * Discards the phases and zeroes the counters.
+ */
+void cactusMetrics_reset(void);
+
+#endif
@@ -8,6 +8,7 @@
 #define CACTUS_SEQUENCE_H_
 
 #include "cactusGlobals.h"
+#include "cactusSequenceStore.h"
 
 ////////////////////////////////////////////////
 ////////////////////////////////////////////////
@@ -56,6 +57,12 @@ Event *sequence_getEvent(Sequence *sequence);
  */
 char *sequence_getString(Sequence *sequence, int64_t start, int64_t length, int64_t strand);
 
+/*
+ * Fills in a window onto a subsequence of the meta sequence. Unlike sequence_getString this does
+ * not copy the subsequence, the bases are decoded from the packed store as they are requested.
+ */
+void sequence_getWindow(Sequence *sequence, int64_t start, int64_t length, int64_t strand, SequenceWindow *window);
+
 /*
  * Gets the header line associated with the meta sequence.
  */
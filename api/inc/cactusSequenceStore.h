@@ -0,0 +1,108 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#ifndef CACTUS_SEQUENCE_STORE_H_
+#define CACTUS_SEQUENCE_STORE_H_
+
+#include "cactusGlobals.h"
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+//Packed sequence store functions.
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+/*
+ * The sequence store holds the strings of the cactus disk packed at 2 bits per base.
+ * Runs of Ns and soft-masked (lower case) runs are held in side tables, as are
+ * any other characters (IUPAC codes, etc.), so every string round trips exactly.
+ * The packed bases can optionally be backed by a memory-mapped file.
+ */
+
+/*
+ * A read-only view of a substring of a stored string. Windows are cheap to
+ * construct and decode bases on demand, so no copy is made until the caller asks
+ * for one. If strand is false the window is read as the reverse complement.
+ */
+typedef struct _sequenceWindow {
+    const struct _packedString *string;
+    int64_t start;
+    int64_t length;
+    bool strand;
+} SequenceWindow;
+
+/*
+ * Constructs an empty sequence store. If backingFile is not NULL then the packed bases of
+ * large strings are written to this file and memory-mapped, rather than held on the heap.
+ * The backing file is unlinked as soon as it is opened, so it does not outlive the process.
+ */
+SequenceStore *sequenceStore_construct(const char *backingFile);
+
+/*
+ * Destructs the store, and unmaps any memory-mapped strings.
+ */
+void sequenceStore_destruct(SequenceStore *sequenceStore);
+
+/*
+ * Packs the string and adds it to the store under the given name.
+ *
+ * This function is not thread safe, the caller must serialise calls that modify the store.
+ */
+void sequenceStore_add(SequenceStore *sequenceStore, Name name, const char *string);
+
+/*
+ * Returns non-zero if the store contains a string with the given name.
+ */
+bool sequenceStore_contains(SequenceStore *sequenceStore, Name name);
+
+/*
+ * Gets the length of the string with the given name.
+ */
+int64_t sequenceStore_getLength(SequenceStore *sequenceStore, Name name);
+
+/*
+ * Fills in window to view the substring of the named string starting at start (zero based)
+ * of the given length. If strand is false the window is the reverse complement of the substring.
+ */
+void sequenceStore_getWindow(SequenceStore *sequenceStore, Name name, int64_t start, int64_t length,
+        bool strand, SequenceWindow *window);
+
+/*
+ * Builds a read-only index of the strings currently in the store, which can then be searched
+ * by sequenceStore_getFrozenWindow without any locking. Strings added afterwards are not in the
+ * index until the store is frozen again. Must not be called concurrently with other store functions.
+ */
+void sequenceStore_freeze(SequenceStore *sequenceStore);
+
+/*
+ * As sequenceStore_getWindow, but only searches the strings present when the store was last frozen,
+ * and so is safe to call concurrently with sequenceStore_add. Returns non-zero if the string was found.
+ */
+bool sequenceStore_getFrozenWindow(SequenceStore *sequenceStore, Name name, int64_t start, int64_t length,
+        bool strand, SequenceWindow *window);
+
+/*
+ * Gets the total number of bytes used to hold the packed strings and their side tables.
+ */
+int64_t sequenceStore_getPackedSize(SequenceStore *sequenceStore);
+
+/*
+ * Gets the base at the given offset (zero based) in the window.
+ */
+char sequenceWindow_getBase(const SequenceWindow *window, int64_t offset);
+
+/*
+ * Decodes length bases starting at the given offset in the window into buffer, which
+ * must have space for length + 1 characters. The buffer is null terminated.
+ */
+void sequenceWindow_copy(const SequenceWindow *window, int64_t offset, int64_t length, char *buffer);
+
+/*
+ * Returns a newly allocated copy of the complete window as a null terminated string.
+ */
+char *sequenceWindow_getString(const SequenceWindow *window);
+
+#endif
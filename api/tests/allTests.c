@@ -16,6 +16,8 @@ CuSuite *cactusEventTestSuite();
 CuSuite *cactusEventTreeTestSuite();
 CuSuite *cactusLinkTestSuite();
 CuSuite *cactusSequenceTestSuite();
+CuSuite *cactusSequenceStoreTestSuite();
+CuSuite *cactusMetricsTestSuite(void);
 CuSuite *cactusDiskTestSuite();
 CuSuite *cactusMiscTestSuite();
 CuSuite *cactusFlowerTestSuite();
@@ -34,6 +36,8 @@ int cactusAPIRunAllTests(void) {
 	CuSuiteAddSuite(suite, cactusEventTreeTestSuite());
 	CuSuiteAddSuite(suite, cactusLinkTestSuite());
 	CuSuiteAddSuite(suite, cactusSequenceTestSuite());
+	CuSuiteAddSuite(suite, cactusSequenceStoreTestSuite());
+	CuSuiteAddSuite(suite, cactusMetricsTestSuite());
 	CuSuiteAddSuite(suite, cactusDiskTestSuite());
 	CuSuiteAddSuite(suite, cactusMiscTestSuite());
 	CuSuiteAddSuite(suite, cactusFlowerTestSuite());
@@ -32,6 +32,44 @@ void testCactusDisk_getSequence(CuTest* testCase) {
     cactusDisk_destruct(cactusDisk);
 }
 
+void testCactusDisk_freeze(CuTest* testCase) {
+    CactusDisk *cactusDisk = cactusDisk_construct();
+    stList *flowers = stList_construct();
+    for (int64_t i = 0; i < 200; i++) {
+        stList_append(flowers, flower_construct(cactusDisk));
+    }
+    Sequence *sequence = sequence_construct(1, 10, "ACTGACTGAG",
+            "FOO", NULL, cactusDisk);
+    CuAssertTrue(testCase, !cactusDisk_isFrozen(cactusDisk));
+    cactusDisk_freeze(cactusDisk);
+    CuAssertTrue(testCase, cactusDisk_isFrozen(cactusDisk));
+
+    // Objects present at the freeze are found through the frozen indexes
+    for (int64_t i = 0; i < stList_length(flowers); i++) {
+        Flower *flower = stList_get(flowers, i);
+        CuAssertTrue(testCase, cactusDisk_getFlower(cactusDisk, flower_getName(flower)) == flower);
+    }
+    CuAssertTrue(testCase, cactusDisk_getSequence(cactusDisk, sequence_getName(sequence)) == sequence);
+    CuAssertStrEquals(testCase, "TGAC", sequence_getString(sequence, 3, 4, 1));
+
+    // Objects added after the freeze are still found
+    Flower *flower2 = flower_construct(cactusDisk);
+    Sequence *sequence2 = sequence_construct(2, 10, "CCCCCCCCCA",
+            "BAR", NULL, cactusDisk);
+    CuAssertTrue(testCase, cactusDisk_getFlower(cactusDisk, flower_getName(flower2)) == flower2);
+    CuAssertTrue(testCase, cactusDisk_getSequence(cactusDisk, sequence_getName(sequence2)) == sequence2);
+    CuAssertStrEquals(testCase, "TGGG", sequence_getString(sequence2, 8, 4, 0));
+
+    // Removed flowers are not
+    Flower *flower = stList_get(flowers, 0);
+    Name flowerName = flower_getName(flower);
+    flower_destruct(flower, FALSE, FALSE);
+    CuAssertTrue(testCase, cactusDisk_getFlower(cactusDisk, flowerName) == NULL);
+
+    stList_destruct(flowers);
+    cactusDisk_destruct(cactusDisk);
+}
+
 void testCactusDisk_getUniqueID(CuTest* testCase) {
     CactusDisk *cactusDisk = cactusDisk_construct();
     for (int64_t i = 0; i < 1000000; i++) { //Gets a billion ids, checks we are good.
@@ -43,6 +81,44 @@ void testCactusDisk_getUniqueID(CuTest* testCase) {
     cactusDisk_destruct(cactusDisk);
 }
 
+void testCactusDisk_getUniqueID_Counts(CuTest* testCase) {
+    CactusDisk *cactusDisk = cactusDisk_construct();
+    int64_t lockFreeIDs, lockedIDRequests;
+    cactusDisk_getUniqueIDCounts(cactusDisk, &lockFreeIDs, &lockedIDRequests);
+    CuAssertIntEquals(testCase, 0, lockFreeIDs);
+    CuAssertIntEquals(testCase, 0, lockedIDRequests);
+    for (int64_t i = 0; i < 200000; i++) {
+        cactusDisk_getUniqueID(cactusDisk);
+    }
+    cactusDisk_getUniqueIDCounts(cactusDisk, &lockFreeIDs, &lockedIDRequests);
+    // Only the first ID of each reservation needs the lock
+    CuAssertIntEquals(testCase, 200000, lockFreeIDs + lockedIDRequests);
+    CuAssertTrue(testCase, lockedIDRequests <= 4);
+    cactusDisk_destruct(cactusDisk);
+}
+
+void testCactusDisk_getUniqueID_UniqueParallel(CuTest* testCase) {
+    CactusDisk *cactusDisk = cactusDisk_construct();
+    int64_t idNumber = 500000;
+    stList *names = stList_construct2(idNumber);
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(static, 1000)
+#endif
+    for (int64_t i = 0; i < idNumber; i++) {
+        stList_set(names, i, (void *)cactusDisk_getUniqueID(cactusDisk));
+    }
+    stSortedSet *uniqueNames = stSortedSet_construct();
+    for (int64_t i = 0; i < idNumber; i++) {
+        Name name = (Name)stList_get(names, i);
+        CuAssertTrue(testCase, name > 0 && name != NULL_NAME);
+        CuAssertTrue(testCase, stSortedSet_search(uniqueNames, (void *)name) == NULL);
+        stSortedSet_insert(uniqueNames, (void *)name);
+    }
+    stSortedSet_destruct(uniqueNames);
+    stList_destruct(names);
+    cactusDisk_destruct(cactusDisk);
+}
+
 int testCactusDisk_getUniqueID_UniqueP(const void *a, const void *b) {
     return cactusMisc_nameCompare(cactusMisc_stringToName(a), cactusMisc_stringToName(b));
 }
@@ -89,9 +165,12 @@ CuSuite* cactusDiskTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testCactusDisk_getFlower);
     SUITE_ADD_TEST(suite, testCactusDisk_getSequence);
+    SUITE_ADD_TEST(suite, testCactusDisk_freeze);
     SUITE_ADD_TEST(suite, testCactusDisk_getUniqueID);
     SUITE_ADD_TEST(suite, testCactusDisk_getUniqueID_Unique);
     SUITE_ADD_TEST(suite, testCactusDisk_getUniqueID_UniqueIntervals);
+    SUITE_ADD_TEST(suite, testCactusDisk_getUniqueID_Counts);
+    SUITE_ADD_TEST(suite, testCactusDisk_getUniqueID_UniqueParallel);
     SUITE_ADD_TEST(suite, testCactusDisk_constructAndDestruct);
     return suite;
 }
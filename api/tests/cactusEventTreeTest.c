@@ -157,6 +157,59 @@ void testEventTree_makeNewickString(CuTest* testCase) {
 	cactusEventTreeTestTeardown(testCase);
 }
 
+void testEventTree_freeze(CuTest* testCase) {
+	cactusEventTreeTestSetup(testCase);
+	//Grow a random tree below the internal event
+	stList *events = stList_construct();
+	stList_append(events, rootEvent);
+	stList_append(events, internalEvent);
+	stList_append(events, leafEvent1);
+	stList_append(events, leafEvent2);
+	for(int64_t i=0; i<200; i++) {
+		Event *parentEvent = stList_get(events, st_randomInt(1, stList_length(events)));
+		stList_append(events, event_construct3("RANDOM", st_random(), parentEvent, eventTree));
+	}
+
+	//Get the answers from the unfrozen tree
+	int64_t n = stList_length(events);
+	Event **commonAncestors = st_malloc(sizeof(Event *) * n * n);
+	float *subTreeBranchLengths = st_malloc(sizeof(float) * n);
+	CuAssertTrue(testCase, !eventTree_isFrozen(eventTree));
+	for(int64_t i=0; i<n; i++) {
+		for(int64_t j=0; j<n; j++) {
+			commonAncestors[i * n + j] = eventTree_getCommonAncestor(stList_get(events, i), stList_get(events, j));
+		}
+		subTreeBranchLengths[i] = event_getSubTreeBranchLength(stList_get(events, i));
+	}
+
+	//The frozen tree gives the same answers
+	eventTree_freeze(eventTree);
+	CuAssertTrue(testCase, eventTree_isFrozen(eventTree));
+	for(int64_t i=0; i<n; i++) {
+		for(int64_t j=0; j<n; j++) {
+			CuAssertPtrEquals(testCase, commonAncestors[i * n + j], eventTree_getCommonAncestor(stList_get(events, i), stList_get(events, j)));
+		}
+		CuAssertTrue(testCase, subTreeBranchLengths[i] == event_getSubTreeBranchLength(stList_get(events, i)));
+	}
+	CuAssertTrue(testCase, event_isAncestor(leafEvent1, internalEvent));
+	CuAssertTrue(testCase, event_isDescendant(internalEvent, leafEvent2));
+	CuAssertTrue(testCase, event_isSibling(leafEvent1, leafEvent2));
+
+	//Changing the tree unfreezes it
+	Event *event = event_construct4("UNARY", 0.1, internalEvent, leafEvent1, eventTree);
+	CuAssertTrue(testCase, !eventTree_isFrozen(eventTree));
+	CuAssertTrue(testCase, eventTree_getCommonAncestor(leafEvent1, leafEvent2) == internalEvent);
+	CuAssertTrue(testCase, eventTree_getCommonAncestor(leafEvent1, event) == event);
+	eventTree_freeze(eventTree);
+	CuAssertTrue(testCase, eventTree_getCommonAncestor(leafEvent1, event) == event);
+	CuAssertTrue(testCase, eventTree_getCommonAncestor(event, leafEvent2) == internalEvent);
+
+	free(commonAncestors);
+	free(subTreeBranchLengths);
+	stList_destruct(events);
+	cactusEventTreeTestTeardown(testCase);
+}
+
 CuSuite* cactusEventTreeTestSuite(void) {
 	CuSuite* suite = CuSuiteNew();
 	SUITE_ADD_TEST(suite, testEventTree_copyConstruct);
@@ -167,6 +220,7 @@ CuSuite* cactusEventTreeTestSuite(void) {
 	SUITE_ADD_TEST(suite, testEventTree_getFirst);
 	SUITE_ADD_TEST(suite, testEventTree_iterator);
 	SUITE_ADD_TEST(suite, testEventTree_makeNewickString);
+	SUITE_ADD_TEST(suite, testEventTree_freeze);
 	SUITE_ADD_TEST(suite, testEventTree_construct);
 	return suite;
 }
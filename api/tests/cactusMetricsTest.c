@@ -0,0 +1,71 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "cactusGlobalsPrivate.h"
+
+static char *writeJsonToString(void) {
+    FILE *fileHandle = tmpfile();
+    cactusMetrics_writeJson(fileHandle);
+    int64_t length = ftell(fileHandle);
+    rewind(fileHandle);
+    char *json = st_malloc(length + 1);
+    int64_t i = fread(json, sizeof(char), length, fileHandle);
+    json[i] = '\0';
+    fclose(fileHandle);
+    return json;
+}
+
+static void testCactusMetrics_counters(CuTest *testCase) {
+    cactusMetrics_reset();
+#if defined(_OPENMP)
+#pragma omp parallel for
+#endif
+    for (int64_t i = 0; i < 1000; i++) {
+        cactusMetrics_addToCounter(CACTUS_COUNTER_PINCHES, 2);
+        cactusMetrics_addToCounter(CACTUS_COUNTER_POA_WINDOWS, 1);
+    }
+    CuAssertIntEquals(testCase, 2000, cactusMetrics_getCounter(CACTUS_COUNTER_PINCHES));
+    CuAssertIntEquals(testCase, 1000, cactusMetrics_getCounter(CACTUS_COUNTER_POA_WINDOWS));
+    CuAssertIntEquals(testCase, 0, cactusMetrics_getCounter(CACTUS_COUNTER_FLOWERS_ALIGNED));
+    cactusMetrics_reset();
+    CuAssertIntEquals(testCase, 0, cactusMetrics_getCounter(CACTUS_COUNTER_PINCHES));
+}
+
+static void testCactusMetrics_phases(CuTest *testCase) {
+    cactusMetrics_reset();
+    cactusMetrics_startPhase("outer");
+    cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, 3);
+    cactusMetrics_startPhase("inner");
+    cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, 5);
+    cactusMetrics_endPhase();
+    cactusMetrics_endPhase();
+    cactusMetrics_startPhase("unfinished \"phase\"");
+
+    char *json = writeJsonToString();
+    st_logInfo("Metrics report:\n%s", json);
+    // The inner phase is nested in the outer phase, and the counters of each phase only count its own additions
+    char *outer = strstr(json, "\"name\": \"outer\", \"ended\": true");
+    CuAssertTrue(testCase, outer != NULL);
+    CuAssertTrue(testCase, strstr(outer, "\"blocksDestroyed\": 8") != NULL);
+    char *inner = strstr(outer, "\"phases\": [");
+    CuAssertTrue(testCase, inner != NULL);
+    inner = strstr(inner, "\"name\": \"inner\", \"ended\": true");
+    CuAssertTrue(testCase, inner != NULL);
+    CuAssertTrue(testCase, strstr(inner, "\"blocksDestroyed\": 5") != NULL);
+    CuAssertTrue(testCase, strstr(json, "\"name\": \"unfinished \\\"phase\\\"\", \"ended\": false") != NULL);
+    free(json);
+
+    cactusMetrics_endPhase();
+    cactusMetrics_reset();
+    json = writeJsonToString();
+    CuAssertTrue(testCase, strstr(json, "\"phases\": []") != NULL);
+    free(json);
+}
+
+CuSuite* cactusMetricsTestSuite(void) {
+    CuSuite* suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, testCactusMetrics_counters);
+    SUITE_ADD_TEST(suite, testCactusMetrics_phases);
+    return suite;
+}
@@ -0,0 +1,99 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "cactusGlobalsPrivate.h"
+#include <unistd.h>
+
+static char *getRandomStoreString(int64_t length) {
+    const char *alphabet = "ACGTNacgtnRYkm";
+    char *string = st_malloc((length + 1) * sizeof(char));
+    for (int64_t i = 0; i < length; i++) {
+        // Mostly ordinary bases, with runs of Ns and soft-masking
+        string[i] = st_random() > 0.2 ? "ACGT"[st_randomInt(0, 4)] : alphabet[st_randomInt(0, strlen(alphabet))];
+    }
+    for (int64_t i = 0; i + 30 < length; i += 101) {
+        for (int64_t j = 0; j < 30; j++) {
+            string[i + j] = i % 2 ? 'N' : tolower(string[i + j]);
+        }
+    }
+    string[length] = '\0';
+    return string;
+}
+
+static void testSequenceStore_windows(CuTest *testCase, const char *backingFile) {
+    for (int64_t test = 0; test < 10; test++) {
+        SequenceStore *sequenceStore = sequenceStore_construct(backingFile);
+        stList *strings = stList_construct3(0, free);
+        for (int64_t i = 0; i < 10; i++) {
+            char *string = getRandomStoreString(i == 0 ? 300000 : st_randomInt(0, 1000));
+            stList_append(strings, string);
+            sequenceStore_add(sequenceStore, i + 1, string);
+            CuAssertTrue(testCase, sequenceStore_contains(sequenceStore, i + 1));
+            CuAssertIntEquals(testCase, strlen(string), sequenceStore_getLength(sequenceStore, i + 1));
+        }
+        for (int64_t i = 0; i < stList_length(strings); i++) {
+            char *string = stList_get(strings, i);
+            int64_t length = strlen(string);
+            for (int64_t j = 0; j < 100; j++) {
+                int64_t start = st_randomInt(0, length + 1);
+                int64_t windowLength = st_randomInt(0, length - start + 1);
+                bool strand = st_random() > 0.5;
+                SequenceWindow window;
+                sequenceStore_getWindow(sequenceStore, i + 1, start, windowLength, strand, &window);
+                char *expected = stString_getSubString(string, start, windowLength);
+                if (!strand) {
+                    char *c = stString_reverseComplementString(expected);
+                    free(expected);
+                    expected = c;
+                }
+                char *decoded = sequenceWindow_getString(&window);
+                CuAssertStrEquals(testCase, expected, decoded);
+                for (int64_t k = 0; k < windowLength; k += 7) {
+                    CuAssertTrue(testCase, sequenceWindow_getBase(&window, k) == expected[k]);
+                }
+                free(decoded);
+                free(expected);
+            }
+        }
+        stList_destruct(strings);
+        sequenceStore_destruct(sequenceStore);
+    }
+}
+
+static void testSequenceStore_inMemory(CuTest *testCase) {
+    testSequenceStore_windows(testCase, NULL);
+}
+
+static void testSequenceStore_memoryMapped(CuTest *testCase) {
+    char *backingFile = getTempFile();
+    testSequenceStore_windows(testCase, backingFile);
+    CuAssertTrue(testCase, access(backingFile, F_OK) != 0); // The backing file is cleaned up
+    free(backingFile);
+}
+
+static void testSequenceStore_cactusDisk(CuTest *testCase) {
+    char *backingFile = getTempFile();
+    CactusDisk *cactusDisk = cactusDisk_construct2(backingFile);
+    Sequence *sequence = sequence_construct(1, 12, "ACTGnnNNacgt", "FOO", NULL, cactusDisk);
+    char *string = sequence_getString(sequence, 1, 12, 1);
+    CuAssertStrEquals(testCase, "ACTGnnNNacgt", string);
+    free(string);
+    string = sequence_getString(sequence, 1, 12, 0);
+    CuAssertStrEquals(testCase, "acgtNNnnCAGT", string);
+    free(string);
+    SequenceWindow window;
+    sequence_getWindow(sequence, 3, 4, 1, &window);
+    CuAssertIntEquals(testCase, 4, window.length);
+    CuAssertTrue(testCase, sequenceWindow_getBase(&window, 2) == 'n');
+    cactusDisk_destruct(cactusDisk);
+    free(backingFile);
+}
+
+CuSuite* cactusSequenceStoreTestSuite(void) {
+    CuSuite* suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, testSequenceStore_inMemory);
+    SUITE_ADD_TEST(suite, testSequenceStore_memoryMapped);
+    SUITE_ADD_TEST(suite, testSequenceStore_cactusDisk);
+    return suite;
+}
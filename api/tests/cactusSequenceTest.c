@@ -55,16 +55,22 @@ void testSequence_getEvent(CuTest* testCase) {
     cactusSequenceTestTeardown(testCase);
 }
 
+static void checkString(CuTest *testCase, const char *expected, int64_t start, int64_t length, bool strand) {
+    char *string = sequence_getString(sequence, start, length, strand);
+    CuAssertStrEquals(testCase, expected, string);
+    free(string);
+}
+
 void testSequence_getString(CuTest* testCase) {
     for(int64_t i=0; i<10; i++) {
         cactusSequenceTestSetup(testCase);
         //String is ACTGGCACTG
-        CuAssertStrEquals(testCase, sequenceString, sequence_getString(sequence, 1, 10, 1)); //complete sequence
-        CuAssertStrEquals(testCase, "TGGC", sequence_getString(sequence, 3, 4, 1)); //sub range
-        CuAssertStrEquals(testCase, "", sequence_getString(sequence, 3, 0, 1)); //zero length sub range
-        CuAssertStrEquals(testCase, "CAGTGCCAGT", sequence_getString(sequence, 1, 10, 0)); //reverse complement
-        CuAssertStrEquals(testCase, "GCCA", sequence_getString(sequence, 3, 4, 0)); //sub range, reverse complement
-        CuAssertStrEquals(testCase, "", sequence_getString(sequence, 3, 0, 0)); //zero length sub range on reverse strand
+        checkString(testCase, sequenceString, 1, 10, 1); //complete sequence
+        checkString(testCase, "TGGC", 3, 4, 1); //sub range
+        checkString(testCase, "", 3, 0, 1); //zero length sub range
+        checkString(testCase, "CAGTGCCAGT", 1, 10, 0); //reverse complement
+        checkString(testCase, "GCCA", 3, 4, 0); //sub range, reverse complement
+        checkString(testCase, "", 3, 0, 0); //zero length sub range on reverse strand
         cactusSequenceTestTeardown(testCase);
     }
 }
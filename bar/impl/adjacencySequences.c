@@ -14,9 +14,9 @@
 #include "adjacencySequences.h"
 
 /*
- * Gets the raw sequence.
+ * Gets a window onto the raw sequence.
  */
-static char *getAdjacencySequenceP(Cap *cap, int64_t maxLength) {
+static void getAdjacencySequenceP(Cap *cap, int64_t maxLength, SequenceWindow *window) {
     Sequence *sequence = cap_getSequence(cap);
     assert(sequence != NULL);
     Cap *cap2 = cap_getAdjacency(cap);
@@ -27,22 +27,24 @@ static char *getAdjacencySequenceP(Cap *cap, int64_t maxLength) {
         int64_t length = cap_getCoordinate(cap2) - cap_getCoordinate(cap) - 1;
         assert(length >= 0);
         assert(maxLength >= 0);
-        return sequence_getString(sequence, cap_getCoordinate(cap) + 1, length
-                > maxLength ? maxLength : length, 1);
+        sequence_getWindow(sequence, cap_getCoordinate(cap) + 1, length
+                > maxLength ? maxLength : length, 1, window);
     } else {
         int64_t length = cap_getCoordinate(cap) - cap_getCoordinate(cap2) - 1;
         assert(length >= 0);
-        return sequence_getString(sequence,
+        sequence_getWindow(sequence,
                 length > maxLength ? cap_getCoordinate(cap) - maxLength
                         : cap_getCoordinate(cap2) + 1,
-                length > maxLength ? maxLength : length, 0);
+                length > maxLength ? maxLength : length, 0, window);
     }
 }
 
 AdjacencySequence *adjacencySequence_construct(Cap *cap, int64_t maxLength) {
     AdjacencySequence *subSequence = (AdjacencySequence *) st_malloc(
             sizeof(AdjacencySequence));
-    subSequence->string = getAdjacencySequenceP(cap, maxLength);
+    SequenceWindow window;
+    getAdjacencySequenceP(cap, maxLength, &window);
+    subSequence->string = sequenceWindow_getString(&window); // Decoded once, straight into its own buffer
     Cap *adjacentCap = cap_getAdjacency(cap);
     assert(adjacentCap != NULL);
     assert(!cap_getSide(cap));
@@ -50,7 +52,7 @@ AdjacencySequence *adjacencySequence_construct(Cap *cap, int64_t maxLength) {
     subSequence->subsequenceIdentifier = cap_getName(cap_getStrand(cap) ? cap : adjacentCap);
     subSequence->strand = cap_getStrand(cap);
     subSequence->start = cap_getCoordinate(cap) + (cap_getStrand(cap) ? 1 : -1);
-    subSequence->length = strlen(subSequence->string);
+    subSequence->length = window.length;
     subSequence->hasStubEnd = end_isFree(cap_getEnd(adjacentCap)) && end_isStubEnd(cap_getEnd(adjacentCap));
     return subSequence;
 }
@@ -11,6 +11,8 @@
 #include "stateMachine.h"
 #include "pairwiseAligner.h"
 #include "../../caf/inc/stCaf.h"
+#include <math.h>
+#include <time.h>
 
 // OpenMP
 #if defined(_OPENMP)
@@ -49,13 +51,165 @@ bool blockFilterFn(stPinchBlock *pinchBlock, void *extraArg) {
     return !stCaf_containsRequiredSpecies(pinchBlock, f->flower, f->minimumIngroupDegree, f->minimumOutgroupDegree, f->minimumDegree, f->minimumNumberOfSpecies);
 }
 
-void bar(stList *flowers, CactusParams *params, CactusDisk *cactusDisk, stList *listOfEndAlignmentFiles) {
+///////////////////////////////////////////////////////////////////////////
+// Cost model used to schedule the flowers
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * The number of chunks per thread the flowers are split into. The most expensive flowers each get a chunk to
+ * themselves, while the cheap flowers of the tail are grouped, so the scheduling overhead is not paid per flower.
+ */
+#define BAR_CHUNKS_PER_THREAD 16
+
+static void addEndCost(int64_t rows, int64_t length, int64_t window_size, BarFlowerStats *stats) {
+    // abPOA aligns the rows in windows, consecutive windows overlapping by half the window size, and the cost
+    // of a window is about the number of rows times the square of its length
+    int64_t windows = 1;
+    if (window_size > 0 && length > window_size) {
+        int64_t overlap = window_size / 2 > 0 ? window_size / 2 - 1 : 0;
+        int64_t stride = window_size - overlap;
+        windows += (length - window_size + stride - 1) / stride;
+        length = window_size;
+    }
+    stats->windowNumber += windows;
+    stats->alignmentCost += (double) rows * windows * length * length;
+}
+
+void barFlowerStats_compute(Flower *flower, int64_t max_seq_length, int64_t window_size, int64_t end_overhead_cost,
+                            BarFlowerStats *stats) {
+    stats->flower = flower;
+    stats->endNumber = 0;
+    stats->rowNumber = 0;
+    stats->maxAdjacencyLength = 0;
+    stats->windowNumber = 0;
+    stats->alignmentCost = 0.0;
+    stats->time = 0.0;
+
+    End *end;
+    Flower_EndIterator *endIterator = flower_getEndIterator(flower);
+    while ((end = flower_getNextEnd(endIterator)) != NULL) {
+        int64_t rows = end_getInstanceNumber(end);
+        int64_t length = rows > 0 ? getMaxSequenceLength(end) : 0;
+        length = length < max_seq_length ? length : max_seq_length;
+        stats->endNumber++;
+        stats->rowNumber += rows;
+        stats->maxAdjacencyLength = length > stats->maxAdjacencyLength ? length : stats->maxAdjacencyLength;
+        if (rows > 0) {
+            addEndCost(rows, length, window_size, stats);
+        }
+    }
+    flower_destructEndIterator(endIterator);
+
+    // If one end is incident with every adjacency, and they are all short enough, only that end is aligned
+    End *dominantEnd = getDominantEnd(flower);
+    if (dominantEnd != NULL && stats->maxAdjacencyLength < max_seq_length) {
+        stats->windowNumber = 0;
+        stats->alignmentCost = 0.0;
+        addEndCost(end_getInstanceNumber(dominantEnd), getMaxSequenceLength(dominantEnd), window_size, stats);
+    }
+    stats->cost = stats->alignmentCost + (double) end_overhead_cost * stats->endNumber;
+}
+
+static int barFlowerStats_cmpFn(const void *a, const void *b) {
+    // Sort by descending order of cost, so the most expensive flowers are started first, ties broken by name
+    const BarFlowerStats *stats1 = a, *stats2 = b;
+    if (stats1->cost != stats2->cost) {
+        return stats1->cost > stats2->cost ? -1 : 1;
+    }
+    return cactusMisc_nameCompare(flower_getName(stats1->flower), flower_getName(stats2->flower));
+}
+
+/*
+ * Splits the flowers, sorted by descending cost, into contiguous chunks, returning the start of each chunk
+ * followed by the number of flowers.
+ */
+static int64_t *getFlowerChunks(BarFlowerStats *flowerStats, int64_t flowerNumber, int64_t *chunkNumber) {
+    int64_t threadNumber = 1;
+#if defined(_OPENMP)
+    threadNumber = omp_get_max_threads();
+#endif
+    double totalCost = 0.0;
+    for (int64_t i = 0; i < flowerNumber; i++) {
+        totalCost += flowerStats[i].cost;
+    }
+    double chunkCost = totalCost / (threadNumber * BAR_CHUNKS_PER_THREAD);
+    int64_t *chunkStarts = st_malloc(sizeof(int64_t) * (flowerNumber + 1));
+    *chunkNumber = 0;
+    for (int64_t i = 0; i < flowerNumber;) {
+        chunkStarts[(*chunkNumber)++] = i;
+        double cost = flowerStats[i++].cost;
+        while (i < flowerNumber && cost + flowerStats[i].cost <= chunkCost) {
+            cost += flowerStats[i++].cost;
+        }
+    }
+    chunkStarts[*chunkNumber] = flowerNumber;
+    return chunkStarts;
+}
+
+static double getTime(void) {
+#if defined(_OPENMP)
+    return omp_get_wtime();
+#else
+    return ((double)clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Logs a least squares fit of the times taken to align the flowers to their alignment costs and end numbers,
+ * and how much of the variation in the times the cost model explains. The ratio of the fitted coefficients is
+ * the end overhead cost the times suggest, which bar's endOverheadCost can be set to.
+ */
+static void logCostModelFit(BarFlowerStats *flowerStats, int64_t flowerNumber, int64_t endOverheadCost) {
+    // Solve the normal equations for time = a * alignmentCost + b * endNumber
+    double sxx = 0.0, sxy = 0.0, syy = 0.0, sxt = 0.0, syt = 0.0, totalTime = 0.0, totalCost = 0.0;
+    for (int64_t i = 0; i < flowerNumber; i++) {
+        double x = flowerStats[i].alignmentCost, y = flowerStats[i].endNumber, t = flowerStats[i].time;
+        sxx += x * x; sxy += x * y; syy += y * y; sxt += x * t; syt += y * t;
+        totalTime += t;
+        totalCost += flowerStats[i].cost;
+    }
+    double determinant = sxx * syy - sxy * sxy;
+    if (flowerNumber < 2 || determinant <= 0.0 || totalTime <= 0.0) {
+        return;
+    }
+    double a = (syy * sxt - sxy * syt) / determinant, b = (sxx * syt - sxy * sxt) / determinant;
+
+    // The correlation of the modelled costs with the times
+    double meanCost = totalCost / flowerNumber, meanTime = totalTime / flowerNumber, sct = 0.0, scc = 0.0, stt = 0.0;
+    for (int64_t i = 0; i < flowerNumber; i++) {
+        double c = flowerStats[i].cost - meanCost, t = flowerStats[i].time - meanTime;
+        sct += c * t; scc += c * c; stt += t * t;
+    }
+    st_logInfo("Aligned %" PRIi64 " flowers in %f seconds of thread time. Fitted seconds per flower = %g * alignment "
+               "cost + %g * ends (an end overhead cost of %g, endOverheadCost is %" PRIi64 "). The correlation of the modelled "
+               "costs with the times is %f\n", flowerNumber, totalTime, a, b, a != 0.0 ? b / a : 0.0,
+               endOverheadCost, scc > 0.0 && stt > 0.0 ? sct / sqrt(scc * stt) : 0.0);
+}
+
+static void writeFlowerStats(BarFlowerStats *flowerStats, int64_t flowerNumber, const char *flowerStatsFile) {
+    FILE *fileHandle = fopen(flowerStatsFile, "w");
+    if (fileHandle == NULL) {
+        st_errnoAbort("Failed to open bar flower stats file %s", flowerStatsFile);
+    }
+    fprintf(fileHandle, "flower\tends\trows\tmaxAdjacencyLength\twindows\tcost\tseconds\n");
+    for (int64_t i = 0; i < flowerNumber; i++) {
+        BarFlowerStats *stats = &flowerStats[i];
+        fprintf(fileHandle, "%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\t%.0f\t%f\n",
+                flower_getName(stats->flower), stats->endNumber, stats->rowNumber, stats->maxAdjacencyLength,
+                stats->windowNumber, stats->cost, stats->time);
+    }
+    fclose(fileHandle);
+}
+
+void bar(stList *flowers, CactusParams *params, CactusDisk *cactusDisk, stList *listOfEndAlignmentFiles,
+         const char *flowerStatsFile) {
     //////////////////////////////////////////////
     //Parse the many, many necessary parameters from the params file
     //////////////////////////////////////////////
 
     int64_t maximumLength = cactusParams_get_int(params, 2, "bar", "bandingLimit");
     int64_t usePoa = cactusParams_get_int(params, 2, "bar", "partialOrderAlignment");
+    int64_t endOverheadCost = cactusParams_get_int(params, 2, "bar", "endOverheadCost");
 
     // Pecan prams
     int64_t spanningTrees = cactusParams_get_int(params, 3, "bar", "pecan", "spanningTrees");
@@ -72,6 +226,7 @@ void bar(stList *flowers, CactusParams *params, CactusDisk *cactusDisk, stList *
     int64_t maskFilter = cactusParams_get_int(params, 3, "bar", "poa", "partialOrderAlignmentMaskFilter");
     int64_t poaMaxProgRows = cactusParams_get_int(params, 3, "bar", "poa", "partialOrderAlignmentProgressiveMaxRows");
     double poaMaxLenDiff = cactusParams_get_float(params, 3, "bar", "poa", "partialOrderAlignmentProgressiveMaxLengthDiff");
+    bool poaAnchoredWindows = cactusParams_get_int(params, 3, "bar", "poa", "partialOrderAlignmentAnchoredWindows");
     abpoa_para_t *poaParameters = usePoa ? abpoaParamaters_constructFromCactusParams(params) : NULL;
 
     //////////////////////////////////////////////
@@ -82,80 +237,107 @@ void bar(stList *flowers, CactusParams *params, CactusDisk *cactusDisk, stList *
         st_errAbort("We have precomputed alignments but %" PRIi64 " flowers to align.\n", stList_length(flowers));
     }
 
+    // Model the cost of each flower, and order and chunk the flowers by it
+    int64_t flowerNumber = stList_length(flowers);
+    BarFlowerStats *flowerStats = st_malloc(sizeof(BarFlowerStats) * (flowerNumber + 1));
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int64_t j = 0; j < flowerNumber; j++) {
+        barFlowerStats_compute(stList_get(flowers, j), maximumLength, usePoa ? poaWindow : maximumLength, endOverheadCost,
+                               &flowerStats[j]);
+    }
+    qsort(flowerStats, flowerNumber, sizeof(BarFlowerStats), barFlowerStats_cmpFn);
+    int64_t chunkNumber;
+    int64_t *chunkStarts = getFlowerChunks(flowerStats, flowerNumber, &chunkNumber);
+    st_logInfo("Aligning %" PRIi64 " flowers in %" PRIi64 " chunks\n", flowerNumber, chunkNumber);
+
 #if defined(_OPENMP)
 #pragma omp parallel for schedule(dynamic, 1)
 #endif
-    for (int64_t j = 0; j<stList_length(flowers); j++) {
-        Flower *flower = stList_get(flowers, j);
-
-        // These are all variables used by the filter fns
-        FilterArgs *fa = st_calloc(1, sizeof(FilterArgs));
-        fa->minimumIngroupDegree = cactusParams_get_int(params, 2, "bar", "minimumIngroupDegree");
-        fa->minimumOutgroupDegree = cactusParams_get_int(params, 2, "bar", "minimumOutgroupDegree");
-        fa->minimumDegree = cactusParams_get_int(params, 2, "bar", "minimumBlockDegree");
-        fa->minimumNumberOfSpecies = cactusParams_get_int(params, 2, "bar", "minimumNumberOfSpecies");
-        fa->flower = flower;
-
-        void *alignments;
-        if (usePoa) {
+    for (int64_t chunk = 0; chunk < chunkNumber; chunk++) {
+        for (int64_t j = chunkStarts[chunk]; j < chunkStarts[chunk + 1]; j++) {
+            Flower *flower = flowerStats[j].flower;
+            double startTime = getTime();
+
+            // These are all variables used by the filter fns
+            FilterArgs *fa = st_calloc(1, sizeof(FilterArgs));
+            fa->minimumIngroupDegree = cactusParams_get_int(params, 2, "bar", "minimumIngroupDegree");
+            fa->minimumOutgroupDegree = cactusParams_get_int(params, 2, "bar", "minimumOutgroupDegree");
+            fa->minimumDegree = cactusParams_get_int(params, 2, "bar", "minimumBlockDegree");
+            fa->minimumNumberOfSpecies = cactusParams_get_int(params, 2, "bar", "minimumNumberOfSpecies");
+            fa->flower = flower;
+
+            void *alignments;
+            if (usePoa) {
+                /*
+                 * This makes a consistent set of alignments using abPoa.
+                 *
+                 * It does not use any precomputed alignments, if they are provided they will be ignored
+                 */
+                alignments = make_flower_alignment_poa(flower, maximumLength, poaWindow, maskFilter,
+                                                       poaMaxProgRows, poaMaxLenDiff, poaParameters, poaAnchoredWindows);
+                st_logDebug("Created the poa alignments: %" PRIi64 " poa alignment blocks for flower\n", stList_length(alignments));
+            } else {
+                alignments = makeFlowerAlignment3(sM, flower, listOfEndAlignmentFiles, spanningTrees, maximumLength,
+                                                  useProgressiveMerging, matchGamma, pairwiseAlignmentParameters,
+                                                  pruneOutStubAlignments);
+                st_logDebug("Created the alignment: %" PRIi64 " pairs for flower\n", stSortedSet_size(alignments));
+            }
+
+            stPinchIterator *pinchIterator = NULL;
+            if(usePoa) {
+                pinchIterator = stPinchIterator_constructFromAlignedBlocks(alignments);
+            }
+            else {
+                pinchIterator = stPinchIterator_constructFromAlignedPairs(alignments, getNextAlignedPairAlignment);
+            }
             /*
-             * This makes a consistent set of alignments using abPoa.
-             *
-             * It does not use any precomputed alignments, if they are provided they will be ignored
+             * Run the cactus caf functions to build cactus.
              */
-            alignments = make_flower_alignment_poa(flower, maximumLength, poaWindow, maskFilter,
-                                                   poaMaxProgRows, poaMaxLenDiff, poaParameters);
-            st_logDebug("Created the poa alignments: %" PRIi64 " poa alignment blocks for flower\n", stList_length(alignments));
-        } else {
-            alignments = makeFlowerAlignment3(sM, flower, listOfEndAlignmentFiles, spanningTrees, maximumLength,
-                                              useProgressiveMerging, matchGamma, pairwiseAlignmentParameters,
-                                              pruneOutStubAlignments);
-            st_logDebug("Created the alignment: %" PRIi64 " pairs for flower\n", stSortedSet_size(alignments));
-        }
 
-        stPinchIterator *pinchIterator = NULL;
-        if(usePoa) {
-            pinchIterator = stPinchIterator_constructFromAlignedBlocks(alignments);
-        }
-        else {
-            pinchIterator = stPinchIterator_constructFromAlignedPairs(alignments, getNextAlignedPairAlignment);
-        }
-        /*
-         * Run the cactus caf functions to build cactus.
-         */
+            stPinchThreadSet *threadSet = stCaf_setup(flower);
 
-        stPinchThreadSet *threadSet = stCaf_setup(flower);
+            stCaf_anneal(threadSet, pinchIterator, NULL, flower);
 
-        stCaf_anneal(threadSet, pinchIterator, NULL, flower);
+            if (fa->minimumDegree < 2) {
+                stCaf_makeDegreeOneBlocks(threadSet);
+            }
 
-        if (fa->minimumDegree < 2) {
-            stCaf_makeDegreeOneBlocks(threadSet);
-        }
+            if (fa->minimumIngroupDegree > 0 || fa->minimumOutgroupDegree > 0 || fa->minimumDegree > 1) {
+                stCaf_melt(flower, threadSet, blockFilterFn, fa, 0, 0, 0, INT64_MAX);
+            }
 
-        if (fa->minimumIngroupDegree > 0 || fa->minimumOutgroupDegree > 0 || fa->minimumDegree > 1) {
-            stCaf_melt(flower, threadSet, blockFilterFn, fa, 0, 0, 0, INT64_MAX);
-        }
+            stCaf_finish(flower, threadSet, INT64_MAX, INT64_MAX); //Flower now destroyed.
 
-        stCaf_finish(flower, threadSet, INT64_MAX, INT64_MAX); //Flower now destroyed.
+            stPinchThreadSet_destruct(threadSet);
+            st_logDebug("Ran the cactus core script.\n");
 
-        stPinchThreadSet_destruct(threadSet);
-        st_logDebug("Ran the cactus core script.\n");
+            /*
+             * Cleanup
+             */
+            //Clean up the sorted set after cleaning up the iterator
+            stPinchIterator_destruct(pinchIterator);
+            if(usePoa) {
+                stList_destruct(alignments);
+            }
+            else {
+                stSortedSet_destruct(alignments);
+            }
+            free(fa);
 
-        /*
-         * Cleanup
-         */
-        //Clean up the sorted set after cleaning up the iterator
-        stPinchIterator_destruct(pinchIterator);
-        if(usePoa) {
-            stList_destruct(alignments);
-        }
-        else {
-            stSortedSet_destruct(alignments);
+            flowerStats[j].time = getTime() - startTime;
+            cactusMetrics_addToCounter(CACTUS_COUNTER_FLOWERS_ALIGNED, 1);
+            st_logDebug("Finished filling in the alignments for the flower\n");
         }
-        free(fa);
+    }
 
-        st_logDebug("Finished filling in the alignments for the flower\n");
+    logCostModelFit(flowerStats, flowerNumber, endOverheadCost);
+    if (flowerStatsFile != NULL) {
+        writeFlowerStats(flowerStats, flowerNumber, flowerStatsFile);
     }
+    free(flowerStats);
+    free(chunkStarts);
 
     //////////////////////////////////////////////
     //Clean up
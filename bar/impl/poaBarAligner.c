@@ -17,9 +17,9 @@
 //#define CACTUS_ABPOA_FROM_COMMAND_LINE
 
 // OpenMP
-//#if defined(_OPENMP)
-//#include <omp.h>
-//#endif
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 abpoa_para_t *abpoaParamaters_constructFromCactusParams(CactusParams *params) {
     abpoa_para_t *abpt = abpoa_init_para();
@@ -80,7 +80,8 @@ abpoa_para_t *abpoaParamaters_constructFromCactusParams(CactusParams *params) {
     return abpt;
 }
 
-// It turns out abpoa can write to these, so we make a quick copy before using
+// It turns out abpoa can write to these, so we make a quick copy before using.
+// Each copy is private to the alignment that makes it, so alignments can run concurrently.
 static abpoa_para_t *copy_abpoa_params(abpoa_para_t *abpt) {
     abpoa_para_t *abpt_cpy = abpoa_init_para();
     abpt_cpy->out_msa = 1;
@@ -101,6 +102,10 @@ static abpoa_para_t *copy_abpoa_params(abpoa_para_t *abpt) {
     abpt_cpy->min_w = abpt->min_w;
     abpt_cpy->progressive_poa = abpt->progressive_poa;
     abpt_cpy->use_score_matrix = 0;
+    // abpoa_post_set_para (re)fills abpoa's global lookup tables, so calls to it are serialised
+#if defined(_OPENMP)
+#pragma omp critical(abpoa_para)
+#endif
     abpoa_post_set_para(abpt_cpy);
     abpt_cpy->use_score_matrix = abpt->use_score_matrix;
     if (abpt->use_score_matrix == 1) {
@@ -460,6 +465,82 @@ static void msa_fix_trimmed(Msa* msa) {
     msa->column_no -= empty_columns;
 }
 
+/**
+ * Trims the overlap between two consecutive windows of an alignment, row_overlaps giving for each row the number of
+ * bases at the start of the row in msa that are also at the end of the row in prev_msa.
+ */
+static void trim_window_overlap(Msa *prev_msa, Msa *msa, int64_t *row_overlaps) {
+    // todo: there is obviously room for optimization here, as we compute full scores twice for each msa
+    //       in addition to flipping the prev_msa back and forth
+    //       (not sure if this is at all noticeable on top of abpoa running time though)
+    // trim() presently assumes we're looking at reverse-complement sequence:
+    flip_msa_seq(msa);
+    float* prev_column_scores = make_column_scores(prev_msa);
+    float* column_scores = make_column_scores(msa);
+
+    // trim with the previous alignment
+    for (int64_t i = 0; i < msa->seq_no; ++i) {
+        int64_t overlap = msa->seq_lens[i] < row_overlaps[i] ? msa->seq_lens[i] : row_overlaps[i];
+        if (overlap > 0) {
+            trim(i, msa, column_scores, i, prev_msa, prev_column_scores, overlap);
+        }
+    }
+    // todo: can this be done as part of trim?
+    msa_fix_trimmed(msa);
+    msa_fix_trimmed(prev_msa);
+    // flip our msa back to its original strand
+    flip_msa_seq(msa);
+
+    free(prev_column_scores);
+    free(column_scores);
+}
+
+/**
+ * Concatenates the (trimmed) window msas into one msa of the given sequences, destructing the windows.
+ */
+static Msa *stitch_msa_windows(stList *msa_windows, char **seqs, int *seq_lens, int64_t seq_no) {
+    int64_t num_windows = stList_length(msa_windows);
+    Msa *output_msa;
+    if (num_windows == 1) {
+        // if we have only one window, return it
+        output_msa = stList_removeFirst(msa_windows);
+        for (int64_t i = 0; output_msa->seqs != NULL && i < seq_no; ++i) {
+            free(output_msa->seqs[i]);
+        }
+        free(output_msa->seqs);
+        output_msa->seqs = seqs;
+        free(output_msa->seq_lens); // cleanup old memory
+        output_msa->seq_lens = seq_lens;
+    } else {
+        // otherwise, we stitch all the window msas into a new output msa
+        output_msa = st_malloc(sizeof(Msa));
+        assert(seq_no > 0);
+        output_msa->seq_no = seq_no;
+        output_msa->seqs = seqs;
+        output_msa->seq_lens = seq_lens;
+        output_msa->column_no = 0;
+        for (int64_t i = 0; i < num_windows; ++i) {
+            Msa* msa_i = (Msa*)stList_get(msa_windows, i);
+            output_msa->column_no += msa_i->column_no;
+        }
+        output_msa->msa_seq = st_malloc(sizeof(uint8_t *) * output_msa->seq_no);
+        for (int64_t i = 0; i < output_msa->seq_no; ++i) {
+            output_msa->msa_seq[i] = st_malloc(sizeof(uint8_t) * output_msa->column_no);
+            int64_t offset = 0;
+            for (int64_t j = 0; j < num_windows; ++j) {
+                Msa* msa_j = stList_get(msa_windows, j);
+                uint8_t* window_row = msa_j->msa_seq[i];
+                for (int64_t k = 0; k < msa_j->column_no; ++k) {
+                    output_msa->msa_seq[i][offset++] = window_row[k];
+                }
+            }
+            assert(offset == output_msa->column_no);
+        }
+    }
+    stList_destruct(msa_windows);
+    return output_msa;
+}
+
 Msa *msa_make_partial_order_alignment(char **seqs, int *seq_lens, int64_t seq_no, int64_t window_size,
                                       int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t *poa_parameters) {
 
@@ -662,30 +743,8 @@ Msa *msa_make_partial_order_alignment(char **seqs, int *seq_lens, int64_t seq_no
             seq_offsets[i] += msa->seq_lens[i];
         }
 
-        // todo: there is obviously room for optimization here, as we compute full scores twice for each msa
-        //       in addition to flipping the prev_msa back and forth
-        //       (not sure if this is at all noticeable on top of abpoa running time though)
         if (prev_msa) {
-            // trim() presently assumes we're looking at reverse-complement sequence:
-            flip_msa_seq(msa);
-            float* prev_column_scores = make_column_scores(prev_msa);
-            float* column_scores = make_column_scores(msa);
-
-            // trim with the previous alignment
-            for (int64_t i = 0; i < msa->seq_no; ++i) {
-                int64_t overlap = msa->seq_lens[i] < row_overlaps[i] ? msa->seq_lens[i] : row_overlaps[i];
-                if (overlap > 0) {
-                    trim(i, msa, column_scores, i, prev_msa, prev_column_scores, overlap);
-                }
-            }
-            // todo: can this be done as part of trim?
-            msa_fix_trimmed(msa);
-            msa_fix_trimmed(prev_msa);            
-            // flip our msa back to its original strand
-            flip_msa_seq(msa);
-
-            free(prev_column_scores);
-            free(column_scores);
+            trim_window_overlap(prev_msa, msa, row_overlaps);
         }
 
         // add the msa to our list
@@ -700,40 +759,8 @@ Msa *msa_make_partial_order_alignment(char **seqs, int *seq_lens, int64_t seq_no
         prev_bases_remaining = bases_remaining; 
     }
 
-    int64_t num_windows = stList_length(msa_windows);
-    Msa *output_msa;
-    if (num_windows == 1) {
-        // if we have only one window, return it
-        output_msa = stList_removeFirst(msa_windows);
-        output_msa->seqs = seqs;
-        free(output_msa->seq_lens); // cleanup old memory
-        output_msa->seq_lens = seq_lens;
-    } else {
-        // otherwise, we stitch all the window msas into a new output msa
-        output_msa = st_malloc(sizeof(Msa));
-        assert(seq_no > 0);
-        output_msa->seq_no = seq_no;
-        output_msa->seqs = seqs;
-        output_msa->seq_lens = seq_lens;
-        output_msa->column_no = 0;
-        for (int64_t i = 0; i < num_windows; ++i) {
-            Msa* msa_i = (Msa*)stList_get(msa_windows, i);
-            output_msa->column_no += msa_i->column_no;
-        }
-        output_msa->msa_seq = st_malloc(sizeof(uint8_t *) * output_msa->seq_no);
-        for (int64_t i = 0; i < output_msa->seq_no; ++i) {
-            output_msa->msa_seq[i] = st_malloc(sizeof(uint8_t) * output_msa->column_no);
-            int64_t offset = 0;
-            for (int64_t j = 0; j < num_windows; ++j) {
-                Msa* msa_j = stList_get(msa_windows, j);
-                uint8_t* window_row = msa_j->msa_seq[i];
-                for (int64_t k = 0; k < msa_j->column_no; ++k) {
-                    output_msa->msa_seq[i][offset++] = window_row[k];
-                }
-            }
-            assert(offset == output_msa->column_no);
-        }
-    } 
+    cactusMetrics_addToCounter(CACTUS_COUNTER_POA_WINDOWS, stList_length(msa_windows));
+    Msa *output_msa = stitch_msa_windows(msa_windows, seqs, seq_lens, seq_no);
 
     // Clean up
     for (int64_t i = 0; i < seq_no; ++i) {
@@ -743,27 +770,383 @@ Msa *msa_make_partial_order_alignment(char **seqs, int *seq_lens, int64_t seq_no
     free(seq_offsets);
     free(empty_seqs);
     free(row_overlaps);
-    stList_destruct(msa_windows);
 
     return output_msa;
 }
 
+/*
+ * Runs fn(order[k], extra_arg) for each k in [0, job_no), in parallel. If called from within a parallel region,
+ * for example the loop over flowers in bar(), each job is an OpenMP task, so the jobs are picked up by the threads
+ * of that region once they run out of other work, otherwise a parallel region is started for them. If job_seq_nos
+ * is not NULL it gives the number of sequences each job aligns, and jobs with only one, which are trivial, are run
+ * straight away rather than paying for a task.
+ * Jobs must only write their own results, so the outcome does not depend on the order they are run in.
+ */
+static void run_poa_jobs(int64_t job_no, int64_t *order, int64_t *job_seq_nos, void (*fn)(int64_t, void *),
+                         void *extra_arg) {
+#if defined(_OPENMP)
+    if(omp_in_parallel()) {
+        for(int64_t k=0; k<job_no; k++) {
+            int64_t i = order[k];
+#pragma omp task firstprivate(i) if(job_seq_nos == NULL || job_seq_nos[i] > 1)
+            fn(i, extra_arg);
+        }
+#pragma omp taskwait
+    } else {
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int64_t k=0; k<job_no; k++) {
+            fn(order[k], extra_arg);
+        }
+    }
+#else
+    for(int64_t k=0; k<job_no; k++) {
+        fn(order[k], extra_arg);
+    }
+#endif
+}
+
+/*
+ * Gets an ordering of the jobs by descending order of their sizes, ties broken by index, so that the largest
+ * jobs are started first rather than left until last.
+ */
+static int64_t *get_poa_job_order(int64_t job_no, int64_t *job_sizes) {
+    int64_t *order = st_malloc(sizeof(int64_t) * job_no);
+    for(int64_t i=0; i<job_no; i++) {
+        // Insertion sort, which is stable and fine for the numbers of jobs here
+        int64_t j = i;
+        while(j > 0 && job_sizes[order[j-1]] < job_sizes[i]) {
+            order[j] = order[j-1];
+            j--;
+        }
+        order[j] = i;
+    }
+    return order;
+}
+
+/*
+ * Anchored windows.
+ *
+ * Rather than walking the windows one after another, the window boundaries are picked up front at anchors:
+ * k-mers that occur exactly once in every row, in the same order in every row. Each window ends with the anchor
+ * that the next window starts with, so consecutive windows overlap by the anchor in every row, and the windows
+ * are stitched together with the same trimming used for the sliding windows.
+ */
+
+/*
+ * The size of the anchor k-mers, and the maximum number of positions either side of each target
+ * boundary in the first row that are tried as anchors.
+ */
+#define POA_ANCHOR_KMER_SIZE 16
+#define POA_ANCHOR_SEARCH_RADIUS 64
+
+typedef struct _anchorCandidate {
+    uint64_t kmer;
+    int64_t index; // Index of the candidate, candidates are numbered in order of their position in the first row
+} AnchorCandidate;
+
+static int anchorCandidate_cmp(const void *a, const void *b) {
+    const AnchorCandidate *c1 = a, *c2 = b;
+    return c1->kmer < c2->kmer ? -1 : (c1->kmer > c2->kmer ? 1 :
+           (c1->index < c2->index ? -1 : (c1->index > c2->index ? 1 : 0)));
+}
+
+static int64_t anchor_base_code(char c) {
+    switch(toupper(c)) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Calls fn for each k-mer of the sequence that contains only ACGT bases, with the k-mer's start position.
+ */
+static void for_each_anchor_kmer(char *seq, int64_t seq_len, void (*fn)(uint64_t, int64_t, void *), void *extra_arg) {
+    uint64_t mask = (((uint64_t)1) << (2 * POA_ANCHOR_KMER_SIZE)) - 1;
+    uint64_t kmer = 0;
+    int64_t valid = 0; // The number of consecutive ACGT bases ending at the current position
+    for(int64_t i=0; i<seq_len; i++) {
+        int64_t code = anchor_base_code(seq[i]);
+        if(code < 0) {
+            valid = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | code) & mask;
+        if(++valid >= POA_ANCHOR_KMER_SIZE) {
+            fn(kmer, i + 1 - POA_ANCHOR_KMER_SIZE, extra_arg);
+        }
+    }
+}
+
+typedef struct _anchorSearch {
+    AnchorCandidate *candidates; // Sorted by k-mer
+    int64_t candidate_no;
+    int64_t *positions; // positions[index * seq_no + row] is the position of the candidate in the row,
+                        // -1 if not yet seen and -2 if seen more than once
+    int64_t seq_no;
+    int64_t row;
+} AnchorSearch;
+
+static void anchor_search_add(uint64_t kmer, int64_t position, void *extra_arg) {
+    AnchorSearch *search = extra_arg;
+    // Binary search for the first candidate with the k-mer
+    int64_t lo = 0, hi = search->candidate_no;
+    while(lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if(search->candidates[mid].kmer < kmer) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for(; lo < search->candidate_no && search->candidates[lo].kmer == kmer; lo++) {
+        int64_t *p = &search->positions[search->candidates[lo].index * search->seq_no + search->row];
+        *p = *p == -1 ? position : -2;
+    }
+}
+
+/*
+ * Gets the anchors at which to cut the rows into windows. Returns an array with the position of each
+ * anchor in each row, anchor i in row j being at [i * seq_no + j], and sets anchor_no. Returns NULL if
+ * no anchors are found.
+ */
+static int64_t *get_window_anchors(char **seqs, int *seq_lens, int64_t seq_no, int64_t window_size,
+                                   int64_t *anchor_no) {
+    *anchor_no = 0;
+    // Aim for windows of half the window size in the first row, leaving room for the other rows to be longer
+    int64_t stride = window_size / 2;
+    int64_t radius = stride / 4 < POA_ANCHOR_SEARCH_RADIUS ? stride / 4 : POA_ANCHOR_SEARCH_RADIUS;
+    if(seq_no < 2 || stride < 2 * POA_ANCHOR_KMER_SIZE || seq_lens[0] <= stride) {
+        return NULL;
+    }
+
+    // Get the candidate anchors from the first row, around each target boundary
+    int64_t target_no = (seq_lens[0] - POA_ANCHOR_KMER_SIZE) / stride;
+    int64_t *target_starts = st_malloc(sizeof(int64_t) * (target_no + 1)); // Index of the first candidate for each target
+    AnchorCandidate *candidates = st_malloc(sizeof(AnchorCandidate) * target_no * (2 * radius + 1));
+    int64_t *first_row_positions = st_malloc(sizeof(int64_t) * target_no * (2 * radius + 1));
+    int64_t candidate_no = 0;
+    for(int64_t t=0; t<target_no; t++) {
+        target_starts[t] = candidate_no;
+        int64_t target = (t + 1) * stride;
+        for(int64_t i=target-radius; i<=target+radius; i++) {
+            if(i < 0 || i + POA_ANCHOR_KMER_SIZE > seq_lens[0]) {
+                continue;
+            }
+            uint64_t kmer = 0;
+            int64_t j = 0;
+            for(; j<POA_ANCHOR_KMER_SIZE; j++) {
+                int64_t code = anchor_base_code(seqs[0][i + j]);
+                if(code < 0) {
+                    break;
+                }
+                kmer = (kmer << 2) | code;
+            }
+            if(j == POA_ANCHOR_KMER_SIZE) {
+                candidates[candidate_no].kmer = kmer;
+                candidates[candidate_no].index = candidate_no;
+                first_row_positions[candidate_no++] = i;
+            }
+        }
+    }
+    target_starts[target_no] = candidate_no;
+
+    // Find where each candidate occurs in each row
+    AnchorSearch search;
+    search.candidates = candidates;
+    search.candidate_no = candidate_no;
+    search.positions = st_malloc(sizeof(int64_t) * candidate_no * seq_no);
+    for(int64_t i=0; i<candidate_no * seq_no; i++) {
+        search.positions[i] = -1;
+    }
+    search.seq_no = seq_no;
+    qsort(candidates, candidate_no, sizeof(AnchorCandidate), anchorCandidate_cmp);
+    for(search.row=0; search.row<seq_no; search.row++) {
+        for_each_anchor_kmer(seqs[search.row], seq_lens[search.row], anchor_search_add, &search);
+    }
+
+    // Greedily pick for each target the candidate closest to it that is unique in every row and that
+    // follows the previous anchor, without overlapping it, in every row
+    int64_t *anchors = st_malloc(sizeof(int64_t) * target_no * seq_no);
+    for(int64_t t=0; t<target_no; t++) {
+        int64_t target = (t + 1) * stride, best = -1, best_distance = INT64_MAX;
+        for(int64_t c=target_starts[t]; c<target_starts[t+1]; c++) {
+            int64_t distance = llabs(first_row_positions[c] - target);
+            if(distance >= best_distance) {
+                continue;
+            }
+            int64_t *positions = &search.positions[c * seq_no];
+            int64_t j = 0;
+            for(; j<seq_no; j++) {
+                int64_t previous = *anchor_no > 0 ? anchors[(*anchor_no - 1) * seq_no + j] : 0;
+                if(positions[j] < previous + POA_ANCHOR_KMER_SIZE) { // Also true if not unique or absent
+                    break;
+                }
+            }
+            if(j == seq_no) {
+                best = c;
+                best_distance = distance;
+            }
+        }
+        if(best != -1) {
+            memcpy(&anchors[(*anchor_no)++ * seq_no], &search.positions[best * seq_no], sizeof(int64_t) * seq_no);
+        }
+    }
+
+    free(target_starts);
+    free(candidates);
+    free(first_row_positions);
+    free(search.positions);
+    if(*anchor_no == 0) {
+        free(anchors);
+        return NULL;
+    }
+    return anchors;
+}
+
+typedef struct _anchoredWindows {
+    char **seqs;
+    int *seq_lens;
+    int64_t seq_no;
+    int64_t *anchors;
+    int64_t anchor_no;
+    int64_t window_size;
+    int64_t max_prog_rows;
+    double max_prog_length_diff;
+    abpoa_para_t *poa_parameters;
+    Msa **msas;
+} AnchoredWindows;
+
+static int64_t anchored_window_start(AnchoredWindows *w, int64_t window, int64_t row) {
+    return window == 0 ? 0 : w->anchors[(window - 1) * w->seq_no + row];
+}
+
+static int64_t anchored_window_end(AnchoredWindows *w, int64_t window, int64_t row) {
+    return window == w->anchor_no ? w->seq_lens[row] : w->anchors[window * w->seq_no + row] + POA_ANCHOR_KMER_SIZE;
+}
+
+static void make_anchored_window_alignment(int64_t window, void *extra_arg) {
+    AnchoredWindows *w = extra_arg;
+    char **seqs = st_malloc(sizeof(char *) * w->seq_no);
+    int *seq_lens = st_malloc(sizeof(int) * w->seq_no);
+    for(int64_t i=0; i<w->seq_no; i++) {
+        int64_t start = anchored_window_start(w, window, i);
+        seq_lens[i] = anchored_window_end(w, window, i) - start;
+        assert(seq_lens[i] >= POA_ANCHOR_KMER_SIZE);
+        seqs[i] = st_malloc(sizeof(char) * (seq_lens[i] + 1));
+        memcpy(seqs[i], w->seqs[i] + start, seq_lens[i]);
+        seqs[i][seq_lens[i]] = '\0';
+    }
+    // Windows longer than the window size are themselves aligned with sliding windows
+    w->msas[window] = msa_make_partial_order_alignment(seqs, seq_lens, w->seq_no, w->window_size,
+                                                       w->max_prog_rows, w->max_prog_length_diff, w->poa_parameters);
+}
+
+Msa *msa_make_partial_order_alignment_anchored(char **seqs, int *seq_lens, int64_t seq_no, int64_t window_size,
+                                               int64_t max_prog_rows, double max_prog_length_diff,
+                                               abpoa_para_t *poa_parameters) {
+    AnchoredWindows w;
+    w.anchors = get_window_anchors(seqs, seq_lens, seq_no, window_size, &w.anchor_no);
+    if(w.anchors == NULL) { // Nothing to gain, so just use the sliding windows
+        return msa_make_partial_order_alignment(seqs, seq_lens, seq_no, window_size,
+                                                max_prog_rows, max_prog_length_diff, poa_parameters);
+    }
+    w.seqs = seqs;
+    w.seq_lens = seq_lens;
+    w.seq_no = seq_no;
+    w.window_size = window_size;
+    w.max_prog_rows = max_prog_rows;
+    w.max_prog_length_diff = max_prog_length_diff;
+    w.poa_parameters = poa_parameters;
+    int64_t window_no = w.anchor_no + 1;
+    w.msas = st_malloc(sizeof(Msa *) * window_no);
+
+    // Align the windows in parallel, largest first
+    int64_t *window_sizes = st_malloc(sizeof(int64_t) * window_no);
+    for(int64_t i=0; i<window_no; i++) {
+        window_sizes[i] = 0;
+        for(int64_t j=0; j<seq_no; j++) {
+            window_sizes[i] += anchored_window_end(&w, i, j) - anchored_window_start(&w, i, j);
+        }
+    }
+    int64_t *order = get_poa_job_order(window_no, window_sizes);
+    run_poa_jobs(window_no, order, NULL, make_anchored_window_alignment, &w);
+
+    // Stitch the windows together, in order, trimming the anchor each pair of consecutive windows shares
+    int64_t *row_overlaps = st_malloc(sizeof(int64_t) * seq_no);
+    for(int64_t j=0; j<seq_no; j++) {
+        row_overlaps[j] = POA_ANCHOR_KMER_SIZE;
+    }
+    stList *msa_windows = stList_construct3(0, (void(*)(void *)) msa_destruct);
+    for(int64_t i=0; i<window_no; i++) {
+        if(i > 0) {
+            trim_window_overlap(w.msas[i-1], w.msas[i], row_overlaps);
+        }
+        stList_append(msa_windows, w.msas[i]);
+    }
+    Msa *output_msa = stitch_msa_windows(msa_windows, seqs, seq_lens, seq_no);
+
+    // Clean up
+    free(row_overlaps);
+    free(order);
+    free(window_sizes);
+    free(w.msas);
+    free(w.anchors);
+
+    return output_msa;
+}
+
+typedef struct _endAlignments {
+    int64_t *end_lengths;
+    char ***end_strings;
+    int **end_string_lengths;
+    int64_t window_size;
+    int64_t max_prog_rows;
+    double max_prog_length_diff;
+    abpoa_para_t *poa_parameters;
+    bool anchored_windows;
+    Msa **msas;
+    float **column_scores;
+} EndAlignments;
+
+static void make_end_alignment(int64_t i, void *extra_arg) {
+    EndAlignments *e = extra_arg;
+    e->msas[i] = (e->anchored_windows ? msa_make_partial_order_alignment_anchored : msa_make_partial_order_alignment)(
+            e->end_strings[i], e->end_string_lengths[i], e->end_lengths[i], e->window_size,
+            e->max_prog_rows, e->max_prog_length_diff, e->poa_parameters);
+    e->column_scores[i] = make_column_scores(e->msas[i]);
+}
+
 Msa **make_consistent_partial_order_alignments(int64_t end_no, int64_t *end_lengths, char ***end_strings,
         int **end_string_lengths, int64_t **right_end_indexes, int64_t **right_end_row_indexes, int64_t **overlaps,
-        int64_t window_size, int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t *poa_parameters) {
-    // Calculate the initial, potentially inconsistent msas and column scores for each msa
+        int64_t window_size, int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t *poa_parameters,
+        bool anchored_windows) {
+    // Calculate the initial, potentially inconsistent msas and column scores for each msa, in parallel,
+    // starting with the ends with the most sequence
     float *column_scores[end_no];
     Msa **msas = st_malloc(sizeof(Msa *) * end_no);
-//#if defined(_OPENMP)
-//#pragma omp parallel for schedule(dynamic)
-//#endif
+    EndAlignments e = { end_lengths, end_strings, end_string_lengths, window_size, max_prog_rows,
+                        max_prog_length_diff, poa_parameters, anchored_windows, msas, column_scores };
+    int64_t *end_sizes = st_malloc(sizeof(int64_t) * end_no);
     for(int64_t i=0; i<end_no; i++) {
-        msas[i] = msa_make_partial_order_alignment(end_strings[i], end_string_lengths[i], end_lengths[i], window_size,
-                                                   max_prog_rows, max_prog_length_diff, poa_parameters);
-        column_scores[i] = make_column_scores(msas[i]);
+        end_sizes[i] = 0;
+        for(int64_t j=0; j<end_lengths[i]; j++) {
+            end_sizes[i] += end_string_lengths[i][j];
+        }
     }
+    int64_t *order = get_poa_job_order(end_no, end_sizes);
+    run_poa_jobs(end_no, order, end_lengths, make_end_alignment, &e);
+    free(order);
+    free(end_sizes);
 
-    // Make the msas consistent with one another
+    // Make the msas consistent with one another, serially and in end order so the result is deterministic
     for(int64_t i=0; i<end_no; i++) { // For each end
         Msa *msa = msas[i];
         for(int64_t j=0; j<msa->seq_no; j++) { //  For each string incident to the ith end
@@ -800,7 +1183,7 @@ void alignmentBlock_destruct(AlignmentBlock *alignmentBlock) {
     }
 }
 
-char *get_adjacency_string(Cap *cap, int *length, bool return_string) {
+void get_adjacency_window(Cap *cap, SequenceWindow *window) {
     assert(!cap_getSide(cap));
     Sequence *sequence = cap_getSequence(cap);
     assert(sequence != NULL);
@@ -809,17 +1192,24 @@ char *get_adjacency_string(Cap *cap, int *length, bool return_string) {
     assert(cap_getSide(cap2));
     if (cap_getStrand(cap)) {
         assert(cap_getCoordinate(cap2) > cap_getCoordinate(cap));
-        *length = cap_getCoordinate(cap2) - cap_getCoordinate(cap) - 1;
-        assert(*length >= 0);
-        return return_string ? sequence_getString(sequence, cap_getCoordinate(cap) + 1, *length, 1) : NULL;
+        int64_t length = cap_getCoordinate(cap2) - cap_getCoordinate(cap) - 1;
+        assert(length >= 0);
+        sequence_getWindow(sequence, cap_getCoordinate(cap) + 1, length, 1, window);
     } else {
         assert(cap_getCoordinate(cap) > cap_getCoordinate(cap2));
-        *length = cap_getCoordinate(cap) - cap_getCoordinate(cap2) - 1;
-        assert(*length >= 0);
-        return return_string ? sequence_getString(sequence, cap_getCoordinate(cap2) + 1, *length, 0) : NULL;
+        int64_t length = cap_getCoordinate(cap) - cap_getCoordinate(cap2) - 1;
+        assert(length >= 0);
+        sequence_getWindow(sequence, cap_getCoordinate(cap2) + 1, length, 0, window);
     }
 }
 
+char *get_adjacency_string(Cap *cap, int *length, bool return_string) {
+    SequenceWindow window;
+    get_adjacency_window(cap, &window);
+    *length = window.length;
+    return return_string ? sequenceWindow_getString(&window) : NULL;
+}
+
 /**
  * Used to find where a run of masked (hard or soft) of at least mask_filter bases starts
  * @param seq : The string
@@ -860,9 +1250,10 @@ static int get_unmasked_length(char* seq, int64_t seq_length, int64_t length, bo
  * @return
  */
 char *get_adjacency_string_and_overlap(Cap *cap, int *length, int64_t *overlap, int64_t max_seq_length, int64_t mask_filter) {
-    // Get the complete adjacency string
-    int seq_length;
-    char *adjacency_string = get_adjacency_string(cap, &seq_length, 1);
+    // Get a window onto the complete adjacency string, nothing is decoded until we copy from it
+    SequenceWindow window;
+    get_adjacency_window(cap, &window);
+    int seq_length = window.length;
     assert(seq_length >= 0);
 
     // Calculate the length of the prefix up to max_seq_length
@@ -870,17 +1261,21 @@ char *get_adjacency_string_and_overlap(Cap *cap, int *length, int64_t *overlap,
     assert(*length >= 0);
     int length_backward = *length;
 
+    // Decode just the prefix
+    char *adjacency_string = st_malloc((*length + 1) * sizeof(char));
+    sequenceWindow_copy(&window, 0, *length, adjacency_string);
+
     if (mask_filter >= 0) {
         // apply the mask filter on the forward strand
-        *length = get_unmasked_length(adjacency_string, seq_length, *length, false, mask_filter);
-        length_backward = get_unmasked_length(adjacency_string, seq_length, *length, true, mask_filter);
+        *length = get_unmasked_length(adjacency_string, *length, *length, false, mask_filter);
+        // and on the suffix, scanning backwards from the end of the adjacency
+        char *suffix = st_malloc((*length + 1) * sizeof(char));
+        sequenceWindow_copy(&window, seq_length - *length, *length, suffix);
+        length_backward = get_unmasked_length(suffix, *length, *length, true, mask_filter);
+        free(suffix);
     }
 
-    // Cleanup the string
     adjacency_string[*length] = '\0'; // Terminate the string at the given length
-    char *c = stString_copy(adjacency_string);
-    free(adjacency_string);
-    adjacency_string = c;
 
     // Calculate the overlap with the reverse complement
     if (*length + length_backward > seq_length) { // There is overlap
@@ -1099,7 +1494,8 @@ int64_t getMaxSequenceLength(End *end) {
 }
 
 stList *make_flower_alignment_poa(Flower *flower, int64_t max_seq_length, int64_t window_size, int64_t mask_filter,
-                                  int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t * poa_parameters) {
+                                  int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t * poa_parameters,
+                                  bool anchored_windows) {
     End *dominantEnd = getDominantEnd(flower);
     int64_t seq_no = dominantEnd != NULL ? end_getInstanceNumber(dominantEnd) : -1;
     if(dominantEnd != NULL && getMaxSequenceLength(dominantEnd) < max_seq_length) {
@@ -1115,8 +1511,8 @@ stList *make_flower_alignment_poa(Flower *flower, int64_t max_seq_length, int64_
         Cap *indices_to_caps[seq_no];
 
         get_end_sequences(dominantEnd, end_strings, end_string_lengths, overlaps, indices_to_caps, max_seq_length, mask_filter);
-        Msa *msa = msa_make_partial_order_alignment(end_strings, end_string_lengths, seq_no, window_size,
-                                                    max_prog_rows, max_prog_length_diff, poa_parameters);
+        Msa *msa = (anchored_windows ? msa_make_partial_order_alignment_anchored : msa_make_partial_order_alignment)(
+                end_strings, end_string_lengths, seq_no, window_size, max_prog_rows, max_prog_length_diff, poa_parameters);
 
         //Now convert to set of alignment blocks
         stList *alignment_blocks = stList_construct3(0, (void (*)(void *))alignmentBlock_destruct);
@@ -1190,7 +1586,8 @@ stList *make_flower_alignment_poa(Flower *flower, int64_t max_seq_length, int64_
     // Now make the consistent MSAs
     Msa **msas = make_consistent_partial_order_alignments(end_no, end_lengths, end_strings, end_string_lengths,
                                                           right_end_indexes, right_end_row_indexes, overlaps, window_size,
-                                                          max_prog_rows, max_prog_length_diff, poa_parameters);
+                                                          max_prog_rows, max_prog_length_diff, poa_parameters,
+                                                          anchored_windows);
 
     // Temp debug output
     //for(int64_t i=0; i<end_no; i++) {
@@ -16,9 +16,33 @@
 #include "flowerAligner.h"
 
 /*
- * Overall coordination function to run the bar algorithm.
+ * Overall coordination function to run the bar algorithm. The flowers are aligned in parallel, the most expensive
+ * by the cost model of barFlowerStats_compute first. If flowerStatsFile is not NULL, the stats of each flower,
+ * with the time taken to align it, are written to it as a TSV, in the order the flowers were started.
  */
-void bar(stList *flowers, CactusParams *p, CactusDisk *cactusDisk, stList *listOfEndAlignmentFiles);
+void bar(stList *flowers, CactusParams *p, CactusDisk *cactusDisk, stList *listOfEndAlignmentFiles,
+         const char *flowerStatsFile);
+
+/*
+ * The features of a flower that the cost of aligning it in bar() is modelled from.
+ */
+typedef struct _barFlowerStats {
+    Flower *flower;
+    int64_t endNumber; // The number of ends
+    int64_t rowNumber; // The number of adjacencies at the ends, each adjacency being counted at both of its ends
+    int64_t maxAdjacencyLength; // The length of the longest adjacency, up to the maximum length aligned
+    int64_t windowNumber; // The number of alignment windows the adjacencies of the ends are expected to need
+    double alignmentCost; // The sum over the windows of the number of rows times the squared window length
+    double cost; // The alignment cost plus a fixed cost per end
+    double time; // The seconds taken to align the flower, once it has been aligned
+} BarFlowerStats;
+
+/*
+ * Fills in the stats of the flower, for adjacencies aligned up to max_seq_length bases in windows of window_size.
+ * Each end adds end_overhead_cost to the cost, in the units of the alignment cost.
+ */
+void barFlowerStats_compute(Flower *flower, int64_t max_seq_length, int64_t window_size, int64_t end_overhead_cost,
+                            BarFlowerStats *stats);
 
 /*
  * Construct a pairwise alignment parameters object parsing the cactus params specified parameters.
@@ -81,6 +105,20 @@ Msa *msa_make_partial_order_alignment(char **seqs,
                                       double max_prog_length_diff,
                                       abpoa_para_t *poa_parameters);
 
+/**
+ * As msa_make_partial_order_alignment, but the strings are first cut into windows at anchors, k-mers that
+ * occur exactly once in every string, in the same order. The windows, which overlap by their shared anchor,
+ * are aligned in parallel and stitched together, as for the sliding windows. Where no anchors can be found
+ * the sliding windows are used instead.
+ */
+Msa *msa_make_partial_order_alignment_anchored(char **seqs,
+                                               int *seq_lens,
+                                               int64_t seq_no,
+                                               int64_t window_size,
+                                               int64_t max_prog_rows,
+                                               double max_prog_length_diff,
+                                               abpoa_para_t *poa_parameters);
+
 /**
  * Takes a set of ends and returns a set of consistent multiple alignments,
  * one for each of them.
@@ -92,6 +130,9 @@ Msa *msa_make_partial_order_alignment(char **seqs,
  * The MSAs are consistent with one another if each base in each string and its reverse complement is only
  * aligned to other bases in one MSA.
  *
+ * The MSAs of the ends are computed in parallel, as OpenMP tasks if called from within a parallel region,
+ * and then made consistent serially, so the result is the same whatever the number of threads.
+ *
  * @param end_no The number of ends
  * @param end_lengths The number of strings incident with each the end
  * @param end_strings The strings connecting the ends
@@ -103,11 +144,13 @@ Msa *msa_make_partial_order_alignment(char **seqs,
  * @param max_prog_rows Disable abpoas progressive alignment if there are more than this many rows (avoid quadratic dist mat blowup)
  * @param max_prog_length_diff Disable abpoa's progresive alignment if the 1 - shortest (last) sequence / longest (first) sequence is more than this 
  * @param poa_parameters abpoa parameters
+ * @param anchored_windows Use msa_make_partial_order_alignment_anchored to align each end
  * @return A consistent Msa for each end
  */
 Msa **make_consistent_partial_order_alignments(int64_t end_no, int64_t *end_lengths, char ***end_strings,
         int **end_string_lengths, int64_t **right_end_indexes, int64_t **right_end_row_indexes, int64_t **overlaps,
-        int64_t window_size, int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t *poa_parameters);
+        int64_t window_size, int64_t max_prog_rows, double max_prog_length_diff, abpoa_para_t *poa_parameters,
+        bool anchored_windows);
 
 /**
  * Represents a gapless alignment of a set of sequences.
@@ -135,6 +178,16 @@ void alignmentBlock_print(AlignmentBlock *ab, FILE *f);
  */
 char *get_adjacency_string(Cap *cap, int *length, bool return_string);
 
+/**
+ * Fills in a window onto the string connecting two ends for the given cap, without copying it.
+ */
+void get_adjacency_window(Cap *cap, SequenceWindow *window);
+
+/**
+ * Gets the length of the longest string connecting the end to another end.
+ */
+int64_t getMaxSequenceLength(End *end);
+
 /**
  * Makes alignments of the the unaligned sequence using the bar algorithm.
  *
@@ -145,6 +198,7 @@ char *get_adjacency_string(Cap *cap, int *length, bool return_string);
  * @param max_prog_rows Disable abpoa's progressive alignment if there are more than this many rows (avoid quadratic dist mat blowup)
  * @param max_prog_length_diff Disable abpoa's progresive alignment if the 1 - shortest (last) sequence / longest (first) sequence is more than this
  * @param poa_parameters abpoa parameters
+ * @param anchored_windows Cut the sequences into windows at anchors and align the windows in parallel
  */
 stList *make_flower_alignment_poa(Flower *flower,
                                   int64_t max_seq_length,
@@ -152,7 +206,8 @@ stList *make_flower_alignment_poa(Flower *flower,
                                   int64_t mask_filter,
                                   int64_t max_prog_rows,
                                   double max_prog_length_diff,
-                                  abpoa_para_t * poa_parameters);
+                                  abpoa_para_t * poa_parameters,
+                                  bool anchored_windows);
 
 /**
  * Create a pinch iterator for a list of alignment blocks.
@@ -87,6 +87,53 @@ void test_make_partial_order_alignment(CuTest *testCase) {
     abpoa_free_para(abpt);
 }
 
+/**
+ * As test_make_partial_order_alignment, but for the anchored windows, using longer strings, some containing
+ * repeats, so that there are several windows and some candidate anchors are not unique.
+ */
+void test_make_partial_order_alignment_anchored(CuTest *testCase) {
+    abpoa_para_t *abpt = abpoa_init_para();
+    abpt->wb = 10;
+    abpt->wf = 0.01;
+    abpoa_post_set_para(abpt);
+    for(int64_t test=0; test<20; test++) {
+#ifdef stderr_logging
+        fprintf(stderr, "Running test_make_partial_order_alignment_anchored, test %i\n", (int)test);
+#endif
+        char *parent_string = getRandomACGTSequence(st_randomInt(1, 2000));
+        if(st_random() > 0.5) { // Add a repeat
+            char *repeat = getRandomACGTSequence(st_randomInt(1, 200));
+            char *s = stString_print("%s%s%s%s", repeat, parent_string, repeat, repeat);
+            free(repeat);
+            free(parent_string);
+            parent_string = s;
+        }
+        int64_t seq_no = st_randomInt(1, 10);
+        char **seqs = st_malloc(sizeof(char *) * seq_no);
+        int *seq_lens = st_malloc(sizeof(int) * seq_no);
+        for(int64_t i=0; i<seq_no; i++) {
+            seqs[i] = evolveSequence(parent_string);
+            seq_lens[i] = strlen(seqs[i]);
+        }
+
+        Msa *msa = msa_make_partial_order_alignment_anchored(seqs, seq_lens, seq_no, st_randomInt(50, 500),
+                                                             1000, 0.02, abpt);
+#ifdef stderr_logging
+        msa_print(msa, stderr);
+#endif
+
+        int64_t lengths[seq_no];
+        validate_msa(testCase, msa, lengths);
+        for(int64_t i=0; i<seq_no; i++) {
+            CuAssertTrue(testCase, lengths[i] == seq_lens[i]);
+        }
+
+        msa_destruct(msa);
+        free(parent_string);
+    }
+    abpoa_free_para(abpt);
+}
+
 /**
  * Repeatedly generate random sets of two ends connected by set of strings, check that the resulting msa is valid
  */
@@ -146,7 +193,7 @@ void test_make_consistent_partial_order_alignments_two_ends(CuTest *testCase) {
         // generate the alignments
         Msa **msas = make_consistent_partial_order_alignments(end_no, end_lengths, end_strings, end_string_lengths,
                                                               right_end_indexes, right_end_row_indexes, overlaps,
-                                                              1000000, 100, 0.02, abpt);
+                                                              1000000, 100, 0.02, abpt, 0);
 
         // print the msas
 #ifdef stderr_logging
@@ -178,6 +225,110 @@ void test_make_consistent_partial_order_alignments_two_ends(CuTest *testCase) {
     abpoa_free_para(abpt);
 }
 
+/**
+ * Fills out the end arrays for pairs of ends, the ith pair connected by copies of the strings in pair_strings[i].
+ */
+static void make_end_pairs(int64_t pair_no, stList **pair_strings, int64_t *end_lengths, char ***end_strings,
+                           int **end_string_lengths, int64_t **right_end_indexes, int64_t **right_end_row_indexes,
+                           int64_t **overlaps) {
+    for(int64_t p=0; p<pair_no; p++) {
+        int64_t seq_no = stList_length(pair_strings[p]);
+        for(int64_t i=2*p; i<2*p+2; i++) {
+            end_lengths[i] = seq_no;
+            end_strings[i] = st_malloc(sizeof(char *) * seq_no);
+            end_string_lengths[i] = st_malloc(sizeof(int) * seq_no);
+            right_end_indexes[i] = st_malloc(sizeof(int64_t) * seq_no);
+            right_end_row_indexes[i] = st_malloc(sizeof(int64_t) * seq_no);
+            overlaps[i] = st_malloc(sizeof(int64_t) * seq_no);
+        }
+        for(int64_t i=0; i<seq_no; i++) {
+            char *c = stList_get(pair_strings[p], i);
+            end_strings[2*p][i] = stString_copy(c);
+            end_strings[2*p+1][i] = stString_reverseComplementString(c);
+            for(int64_t j=2*p; j<2*p+2; j++) {
+                end_string_lengths[j][i] = strlen(c);
+                right_end_indexes[j][i] = j == 2*p ? 2*p+1 : 2*p;
+                right_end_row_indexes[j][i] = i;
+                overlaps[j][i] = strlen(c);
+            }
+        }
+    }
+}
+
+static Msa **make_consistent_partial_order_alignments_for_end_pairs(int64_t pair_no, stList **pair_strings,
+                                                                    abpoa_para_t *abpt) {
+    int64_t end_no = 2*pair_no;
+    int64_t end_lengths[end_no];
+    char **end_strings[end_no];
+    int *end_string_lengths[end_no];
+    int64_t *right_end_indexes[end_no];
+    int64_t *right_end_row_indexes[end_no];
+    int64_t *overlaps[end_no];
+    make_end_pairs(pair_no, pair_strings, end_lengths, end_strings, end_string_lengths,
+                   right_end_indexes, right_end_row_indexes, overlaps);
+    Msa **msas = make_consistent_partial_order_alignments(end_no, end_lengths, end_strings, end_string_lengths,
+                                                          right_end_indexes, right_end_row_indexes, overlaps,
+                                                          1000000, 100, 0.02, abpt, 0);
+    for(int64_t i=0; i<end_no; i++) {
+        free(right_end_indexes[i]);
+        free(right_end_row_indexes[i]);
+        free(overlaps[i]);
+    }
+    return msas;
+}
+
+/**
+ * Checks the msas of many ends, which are computed in parallel, are the same whether computed as tasks within
+ * an enclosing parallel region or not.
+ */
+void test_make_consistent_partial_order_alignments_parallel(CuTest *testCase) {
+    abpoa_para_t *abpt = abpoa_init_para();
+    abpt->wb = 10;
+    abpt->wf = 0.01;
+    abpoa_post_set_para(abpt);
+
+    for(int64_t test=0; test<10; test++) {
+        int64_t pair_no = st_randomInt(1, 20);
+        stList *pair_strings[pair_no];
+        for(int64_t p=0; p<pair_no; p++) {
+            char *parent_string = getRandomACGTSequence(st_randomInt(1, 100));
+            int64_t seq_no = st_randomInt(1, 10);
+            pair_strings[p] = stList_construct3(0, free);
+            for(int64_t i=0; i<seq_no; i++) {
+                stList_append(pair_strings[p], evolveSequence(parent_string));
+            }
+            free(parent_string);
+        }
+
+        Msa **msas = make_consistent_partial_order_alignments_for_end_pairs(pair_no, pair_strings, abpt);
+        Msa **msas2 = NULL;
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+        msas2 = make_consistent_partial_order_alignments_for_end_pairs(pair_no, pair_strings, abpt);
+
+        for(int64_t i=0; i<2*pair_no; i++) {
+            CuAssertIntEquals(testCase, msas[i]->seq_no, msas2[i]->seq_no);
+            CuAssertIntEquals(testCase, msas[i]->column_no, msas2[i]->column_no);
+            for(int64_t j=0; j<msas[i]->seq_no; j++) {
+                CuAssertIntEquals(testCase, msas[i]->seq_lens[j], msas2[i]->seq_lens[j]);
+                CuAssertTrue(testCase, memcmp(msas[i]->msa_seq[j], msas2[i]->msa_seq[j], msas[i]->column_no) == 0);
+            }
+            int64_t lengths[msas[i]->seq_no];
+            validate_msa(testCase, msas[i], lengths);
+            msa_destruct(msas[i]);
+            msa_destruct(msas2[i]);
+        }
+        free(msas);
+        free(msas2);
+        for(int64_t p=0; p<pair_no; p++) {
+            stList_destruct(pair_strings[p]);
+        }
+    }
+    abpoa_free_para(abpt);
+}
+
 void test_make_flower_alignment_poa(CuTest *testCase) {
     setup(testCase);
 
@@ -213,7 +364,7 @@ void test_make_flower_alignment_poa(CuTest *testCase) {
     }
     flower_destructEndIterator(endIterator);
 
-    stList *alignment_blocks = make_flower_alignment_poa(flower, 2, 1000000, 5, 1000, 0.02, abpt);
+    stList *alignment_blocks = make_flower_alignment_poa(flower, 2, 1000000, 5, 1000, 0.02, abpt, 0);
 
     for(int64_t i=0; i<stList_length(alignment_blocks); i++) {
         AlignmentBlock *b = stList_get(alignment_blocks, i);
@@ -226,6 +377,47 @@ void test_make_flower_alignment_poa(CuTest *testCase) {
     teardown(testCase);
 }
 
+void test_barFlowerStats(CuTest *testCase) {
+    setup(testCase);
+
+    // Get the expected features
+    int64_t end_no = 0, row_no = 0, max_length = 0;
+    End *end;
+    Flower_EndIterator *endIterator = flower_getEndIterator(flower);
+    while ((end = flower_getNextEnd(endIterator)) != NULL) {
+        end_no++;
+        row_no += end_getInstanceNumber(end);
+        if (end_getInstanceNumber(end) > 0 && getMaxSequenceLength(end) > max_length) {
+            max_length = getMaxSequenceLength(end);
+        }
+    }
+    flower_destructEndIterator(endIterator);
+
+    BarFlowerStats stats;
+    barFlowerStats_compute(flower, 1000000, 1000000, 100000, &stats);
+    CuAssertPtrEquals(testCase, flower, stats.flower);
+    CuAssertIntEquals(testCase, end_no, stats.endNumber);
+    CuAssertIntEquals(testCase, row_no, stats.rowNumber);
+    CuAssertIntEquals(testCase, max_length, stats.maxAdjacencyLength);
+    CuAssertTrue(testCase, stats.windowNumber <= end_no);
+    CuAssertTrue(testCase, stats.cost > stats.alignmentCost);
+    CuAssertDblEquals(testCase, 0.0, stats.time, 0.0);
+
+    // Only a prefix of each adjacency is aligned
+    BarFlowerStats prefix_stats;
+    barFlowerStats_compute(flower, max_length / 2, 1000000, 100000, &prefix_stats);
+    CuAssertIntEquals(testCase, max_length / 2, prefix_stats.maxAdjacencyLength);
+
+    // Aligning in smaller windows takes more windows
+    if (max_length > 4) {
+        BarFlowerStats window_stats;
+        barFlowerStats_compute(flower, 1000000, 4, 100000, &window_stats);
+        CuAssertTrue(testCase, window_stats.windowNumber > stats.windowNumber);
+    }
+
+    teardown(testCase);
+}
+
 void test_alignment_block_iterator(CuTest *testCase) {
     setup(testCase);
 
@@ -234,7 +426,7 @@ void test_alignment_block_iterator(CuTest *testCase) {
     abpt->wf = 0.01;
     abpoa_post_set_para(abpt);
 
-    stList *alignment_blocks = make_flower_alignment_poa(flower, 10000, 1000000, 5, 50, 0.05, abpt);
+    stList *alignment_blocks = make_flower_alignment_poa(flower, 10000, 1000000, 5, 50, 0.05, abpt, 0);
 
     abpoa_free_para(abpt);
 #ifdef stderr_logging
@@ -267,8 +459,11 @@ void test_alignment_block_iterator(CuTest *testCase) {
 CuSuite* poaBarAlignerTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, test_make_partial_order_alignment);
+    SUITE_ADD_TEST(suite, test_make_partial_order_alignment_anchored);
     SUITE_ADD_TEST(suite, test_make_consistent_partial_order_alignments_two_ends);
+    SUITE_ADD_TEST(suite, test_make_consistent_partial_order_alignments_parallel);
     SUITE_ADD_TEST(suite, test_make_flower_alignment_poa);
+    SUITE_ADD_TEST(suite, test_barFlowerStats);
     SUITE_ADD_TEST(suite, test_alignment_block_iterator);
     return suite;
 }
@@ -0,0 +1,170 @@
+/*
+ * Sorts the pinches of an alignment file by the scores of their alignments, for the filters that
+ * pinch the best alignments first.
+ *
+ * The sort is an external merge sort: the pinches are read in runs that fit in the given memory, each
+ * run is sorted and written to a temporary scored binary pinch file, one run per thread at a time, and
+ * the memory-mapped runs are then merged with a heap into the output.
+ */
+
+#include <stdlib.h>
+#include "sonLib.h"
+#include "cactus.h"
+#include "stPinchGraphs.h"
+#include "stPinchIterator.h"
+#include "stCaf.h"
+
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+typedef struct _scoredPinch {
+    int64_t score;
+    int64_t index; // The position of the pinch in the input, which keeps the sort stable
+    stPinch pinch;
+} ScoredPinch;
+
+static int scoredPinch_cmpFn(const void *a, const void *b) {
+    const ScoredPinch *pinch1 = a, *pinch2 = b;
+    if (pinch1->score != pinch2->score) {
+        return pinch1->score > pinch2->score ? -1 : 1;
+    }
+    return pinch1->index < pinch2->index ? -1 : (pinch1->index > pinch2->index ? 1 : 0);
+}
+
+static void writeRun(ScoredPinch *pinches, int64_t pinchNumber, const char *runFile) {
+    qsort(pinches, pinchNumber, sizeof(ScoredPinch), scoredPinch_cmpFn);
+    FILE *fileHandle = fopen(runFile, "w");
+    if (fileHandle == NULL) {
+        st_errnoAbort("Failed to open run file %s", runFile);
+    }
+    stPinch_writeScoredBinaryHeader(fileHandle);
+    for (int64_t i = 0; i < pinchNumber; i++) {
+        stPinch_writeScoredBinary(&pinches[i].pinch, pinches[i].score, fileHandle);
+    }
+    fclose(fileHandle);
+}
+
+/*
+ * Reads the pinches into runs of at most runLength pinches, reading up to parallelRuns runs at a time and
+ * sorting and writing them in parallel. Returns the run files, in the order of the input.
+ */
+static stList *makeSortedRuns(stPinchIterator *pinchIterator, int64_t runLength, int64_t parallelRuns) {
+    stList *runFiles = stList_construct3(0, free);
+    int64_t bufferLength = runLength * parallelRuns;
+    ScoredPinch *pinches = st_malloc(sizeof(ScoredPinch) * bufferLength);
+    int64_t index = 0, pinchNumber;
+    do {
+        pinchNumber = 0;
+        while (pinchNumber < bufferLength && stPinchIterator_getNext(pinchIterator, &pinches[pinchNumber].pinch) != NULL) {
+            pinches[pinchNumber].score = stPinchIterator_getScore(pinchIterator);
+            pinches[pinchNumber++].index = index++;
+        }
+        int64_t firstRun = stList_length(runFiles);
+        int64_t runNumber = (pinchNumber + runLength - 1) / runLength;
+        for (int64_t i = 0; i < runNumber; i++) {
+            stList_append(runFiles, getTempFile());
+        }
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (int64_t i = 0; i < runNumber; i++) {
+            int64_t start = i * runLength;
+            int64_t end = start + runLength < pinchNumber ? start + runLength : pinchNumber;
+            writeRun(pinches + start, end - start, stList_get(runFiles, firstRun + i));
+        }
+    } while (pinchNumber == bufferLength);
+    free(pinches);
+    return runFiles;
+}
+
+typedef struct _run {
+    stPinchIterator *pinchIterator;
+    stPinch pinch; // The next pinch of the run
+    int64_t score;
+} Run;
+
+/*
+ * Returns true if the next pinch of run i comes before that of run j. Ties go to the earlier run, as it
+ * holds the earlier pinches of the input.
+ */
+static bool runIsBefore(Run *runs, int64_t i, int64_t j) {
+    return runs[i].score > runs[j].score || (runs[i].score == runs[j].score && i < j);
+}
+
+static void siftDown(int64_t *heap, int64_t heapLength, int64_t i, Run *runs) {
+    while (2 * i + 1 < heapLength) {
+        int64_t child = 2 * i + 1;
+        if (child + 1 < heapLength && runIsBefore(runs, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!runIsBefore(runs, heap[child], heap[i])) {
+            break;
+        }
+        int64_t j = heap[i];
+        heap[i] = heap[child];
+        heap[child] = j;
+        i = child;
+    }
+}
+
+static void mergeRuns(stList *runFiles, const char *outputFile) {
+    int64_t runNumber = stList_length(runFiles);
+    Run *runs = st_malloc(sizeof(Run) * runNumber);
+    int64_t *heap = st_malloc(sizeof(int64_t) * runNumber);
+    int64_t heapLength = 0;
+    for (int64_t i = 0; i < runNumber; i++) {
+        runs[i].pinchIterator = stPinchIterator_constructFromFile(stList_get(runFiles, i));
+        if (stPinchIterator_getNext(runs[i].pinchIterator, &runs[i].pinch) != NULL) {
+            runs[i].score = stPinchIterator_getScore(runs[i].pinchIterator);
+            heap[heapLength++] = i;
+        }
+    }
+    for (int64_t i = heapLength / 2 - 1; i >= 0; i--) {
+        siftDown(heap, heapLength, i, runs);
+    }
+
+    FILE *fileHandle = fopen(outputFile, "w");
+    if (fileHandle == NULL) {
+        st_errnoAbort("Failed to open sorted alignments file %s", outputFile);
+    }
+    stPinch_writeBinaryHeader(fileHandle);
+    while (heapLength > 0) {
+        Run *run = &runs[heap[0]];
+        stPinch_writeBinary(&run->pinch, fileHandle);
+        if (stPinchIterator_getNext(run->pinchIterator, &run->pinch) != NULL) {
+            run->score = stPinchIterator_getScore(run->pinchIterator);
+        } else {
+            heap[0] = heap[--heapLength];
+        }
+        siftDown(heap, heapLength, 0, runs);
+    }
+    fclose(fileHandle);
+
+    for (int64_t i = 0; i < runNumber; i++) {
+        stPinchIterator_destruct(runs[i].pinchIterator);
+    }
+    free(runs);
+    free(heap);
+}
+
+void stCaf_sortAlignmentsFileByScoreInDescendingOrder(const char *inputFile, const char *outputFile, int64_t maximumMemory) {
+    int64_t parallelRuns = 1;
+#if defined(_OPENMP)
+    parallelRuns = omp_in_parallel() ? 1 : omp_get_max_threads();
+#endif
+    int64_t runLength = maximumMemory / ((int64_t) sizeof(ScoredPinch) * parallelRuns);
+    runLength = runLength > 0 ? runLength : 1;
+
+    stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(inputFile);
+    stList *runFiles = makeSortedRuns(pinchIterator, runLength, parallelRuns);
+    stPinchIterator_destruct(pinchIterator);
+    st_logInfo("Sorting the alignments of %s by score in %" PRIi64 " runs\n", inputFile, stList_length(runFiles));
+
+    mergeRuns(runFiles, outputFile);
+    for (int64_t i = 0; i < stList_length(runFiles); i++) {
+        stFile_rmtree(stList_get(runFiles, i));
+    }
+    stList_destruct(runFiles);
+}
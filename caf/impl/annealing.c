@@ -5,6 +5,11 @@
 #include "stCactusGraphs.h"
 #include "stCaf.h"
 
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 ///////////////////////////////////////////////////////////////////////////
 // Code to safely join all the trivial boundaries in the pinch graph, while
 // respecting end blocks.
@@ -34,36 +39,32 @@ void stCaf_joinTrivialBoundaries(stPinchThreadSet *threadSet) {
 
 void stCaf_anneal2(stPinchThreadSet *threadSet, stPinch *(*pinchIterator)(void *, stPinch *), void *extraArg) {
     stPinch *pinch, pinchToFillOut;
+    int64_t pinchNumber = 0;
     while ((pinch = pinchIterator(extraArg, &pinchToFillOut)) != NULL) {
         stPinchThread *thread1 = stPinchThreadSet_getThread(threadSet, pinch->name1);
         stPinchThread *thread2 = stPinchThreadSet_getThread(threadSet, pinch->name2);
         assert(thread1 != NULL && thread2 != NULL);
         stPinchThread_pinch(thread1, thread2, pinch->start1, pinch->start2, pinch->length, pinch->strand);
+        pinchNumber++;
     }
+    cactusMetrics_addToCounter(CACTUS_COUNTER_PINCHES, pinchNumber);
 }
 
 static void stCaf_annealWithFilter2(stPinchThreadSet *threadSet, stPinch *(*pinchIterator)(void *, stPinch *), void *extraArg,
                                     bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
+    stCaf_trackPinches(flower, 1);
     stPinch *pinch, pinchToFillOut;
+    int64_t pinchNumber = 0;
     while ((pinch = pinchIterator(extraArg, &pinchToFillOut)) != NULL) {
         stPinchThread *thread1 = stPinchThreadSet_getThread(threadSet, pinch->name1);
         stPinchThread *thread2 = stPinchThreadSet_getThread(threadSet, pinch->name2);
         assert(thread1 != NULL && thread2 != NULL);
         stPinchThread_filterPinch(thread1, thread2, pinch->start1, pinch->start2, pinch->length, pinch->strand,
                                   (bool(*)(stPinchSegment *, stPinchSegment *, void *))filterFn, flower);
+        pinchNumber++;
     }
-}
-
-void stCaf_anneal(stPinchThreadSet *threadSet, stPinchIterator *pinchIterator,
-                  bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
-    stPinchIterator_reset(pinchIterator);
-    if(filterFn != NULL) {
-        stCaf_annealWithFilter2(threadSet, (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator, filterFn, flower);
-    }
-    else {
-        stCaf_anneal2(threadSet, (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator);
-    }
-    stCaf_joinTrivialBoundaries(threadSet);
+    stCaf_trackPinches(flower, 0);
+    cactusMetrics_addToCounter(CACTUS_COUNTER_PINCHES, pinchNumber);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -162,23 +163,331 @@ static stSortedSet *getAdjacencyComponentIntervals(stPinchThreadSet *threadSet,
     return adjacencyComponentIntervals;
 }
 
+static void annealBetweenAdjacencyComponents(stPinchThreadSet *threadSet, stSortedSet *adjacencyComponentIntervals,
+        stPinch *(*pinchIterator)(void *, stPinch *), void *extraArg,
+        bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
+    if (filterFn != NULL) {
+        stCaf_trackPinches(flower, 1);
+    }
+    stPinch *pinch, pinchToFillOut;
+    int64_t pinchNumber = 0;
+    while ((pinch = pinchIterator(extraArg, &pinchToFillOut)) != NULL) {
+        alignSameComponents(pinch, threadSet, adjacencyComponentIntervals, filterFn, flower);
+        pinchNumber++;
+    }
+    if (filterFn != NULL) {
+        stCaf_trackPinches(flower, 0);
+    }
+    cactusMetrics_addToCounter(CACTUS_COUNTER_PINCHES, pinchNumber);
+}
+
 void stCaf_annealBetweenAdjacencyComponents2(stPinchThreadSet *threadSet, stPinch *(*pinchIterator)(void *, stPinch *),
         void *extraArg, bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
     //Get the adjacency component intervals
     stList *adjacencyComponents;
     stSortedSet *adjacencyComponentIntervals = getAdjacencyComponentIntervals(threadSet, &adjacencyComponents);
     //Now do the actual alignments.
-    stPinch *pinch, pinchToFillOut;
-    while ((pinch = pinchIterator(extraArg, &pinchToFillOut)) != NULL) {
-        alignSameComponents(pinch, threadSet, adjacencyComponentIntervals, filterFn, flower);
-    }
+    annealBetweenAdjacencyComponents(threadSet, adjacencyComponentIntervals, pinchIterator, extraArg, filterFn, flower);
     stSortedSet_destruct(adjacencyComponentIntervals);
     stList_destruct(adjacencyComponents);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Parallel annealing. The pinches are split by the component of the threads they connect, threads
+// already connected by blocks counting as connected. The pinches of different components touch disjoint
+// threads and blocks, so the components are annealed concurrently, each with its pinches in the order of
+// the stream, which makes the same graph as annealing serially. The stream is read in batches, so only a
+// batch of pinches is held in memory.
+///////////////////////////////////////////////////////////////////////////
+
+#define PARALLEL_ANNEALING_BATCH_SIZE 1000000
+
+typedef struct _annealer {
+    stPinchThreadSet *threadSet;
+    stSortedSet *adjacencyComponentIntervals; // If not NULL only bases in the same adjacency component are pinched
+    bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *);
+    Flower *flower;
+} Annealer;
+
+static void annealer_pinch(Annealer *annealer, stPinch *pinch) {
+    if (annealer->adjacencyComponentIntervals != NULL) {
+        alignSameComponents(pinch, annealer->threadSet, annealer->adjacencyComponentIntervals, annealer->filterFn,
+                            annealer->flower);
+        return;
+    }
+    stPinchThread *thread1 = stPinchThreadSet_getThread(annealer->threadSet, pinch->name1);
+    stPinchThread *thread2 = stPinchThreadSet_getThread(annealer->threadSet, pinch->name2);
+    assert(thread1 != NULL && thread2 != NULL);
+    if (annealer->filterFn != NULL) {
+        stPinchThread_filterPinch(thread1, thread2, pinch->start1, pinch->start2, pinch->length, pinch->strand,
+                                  (bool(*)(stPinchSegment *, stPinchSegment *, void *))annealer->filterFn, annealer->flower);
+    } else {
+        stPinchThread_pinch(thread1, thread2, pinch->start1, pinch->start2, pinch->length, pinch->strand);
+    }
+}
+
+static int64_t findComponent(int64_t *parents, int64_t i) {
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]]; // Path halving
+        i = parents[i];
+    }
+    return i;
+}
+
+static void joinComponents(int64_t *parents, int64_t *sizes, int64_t i, int64_t j) {
+    i = findComponent(parents, i);
+    j = findComponent(parents, j);
+    if (i != j) {
+        if (sizes[i] < sizes[j]) {
+            int64_t k = i;
+            i = j;
+            j = k;
+        }
+        parents[j] = i;
+        sizes[i] += sizes[j];
+    }
+}
+
+static int64_t getThreadOrdinal(stHash *threadsToOrdinals, stPinchThread *thread) {
+    assert(thread != NULL);
+    return *(int64_t *)stHash_search(threadsToOrdinals, thread);
+}
+
+/*
+ * Gets the component of each thread, numbering the components with pinches from 0 to *componentNumber - 1,
+ * in which case the other threads are numbered -1. Sets *largestComponentPinches to the number of pinches of
+ * the largest component.
+ */
+static int64_t *getThreadComponents(stPinchThreadSet *threadSet, stHash *threadsToOrdinals, stPinchIterator *pinchIterator,
+                                    int64_t *componentNumber, int64_t *totalPinches, int64_t *largestComponentPinches) {
+    int64_t threadNumber = stPinchThreadSet_getSize(threadSet);
+    int64_t *parents = st_malloc(sizeof(int64_t) * threadNumber);
+    int64_t *sizes = st_malloc(sizeof(int64_t) * threadNumber);
+    int64_t *pinchNumbers = st_calloc(threadNumber, sizeof(int64_t));
+    for (int64_t i = 0; i < threadNumber; i++) {
+        parents[i] = i;
+        sizes[i] = 1;
+    }
+
+    // Join the threads already connected by blocks
+    stPinchThreadSetBlockIt blockIt = stPinchThreadSet_getBlockIt(threadSet);
+    stPinchBlock *block;
+    while ((block = stPinchThreadSetBlockIt_getNext(&blockIt)) != NULL) {
+        int64_t i = getThreadOrdinal(threadsToOrdinals, stPinchSegment_getThread(stPinchBlock_getFirst(block)));
+        stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(block);
+        stPinchSegment *segment;
+        while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+            joinComponents(parents, sizes, i, getThreadOrdinal(threadsToOrdinals, stPinchSegment_getThread(segment)));
+        }
+    }
+
+    // Join the threads the pinches connect
+    *totalPinches = 0;
+    stPinchIterator_reset(pinchIterator);
+    stPinch *pinch, pinchToFillOut;
+    while ((pinch = stPinchIterator_getNext(pinchIterator, &pinchToFillOut)) != NULL) {
+        int64_t i = getThreadOrdinal(threadsToOrdinals, stPinchThreadSet_getThread(threadSet, pinch->name1));
+        joinComponents(parents, sizes, i, getThreadOrdinal(threadsToOrdinals, stPinchThreadSet_getThread(threadSet, pinch->name2)));
+        pinchNumbers[i]++;
+        (*totalPinches)++;
+    }
+
+    // Number the components with pinches
+    int64_t *componentPinchNumbers = st_calloc(threadNumber, sizeof(int64_t));
+    for (int64_t i = 0; i < threadNumber; i++) {
+        componentPinchNumbers[findComponent(parents, i)] += pinchNumbers[i];
+    }
+    int64_t *componentOrdinals = st_malloc(sizeof(int64_t) * threadNumber);
+    *componentNumber = 0;
+    *largestComponentPinches = 0;
+    for (int64_t i = 0; i < threadNumber; i++) {
+        if (componentPinchNumbers[i] > 0) {
+            componentOrdinals[i] = (*componentNumber)++;
+            if (componentPinchNumbers[i] > *largestComponentPinches) {
+                *largestComponentPinches = componentPinchNumbers[i];
+            }
+        }
+    }
+    int64_t *threadComponents = st_malloc(sizeof(int64_t) * threadNumber);
+    for (int64_t i = 0; i < threadNumber; i++) {
+        int64_t j = findComponent(parents, i);
+        threadComponents[i] = componentPinchNumbers[j] > 0 ? componentOrdinals[j] : -1;
+    }
+
+    free(parents);
+    free(sizes);
+    free(pinchNumbers);
+    free(componentPinchNumbers);
+    free(componentOrdinals);
+    return threadComponents;
+}
+
+/*
+ * Anneals the batch of pinches, which are the pinches of the given components, starting at
+ * componentStarts[c] for component c and in stream order.
+ */
+static void annealBatch(Annealer *annealer, stPinch *pinches, int64_t *componentStarts, int64_t *components,
+                        int64_t batchComponentNumber) {
+#if defined(_OPENMP)
+#pragma omp parallel
+#endif
+    {
+#if defined(_OPENMP)
+#pragma omp for schedule(dynamic, 1)
+#endif
+        for (int64_t k = 0; k < batchComponentNumber; k++) {
+            int64_t c = components[k];
+            if (annealer->filterFn != NULL) { // Each thread keeps its own index and block summaries for the filters
+                stCaf_trackPinches(annealer->flower, 1);
+            }
+            for (int64_t j = componentStarts[c]; j < componentStarts[c + 1]; j++) {
+                annealer_pinch(annealer, &pinches[j]);
+            }
+            if (annealer->filterFn != NULL) {
+                stCaf_trackPinches(annealer->flower, 0);
+            }
+        }
+#if defined(_OPENMP)
+        // The indexes the other threads built for the filters are freed with the region, rather than left with
+        // the threads of the pool. The calling thread keeps its own, which stCaf_finish frees.
+        if (annealer->filterFn != NULL && omp_get_thread_num() != 0) {
+            stCaf_destructThreadIndex();
+        }
+#endif
+    }
+}
+
+/*
+ * Anneals the pinches of the iterator in parallel, returning false without making any pinches if there is
+ * no parallelism to be had: if not running with multiple threads, if already in a parallel region (as when
+ * bar fills out flowers), if the filter keeps global state, or if the pinches form a single component.
+ */
+static bool annealInParallel(Annealer *annealer, stPinchIterator *pinchIterator) {
+#if defined(_OPENMP)
+    if (omp_in_parallel() || omp_get_max_threads() < 2 || annealer->filterFn == stCaf_filterToEnsureCycleFreeIsolatedComponents) {
+        return 0;
+    }
+#else
+    return 0;
+#endif
+    stPinchThreadSet *threadSet = annealer->threadSet;
+
+    // Number the threads
+    int64_t threadNumber = stPinchThreadSet_getSize(threadSet);
+    int64_t *ordinals = st_malloc(sizeof(int64_t) * threadNumber);
+    stHash *threadsToOrdinals = stHash_construct();
+    stPinchThreadSetIt threadIt = stPinchThreadSet_getIt(threadSet);
+    stPinchThread *thread;
+    for (int64_t i = 0; (thread = stPinchThreadSetIt_getNext(&threadIt)) != NULL; i++) {
+        ordinals[i] = i;
+        stHash_insert(threadsToOrdinals, thread, &ordinals[i]);
+    }
+
+    int64_t componentNumber, totalPinches, largestComponentPinches;
+    int64_t *threadComponents = getThreadComponents(threadSet, threadsToOrdinals, pinchIterator, &componentNumber,
+                                                    &totalPinches, &largestComponentPinches);
+    if (componentNumber < 2) {
+        free(threadComponents);
+        stHash_destruct(threadsToOrdinals);
+        free(ordinals);
+        return 0;
+    }
+    st_logInfo("Annealing %" PRIi64 " pinches in %" PRIi64 " components in parallel, the largest having %" PRIi64 " pinches\n",
+               totalPinches, componentNumber, largestComponentPinches);
+
+    stPinch *batch = st_malloc(sizeof(stPinch) * PARALLEL_ANNEALING_BATCH_SIZE);
+    int64_t *batchComponents = st_malloc(sizeof(int64_t) * PARALLEL_ANNEALING_BATCH_SIZE);
+    stPinch *pinches = st_malloc(sizeof(stPinch) * PARALLEL_ANNEALING_BATCH_SIZE);
+    int64_t *componentStarts = st_malloc(sizeof(int64_t) * (componentNumber + 1));
+    int64_t *componentEnds = st_malloc(sizeof(int64_t) * componentNumber);
+    int64_t *components = st_malloc(sizeof(int64_t) * componentNumber);
+    stPinchIterator_reset(pinchIterator);
+    int64_t batchLength;
+    do {
+        // Read a batch of pinches
+        stPinch *pinch;
+        for (batchLength = 0; batchLength < PARALLEL_ANNEALING_BATCH_SIZE &&
+                              (pinch = stPinchIterator_getNext(pinchIterator, &batch[batchLength])) != NULL; batchLength++) {
+            batch[batchLength] = *pinch;
+            batchComponents[batchLength] = threadComponents[getThreadOrdinal(threadsToOrdinals,
+                                                                             stPinchThreadSet_getThread(threadSet, pinch->name1))];
+            assert(batchComponents[batchLength] >= 0);
+        }
+
+        // Bucket the pinches by component, keeping them in stream order within each
+        for (int64_t c = 0; c <= componentNumber; c++) {
+            componentStarts[c] = 0;
+        }
+        for (int64_t j = 0; j < batchLength; j++) {
+            componentStarts[batchComponents[j] + 1]++;
+        }
+        for (int64_t c = 0; c < componentNumber; c++) {
+            componentStarts[c + 1] += componentStarts[c];
+            componentEnds[c] = componentStarts[c];
+        }
+        for (int64_t j = 0; j < batchLength; j++) {
+            pinches[componentEnds[batchComponents[j]]++] = batch[j];
+        }
+
+        // Anneal the components with pinches in the batch, starting with the largest, which may well take
+        // as long as all the others
+        int64_t batchComponentNumber = 0;
+        for (int64_t c = 0; c < componentNumber; c++) {
+            if (componentStarts[c + 1] > componentStarts[c]) {
+                components[batchComponentNumber++] = c;
+                int64_t largest = components[0];
+                if (componentStarts[c + 1] - componentStarts[c] > componentStarts[largest + 1] - componentStarts[largest]) {
+                    components[batchComponentNumber - 1] = largest;
+                    components[0] = c;
+                }
+            }
+        }
+        annealBatch(annealer, pinches, componentStarts, components, batchComponentNumber);
+    } while (batchLength == PARALLEL_ANNEALING_BATCH_SIZE);
+    cactusMetrics_addToCounter(CACTUS_COUNTER_PINCHES, totalPinches);
+
+    free(batch);
+    free(batchComponents);
+    free(pinches);
+    free(componentStarts);
+    free(componentEnds);
+    free(components);
+    free(threadComponents);
+    stHash_destruct(threadsToOrdinals);
+    free(ordinals);
+    return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The annealing functions, which anneal in parallel where they can
+///////////////////////////////////////////////////////////////////////////
+
+void stCaf_anneal(stPinchThreadSet *threadSet, stPinchIterator *pinchIterator,
+                  bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
+    Annealer annealer = { threadSet, NULL, filterFn, flower };
+    if (!annealInParallel(&annealer, pinchIterator)) {
+        stPinchIterator_reset(pinchIterator);
+        if(filterFn != NULL) {
+            stCaf_annealWithFilter2(threadSet, (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator, filterFn, flower);
+        }
+        else {
+            stCaf_anneal2(threadSet, (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator);
+        }
+    }
+    stCaf_joinTrivialBoundaries(threadSet);
+}
+
 void stCaf_annealBetweenAdjacencyComponents(stPinchThreadSet *threadSet, stPinchIterator *pinchIterator,
                                             bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower) {
-    stPinchIterator_reset(pinchIterator);
-    stCaf_annealBetweenAdjacencyComponents2(threadSet, (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator, filterFn, flower);
+    stList *adjacencyComponents;
+    stSortedSet *adjacencyComponentIntervals = getAdjacencyComponentIntervals(threadSet, &adjacencyComponents);
+    Annealer annealer = { threadSet, adjacencyComponentIntervals, filterFn, flower };
+    if (!annealInParallel(&annealer, pinchIterator)) {
+        stPinchIterator_reset(pinchIterator);
+        annealBetweenAdjacencyComponents(threadSet, adjacencyComponentIntervals,
+                                         (stPinch *(*)(void *, stPinch *)) stPinchIterator_getNext, pinchIterator, filterFn, flower);
+    }
+    stSortedSet_destruct(adjacencyComponentIntervals);
+    stList_destruct(adjacencyComponents);
     stCaf_joinTrivialBoundaries(threadSet);
 }
@@ -70,5 +70,8 @@ stPinchThreadSet *stCaf_setup(Flower *flower) {
     //Create empty pinch graph from flower
     stPinchThreadSet *threadSet = stCaf_constructEmptyPinchGraph(flower);
 
+    //Index the threads for the filters
+    stCaf_buildThreadIndex(flower, threadSet);
+
     return threadSet;
 }
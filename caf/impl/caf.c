@@ -44,10 +44,7 @@ static uint64_t numPossibleSupportingHomologies(stPinchBlock *block, Flower *flo
     stPinchBlockIt segIt = stPinchBlock_getSegmentIterator(block);
     stPinchSegment *segment;
     while ((segment = stPinchBlockIt_getNext(&segIt)) != NULL) {
-        Name capName = stPinchSegment_getName(segment);
-        Cap *cap = flower_getCap(flower, capName);
-        Event *event = cap_getEvent(cap);
-        if (event_isOutgroup(event)) {
+        if (stCaf_getThreadInfo(segment, flower)->outgroup) {
             outgroupDegree++;
         } else {
             ingroupDegree++;
@@ -226,6 +223,8 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
 
     // Setting the alignment filters
     char *alignmentFilter = (char *)cactusParams_get_string(params, 2, "caf", "alignmentFilter");
+    // The memory used to hold alignments while sorting them by score for the single copy filters, in bytes
+    int64_t alignmentSortingMemory = cactusParams_get_int(params, 2, "caf", "alignmentSortingMemory");
     bool sortAlignments = false;
     bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *) = NULL;
     bool (*secondaryFilterFn)(stPinchSegment *, stPinchSegment *, Flower *) = NULL;
@@ -353,7 +352,7 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
 
         if (sortAlignments) {
             tempFile1 = getTempFile();
-            //stCaf_sortCigarsFileByScoreInDescendingOrder(alignmentsFile, tempFile1);
+            stCaf_sortAlignmentsFileByScoreInDescendingOrder(alignmentsFile, tempFile1, alignmentSortingMemory);
             pinchIterator = stPinchIterator_constructFromFile(tempFile1);
         } else {
             pinchIterator = stPinchIterator_constructFromFile(alignmentsFile);
@@ -362,7 +361,7 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
         if(secondaryAlignmentsFile != NULL) {
             if (sortSecondaryAlignments) {
                 tempFile2 = getTempFile();
-                //stCaf_sortCigarsFileByScoreInDescendingOrder(secondaryAlignmentsFile, tempFile2);
+                stCaf_sortAlignmentsFileByScoreInDescendingOrder(secondaryAlignmentsFile, tempFile2, alignmentSortingMemory);
                 secondaryPinchIterator = stPinchIterator_constructFromFile(tempFile2);
             } else {
                 secondaryPinchIterator = stPinchIterator_constructFromFile(secondaryAlignmentsFile);
@@ -373,6 +372,10 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
             int64_t minimumChainLength = annealingRounds[annealingRound];
             int64_t alignmentTrim = annealingRound < alignmentTrimLength ? alignmentTrims[annealingRound] : 0;
             st_logInfo("Starting annealing round with a minimum chain length of %" PRIi64 " and an alignment trim of %" PRIi64 "\n", minimumChainLength, alignmentTrim);
+            char *phaseName = stString_print("annealing round %" PRIi64, annealingRound);
+            cactusMetrics_startPhase(phaseName);
+            free(phaseName);
+            cactusMetrics_startPhase("anneal");
 
             stPinchIterator_setTrim(pinchIterator, alignmentTrim);
             if(secondaryPinchIterator != NULL) {
@@ -400,9 +403,13 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
                 }
             }
 
+            cactusMetrics_endPhase();
+
             st_logInfo("Sequence graph statistics after annealing:\n");
             printThreadSetStatistics(threadSet, flower, stderr);
 
+            cactusMetrics_startPhase("melt");
+
             if (minimumBlockHomologySupport > 0) {
                 // Check for poorly-supported blocks--those that have
                 // been transitively aligned together but with very
@@ -430,28 +437,45 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
                         }
                     }
                 }
+                cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, num_megablocks_destroyed);
                 if (num_megablocks_destroyed > 0) {
                   st_logInfo("Destroyed %" PRIi64 " megablocks with a total of %" PRIi64 " supporting homologies\n",
                              num_megablocks_destroyed, num_homologies_destroyed);
                 }
             }
 
-            //Do the melting rounds
+            //Do the melting rounds, the last one too if it does not break chains
+            int64_t *minimumChainLengths = st_malloc(sizeof(int64_t) * (meltingRoundsLength + 1));
+            int64_t roundNumber = 0;
             for (int64_t meltingRound = 0; meltingRound < meltingRoundsLength; meltingRound++) {
                 int64_t minimumChainLengthForMeltingRound = meltingRounds[meltingRound];
                 st_logInfo("Starting melting round with a minimum chain length of %" PRIi64 " \n", minimumChainLengthForMeltingRound);
                 if (minimumChainLengthForMeltingRound >= minimumChainLength) {
                     break;
                 }
-                stCaf_melt(flower, threadSet, NULL, NULL, 0, minimumChainLengthForMeltingRound, 0, INT64_MAX);
+                if (minimumChainLengthForMeltingRound > 1) {
+                    minimumChainLengths[roundNumber++] = minimumChainLengthForMeltingRound;
+                }
             } st_logDebug("Last melting round of cycle with a minimum chain length of %" PRIi64 " \n", minimumChainLength);
-            stCaf_melt(flower, threadSet, NULL, NULL, 0, minimumChainLength, breakChainsAtReverseTandems, maximumMedianSequenceLengthBetweenLinkedEnds);
+            bool breakChains = breakChainsAtReverseTandems || maximumMedianSequenceLengthBetweenLinkedEnds < INT64_MAX;
+            if (!breakChains && minimumChainLength > 1) {
+                minimumChainLengths[roundNumber++] = minimumChainLength;
+            }
+            stCaf_meltInRounds(flower, threadSet, minimumChainLengths, roundNumber);
+            free(minimumChainLengths);
+            if (breakChains) {
+                stCaf_melt(flower, threadSet, NULL, NULL, 0, minimumChainLength, breakChainsAtReverseTandems, maximumMedianSequenceLengthBetweenLinkedEnds);
+            }
             //This does the filtering of blocks that do not have the required species/tree-coverage/degree.
             stCaf_melt(flower, threadSet, blockFilterFn, fa, blockTrim, 0, 0, INT64_MAX);
+            cactusMetrics_endPhase();
+            cactusMetrics_endPhase();
         }
 
         if (removeRecoverableChains) {
+            cactusMetrics_startPhase("melt recoverable chains");
             stCaf_meltRecoverableChains(flower, threadSet, breakChainsAtReverseTandems, maximumMedianSequenceLengthBetweenLinkedEnds, recoverableChainsFilter, maxRecoverableChainsIterations, maxRecoverableChainLength);
+            cactusMetrics_endPhase();
         }
 
         st_logInfo("Sequence graph statistics after melting:\n");
@@ -468,7 +492,9 @@ void caf(Flower *flower, CactusParams *params, char *alignmentsFile, char *secon
         }
 
         //Finish up
+        cactusMetrics_startPhase("finish");
         stCaf_finish(flower, threadSet, minLengthForChromosome, proportionOfUnalignedBasesForNewChromosome);
+        cactusMetrics_endPhase();
         st_logDebug("Ran the cactus core script\n");
 
         //Cleanup
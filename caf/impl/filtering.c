@@ -8,9 +8,23 @@
  */
 
 Event *stCaf_getEvent(stPinchSegment *segment, Flower *flower) {
-    Event *event = cap_getEvent(flower_getCap(flower, stPinchSegment_getName(segment)));
-    assert(event != NULL);
-    return event;
+    return stCaf_getEventByOrdinal(flower, stCaf_getThreadInfo(segment, flower)->event);
+}
+
+/*
+ * Sets of events or sequences, as bitsets over their ordinals in the thread index.
+ */
+
+static uint64_t *constructSet(int64_t size) {
+    return st_calloc((size + 63) / 64, sizeof(uint64_t));
+}
+
+static inline void addToSet(uint64_t *set, int64_t i) {
+    set[i >> 6] |= ((uint64_t)1) << (i & 63);
+}
+
+static inline bool isInSet(const uint64_t *set, int64_t i) {
+    return (set[i >> 6] >> (i & 63)) & 1;
 }
 
 /*
@@ -21,7 +35,7 @@ static bool containsOutgroupSegment(stPinchBlock *block, Flower *flower) {
     stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
     stPinchSegment *segment;
     while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-        if (event_isOutgroup(stCaf_getEvent(segment, flower))) {
+        if (stCaf_getThreadInfo(segment, flower)->outgroup) {
             stPinchSegment_putSegmentFirstInBlock(segment);
             assert(stPinchBlock_getFirst(block) == segment);
             return 1;
@@ -31,11 +45,7 @@ static bool containsOutgroupSegment(stPinchBlock *block, Flower *flower) {
 }
 
 static bool isOutgroupSegment(stPinchSegment *segment, Flower *flower) {
-    if (event_isOutgroup(stCaf_getEvent(segment, flower))) {
-        return 1;
-    } else {
-        return 0;
-    }
+    return stCaf_getThreadInfo(segment, flower)->outgroup;
 }
 
 bool stCaf_filterByOutgroup(stPinchSegment *segment1,
@@ -79,55 +89,73 @@ bool stCaf_relaxedFilterByOutgroup(stPinchSegment *segment1,
 }
 
 /*
- * Filtering by presence of repeat species in block. This code is inefficient and does not scale.
+ * Filtering by presence of repeat species in block, using the summaries of the blocks.
  */
 
-static bool checkIntersection(stSortedSet *names1, stSortedSet *names2) {
-    stSortedSet *n12 = stSortedSet_getIntersection(names1, names2);
-    bool b = stSortedSet_size(n12) > 0;
-    stSortedSet_destruct(names1);
-    stSortedSet_destruct(names2);
-    stSortedSet_destruct(n12);
+static bool checkIntersection(uint64_t *set1, uint64_t *set2, int64_t size) {
+    bool b = 0;
+    for (int64_t i = 0; i < (size + 63) / 64; i++) {
+        if (set1[i] & set2[i]) {
+            b = 1;
+            break;
+        }
+    }
+    free(set1);
+    free(set2);
     return b;
 }
 
-static stSortedSet *getEvents(stPinchSegment *segment, Flower *flower) {
-    stSortedSet *events = stSortedSet_construct();
-    if (stPinchSegment_getBlock(segment) != NULL) {
-        stPinchBlock *block = stPinchSegment_getBlock(segment);
-        stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
-        while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-            stSortedSet_insert(events, stCaf_getEvent(segment, flower));
+/*
+ * Returns non-zero if the segments' blocks, or the segments if not in blocks, have an event (or, if
+ * ingroupsOnly, an ingroup event) in common. The events of blocks are taken from their summaries, so this
+ * is a few word operations rather than a walk of the blocks.
+ */
+static bool eventsIntersect(stPinchSegment *segment1, stPinchSegment *segment2, Flower *flower, bool ingroupsOnly) {
+    stPinchBlock *block1 = stPinchSegment_getBlock(segment1);
+    stPinchBlock *block2 = stPinchSegment_getBlock(segment2);
+    if (block1 == NULL && block2 != NULL) {
+        return eventsIntersect(segment2, segment1, flower, ingroupsOnly);
+    }
+    // Copied, as the lookups that follow may add threads to the index, moving its entries
+    stCafThreadInfo info2 = *stCaf_getThreadInfo(segment2, flower);
+    if (block1 == NULL) {
+        const stCafThreadInfo *info1 = stCaf_getThreadInfo(segment1, flower);
+        return info1->event == info2.event && (!ingroupsOnly || !info1->outgroup);
+    }
+    const stCafBlockSummary *summary1 = stCaf_getBlockSummary(block1, flower);
+    if (block2 == NULL) {
+        return isInSet(summary1->events, info2.event) && (!ingroupsOnly || !info2.outgroup);
+    }
+    const stCafBlockSummary *summary2 = stCaf_getBlockSummary(block2, flower);
+    const uint64_t *ingroupEvents = stCaf_getIngroupEventSet(flower);
+    for (int64_t i = 0; i < (stCaf_getEventNumber(flower) + 63) / 64; i++) {
+        if (summary1->events[i] & summary2->events[i] & (ingroupsOnly ? ingroupEvents[i] : ~((uint64_t)0))) {
+            return 1;
         }
-    } else {
-        stSortedSet_insert(events, stCaf_getEvent(segment, flower));
     }
-    return events;
+    return 0;
+}
+
+/*
+ * Returns the value of a filter, recording the pinch if allowed.
+ */
+static bool recordIfAllowed(bool filter, stPinchSegment *segment1, stPinchSegment *segment2, Flower *flower) {
+    if (!filter) {
+        stCaf_recordPinch(segment1, segment2, flower);
+    }
+    return filter;
 }
 
 static bool containsMoreThanOneEvent(stPinchSegment *segment, Flower *flower) {
     if(stPinchSegment_getBlock(segment) == NULL) {
         return false;
     }
-    stPinchBlock *block = stPinchSegment_getBlock(segment);
-    if(!stPinchBlock_getModifiedFlag(block)) {
-        return stPinchBlock_getFilterFlag(block);
-    }
-    stPinchBlock_setModifiedFlag(block, false); // this ensures that we won't evaluate this again unless
-    // we've added to the block
-    if(stPinchBlock_getFilterFlag(block)) { // note: having this line assumes that we won't remove segments
-        // from blocks during the annealing phase
-        return true;
-    }
-    Event *event = stCaf_getEvent(segment, flower);
-    stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
-    while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-        if (stCaf_getEvent(segment, flower) != event) {
-            stPinchBlock_setFilterFlag(block, true);
-            return true;
-        }
+    const stCafBlockSummary *summary = stCaf_getBlockSummary(stPinchSegment_getBlock(segment), flower);
+    int64_t eventNumber = 0;
+    for (int64_t i = 0; i < (stCaf_getEventNumber(flower) + 63) / 64 && eventNumber <= 1; i++) {
+        eventNumber += __builtin_popcountll(summary->events[i]);
     }
-    return false;
+    return eventNumber > 1;
 }
 
 bool stCaf_filterByMultipleSequences(stPinchSegment *segment1,
@@ -144,27 +172,26 @@ bool stCaf_filterByMultipleSpecies(stPinchSegment *segment1,
             if (block1 == block2) {
                 return stPinchBlock_getLength(block1) == 1 ? 0 : containsMoreThanOneEvent(segment1, flower);
             }
-            if (stPinchBlock_getDegree(block1) < stPinchBlock_getDegree(block2)) {
-                return containsMoreThanOneEvent(segment1, flower) && containsMoreThanOneEvent(segment2, flower);
-            }
-            return containsMoreThanOneEvent(segment2, flower) && containsMoreThanOneEvent(segment1, flower);
+            return recordIfAllowed(containsMoreThanOneEvent(segment1, flower) && containsMoreThanOneEvent(segment2, flower),
+                                   segment1, segment2, flower);
         }
     }
     // If we get here, we are just adding a segment to a block, not
     // pinching two blocks together.
+    stCaf_recordPinch(segment1, segment2, flower);
     return false;
 }
 
 bool stCaf_filterByRepeatSpecies(stPinchSegment *segment1,
                                  stPinchSegment *segment2, Flower *flower) {
-    return checkIntersection(getEvents(segment1, flower), getEvents(segment2, flower));
+    return recordIfAllowed(eventsIntersect(segment1, segment2, flower, 0), segment1, segment2, flower);
 }
 
 bool stCaf_relaxedFilterByRepeatSpecies(stPinchSegment *segment1,
                                         stPinchSegment *segment2, Flower *flower) {
-    return stPinchSegment_getBlock(segment1) != NULL
-        && stPinchSegment_getBlock(segment2) != NULL
-        && checkIntersection(getEvents(segment1, flower), getEvents(segment2, flower));
+    return recordIfAllowed(stPinchSegment_getBlock(segment1) != NULL
+                           && stPinchSegment_getBlock(segment2) != NULL
+                           && eventsIntersect(segment1, segment2, flower, 0), segment1, segment2, flower);
 }
 
 static Event* singleCopyEvent = NULL;
@@ -178,74 +205,58 @@ void stCaf_setSingleCopyEvent(Flower* flower, char *singleCopyEventName) {
     }
 }
 
-bool stCaf_filterBySingleCopyEvent(stPinchSegment *segment1,
-                                   stPinchSegment *segment2, Flower *flower) {
-    bool b = false;
-    if (singleCopyEvent != NULL) {
-        stSortedSet *names1 = getEvents(segment1, flower);
-        if (stSortedSet_search(names1, singleCopyEvent) != NULL) {
-            stSortedSet *names2 = getEvents(segment2, flower);
-            b = stSortedSet_search(names2, singleCopyEvent) != NULL;
-            stSortedSet_destruct(names2);
+static bool containsEvent(stPinchSegment *segment, Flower *flower, Event *event) {
+    stPinchBlock *block = stPinchSegment_getBlock(segment);
+    if (block == NULL) {
+        return stCaf_getEvent(segment, flower) == event;
+    }
+    stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
+    while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
+        if (stCaf_getEvent(segment, flower) == event) {
+            return 1;
         }
-        stSortedSet_destruct(names1);
     }
-    return b;
+    return 0;
 }
 
-static stSortedSet *getChrNames(stPinchSegment *segment, Flower *flower) {
-    stSortedSet *names = stSortedSet_construct();
-    if (stPinchSegment_getBlock(segment) != NULL) {
-        stPinchBlock *block = stPinchSegment_getBlock(segment);
-        stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
-        while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-            Cap *cap = flower_getCap(flower, stPinchSegment_getName(segment));
-            Sequence *sequence = cap_getSequence(cap);
-            stSortedSet_insert(names, (void *) sequence_getName(sequence));
-        }
-    } else {
-        Cap *cap = flower_getCap(flower, stPinchSegment_getName(segment));
-        Sequence *sequence = cap_getSequence(cap);
-        stSortedSet_insert(names, (void *) sequence_getName(sequence));
+bool stCaf_filterBySingleCopyEvent(stPinchSegment *segment1,
+                                   stPinchSegment *segment2, Flower *flower) {
+    return singleCopyEvent != NULL && containsEvent(segment1, flower, singleCopyEvent)
+           && containsEvent(segment2, flower, singleCopyEvent);
+}
+
+static uint64_t *getChrs(stPinchSegment *segment, Flower *flower) {
+    uint64_t *chrs = constructSet(stCaf_getSequenceNumber(flower));
+    stPinchBlock *block = stPinchSegment_getBlock(segment);
+    stPinchBlockIt it;
+    if (block != NULL) {
+        it = stPinchBlock_getSegmentIterator(block);
+        segment = stPinchBlockIt_getNext(&it);
+    }
+    while (segment != NULL) {
+        const stCafThreadInfo *info = stCaf_getThreadInfo(segment, flower);
+        assert(info->sequence != -1);
+        addToSet(chrs, info->sequence);
+        segment = block != NULL ? stPinchBlockIt_getNext(&it) : NULL;
     }
-    return names;
+    return chrs;
 }
 
 bool stCaf_singleCopyChr(stPinchSegment *segment1,
                          stPinchSegment *segment2, Flower *flower) {
-    return checkIntersection(getChrNames(segment1, flower), getChrNames(segment2, flower));
-}
-
-static stSortedSet *getIngroupEvents(stPinchSegment *segment, Flower *flower) {
-    stSortedSet *events = stSortedSet_construct();
-    if (stPinchSegment_getBlock(segment) != NULL) {
-        stPinchBlock *block = stPinchSegment_getBlock(segment);
-        stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
-        while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-            Event *event = stCaf_getEvent(segment, flower);
-            if (!event_isOutgroup(event)) {
-                stSortedSet_insert(events, event);
-            }
-        }
-    } else {
-        Event *event = stCaf_getEvent(segment, flower);
-        if (!event_isOutgroup(event)) {
-            stSortedSet_insert(events, event);
-        }
-    }
-    return events;
+    return checkIntersection(getChrs(segment1, flower), getChrs(segment2, flower), stCaf_getSequenceNumber(flower));
 }
 
 bool stCaf_singleCopyIngroup(stPinchSegment *segment1,
                              stPinchSegment *segment2, Flower *flower) {
-    return checkIntersection(getIngroupEvents(segment1, flower), getIngroupEvents(segment2, flower));
+    return recordIfAllowed(eventsIntersect(segment1, segment2, flower, 1), segment1, segment2, flower);
 }
 
 bool stCaf_relaxedSingleCopyIngroup(stPinchSegment *segment1,
                                     stPinchSegment *segment2, Flower *flower) {
-    return stPinchSegment_getBlock(segment1) != NULL
-        && stPinchSegment_getBlock(segment2) != NULL
-        && checkIntersection(getIngroupEvents(segment1, flower), getIngroupEvents(segment2, flower));
+    return recordIfAllowed(stPinchSegment_getBlock(segment1) != NULL
+                           && stPinchSegment_getBlock(segment2) != NULL
+                           && eventsIntersect(segment1, segment2, flower, 1), segment1, segment2, flower);
 }
 
 /*
@@ -363,72 +374,43 @@ bool stCaf_chainHasUnequalNumberOfIngroupCopies(stCactusEdgeEnd *chainEnd,
     stPinchEnd *end = stCactusEdgeEnd_getObject(chainEnd);
     stPinchBlockIt it = stPinchBlock_getSegmentIterator(end->block);
     stPinchSegment *segment;
-    stHash *ingroupToNumCopies = stHash_construct2(NULL, free);
+    uint64_t *numCopies = st_calloc(stCaf_getEventNumber(flower), sizeof(uint64_t));
     while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-        Cap *cap = flower_getCap(flower, stPinchSegment_getName(segment));
-        Event *event = cap_getEvent(cap);
-        if (!event_isOutgroup(event)) {
-            if (stHash_search(ingroupToNumCopies, event) == NULL) {
-                stHash_insert(ingroupToNumCopies, event, calloc(1, sizeof(uint64_t)));
-            }
-            uint64_t *numCopies = stHash_search(ingroupToNumCopies, event);
-            (*numCopies)++;
+        const stCafThreadInfo *info = stCaf_getThreadInfo(segment, flower);
+        if (!info->outgroup) {
+            numCopies[info->event]++;
         }
     }
 
-    EventTree *eventTree = flower_getEventTree(flower);
-    EventTree_Iterator *eventIt = eventTree_getIterator(eventTree);
+    int64_t ingroupLeafEventNumber;
+    int64_t *ingroupLeafEvents = stCaf_getIngroupLeafEvents(flower, &ingroupLeafEventNumber);
     bool equalNumIngroupCopies = true;
-    Event *event;
-    uint64_t prevCount = 0;
-    while ((event = eventTree_getNext(eventIt)) != NULL) {
-        if (event_isOutgroup(event) || event_getChildNumber(event) != 0) {
-            continue;
-        }
-        uint64_t *count = stHash_search(ingroupToNumCopies, event);
-        if (count == NULL) {
-            equalNumIngroupCopies = false;
-            break;
-        }
-        if (prevCount == 0) {
-            prevCount = *count;
-        } else if (prevCount != *count) {
+    for (int64_t i = 0; i < ingroupLeafEventNumber; i++) {
+        if (numCopies[ingroupLeafEvents[i]] == 0 || numCopies[ingroupLeafEvents[i]] != numCopies[ingroupLeafEvents[0]]) {
             equalNumIngroupCopies = false;
             break;
         }
     }
 
-    eventTree_destructIterator(eventIt);
-    stHash_destruct(ingroupToNumCopies);
+    free(numCopies);
     return !equalNumIngroupCopies;
 }
 
 bool stCaf_chainHasUnequalNumberOfIngroupCopiesOrNoOutgroup(stCactusEdgeEnd *chainEnd,
                                                             Flower *flower) {
-    EventTree *eventTree = flower_getEventTree(flower);
-    EventTree_Iterator *eventIt = eventTree_getIterator(eventTree);
     bool equalNumIngroupCopies = !stCaf_chainHasUnequalNumberOfIngroupCopies(chainEnd, flower);
-    Event *event;
-    uint64_t numOutgroups = 0;
-    while ((event = eventTree_getNext(eventIt)) != NULL) {
-        if (event_isOutgroup(event)) {
-            numOutgroups++;
-        }
-    }
+    uint64_t numOutgroups = stCaf_getOutgroupEventNumber(flower);
 
     uint64_t numOutgroupCopies = 0;
     stPinchEnd *end = stCactusEdgeEnd_getObject(chainEnd);
     stPinchBlockIt it = stPinchBlock_getSegmentIterator(end->block);
     stPinchSegment *segment;
     while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
-        Cap *cap = flower_getCap(flower, stPinchSegment_getName(segment));
-        Event *event = cap_getEvent(cap);
-        if (event_isOutgroup(event)) {
+        if (stCaf_getThreadInfo(segment, flower)->outgroup) {
             numOutgroupCopies++;
         }
     }
 
-    eventTree_destructIterator(eventIt);
     return !equalNumIngroupCopies
         || (numOutgroups > 0 && numOutgroupCopies == 0);
 }
@@ -439,25 +421,25 @@ bool stCaf_containsRequiredSpecies(stPinchBlock *pinchBlock,
                                    int64_t minimumOutgroupDegree,
                                    int64_t minimumDegree,
                                    int64_t minimumNumberOfSpecies) {
-    stSet *seenEvents = stSet_construct();
+    uint64_t *seenEvents = constructSet(stCaf_getEventNumber(flower));
     int64_t numberOfSpecies = 0;
     int64_t outgroupSequences = 0;
     int64_t ingroupSequences = 0;
     stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(pinchBlock);
     stPinchSegment *segment;
     while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
-        Event *event = stCaf_getEvent(segment, flower);
-        if (!stSet_search(seenEvents, event)) {
-            stSet_insert(seenEvents, event);
+        const stCafThreadInfo *info = stCaf_getThreadInfo(segment, flower);
+        if (!isInSet(seenEvents, info->event)) {
+            addToSet(seenEvents, info->event);
             numberOfSpecies++;
         }
-        if (event_isOutgroup(event)) {
+        if (info->outgroup) {
             outgroupSequences++;
         } else {
             ingroupSequences++;
         }
     }
-    stSet_destruct(seenEvents);
+    free(seenEvents);
     return ingroupSequences >= minimumIngroupDegree &&
         outgroupSequences >= minimumOutgroupDegree &&
         outgroupSequences + ingroupSequences >= minimumDegree &&
@@ -466,26 +448,38 @@ bool stCaf_containsRequiredSpecies(stPinchBlock *pinchBlock,
 
 bool stCaf_treeCoverage(stPinchBlock *pinchBlock, Flower *flower) {
     EventTree *eventTree = flower_getEventTree(flower);
-    Event *commonAncestorEvent = NULL;
+    // Get the distinct events of the block, so the tree is walked once per event rather than per segment
+    int64_t eventNumber = stCaf_getEventNumber(flower);
+    uint64_t *blockEvents = constructSet(eventNumber);
     stPinchSegment *segment;
     stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(pinchBlock);
     while ((segment = stPinchBlockIt_getNext(&segmentIt))) {
-        Event *event = stCaf_getEvent(segment, flower);
-        commonAncestorEvent = commonAncestorEvent == NULL ? event : eventTree_getCommonAncestor(event, commonAncestorEvent);
+        addToSet(blockEvents, stCaf_getThreadInfo(segment, flower)->event);
+    }
+    Event *commonAncestorEvent = NULL;
+    for (int64_t i = 0; i < eventNumber; i++) {
+        if (isInSet(blockEvents, i)) {
+            Event *event = stCaf_getEventByOrdinal(flower, i);
+            commonAncestorEvent = commonAncestorEvent == NULL ? event : eventTree_getCommonAncestor(event, commonAncestorEvent);
+        }
     }
     assert(commonAncestorEvent != NULL);
     float treeCoverage = 0.0;
     stHash *hash = stHash_construct();
 
-    segmentIt = stPinchBlock_getSegmentIterator(pinchBlock);
-    while ((segment = stPinchBlockIt_getNext(&segmentIt))) {
-        Event *event = stCaf_getEvent(segment, flower);
+    for (int64_t i = 0; i < eventNumber; i++) {
+        if (!isInSet(blockEvents, i)) {
+            continue;
+        }
+        Event *event = stCaf_getEventByOrdinal(flower, i);
         while (event != commonAncestorEvent && stHash_search(hash, event) == NULL) {
             treeCoverage += event_getBranchLength(event);
             stHash_insert(hash, event, event);
             event = event_getParent(event);
         }
     }
+    free(blockEvents);
+    stHash_destruct(hash);
 
     float wholeTreeCoverage = event_getSubTreeBranchLength(event_getChild(eventTree_getRootEvent(eventTree), 0));
     assert(wholeTreeCoverage >= 0.0);
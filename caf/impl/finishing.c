@@ -447,4 +447,5 @@ void stCaf_finish(Flower *flower, stPinchThreadSet *threadSet, int64_t minLength
 
     //Cleanup
     stCactusGraph_destruct(cactusGraph);
+    stCaf_destructThreadIndex();
 }
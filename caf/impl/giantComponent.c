@@ -10,6 +10,83 @@
 #include <math.h>
 #include <stdlib.h>
 
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/*
+ * An edge between two nodes, given by dense integer ids.
+ */
+typedef struct _weightedEdge {
+    int64_t weight;
+    int64_t node1;
+    int64_t node2;
+    int64_t index; // The position of the edge in the input
+    bool deleted; // Set if the edge must be deleted
+} WeightedEdge;
+
+static int weightedEdge_cmpFn(const void *a, const void *b) {
+    /*
+     * Orders the edges best first: in descending order of weight, then of the node ids.
+     */
+    const WeightedEdge *edge1 = a, *edge2 = b;
+    if (edge1->weight != edge2->weight) {
+        return edge1->weight > edge2->weight ? -1 : 1;
+    }
+    if (edge1->node1 != edge2->node1) {
+        return edge1->node1 > edge2->node1 ? -1 : 1;
+    }
+    return edge1->node2 > edge2->node2 ? -1 : (edge1->node2 < edge2->node2 ? 1 : 0);
+}
+
+static int64_t findComponent(int64_t *parents, int64_t node) {
+    while (parents[node] != node) {
+        parents[node] = parents[parents[node]]; // Path halving
+        node = parents[node];
+    }
+    return node;
+}
+
+static int64_t breakupComponentGreedily(int64_t nodeNumber, WeightedEdge *edges, int64_t edgeNumber, int64_t maxComponentSize) {
+    /*
+     * Sorts the edges best first and adds them in turn to a union-find of the nodes, marking as deleted those that
+     * would join two components into one larger than maxComponentSize. Returns the number of components.
+     */
+    qsort(edges, edgeNumber, sizeof(WeightedEdge), weightedEdge_cmpFn);
+    int64_t *parents = st_malloc(sizeof(int64_t) * nodeNumber);
+    int64_t *sizes = st_malloc(sizeof(int64_t) * nodeNumber);
+    for (int64_t i = 0; i < nodeNumber; i++) {
+        parents[i] = i;
+        sizes[i] = 1;
+    }
+    int64_t totalComponents = nodeNumber;
+    for (int64_t i = 0; i < edgeNumber; i++) {
+        WeightedEdge *edge = &edges[i];
+        edge->deleted = 0;
+        int64_t component1 = findComponent(parents, edge->node1);
+        int64_t component2 = findComponent(parents, edge->node2);
+        if (component1 == component2) { //We're golden, as the edge is already contained within one component.
+            continue;
+        }
+        if (sizes[component1] + sizes[component2] > maxComponentSize) { //This edge would make a too large component, so reject
+            edge->deleted = 1;
+            continue;
+        }
+        if (sizes[component1] < sizes[component2]) {
+            int64_t component3 = component1;
+            component1 = component2;
+            component2 = component3;
+        }
+        parents[component2] = component1;
+        sizes[component1] += sizes[component2];
+        totalComponents -= 1;
+    }
+    free(parents);
+    free(sizes);
+    return totalComponents;
+}
+
 static void *getValue(stHash *hash, int64_t node) {
     stIntTuple *nodeTuple = stIntTuple_construct1(node);
     void *object = stHash_search(hash, nodeTuple);
@@ -19,58 +96,37 @@ static void *getValue(stHash *hash, int64_t node) {
 
 stList *stCaf_breakupComponentGreedily(stList *nodes, stList *edges, int64_t maxComponentSize) {
     /*
-     * Make a component for each node in the graph
+     * Give the nodes dense ids in ascending order of the nodes, so the edges are considered in the same order.
      */
-    stHash *nodeToComponents = stHash_construct3((uint64_t(*)(const void *)) stIntTuple_hashKey,
+    stList *sortedNodes = stList_copy(nodes, NULL); //copy, to avoid messing input
+    stList_sort(sortedNodes, (int(*)(const void *, const void *)) stIntTuple_cmpFn);
+    int64_t *ids = st_malloc(sizeof(int64_t) * stList_length(sortedNodes));
+    stHash *nodesToIds = stHash_construct3((uint64_t(*)(const void *)) stIntTuple_hashKey,
             (int(*)(const void *, const void *)) stIntTuple_equalsFn, NULL, NULL);
-    stListIterator *listIt = stList_getIterator(nodes);
-    stIntTuple *node;
-    while ((node = stList_getNext(listIt)) != NULL) {
-        stSortedSet *component = stSortedSet_construct();
-        stSortedSet_insert(component, node);
-        assert(stHash_search(nodeToComponents, node) == NULL);
-        stHash_insert(nodeToComponents, node, component);
+    for (int64_t i = 0; i < stList_length(sortedNodes); i++) {
+        ids[i] = i;
+        assert(stHash_search(nodesToIds, stList_get(sortedNodes, i)) == NULL);
+        stHash_insert(nodesToIds, stList_get(sortedNodes, i), &ids[i]);
+    }
+
+    WeightedEdge *weightedEdges = st_malloc(sizeof(WeightedEdge) * stList_length(edges));
+    for (int64_t i = 0; i < stList_length(edges); i++) {
+        stIntTuple *edge = stList_get(edges, i);
+        int64_t *id1 = getValue(nodesToIds, stIntTuple_get(edge, 1));
+        int64_t *id2 = getValue(nodesToIds, stIntTuple_get(edge, 2));
+        assert(id1 != NULL && id2 != NULL);
+        weightedEdges[i].weight = stIntTuple_get(edge, 0);
+        weightedEdges[i].node1 = *id1;
+        weightedEdges[i].node2 = *id2;
+        weightedEdges[i].index = i;
     }
-    stList_destructIterator(listIt);
+    int64_t totalComponents = breakupComponentGreedily(stList_length(nodes), weightedEdges, stList_length(edges), maxComponentSize);
 
-    stList *sortedEdges = stList_copy(edges, NULL); //copy, to avoid messing input
-    stList_sort(sortedEdges, (int(*)(const void *, const void *)) stIntTuple_cmpFn); //Sort in ascending order, so best edge first
-    int64_t edgeScore = INT64_MAX;
-    //While edges exist, try and put them into the graph.
     stList *edgesToDelete = stList_construct();
-    int64_t totalComponents = stList_length(nodes);
-    while (stList_length(sortedEdges) > 0) {
-        stIntTuple *edge = stList_pop(sortedEdges);
-        if (edgeScore < stIntTuple_get(edge, 0)) {
-            st_errAbort("bad edgeScore");
-        }
-        edgeScore = stIntTuple_get(edge, 0);
-        stSortedSet *component1 = getValue(nodeToComponents, stIntTuple_get(edge, 1));
-        stSortedSet *component2 = getValue(nodeToComponents, stIntTuple_get(edge, 2));
-        assert(component1 != NULL && component2 != NULL);
-        if (component1 == component2) { //We're golden, as the edge is already contained within one component.
-            continue;
-        }
-        if (stSortedSet_size(component1) + stSortedSet_size(component2) > maxComponentSize) { //This edge would make a too large component, so reject
-            stList_append(edgesToDelete, edge);
-            continue;
-        }
-        //Merge the components and replace references in the hash.
-        if (stSortedSet_size(component1) < stSortedSet_size(component2)) {
-            stSortedSet *component3 = component1;
-            component1 = component2;
-            component2 = component3;
-        }
-        assert(stSortedSet_size(component1) >= stSortedSet_size(component2));
-        while (stSortedSet_size(component2) > 0) {
-            node = stSortedSet_getLast(component2);
-            stSortedSet_remove(component2, node);
-            assert(stSortedSet_search(component1, node) == NULL);
-            stSortedSet_insert(component1, node);
-            stHash_insert(nodeToComponents, node, component1);
+    for (int64_t i = 0; i < stList_length(edges); i++) {
+        if (weightedEdges[i].deleted) {
+            stList_append(edgesToDelete, stList_get(edges, weightedEdges[i].index));
         }
-        stSortedSet_destruct(component2);
-        totalComponents -= 1;
     }
 
     st_logDebug(
@@ -79,76 +135,103 @@ stList *stCaf_breakupComponentGreedily(stList *nodes, stList *edges, int64_t max
             stList_length(edges) - stList_length(edgesToDelete), stList_length(edgesToDelete));
 
     //Cleanup
-    stList_destruct(sortedEdges);
-    stList *components = stHash_getValues(nodeToComponents);
-    stSortedSet *componentsSet = stList_getSortedSet(components, NULL);
-    stList_destruct(components);
-    stSortedSet_setDestructor(componentsSet, (void(*)(void *)) stSortedSet_destruct);
-    stSortedSet_destruct(componentsSet);
-    stHash_destruct(nodeToComponents);
+    free(weightedEdges);
+    stHash_destruct(nodesToIds);
+    free(ids);
+    stList_destruct(sortedNodes);
 
     return edgesToDelete;
 }
 
-static void convertToNodesAndEdges(stList *adjacencyComponent, stList **nodes, stList **edges) {
-    //Make nodes
-    *nodes = stList_construct3(0, (void(*)(void *)) stIntTuple_destruct);
-    stHash *pinchEndsToNodesHash = stHash_construct3(stPinchEnd_hashFn, stPinchEnd_equalsFn, NULL, NULL);
-    for (int64_t i = 0; i < stList_length(adjacencyComponent); i++) {
-        stIntTuple *node = stIntTuple_construct1(i);
-        stList_append(*nodes, node);
-        assert(stHash_search(pinchEndsToNodesHash, stList_get(adjacencyComponent, i)) == NULL);
-        stHash_insert(pinchEndsToNodesHash, stList_get(adjacencyComponent, i), node);
+typedef struct _adjacency {
+    int64_t node1;
+    int64_t node2;
+} Adjacency;
+
+static int adjacency_cmpFn(const void *a, const void *b) {
+    const Adjacency *adjacency1 = a, *adjacency2 = b;
+    if (adjacency1->node1 != adjacency2->node1) {
+        return adjacency1->node1 < adjacency2->node1 ? -1 : 1;
+    }
+    return adjacency1->node2 < adjacency2->node2 ? -1 : (adjacency1->node2 > adjacency2->node2 ? 1 : 0);
+}
+
+static WeightedEdge *convertToEdges(stList *adjacencyComponent, int64_t *edgeNumber) {
+    /*
+     * The nodes are the positions of the ends in the adjacency component. Each edge is weighted by the number of
+     * adjacencies between its two ends, counted from both ends.
+     */
+    int64_t nodeNumber = stList_length(adjacencyComponent);
+    int64_t *ids = st_malloc(sizeof(int64_t) * nodeNumber);
+    stHash *pinchEndsToIds = stHash_construct3(stPinchEnd_hashFn, stPinchEnd_equalsFn, NULL, NULL);
+    int64_t *offsets = st_malloc(sizeof(int64_t) * (nodeNumber + 1));
+    offsets[0] = 0;
+    for (int64_t i = 0; i < nodeNumber; i++) {
+        ids[i] = i;
+        assert(stHash_search(pinchEndsToIds, stList_get(adjacencyComponent, i)) == NULL);
+        stHash_insert(pinchEndsToIds, stList_get(adjacencyComponent, i), &ids[i]);
+        offsets[i + 1] = offsets[i] + stPinchBlock_getDegree(stPinchEnd_getBlock(stList_get(adjacencyComponent, i)));
     }
-    //Make edges
 
-    //First build a hash of edges to their multiplicity
-    stHash *edgesToMultiplicityHash = stHash_construct3((uint64_t(*)(const void *)) stIntTuple_hashKey,
-            (int(*)(const void *, const void *)) stIntTuple_equalsFn, (void(*)(void *)) stIntTuple_destruct,
-            (void(*)(void *)) stIntTuple_destruct);
-    for (int64_t i = 0; i < stList_length(adjacencyComponent); i++) {
+    //Find the adjacencies of each end, one for each segment of its block, in parallel as the graph is not changed
+    Adjacency *adjacencies = st_malloc(sizeof(Adjacency) * offsets[nodeNumber]);
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic, 1024)
+#endif
+    for (int64_t i = 0; i < nodeNumber; i++) {
         stPinchEnd *pinchEnd1 = stList_get(adjacencyComponent, i);
-        int64_t node1 = stIntTuple_get(stHash_search(pinchEndsToNodesHash, pinchEnd1), 0);
+        int64_t j = offsets[i];
         stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(stPinchEnd_getBlock(pinchEnd1));
         stPinchSegment *segment;
         while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+            adjacencies[j].node1 = -1; //Marks there being no edge
             bool traverse5Prime = stPinchEnd_traverse5Prime(stPinchEnd_getOrientation(pinchEnd1), segment);
             stPinchSegment *segment2 = traverse5Prime ? stPinchSegment_get5Prime(segment) : stPinchSegment_get3Prime(segment);
             while (segment2 != NULL) {
                 if (stPinchSegment_getBlock(segment2) != NULL) {
                     stPinchEnd pinchEnd2 = stPinchEnd_constructStatic(stPinchSegment_getBlock(segment2),
                             stPinchEnd_endOrientation(traverse5Prime, segment2));
-                    assert(stHash_search(pinchEndsToNodesHash, &pinchEnd2) != NULL);
-                    int64_t node2 = stIntTuple_get(stHash_search(pinchEndsToNodesHash, &pinchEnd2), 0);
-                    if (node1 != node2) { //Ignore self edges
-                        stIntTuple *edge = node1 < node2 ? stIntTuple_construct2(node1, node2) : stIntTuple_construct2(node2, node1);
-                        int64_t multiplicity = 1;
-                        if (stHash_search(edgesToMultiplicityHash, edge) != NULL) {
-                            stIntTuple *count = stHash_removeAndFreeKey(edgesToMultiplicityHash, edge);
-                            multiplicity += stIntTuple_get(count, 0);
-                            stIntTuple_destruct(count);
-                            assert(multiplicity > 1);
-                        }
-                        stHash_insert(edgesToMultiplicityHash, edge, stIntTuple_construct1(multiplicity));
+                    int64_t *node2 = stHash_search(pinchEndsToIds, &pinchEnd2);
+                    assert(node2 != NULL);
+                    if (i != *node2) { //Ignore self edges
+                        adjacencies[j].node1 = i < *node2 ? i : *node2;
+                        adjacencies[j].node2 = i < *node2 ? *node2 : i;
                     }
                     break;
                 }
                 segment2 = traverse5Prime ? stPinchSegment_get5Prime(segment2) : stPinchSegment_get3Prime(segment2);
             }
+            j++;
         }
+        assert(j == offsets[i + 1]);
     }
-    //Now build edges, scoring them according to their multiplicity
-    *edges = stList_construct3(0, (void(*)(void *)) stIntTuple_destruct);
-    stHashIterator *hashIt = stHash_getIterator(edgesToMultiplicityHash);
-    stIntTuple *edge;
-    while ((edge = stHash_getNext(hashIt)) != NULL) {
-        stIntTuple *count = stHash_search(edgesToMultiplicityHash, edge);
-        stList_append(*edges, stIntTuple_construct3(stIntTuple_get(count, 0), stIntTuple_get(edge, 0), stIntTuple_get(edge, 1)));
+
+    //Sort the adjacencies and count the multiplicity of each, skipping the slots marked as having no edge
+    int64_t adjacencyNumber = offsets[nodeNumber];
+    qsort(adjacencies, adjacencyNumber, sizeof(Adjacency), adjacency_cmpFn);
+    WeightedEdge *edges = st_malloc(sizeof(WeightedEdge) * (adjacencyNumber + 1));
+    *edgeNumber = 0;
+    for (int64_t i = 0; i < adjacencyNumber; i++) {
+        if (adjacencies[i].node1 == -1) {
+            continue;
+        }
+        if (*edgeNumber > 0 && edges[*edgeNumber - 1].node1 == adjacencies[i].node1 && edges[*edgeNumber - 1].node2 == adjacencies[i].node2) {
+            edges[*edgeNumber - 1].weight++;
+        } else {
+            WeightedEdge *edge = &edges[(*edgeNumber)++];
+            edge->weight = 1;
+            edge->node1 = adjacencies[i].node1;
+            edge->node2 = adjacencies[i].node2;
+            edge->index = *edgeNumber - 1;
+        }
     }
 
     //Cleanup
-    stHash_destruct(pinchEndsToNodesHash);
-    stHash_destruct(edgesToMultiplicityHash);
+    free(adjacencies);
+    free(offsets);
+    stHash_destruct(pinchEndsToIds);
+    free(ids);
+    return edges;
 }
 
 static void breakEdges(stPinchThreadSet *threadSet, stPinchEnd *pinchEnd1, stPinchEnd *pinchEnd2) {
@@ -198,17 +281,21 @@ void stCaf_breakupComponentsGreedily(stPinchThreadSet *threadSet, float maximumA
         stList *adjacencyComponent = stList_get(adjacencyComponents, i);
         if (maximumAdjacencyComponentSize < stList_length(adjacencyComponent)) {
             //Get graph description
-            stList *nodes, *edges;
-            convertToNodesAndEdges(adjacencyComponent, &nodes, &edges);
+            int64_t edgeNumber;
+            WeightedEdge *edges = convertToEdges(adjacencyComponent, &edgeNumber);
             //Get the edges to remove
-            stList *edgesToDelete = stCaf_breakupComponentGreedily(nodes, edges, maximumAdjacencyComponentSize);
+            breakupComponentGreedily(stList_length(adjacencyComponent), edges, edgeNumber, maximumAdjacencyComponentSize);
             //Break edges;
-            int64_t unbrokenEdges = 0;
-            for (int64_t j = 0; j < stList_length(edgesToDelete); j++) {
-                stIntTuple *edge = stList_get(edgesToDelete, j);
-                assert(stIntTuple_get(edge, 1) < stIntTuple_get(edge, 2));
-                stPinchEnd *pinchEnd1 = stList_get(adjacencyComponent, stIntTuple_get(edge, 1));
-                stPinchEnd *pinchEnd2 = stList_get(adjacencyComponent, stIntTuple_get(edge, 2));
+            int64_t edgesToDelete = 0, unbrokenEdges = 0;
+            for (int64_t j = 0; j < edgeNumber; j++) {
+                WeightedEdge *edge = &edges[j];
+                if (!edge->deleted) {
+                    continue;
+                }
+                edgesToDelete++;
+                assert(edge->node1 < edge->node2);
+                stPinchEnd *pinchEnd1 = stList_get(adjacencyComponent, edge->node1);
+                stPinchEnd *pinchEnd2 = stList_get(adjacencyComponent, edge->node2);
                 if (stPinchBlock_getDegree(stPinchEnd_getBlock(pinchEnd1)) > 1 && stPinchBlock_getDegree(stPinchEnd_getBlock(pinchEnd2))
                         > 1) {
                     breakEdges(threadSet, pinchEnd1, pinchEnd2);
@@ -216,14 +303,12 @@ void stCaf_breakupComponentsGreedily(stPinchThreadSet *threadSet, float maximumA
                     unbrokenEdges++;
                 }
             }
-            if (stList_length(edgesToDelete) > 0) {
+            if (edgesToDelete > 0) {
                 st_logInfo("Pinch graph component with %" PRIi64 " nodes and %" PRIi64 " edges is being split up by breaking %" PRIi64 " edges to reduce size to less than %" PRIi64 " max, but found %" PRIi64 " pointless edges \n",
-                           stList_length(nodes), stList_length(edges), stList_length(edgesToDelete), maximumAdjacencyComponentSize, unbrokenEdges);
+                           stList_length(adjacencyComponent), edgeNumber, edgesToDelete, maximumAdjacencyComponentSize, unbrokenEdges);
             }
             //Cleanup
-            stList_destruct(edges);
-            stList_destruct(nodes);
-            stList_destruct(edgesToDelete);
+            free(edges);
         }
     }
     stList_destruct(adjacencyComponents);
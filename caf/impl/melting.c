@@ -4,6 +4,11 @@
 #include "stCactusGraphs.h"
 #include "stCaf.h"
 
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
 ///////////////////////////////////////////////////////////////////////////
 // Core functions for melting
 ///////////////////////////////////////////////////////////////////////////
@@ -84,6 +89,21 @@ static stList *stCaf_getBlocksInChainsLessThanGivenLength(stCactusGraph *cactusG
     return blocksToDelete;
 }
 
+/*
+ * Gets the blocks that are not thread ends, in the order of the block iterator.
+ */
+static stList *getBlocksToMelt(stPinchThreadSet *threadSet) {
+    stList *blocks = stList_construct();
+    stPinchThreadSetBlockIt blockIt = stPinchThreadSet_getBlockIt(threadSet);
+    stPinchBlock *block;
+    while ((block = stPinchThreadSetBlockIt_getNext(&blockIt)) != NULL) {
+        if (!isThreadEnd(block)) {
+            stList_append(blocks, block);
+        }
+    }
+    return blocks;
+}
+
 static void trimAlignments(stPinchThreadSet *threadSet, int64_t blockEndTrim) {
     stPinchThreadSetBlockIt blockIt = stPinchThreadSet_getBlockIt(threadSet);
     stPinchBlock *block = stPinchThreadSetBlockIt_getNext(&blockIt);
@@ -98,15 +118,40 @@ static void trimAlignments(stPinchThreadSet *threadSet, int64_t blockEndTrim) {
 
 static void filterAlignments(stPinchThreadSet *threadSet, bool(*blockFilterFn)(stPinchBlock *, void *extraArg),
                              void *extraArg) {
-    stPinchThreadSetBlockIt blockIt = stPinchThreadSet_getBlockIt(threadSet);
-    stPinchBlock *block = stPinchThreadSetBlockIt_getNext(&blockIt);
-    while (block != NULL) {
-        stPinchBlock *block2 = stPinchThreadSetBlockIt_getNext(&blockIt);
-        if (!isThreadEnd(block) && blockFilterFn(block, extraArg)) {
-            stPinchBlock_destruct(block);
+    /*
+     * The filter only reads the graph, so it is evaluated for all the blocks in parallel before any are destroyed.
+     */
+    stList *blocks = getBlocksToMelt(threadSet);
+    int64_t blockNumber = stList_length(blocks);
+    bool *filtered = st_malloc(sizeof(bool) * (blockNumber + 1));
+#if defined(_OPENMP)
+#pragma omp parallel
+#endif
+    {
+#if defined(_OPENMP)
+#pragma omp for schedule(dynamic, 1024)
+#endif
+        for (int64_t i = 0; i < blockNumber; i++) {
+            filtered[i] = blockFilterFn(stList_get(blocks, i), extraArg);
+        }
+#if defined(_OPENMP)
+        // The filters build a thread index for each thread that calls them, which must not outlive the region.
+        // The calling thread keeps its own, which stCaf_finish frees.
+        if (omp_get_thread_num() != 0) {
+            stCaf_destructThreadIndex();
+        }
+#endif
+    }
+    int64_t blocksDestroyed = 0;
+    for (int64_t i = 0; i < blockNumber; i++) {
+        if (filtered[i]) {
+            stPinchBlock_destruct(stList_get(blocks, i));
+            blocksDestroyed++;
         }
-        block = block2;
     }
+    cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, blocksDestroyed);
+    free(filtered);
+    stList_destruct(blocks);
 }
 
 void stCaf_melt(Flower *flower, stPinchThreadSet *threadSet, bool blockFilterfn(stPinchBlock *, void *extraArg),
@@ -138,12 +183,186 @@ void stCaf_melt(Flower *flower, stPinchThreadSet *threadSet, bool blockFilterfn(
 
         //Cleanup cactus
         stCactusGraph_destruct(cactusGraph);
+        cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, stList_length(blocksToDelete));
         stList_destruct(blocksToDelete); //This will destroy the blocks
     }
     //Now heal up the trivial boundaries
     stCaf_joinTrivialBoundaries(threadSet);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Melting in rounds of increasing minimum chain length
+///////////////////////////////////////////////////////////////////////////
+
+typedef struct _meltingChain {
+    int64_t length;
+    stList *blocks; //The blocks destroyed to melt the chain, excluding the thread ends
+} MeltingChain;
+
+static void meltingChain_destruct(MeltingChain *chain) {
+    stList_destruct(chain->blocks);
+    free(chain);
+}
+
+static int meltingChain_cmpFn(const void *a, const void *b) {
+    int64_t i = ((MeltingChain *) a)->length, j = ((MeltingChain *) b)->length;
+    return i > j ? 1 : (i < j ? -1 : 0);
+}
+
+static stList *getChainsLessThanGivenLength(stCactusGraph *cactusGraph, int64_t maximumChainLength) {
+    /*
+     * Gets the chains shorter than the given length, sorted by increasing length.
+     */
+    stList *chains = stList_construct3(0, (void(*)(void *)) meltingChain_destruct);
+    stCactusGraphNodeIt *nodeIt = stCactusGraphNodeIterator_construct(cactusGraph);
+    stCactusNode *cactusNode;
+    while ((cactusNode = stCactusGraphNodeIterator_getNext(nodeIt)) != NULL) {
+        stCactusNodeEdgeEndIt cactusEdgeEndIt = stCactusNode_getEdgeEndIt(cactusNode);
+        stCactusEdgeEnd *cactusEdgeEnd;
+        while ((cactusEdgeEnd = stCactusNodeEdgeEndIt_getNext(&cactusEdgeEndIt)) != NULL) {
+            if (stCactusEdgeEnd_isChainEnd(cactusEdgeEnd) && stCactusEdgeEnd_getLinkOrientation(cactusEdgeEnd)) {
+                int64_t length = getChainLength(cactusEdgeEnd);
+                if (length < maximumChainLength) {
+                    MeltingChain *chain = st_malloc(sizeof(MeltingChain));
+                    chain->length = length;
+                    chain->blocks = stList_construct();
+                    addChainBlocksToBlocksToDelete(cactusEdgeEnd, chain->blocks);
+                    stList_append(chains, chain);
+                }
+            }
+        }
+    }
+    stCactusGraphNodeIterator_destruct(nodeIt);
+    stList_sort(chains, meltingChain_cmpFn);
+    return chains;
+}
+
+static stSet *getThreadsAttachedToDeadEndComponent(stPinchThreadSet *threadSet, stList *deadEndComponent) {
+    stSet *deadEndComponentSet = stSet_construct3(stPinchEnd_hashFn, stPinchEnd_equalsFn, NULL);
+    for (int64_t i = 0; i < stList_length(deadEndComponent); i++) {
+        stSet_insert(deadEndComponentSet, stList_get(deadEndComponent, i));
+    }
+    stSet *attachedThreads = stSet_construct();
+    stPinchThreadSetIt threadIt = stPinchThreadSet_getIt(threadSet);
+    stPinchThread *thread;
+    while ((thread = stPinchThreadSetIt_getNext(&threadIt)) != NULL) {
+        stPinchSegment *segment = stPinchThread_getFirst(thread);
+        stPinchEnd end5Prime = stPinchEnd_constructStatic(stPinchSegment_getBlock(segment), stPinchSegment_getBlockOrientation(segment));
+        segment = stPinchThread_getLast(thread);
+        stPinchEnd end3Prime = stPinchEnd_constructStatic(stPinchSegment_getBlock(segment), !stPinchSegment_getBlockOrientation(segment));
+        if (stSet_search(deadEndComponentSet, &end5Prime) != NULL || stSet_search(deadEndComponentSet, &end3Prime) != NULL) {
+            stSet_insert(attachedThreads, thread);
+        }
+    }
+    stSet_destruct(deadEndComponentSet);
+    return attachedThreads;
+}
+
+static bool threadComponentIsAttached(stPinchThread *thread, stSet *attachedThreads, stSet *threadsSeen) {
+    /*
+     * Walks the threads connected to the given thread by blocks until one attached to the dead end component is found.
+     * Threads in threadsSeen are those already walked to an attached thread.
+     */
+    if (stSet_search(threadsSeen, thread) != NULL) {
+        return 1;
+    }
+    stSet_insert(threadsSeen, thread);
+    bool attached = stSet_search(attachedThreads, thread) != NULL;
+    stList *stack = stList_construct();
+    stList_append(stack, thread);
+    while (!attached && stList_length(stack) > 0) {
+        stPinchSegment *segment = stPinchThread_getFirst(stList_pop(stack));
+        while (!attached && segment != NULL) {
+            stPinchBlock *block = stPinchSegment_getBlock(segment);
+            if (block != NULL) {
+                stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(block);
+                stPinchSegment *segment2;
+                while (!attached && (segment2 = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+                    stPinchThread *thread2 = stPinchSegment_getThread(segment2);
+                    if (stSet_search(threadsSeen, thread2) == NULL) {
+                        stSet_insert(threadsSeen, thread2);
+                        stList_append(stack, thread2);
+                        attached = stSet_search(attachedThreads, thread2) != NULL;
+                    }
+                }
+            }
+            segment = stPinchSegment_get3Prime(segment);
+        }
+    }
+    stList_destruct(stack);
+    return attached;
+}
+
+void stCaf_meltInRounds(Flower *flower, stPinchThreadSet *threadSet, int64_t *minimumChainLengths, int64_t roundNumber) {
+    /*
+     * Destroying the blocks of a chain merges the nodes of its cycle in the cactus graph into one node, which leaves
+     * every other chain, and so its length, as it was. The chains are therefore found once and then melted in order
+     * of length as the minimum length increases, rather than rebuilding the cactus graph every round. The exception is
+     * when destroying blocks splits off a thread component with no thread attached to the dead end component, which a
+     * rebuild would attach, changing the chains; the threads of the destroyed blocks are checked for this and the
+     * cactus graph rebuilt if it happens.
+     */
+    int64_t round = 0;
+    while (round < roundNumber) {
+        stCactusNode *startCactusNode;
+        stList *deadEndComponent;
+        stCactusGraph *cactusGraph = stCaf_getCactusGraphForThreadSet(flower, threadSet, &startCactusNode, &deadEndComponent, 0, INT64_MAX,
+                0.0, 0, INT64_MAX);
+        stList *chains = getChainsLessThanGivenLength(cactusGraph, minimumChainLengths[roundNumber - 1]);
+        stSet *attachedThreads = getThreadsAttachedToDeadEndComponent(threadSet, deadEndComponent);
+        stCactusGraph_destruct(cactusGraph);
+
+        int64_t chainIndex = 0;
+        bool rebuild = 0;
+        while (round < roundNumber && !rebuild) {
+            int64_t minimumChainLength = minimumChainLengths[round++];
+            assert(minimumChainLength > 1);
+            assert(round == 1 || minimumChainLengths[round - 2] < minimumChainLength);
+            stList *blocksToDelete = stList_construct3(0, (void(*)(void *)) stPinchBlock_destruct);
+            stSet *threadsTouched = stSet_construct();
+            while (chainIndex < stList_length(chains) && ((MeltingChain *) stList_get(chains, chainIndex))->length < minimumChainLength) {
+                MeltingChain *chain = stList_get(chains, chainIndex++);
+                for (int64_t i = 0; i < stList_length(chain->blocks); i++) {
+                    stPinchBlock *block = stList_get(chain->blocks, i);
+                    stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(block);
+                    stPinchSegment *segment;
+                    while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+                        stSet_insert(threadsTouched, stPinchSegment_getThread(segment));
+                    }
+                    stList_append(blocksToDelete, block);
+                }
+            }
+
+            st_logInfo("A melting round is destroying %" PRIi64 " blocks with an average degree "
+                   "of %lf from chains with length less than %" PRIi64 ". Total aligned bases"
+                   " lost: %" PRIu64 "\n",
+                   stList_length(blocksToDelete), stCaf_averageBlockDegree(blocksToDelete),
+                   minimumChainLength, stCaf_totalAlignedBases(blocksToDelete));
+            cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, stList_length(blocksToDelete));
+            stList_destruct(blocksToDelete); //This will destroy the blocks
+
+            //Check the threads of the destroyed blocks are still connected to attached threads
+            stSet *threadsSeen = stSet_construct();
+            stSetIterator *threadIt = stSet_getIterator(threadsTouched);
+            stPinchThread *thread;
+            while ((thread = stSet_getNext(threadIt)) != NULL) {
+                if (!threadComponentIsAttached(thread, attachedThreads, threadsSeen)) {
+                    st_logInfo("Melting split off an unattached thread component, rebuilding the cactus graph\n");
+                    rebuild = 1;
+                    break;
+                }
+            }
+            stSet_destructIterator(threadIt);
+            stSet_destruct(threadsSeen);
+            stSet_destruct(threadsTouched);
+        }
+        stList_destruct(chains);
+        stSet_destruct(attachedThreads);
+    }
+    //Now heal up the trivial boundaries
+    stCaf_joinTrivialBoundaries(threadSet);
+}
+
 static bool isTelomere(stPinchEnd *end, stSet *deadEndComponent) {
     stPinchSegment *segment = stPinchBlock_getFirst(end->block);
     bool atEndOfThread = stPinchThread_getFirst(stPinchSegment_getThread(segment)) == segment || stPinchThread_getLast(stPinchSegment_getThread(segment)) == segment;
@@ -499,6 +718,7 @@ void stCaf_meltRecoverableChains(Flower *flower, stPinchThreadSet *threadSet, bo
         st_logInfo("Destroying %" PRIi64 " recoverable blocks\n", numRecoverableBlocks);
         st_logInfo("The blocks covered %" PRIi64 " columns for a total of %" PRIi64 " aligned bases\n", numColumns(blocksToDelete), totalAlignedBases(blocksToDelete));
         stList_destruct(recoverableChains);
+        cactusMetrics_addToCounter(CACTUS_COUNTER_BLOCKS_DESTROYED, numRecoverableBlocks);
         stList_destruct(blocksToDelete);
 
         stCactusGraph_destruct(cactusGraph);
@@ -6,10 +6,14 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sonLib.h"
 #include "stPinchGraphs.h"
 #include "stPinchIterator.h"
-#include "paf.h"
 #include "cactus.h"
 
 stPinch *stPinchIterator_getNext(stPinchIterator *pinchIterator, stPinch *pinchToFillOut) {
@@ -29,6 +33,10 @@ stPinch *stPinchIterator_getNext(stPinchIterator *pinchIterator, stPinch *pinchT
     return pinch;
 }
 
+int64_t stPinchIterator_getScore(stPinchIterator *pinchIterator) {
+    return pinchIterator->getScore != NULL ? pinchIterator->getScore(pinchIterator->alignmentArg) : 0;
+}
+
 void stPinchIterator_reset(stPinchIterator *pinchIterator) {
     pinchIterator->alignmentArg = pinchIterator->startAlignmentStack(pinchIterator->alignmentArg);
 }
@@ -38,102 +46,320 @@ void stPinchIterator_destruct(stPinchIterator *pinchIterator) {
     free(pinchIterator);
 }
 
-typedef struct _pairwiseAlignmentToPinch {
-    void *alignmentArg;
-    Paf *(*getPairwiseAlignment)(void *);
-    Paf *paf;
+/*
+ * Iterator over the pinches of a memory-mapped PAF file.
+ *
+ * The records are parsed straight from the mapped bytes, one cigar operation at a time, so no memory is
+ * allocated per record, and resetting the iterator, which happens for every round of annealing, just
+ * returns to the start of the mapping.
+ */
+
+typedef struct _mappedPafToPinch {
+    const char *bytes; // The mapped file, NULL if the file is empty
+    int64_t length;
+    const char *line; // The start of the next line to parse
+    const char *cigar; // The next cigar operation of the current record, NULL if there is no current record
+    const char *cigarEnd;
     int64_t xCoordinate, yCoordinate, xName, yName;
-    Cigar *op;
-    bool freeAlignments;
-} PairwiseAlignmentToPinch;
+    int64_t queryStart, queryEnd, targetEnd;
+    bool sameStrand;
+    int64_t score;
+} MappedPafToPinch;
 
-static PairwiseAlignmentToPinch *pairwiseAlignmentToPinch_construct(void *alignmentArg,
-        Paf *(*getPairwiseAlignment)(void *), bool freeAlignments) {
-    PairwiseAlignmentToPinch *pairwiseAlignmentToPinch = st_calloc(1, sizeof(PairwiseAlignmentToPinch));
-    pairwiseAlignmentToPinch->alignmentArg = alignmentArg;
-    pairwiseAlignmentToPinch->getPairwiseAlignment = getPairwiseAlignment;
-    pairwiseAlignmentToPinch->freeAlignments = freeAlignments;
-    return pairwiseAlignmentToPinch;
+static int64_t mappedPaf_parseInt(const char **p, const char *end) {
+    const char *q = *p;
+    bool negative = q < end && *q == '-';
+    if (negative) {
+        q++;
+    }
+    if (q == end || *q < '0' || *q > '9') {
+        st_errAbort("Expected an integer in PAF record");
+    }
+    int64_t i = 0;
+    while (q < end && *q >= '0' && *q <= '9') {
+        i = i * 10 + (*q++ - '0');
+    }
+    *p = q;
+    return negative ? -i : i;
 }
 
-static stPinch *pairwiseAlignmentToPinch_getNext(PairwiseAlignmentToPinch *pA, stPinch *pinchToFillOut) {
-    while (1) {
-        if (pA->paf == NULL) {
-            pA->paf = pA->getPairwiseAlignment(pA->alignmentArg);
-            if (pA->paf == NULL) {
-                return NULL;
+/*
+ * Moves p past the next tab, aborting if there is none before end.
+ */
+static void mappedPaf_nextField(const char **p, const char *end) {
+    const char *q = memchr(*p, '\t', end - *p);
+    if (q == NULL) {
+        st_errAbort("Too few fields in PAF record");
+    }
+    *p = q + 1;
+}
+
+/*
+ * Parses the next record, returning false if there are no more.
+ */
+static bool mappedPafToPinch_parseRecord(MappedPafToPinch *pA) {
+    const char *fileEnd = pA->bytes + pA->length;
+    while (pA->line < fileEnd) {
+        const char *p = pA->line;
+        const char *end = memchr(p, '\n', fileEnd - p);
+        end = end == NULL ? fileEnd : end;
+        pA->line = end + 1;
+        if (end == p) { // Skip empty lines
+            continue;
+        }
+        pA->xName = mappedPaf_parseInt(&p, end); // Query name
+        mappedPaf_nextField(&p, end);
+        mappedPaf_nextField(&p, end); // Query length
+        pA->queryStart = mappedPaf_parseInt(&p, end);
+        mappedPaf_nextField(&p, end);
+        pA->queryEnd = mappedPaf_parseInt(&p, end);
+        mappedPaf_nextField(&p, end);
+        pA->sameStrand = *p == '+';
+        mappedPaf_nextField(&p, end);
+        pA->yName = mappedPaf_parseInt(&p, end); // Target name
+        mappedPaf_nextField(&p, end);
+        mappedPaf_nextField(&p, end); // Target length
+        int64_t targetStart = mappedPaf_parseInt(&p, end);
+        mappedPaf_nextField(&p, end);
+        pA->targetEnd = mappedPaf_parseInt(&p, end);
+        // Find the cigar and score amongst the optional tags following the number of matches, number of bases and mapq
+        pA->cigar = NULL;
+        pA->score = 0;
+        for (int64_t i = 0; i < 3; i++) {
+            mappedPaf_nextField(&p, end);
+        }
+        while ((p = memchr(p, '\t', end - p)) != NULL) {
+            p++;
+            if (end - p >= 5 && memcmp(p, "cg:Z:", 5) == 0) {
+                pA->cigar = p + 5;
+                pA->cigarEnd = memchr(pA->cigar, '\t', end - pA->cigar);
+                pA->cigarEnd = pA->cigarEnd == NULL ? end : pA->cigarEnd;
+                p = pA->cigarEnd;
+            } else if (end - p >= 5 && memcmp(p, "AS:i:", 5) == 0) {
+                p += 5;
+                pA->score = mappedPaf_parseInt(&p, end);
             }
-            pA->op = pA->paf->cigar;
-            pA->xCoordinate = pA->paf->same_strand ? pA->paf->query_start : pA->paf->query_end;
-            pA->yCoordinate = pA->paf->target_start;
-            pA->xName = cactusMisc_stringToName(pA->paf->query_name);
-            pA->yName = cactusMisc_stringToName(pA->paf->target_name);
         }
-        while (pA->op != NULL) {
-            assert(pA->op->length >= 1);
-            if (pA->op->op == match || pA->op->op == sequence_match || pA->op->op == sequence_mismatch) { //deal with the possibility of a zero length match (strange, but not illegal)
+        if (pA->cigar == NULL) { // An alignment without a cigar has no pinches
+            continue;
+        }
+        pA->xCoordinate = pA->sameStrand ? pA->queryStart : pA->queryEnd;
+        pA->yCoordinate = targetStart;
+        return 1;
+    }
+    return 0;
+}
+
+static bool mappedPaf_isMatch(char op) {
+    return op == 'M' || op == '=' || op == 'X';
+}
+
+/*
+ * Parses the cigar operation at p, returning the position following it.
+ */
+static const char *mappedPaf_parseCigarOp(const char *p, const char *end, int64_t *length, char *op) {
+    *length = mappedPaf_parseInt(&p, end);
+    if (p == end) {
+        st_errAbort("Cigar operation has no type in PAF record");
+    }
+    *op = *p;
+    return p + 1;
+}
+
+static stPinch *mappedPafToPinch_getNext(MappedPafToPinch *pA, stPinch *pinchToFillOut) {
+    while (1) {
+        if (pA->cigar == NULL && !mappedPafToPinch_parseRecord(pA)) {
+            return NULL;
+        }
+        while (pA->cigar < pA->cigarEnd) {
+            int64_t length;
+            char op;
+            pA->cigar = mappedPaf_parseCigarOp(pA->cigar, pA->cigarEnd, &length, &op);
+            assert(length >= 1);
+            if (mappedPaf_isMatch(op)) {
                 // Make maximal length (in case run of sequence matches and mismatches)
-                int64_t i=0; // Represents the length of the previous matches in the sequence
-                while(pA->op->next != NULL && (pA->op->next->op == match ||
-                                               pA->op->next->op == sequence_match ||
-                                               pA->op->next->op == sequence_mismatch)) {
-                    i+=pA->op->length;
-                    pA->op = pA->op->next;
+                while (pA->cigar < pA->cigarEnd) {
+                    int64_t nextLength;
+                    char nextOp;
+                    const char *next = mappedPaf_parseCigarOp(pA->cigar, pA->cigarEnd, &nextLength, &nextOp);
+                    if (!mappedPaf_isMatch(nextOp)) {
+                        break;
+                    }
+                    length += nextLength;
+                    pA->cigar = next;
                 }
-                if (pA->paf->same_strand) {
-                    stPinch_fillOut(pinchToFillOut, pA->xName, pA->yName, pA->xCoordinate, pA->yCoordinate, i+pA->op->length,
-                                    1);
-                    pA->xCoordinate += i+pA->op->length;
+                if (pA->sameStrand) {
+                    stPinch_fillOut(pinchToFillOut, pA->xName, pA->yName, pA->xCoordinate, pA->yCoordinate, length, 1);
+                    pA->xCoordinate += length;
                 } else {
-                    pA->xCoordinate -= i+pA->op->length;
-                    stPinch_fillOut(pinchToFillOut, pA->xName, pA->yName, pA->xCoordinate, pA->yCoordinate, i+pA->op->length,
-                                    0);
+                    pA->xCoordinate -= length;
+                    stPinch_fillOut(pinchToFillOut, pA->xName, pA->yName, pA->xCoordinate, pA->yCoordinate, length, 0);
                 }
-                pA->yCoordinate += i+pA->op->length;
-                pA->op = pA->op->next;
+                pA->yCoordinate += length;
                 return pinchToFillOut;
             }
-            if (pA->op->op != query_delete) {
-                pA->xCoordinate += pA->paf->same_strand ? pA->op->length : -pA->op->length;
+            if (op != 'D') {
+                pA->xCoordinate += pA->sameStrand ? length : -length;
             }
-            if (pA->op->op != query_insert) {
-                pA->yCoordinate += pA->op->length;
+            if (op != 'I') {
+                pA->yCoordinate += length;
             }
-            pA->op = pA->op->next;
-        }
-        if (pA->paf->same_strand) {
-            assert(pA->xCoordinate == pA->paf->query_end);
-        }
-        else {
-            assert(pA->xCoordinate == pA->paf->query_start);
-        }
-        assert(pA->yCoordinate == pA->paf->target_end);
-        if (pA->freeAlignments) {
-            paf_destruct(pA->paf);
         }
-        pA->paf = NULL;
+        assert(pA->xCoordinate == (pA->sameStrand ? pA->queryEnd : pA->queryStart));
+        assert(pA->yCoordinate == pA->targetEnd);
+        pA->cigar = NULL;
     }
-    return NULL;
 }
 
-static PairwiseAlignmentToPinch *pairwiseAlignmentToPinch_resetForFile(PairwiseAlignmentToPinch *pA) {
-    fseek(pA->alignmentArg, 0, SEEK_SET);
-    pA->paf = NULL;
+static int64_t mappedPafToPinch_getScore(MappedPafToPinch *pA) {
+    return pA->score;
+}
+
+static MappedPafToPinch *mappedPafToPinch_reset(MappedPafToPinch *pA) {
+    pA->line = pA->bytes;
+    pA->cigar = NULL;
     return pA;
 }
 
-static void pairwiseAlignmentToPinch_destructForFile(PairwiseAlignmentToPinch *pA) {
-    fclose(pA->alignmentArg);
+static MappedPafToPinch *mappedPafToPinch_construct(const char *bytes, int64_t length) {
+    MappedPafToPinch *pA = st_calloc(1, sizeof(MappedPafToPinch));
+    pA->bytes = bytes;
+    pA->length = length;
+    return mappedPafToPinch_reset(pA);
+}
+
+static void unmapFile(const char *bytes, int64_t length) {
+    if (bytes != NULL) {
+        munmap((void *)bytes, length);
+    }
+}
+
+static void mappedPafToPinch_destruct(MappedPafToPinch *pA) {
+    unmapFile(pA->bytes, pA->length);
     free(pA);
 }
 
+/*
+ * Iterator over the pinches of a memory-mapped binary or scored binary pinch file, see stPinch_writeBinary
+ * and stPinch_writeScoredBinary.
+ */
+
+typedef struct _binaryPinches {
+    const char *bytes;
+    int64_t length;
+    int64_t recordLength;
+    int64_t offset; // The offset of the next record
+    int64_t score; // The score of the last record, if the file is scored
+} BinaryPinches;
+
+static stPinch *binaryPinches_getNext(BinaryPinches *bP, stPinch *pinchToFillOut) {
+    if (bP->offset + bP->recordLength > bP->length) {
+        if (bP->offset != bP->length) {
+            st_errAbort("Truncated record in binary pinch file");
+        }
+        return NULL;
+    }
+    int64_t record[ST_PINCH_SCORED_BINARY_RECORD_LENGTH / sizeof(int64_t)];
+    memcpy(record, bP->bytes + bP->offset, bP->recordLength); // The mapping is not necessarily aligned
+    bP->offset += bP->recordLength;
+    stPinch_fillOut(pinchToFillOut, record[0], record[1], record[2], record[3], record[4], record[5]);
+    bP->score = bP->recordLength == ST_PINCH_SCORED_BINARY_RECORD_LENGTH ? record[6] : 0;
+    return pinchToFillOut;
+}
+
+static int64_t binaryPinches_getScore(BinaryPinches *bP) {
+    return bP->score;
+}
+
+static BinaryPinches *binaryPinches_reset(BinaryPinches *bP) {
+    bP->offset = ST_PINCH_BINARY_MAGIC_LENGTH;
+    return bP;
+}
+
+static void binaryPinches_destruct(BinaryPinches *bP) {
+    unmapFile(bP->bytes, bP->length);
+    free(bP);
+}
+
+void stPinch_writeBinaryHeader(FILE *fileHandle) {
+    if (fwrite(ST_PINCH_BINARY_MAGIC, sizeof(char), ST_PINCH_BINARY_MAGIC_LENGTH, fileHandle) != ST_PINCH_BINARY_MAGIC_LENGTH) {
+        st_errAbort("Failed to write binary pinch file header");
+    }
+}
+
+void stPinch_writeBinary(stPinch *pinch, FILE *fileHandle) {
+    int64_t record[ST_PINCH_BINARY_RECORD_LENGTH / sizeof(int64_t)] = { pinch->name1, pinch->name2, pinch->start1,
+                                                                       pinch->start2, pinch->length, pinch->strand };
+    if (fwrite(record, sizeof(char), ST_PINCH_BINARY_RECORD_LENGTH, fileHandle) != ST_PINCH_BINARY_RECORD_LENGTH) {
+        st_errAbort("Failed to write binary pinch record");
+    }
+}
+
+void stPinch_writeScoredBinaryHeader(FILE *fileHandle) {
+    if (fwrite(ST_PINCH_SCORED_BINARY_MAGIC, sizeof(char), ST_PINCH_BINARY_MAGIC_LENGTH, fileHandle) != ST_PINCH_BINARY_MAGIC_LENGTH) {
+        st_errAbort("Failed to write scored binary pinch file header");
+    }
+}
+
+void stPinch_writeScoredBinary(stPinch *pinch, int64_t score, FILE *fileHandle) {
+    int64_t record[ST_PINCH_SCORED_BINARY_RECORD_LENGTH / sizeof(int64_t)] = { pinch->name1, pinch->name2, pinch->start1,
+                                                                              pinch->start2, pinch->length, pinch->strand,
+                                                                              score };
+    if (fwrite(record, sizeof(char), ST_PINCH_SCORED_BINARY_RECORD_LENGTH, fileHandle) != ST_PINCH_SCORED_BINARY_RECORD_LENGTH) {
+        st_errAbort("Failed to write scored binary pinch record");
+    }
+}
+
+/*
+ * Maps the file, returning NULL if it is empty.
+ */
+static const char *mapFile(const char *file, int64_t *length) {
+    int fileDescriptor = open(file, O_RDONLY);
+    if (fileDescriptor < 0) {
+        st_errnoAbort("Failed to open alignment file %s", file);
+    }
+    struct stat fileStats;
+    if (fstat(fileDescriptor, &fileStats) != 0) {
+        st_errnoAbort("Failed to stat alignment file %s", file);
+    }
+    *length = fileStats.st_size;
+    void *mapping = NULL;
+    if (*length > 0) { // An empty mapping is an error
+        mapping = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (mapping == MAP_FAILED) {
+            st_errnoAbort("Failed to memory-map alignment file %s", file);
+        }
+        madvise(mapping, *length, MADV_SEQUENTIAL); // Only a hint, so failure is harmless
+    }
+    close(fileDescriptor); // The mapping keeps the file open
+    return mapping;
+}
+
 stPinchIterator *stPinchIterator_constructFromFile(const char *alignmentFile) {
     stPinchIterator *pinchIterator = st_calloc(1, sizeof(stPinchIterator));
-    pinchIterator->alignmentArg = pairwiseAlignmentToPinch_construct(fopen(alignmentFile, "r"),
-            (Paf *(*)(void *)) paf_read2, 1);
-    pinchIterator->getNextAlignment = (stPinch *(*)(void *, stPinch *)) pairwiseAlignmentToPinch_getNext;
-    pinchIterator->destructAlignmentArg = (void(*)(void *)) pairwiseAlignmentToPinch_destructForFile;
-    pinchIterator->startAlignmentStack = (void *(*)(void *)) pairwiseAlignmentToPinch_resetForFile;
+    int64_t length;
+    const char *bytes = mapFile(alignmentFile, &length);
+    bool binary = length >= ST_PINCH_BINARY_MAGIC_LENGTH &&
+                  memcmp(bytes, ST_PINCH_BINARY_MAGIC, ST_PINCH_BINARY_MAGIC_LENGTH) == 0;
+    bool scoredBinary = length >= ST_PINCH_BINARY_MAGIC_LENGTH &&
+                        memcmp(bytes, ST_PINCH_SCORED_BINARY_MAGIC, ST_PINCH_BINARY_MAGIC_LENGTH) == 0;
+    if (binary || scoredBinary) {
+        BinaryPinches *bP = st_calloc(1, sizeof(BinaryPinches));
+        bP->bytes = bytes;
+        bP->length = length;
+        bP->recordLength = scoredBinary ? ST_PINCH_SCORED_BINARY_RECORD_LENGTH : ST_PINCH_BINARY_RECORD_LENGTH;
+        pinchIterator->alignmentArg = binaryPinches_reset(bP);
+        pinchIterator->getNextAlignment = (stPinch *(*)(void *, stPinch *)) binaryPinches_getNext;
+        pinchIterator->destructAlignmentArg = (void(*)(void *)) binaryPinches_destruct;
+        pinchIterator->startAlignmentStack = (void *(*)(void *)) binaryPinches_reset;
+        pinchIterator->getScore = (int64_t (*)(void *)) binaryPinches_getScore;
+    } else {
+        pinchIterator->alignmentArg = mappedPafToPinch_construct(bytes, length);
+        pinchIterator->getNextAlignment = (stPinch *(*)(void *, stPinch *)) mappedPafToPinch_getNext;
+        pinchIterator->destructAlignmentArg = (void(*)(void *)) mappedPafToPinch_destruct;
+        pinchIterator->startAlignmentStack = (void *(*)(void *)) mappedPafToPinch_reset;
+        pinchIterator->getScore = (int64_t (*)(void *)) mappedPafToPinch_getScore;
+    }
     return pinchIterator;
 }
 
@@ -0,0 +1,364 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "cactus.h"
+#include "sonLib.h"
+#include "stCaf.h"
+
+/*
+ * The thread index maps the name of each thread of the pinch graph (the name of its 5' cap) to the
+ * event, outgroup status and sequence of the thread. Pinch threads carry no ordinal of their own, so
+ * the index is an open addressed table over the names, held in one contiguous array and kept at most
+ * half full, so a lookup is a multiply and usually a single probe.
+ */
+
+typedef struct _threadIndexEntry {
+    Name name; // NULL_NAME if the slot is empty
+    stCafThreadInfo info;
+} ThreadIndexEntry;
+
+typedef struct _threadIndex {
+    Flower *flower;
+    Name flowerName; // As a flower may be allocated at the address of a previously destructed one
+    ThreadIndexEntry *entries;
+    int64_t bits; // The table has 2^bits entries
+    int64_t entryNumber;
+    Event **events; // The events, by ordinal
+    int64_t eventNumber;
+    stHash *eventOrdinals;
+    stHash *sequenceOrdinals;
+    int64_t *ingroupLeafEvents; // The ordinals of the ingroup leaf events, in event tree order
+    int64_t ingroupLeafEventNumber;
+    int64_t outgroupEventNumber;
+    uint64_t *ingroupEvents; // The set of the ordinals of the ingroup events
+    stHash *blockSummaries; // Block to the summary of its segments, see stCaf_getBlockSummary
+    bool trackPinches;
+    stPinchSegment *pinchedSegment; // The segment of the last pinch allowed, if tracking pinches
+    stCafBlockSummary *pinchedSummary; // The summary of the block the pinch makes
+} ThreadIndex;
+
+/*
+ * The index of the flower the thread is working on. Flowers are filled out by different threads
+ * concurrently (see bar), each of which calls the filters only on its own flower, so each thread
+ * keeps its own index.
+ */
+static __thread ThreadIndex *threadIndex = NULL;
+
+static inline int64_t getSlot(Name name, int64_t bits) {
+    return (int64_t)(((uint64_t)name * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static void addOrdinal(stHash *ordinals, void *object) {
+    int64_t *ordinal = st_malloc(sizeof(int64_t));
+    *ordinal = stHash_size(ordinals);
+    stHash_insert(ordinals, object, ordinal);
+}
+
+static int64_t getOrdinal(stHash *ordinals, void *object) {
+    int64_t *ordinal = stHash_search(ordinals, object);
+    return ordinal != NULL ? *ordinal : -1;
+}
+
+static void threadIndex_destruct(ThreadIndex *index) {
+    free(index->entries);
+    free(index->events);
+    stHash_destruct(index->eventOrdinals);
+    stHash_destruct(index->sequenceOrdinals);
+    free(index->ingroupLeafEvents);
+    free(index->ingroupEvents);
+    stHash_destruct(index->blockSummaries);
+    free(index->pinchedSummary);
+    free(index);
+}
+
+/*
+ * Constructs an index with no threads. The events are those of the event tree and the sequences those
+ * of the flower.
+ */
+static ThreadIndex *threadIndex_construct(Flower *flower) {
+    ThreadIndex *index = st_calloc(1, sizeof(ThreadIndex));
+    index->flower = flower;
+    index->flowerName = flower_getName(flower);
+
+    // Number the events, in event tree order
+    index->eventOrdinals = stHash_construct2(NULL, free);
+    EventTree *eventTree = flower_getEventTree(flower);
+    index->events = st_malloc(sizeof(Event *) * eventTree_getEventNumber(eventTree));
+    index->ingroupLeafEvents = st_malloc(sizeof(int64_t) * eventTree_getEventNumber(eventTree));
+    index->ingroupEvents = st_calloc((eventTree_getEventNumber(eventTree) + 63) / 64, sizeof(uint64_t));
+    EventTree_Iterator *eventIt = eventTree_getIterator(eventTree);
+    Event *event;
+    while ((event = eventTree_getNext(eventIt)) != NULL) {
+        if (event_isOutgroup(event)) {
+            index->outgroupEventNumber++;
+        } else {
+            index->ingroupEvents[index->eventNumber >> 6] |= ((uint64_t)1) << (index->eventNumber & 63);
+            if (event_getChildNumber(event) == 0) {
+                index->ingroupLeafEvents[index->ingroupLeafEventNumber++] = index->eventNumber;
+            }
+        }
+        addOrdinal(index->eventOrdinals, event);
+        index->events[index->eventNumber++] = event;
+    }
+    eventTree_destructIterator(eventIt);
+
+    // Number the sequences
+    index->sequenceOrdinals = stHash_construct2(NULL, free);
+    Flower_SequenceIterator *sequenceIt = flower_getSequenceIterator(flower);
+    Sequence *sequence;
+    while ((sequence = flower_getNextSequence(sequenceIt)) != NULL) {
+        addOrdinal(index->sequenceOrdinals, sequence);
+    }
+    flower_destructSequenceIterator(sequenceIt);
+
+    index->blockSummaries = stHash_construct2(NULL, free);
+
+    // Size the table for the threads, of which there is one for every two caps
+    index->bits = 4;
+    while ((((int64_t)1) << index->bits) < flower_getCapNumber(flower)) {
+        index->bits++;
+    }
+    index->entries = st_malloc(sizeof(ThreadIndexEntry) * (((int64_t)1) << index->bits));
+    for (int64_t i = 0; i < (((int64_t)1) << index->bits); i++) {
+        index->entries[i].name = NULL_NAME;
+    }
+    return index;
+}
+
+static ThreadIndexEntry *insert(ThreadIndex *index, Name name, stCafThreadInfo *info) {
+    int64_t mask = (((int64_t)1) << index->bits) - 1;
+    int64_t i = getSlot(name, index->bits);
+    while (index->entries[i].name != NULL_NAME) {
+        assert(index->entries[i].name != name);
+        i = (i + 1) & mask;
+    }
+    index->entries[i].name = name;
+    index->entries[i].info = *info;
+    index->entryNumber++;
+    return &index->entries[i];
+}
+
+/*
+ * Adds the thread with the given name to the index, doubling the table if it would be more than half full.
+ */
+static const stCafThreadInfo *addThread(ThreadIndex *index, Name name) {
+    Cap *cap = flower_getCap(index->flower, name);
+    if (cap == NULL) {
+        st_errAbort("The pinch thread %" PRIi64 " has no cap in the flower %" PRIi64, name, index->flowerName);
+    }
+    stCafThreadInfo info;
+    Event *event = cap_getEvent(cap);
+    info.event = getOrdinal(index->eventOrdinals, event);
+    if (info.event == -1) {
+        st_errAbort("The event of the pinch thread %" PRIi64 " is not in the event tree", name);
+    }
+    info.outgroup = event_isOutgroup(event);
+    info.sequence = cap_getSequence(cap) != NULL ? getOrdinal(index->sequenceOrdinals, cap_getSequence(cap)) : -1;
+
+    if (2 * (index->entryNumber + 1) > (((int64_t)1) << index->bits)) {
+        ThreadIndexEntry *entries = index->entries;
+        int64_t size = ((int64_t)1) << index->bits;
+        index->bits++;
+        index->entryNumber = 0;
+        index->entries = st_malloc(sizeof(ThreadIndexEntry) * 2 * size);
+        for (int64_t i = 0; i < 2 * size; i++) {
+            index->entries[i].name = NULL_NAME;
+        }
+        for (int64_t i = 0; i < size; i++) {
+            if (entries[i].name != NULL_NAME) {
+                insert(index, entries[i].name, &entries[i].info);
+            }
+        }
+        free(entries);
+    }
+    return &insert(index, name, &info)->info;
+}
+
+void stCaf_buildThreadIndex(Flower *flower, stPinchThreadSet *threadSet) {
+    stCaf_destructThreadIndex();
+    threadIndex = threadIndex_construct(flower);
+    stPinchThreadSetIt threadIt = stPinchThreadSet_getIt(threadSet);
+    stPinchThread *thread;
+    while ((thread = stPinchThreadSetIt_getNext(&threadIt)) != NULL) {
+        addThread(threadIndex, stPinchThread_getName(thread));
+    }
+}
+
+void stCaf_destructThreadIndex(void) {
+    if (threadIndex != NULL) {
+        threadIndex_destruct(threadIndex);
+        threadIndex = NULL;
+    }
+}
+
+/*
+ * Gets the index of the calling thread, replacing it with an index with no threads if it is of another
+ * flower.
+ */
+static ThreadIndex *getThreadIndex(Flower *flower) {
+    if (threadIndex == NULL || threadIndex->flower != flower || threadIndex->flowerName != flower_getName(flower)) {
+        stCaf_destructThreadIndex();
+        threadIndex = threadIndex_construct(flower);
+    }
+    return threadIndex;
+}
+
+const stCafThreadInfo *stCaf_getThreadInfo(stPinchSegment *segment, Flower *flower) {
+    ThreadIndex *index = getThreadIndex(flower);
+    Name name = stPinchSegment_getName(segment);
+    int64_t mask = (((int64_t)1) << index->bits) - 1;
+    for (int64_t i = getSlot(name, index->bits); index->entries[i].name != NULL_NAME; i = (i + 1) & mask) {
+        if (index->entries[i].name == name) {
+            return &index->entries[i].info;
+        }
+    }
+    return addThread(index, name); // Not yet in the index
+}
+
+int64_t stCaf_getEventNumber(Flower *flower) {
+    return getThreadIndex(flower)->eventNumber;
+}
+
+int64_t stCaf_getSequenceNumber(Flower *flower) {
+    return stHash_size(getThreadIndex(flower)->sequenceOrdinals);
+}
+
+Event *stCaf_getEventByOrdinal(Flower *flower, int64_t event) {
+    ThreadIndex *index = getThreadIndex(flower);
+    assert(event >= 0 && event < index->eventNumber);
+    return index->events[event];
+}
+
+int64_t *stCaf_getIngroupLeafEvents(Flower *flower, int64_t *ingroupLeafEventNumber) {
+    ThreadIndex *index = getThreadIndex(flower);
+    *ingroupLeafEventNumber = index->ingroupLeafEventNumber;
+    return index->ingroupLeafEvents;
+}
+
+int64_t stCaf_getOutgroupEventNumber(Flower *flower) {
+    return getThreadIndex(flower)->outgroupEventNumber;
+}
+
+const uint64_t *stCaf_getIngroupEventSet(Flower *flower) {
+    return getThreadIndex(flower)->ingroupEvents;
+}
+
+/*
+ * Block summaries. A summary is cached for each block it is asked for, and is valid while the block is
+ * unmodified and has the degree it was computed at. The modified flag of a block is set by the pinch graph
+ * library when the block is created or merged with another, and is cleared here once the summary of the
+ * block is brought up to date. The summaries of the blocks merged by a tracked pinch are dropped as it is
+ * recorded, and all are dropped when tracking starts or stops, so none outlive their blocks for long, as
+ * those destructed by melting would otherwise.
+ */
+
+static stCafBlockSummary *blockSummary_construct(ThreadIndex *index) {
+    return st_calloc(1, sizeof(stCafBlockSummary) + sizeof(uint64_t) * ((index->eventNumber + 63) / 64));
+}
+
+static void blockSummary_add(stCafBlockSummary *summary, const stCafBlockSummary *summaryToAdd, int64_t words) {
+    for (int64_t i = 0; i < words; i++) {
+        summary->events[i] |= summaryToAdd->events[i];
+    }
+    summary->degree += summaryToAdd->degree;
+}
+
+static void blockSummary_addSegment(stCafBlockSummary *summary, const stCafThreadInfo *info) {
+    summary->events[info->event >> 6] |= ((uint64_t)1) << (info->event & 63);
+    summary->degree++;
+}
+
+static void removeBlockSummary(ThreadIndex *index, stPinchBlock *block) {
+    stCafBlockSummary *oldSummary = stHash_remove(index->blockSummaries, block);
+    if (oldSummary != NULL) {
+        free(oldSummary);
+    }
+}
+
+static void setBlockSummary(ThreadIndex *index, stPinchBlock *block, stCafBlockSummary *summary) {
+    removeBlockSummary(index, block);
+    stHash_insert(index->blockSummaries, block, summary);
+    stPinchBlock_setModifiedFlag(block, false);
+}
+
+/*
+ * The block of the last pinch allowed is the merge of the blocks (or segments) pinched, so its summary
+ * is the union of theirs. As the pinch is made after the filter returns, this is done on the next call.
+ * If the block has since been split, the part holding the segment has the same segments' threads, so
+ * the same summary.
+ */
+static void resolvePinch(ThreadIndex *index) {
+    if (index->pinchedSegment == NULL) {
+        return;
+    }
+    stPinchBlock *block = stPinchSegment_getBlock(index->pinchedSegment);
+    if (block != NULL && stPinchBlock_getDegree(block) == index->pinchedSummary->degree) {
+        setBlockSummary(index, block, index->pinchedSummary);
+    } else { // The pinch was not made as expected, so the summary is recomputed when next needed
+        free(index->pinchedSummary);
+    }
+    index->pinchedSegment = NULL;
+    index->pinchedSummary = NULL;
+}
+
+const stCafBlockSummary *stCaf_getBlockSummary(stPinchBlock *block, Flower *flower) {
+    ThreadIndex *index = getThreadIndex(flower);
+    resolvePinch(index);
+    stCafBlockSummary *summary = stHash_search(index->blockSummaries, block);
+    if (summary == NULL || stPinchBlock_getModifiedFlag(block) || summary->degree != stPinchBlock_getDegree(block)) {
+        summary = blockSummary_construct(index);
+        stPinchBlockIt it = stPinchBlock_getSegmentIterator(block);
+        stPinchSegment *segment;
+        while ((segment = stPinchBlockIt_getNext(&it)) != NULL) {
+            blockSummary_addSegment(summary, stCaf_getThreadInfo(segment, flower));
+        }
+        setBlockSummary(index, block, summary);
+    }
+    return summary;
+}
+
+void stCaf_trackPinches(Flower *flower, bool trackPinches) {
+    ThreadIndex *index = getThreadIndex(flower);
+    free(index->pinchedSummary);
+    index->pinchedSegment = NULL;
+    index->pinchedSummary = NULL;
+    stHash_destruct(index->blockSummaries);
+    index->blockSummaries = stHash_construct2(NULL, free);
+    index->trackPinches = trackPinches;
+}
+
+void stCaf_recordPinch(stPinchSegment *segment1, stPinchSegment *segment2, Flower *flower) {
+    ThreadIndex *index = getThreadIndex(flower);
+    if (!index->trackPinches) {
+        return;
+    }
+    resolvePinch(index);
+    stPinchBlock *block1 = stPinchSegment_getBlock(segment1);
+    stPinchBlock *block2 = stPinchSegment_getBlock(segment2);
+    if (block1 != NULL && block1 == block2) {
+        return; // Pinching a block with itself leaves its threads as they are
+    }
+    int64_t words = (index->eventNumber + 63) / 64;
+    stCafBlockSummary *summary = blockSummary_construct(index);
+    if (block1 != NULL) {
+        blockSummary_add(summary, stCaf_getBlockSummary(block1, flower), words);
+    } else {
+        blockSummary_addSegment(summary, stCaf_getThreadInfo(segment1, flower));
+    }
+    if (block2 != NULL) {
+        blockSummary_add(summary, stCaf_getBlockSummary(block2, flower), words);
+    } else {
+        blockSummary_addSegment(summary, stCaf_getThreadInfo(segment2, flower));
+    }
+    // The pinch merges the blocks, destructing all but one, so their summaries are dropped rather than left
+    // keyed by blocks that no longer exist, the summary of the merged block replacing them
+    if (block1 != NULL) {
+        removeBlockSummary(index, block1);
+    }
+    if (block2 != NULL) {
+        removeBlockSummary(index, block2);
+    }
+    index->pinchedSegment = segment1;
+    index->pinchedSummary = summary;
+}
@@ -39,13 +39,16 @@ stPinchThreadSet *stCaf_setup(Flower *flower);
 ///////////////////////////////////////////////////////////////////////////
 
 /*
- * Add the set of alignments, represented as pinches, to the graph.
+ * Add the set of alignments, represented as pinches, to the graph. If running with multiple OpenMP threads,
+ * and not already in a parallel region, the pinches of disjoint components of the threads are added
+ * concurrently, making the same graph as adding them serially.
  */
 void stCaf_anneal(stPinchThreadSet *threadSet, stPinchIterator *pinchIterator,
                   bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower);
 
 /*
  * Add the set of alignments, represented as pinches, to the graph, allowing alignments only between segments in the same component.
+ * Runs in parallel as stCaf_anneal.
  */
 void stCaf_annealBetweenAdjacencyComponents(stPinchThreadSet *threadSet, stPinchIterator *pinchIterator,
                                             bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *), Flower *flower);
@@ -55,6 +58,15 @@ void stCaf_annealBetweenAdjacencyComponents(stPinchThreadSet *threadSet, stPinch
  */
 void stCaf_joinTrivialBoundaries(stPinchThreadSet *threadSet);
 
+/*
+ * Sorts the pinches of an alignment file (any file stPinchIterator_constructFromFile reads) by the scores of
+ * their alignments, in descending order and otherwise keeping the order of the file, writing them to a binary
+ * pinch file. This is for the filters that pinch the best alignments first. Holds at most about maximumMemory
+ * bytes of pinches in memory at once, sorting runs of them in parallel on multiple OpenMP threads and merging
+ * the runs from temporary files.
+ */
+void stCaf_sortAlignmentsFileByScoreInDescendingOrder(const char *inputFile, const char *outputFile, int64_t maximumMemory);
+
 ///////////////////////////////////////////////////////////////////////////
 // Melting fuctions -- removing alignments from the pinch graph
 ///////////////////////////////////////////////////////////////////////////
@@ -69,12 +81,20 @@ typedef struct _filterArgs {
 } FilterArgs;
 
 /*
- * Removes homologies from the graph.
+ * Removes homologies from the graph. The block filter is evaluated for the blocks in parallel when running with
+ * multiple OpenMP threads, so it must only read the graph.
  */
 void stCaf_melt(Flower *flower, stPinchThreadSet *threadSet, bool blockFilterfn(stPinchBlock *, void *extraArg), void *extraArg,
                 int64_t blockEndTrim, int64_t minimumChainLength,
                 bool breakChainsAtReverseTandems, int64_t maximumMedianSpacingBetweenLinkedEnds);
 
+/*
+ * Equivalent to calling stCaf_melt with each of the given minimum chain lengths in turn (without trimming, filtering or
+ * breaking chains), but finds the chains once and melts them as the minimum length increases rather than rebuilding
+ * the cactus graph every round. The minimum chain lengths must be increasing and greater than one.
+ */
+void stCaf_meltInRounds(Flower *flower, stPinchThreadSet *threadSet, int64_t *minimumChainLengths, int64_t roundNumber);
+
 /*
  * Removes any recoverable chains (those expected to be picked up by
  * bar phase) from the graph. Only chains that are recoverable *and*
@@ -252,4 +272,102 @@ bool stCaf_treeCoverage(stPinchBlock *pinchBlock, Flower *flower);
  */
 Event *stCaf_getEvent(stPinchSegment *segment, Flower *flower);
 
+///////////////////////////////////////////////////////////////////////////
+// Thread index -- the events and sequences of the threads of the pinch graph
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * What the filters need to know about the thread of a segment. The event and sequence are ordinals,
+ * the events of the event tree being numbered in its order from 0 to stCaf_getEventNumber(flower) - 1,
+ * and the sequences of the flower from 0 to stCaf_getSequenceNumber(flower) - 1. The sequence is -1
+ * for a thread whose sequence was added to the flower after the index was built.
+ */
+typedef struct _stCafThreadInfo {
+    int32_t event;
+    int32_t sequence;
+    bool outgroup;
+} stCafThreadInfo;
+
+/*
+ * Builds the index of the threads of the pinch graph of the flower, replacing any index previously
+ * built by the calling thread. Called by stCaf_setup, and freed by stCaf_finish. Each thread keeps its
+ * own index. The functions below replace it with an empty index if called on a different flower, and
+ * add threads to it as they are looked up if not already present. So they are not leaked, the indexes
+ * the threads of a parallel region make this way must be freed, with stCaf_destructThreadIndex, before
+ * the region ends.
+ */
+void stCaf_buildThreadIndex(Flower *flower, stPinchThreadSet *threadSet);
+
+/*
+ * Frees the index built by the calling thread, if any.
+ */
+void stCaf_destructThreadIndex(void);
+
+/*
+ * Gets the entry of the index for the thread of the segment. The entry is valid until the index is rebuilt, or
+ * another thread is added to it, as a lookup of a thread not yet in the index does (as may stCaf_getBlockSummary).
+ */
+const stCafThreadInfo *stCaf_getThreadInfo(stPinchSegment *segment, Flower *flower);
+
+/*
+ * Gets the number of events in the index.
+ */
+int64_t stCaf_getEventNumber(Flower *flower);
+
+/*
+ * Gets the number of sequences in the index.
+ */
+int64_t stCaf_getSequenceNumber(Flower *flower);
+
+/*
+ * Gets the event with the given ordinal.
+ */
+Event *stCaf_getEventByOrdinal(Flower *flower, int64_t event);
+
+/*
+ * Gets the ordinals of the ingroup leaf events, in event tree order, setting ingroupLeafEventNumber to
+ * their number. The array is owned by the index.
+ */
+int64_t *stCaf_getIngroupLeafEvents(Flower *flower, int64_t *ingroupLeafEventNumber);
+
+/*
+ * Gets the number of outgroup events in the event tree.
+ */
+int64_t stCaf_getOutgroupEventNumber(Flower *flower);
+
+/*
+ * Gets the set of the ingroup events, as a bitset over their ordinals. The set is owned by the index.
+ */
+const uint64_t *stCaf_getIngroupEventSet(Flower *flower);
+
+/*
+ * The events of the segments of a block, as a bitset over their ordinals of stCaf_getEventNumber(flower)
+ * bits, and the degree of the block.
+ */
+typedef struct _stCafBlockSummary {
+    int64_t degree;
+    uint64_t events[];
+} stCafBlockSummary;
+
+/*
+ * Gets the summary of the block. Summaries are cached by the index, so this only walks the segments of the
+ * block if it has been modified since its summary was last asked for and the modification was not a pinch
+ * recorded with stCaf_recordPinch. Summaries of several blocks may be held at once, until the next pinch
+ * is recorded or tracking is started or stopped.
+ */
+const stCafBlockSummary *stCaf_getBlockSummary(stPinchBlock *block, Flower *flower);
+
+/*
+ * Starts or stops tracking the pinches recorded by the filters, dropping the cached summaries either way.
+ * While tracking, the segments passed to the filters must not be freed, so the annealing functions start
+ * tracking before making their pinches and stop before joining trivial boundaries.
+ */
+void stCaf_trackPinches(Flower *flower, bool trackPinches);
+
+/*
+ * Called by a filter that allows the pinch of the two segments. If tracking pinches, the summary of the
+ * block the pinch makes is then computed as the union of the summaries of the segments' blocks.
+ */
+void stCaf_recordPinch(stPinchSegment *segment1, stPinchSegment *segment2, Flower *flower);
+
 #endif /* STCAF_H_ */
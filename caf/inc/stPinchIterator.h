@@ -17,6 +17,7 @@ typedef struct _stPinchIterator {
     stPinch *(*getNextAlignment)(void *, stPinch *);
     void *(*startAlignmentStack)(void *);
     void (*destructAlignmentArg)(void *);
+    int64_t (*getScore)(void *);
 } stPinchIterator;
 
 /*
@@ -25,6 +26,12 @@ typedef struct _stPinchIterator {
  */
 stPinch *stPinchIterator_getNext(stPinchIterator *stPinchIterator, stPinch *pinchToFillOut);
 
+/*
+ * Gets the score of the alignment that the pinch last returned by the iterator came from, taken from the AS:i tag
+ * of a PAF record or the score field of a scored binary pinch record (see below). Returns 0 if there is no score.
+ */
+int64_t stPinchIterator_getScore(stPinchIterator *pinchIterator);
+
 /*
  * Reset the iterator, returning again to the beginning of the sequence.
  */
@@ -38,10 +45,48 @@ void stPinchIterator_destruct(
         stPinchIterator *stPinchIterator);
 
 /*
- * Get a pairwise alignment iterator from a file.
+ * Get a pairwise alignment iterator from a PAF file or a binary or scored binary pinch file (see below), which
+ * are told apart by the binary files' magic bytes. The file is memory-mapped and parsed as it is iterated over,
+ * so resetting the iterator is cheap.
  */
 stPinchIterator *stPinchIterator_constructFromFile(const char *alignmentFile);
 
+/*
+ * A binary pinch file is the magic bytes followed by a fixed width record for each pinch, holding
+ * name1, name2, start1, start2, length and strand, in that order, as native endian 64 bit integers. It is
+ * intended for temporary files that are read many times, as it needs no parsing.
+ */
+#define ST_PINCH_BINARY_MAGIC "stPinch\001"
+#define ST_PINCH_BINARY_MAGIC_LENGTH 8
+#define ST_PINCH_BINARY_RECORD_LENGTH 48
+
+/*
+ * Writes the magic bytes that start a binary pinch file.
+ */
+void stPinch_writeBinaryHeader(FILE *fileHandle);
+
+/*
+ * Writes the record of a pinch to a binary pinch file.
+ */
+void stPinch_writeBinary(stPinch *pinch, FILE *fileHandle);
+
+/*
+ * A scored binary pinch file is a binary pinch file with its own magic bytes and the score of the alignment
+ * each pinch came from as a seventh integer in the record, so the pinches can still be sorted by score.
+ */
+#define ST_PINCH_SCORED_BINARY_MAGIC "stPinch\002"
+#define ST_PINCH_SCORED_BINARY_RECORD_LENGTH 56
+
+/*
+ * Writes the magic bytes that start a scored binary pinch file.
+ */
+void stPinch_writeScoredBinaryHeader(FILE *fileHandle);
+
+/*
+ * Writes the record of a pinch and the score of its alignment to a scored binary pinch file.
+ */
+void stPinch_writeScoredBinary(stPinch *pinch, int64_t score, FILE *fileHandle);
+
 /*
  * Constructs iterator from aligned pairs.
  */
@@ -13,6 +13,7 @@ CuSuite* pinchIteratorTestSuite(void);
 CuSuite* recoverableChainsTestSuite(void);
 CuSuite* phylogenyTestSuite(void);
 CuSuite* filteringTestSuite(void);
+CuSuite* meltingTestSuite(void);
 
 int cactusCoreRunAllTests(void) {
     CuString *output = CuStringNew();
@@ -23,6 +24,7 @@ int cactusCoreRunAllTests(void) {
     CuSuiteAddSuite(suite, recoverableChainsTestSuite());
     CuSuiteAddSuite(suite, phylogenyTestSuite());
     CuSuiteAddSuite(suite, filteringTestSuite());
+    CuSuiteAddSuite(suite, meltingTestSuite());
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
@@ -8,6 +8,12 @@
 #include "sonLib.h"
 #include "stCaf.h"
 #include "stPinchGraphs.h"
+#include "pinchGraphsTestShared.h"
+
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 void stCaf_anneal2(stPinchThreadSet *threadSet, stPinch *(*pinchIterator)(void *), void *extraArg);
 
@@ -41,9 +47,144 @@ static void testAnnealingBetweenAdjacencyComponents(CuTest *testCase) {
     }
 }
 
+/*
+ * Writes a random number of pinches, fewer than maximumPinchNumber, to the file. The threads are grouped in order,
+ * groupSize at a time, and pinches are only made between the threads of a group. The i-th thread is named names[i]
+ * and has bases from firstPosition to firstPosition + lengths[i] - 1.
+ */
+static void writeRandomPinches(char *file, int64_t threadNumber, int64_t groupSize, Name *names, int64_t *lengths,
+                               int64_t firstPosition, int64_t maximumPinchNumber) {
+    FILE *fileHandle = fopen(file, "w");
+    stPinch_writeBinaryHeader(fileHandle);
+    int64_t pinchNumber = st_randomInt(0, maximumPinchNumber);
+    for (int64_t i = 0; i < pinchNumber; i++) {
+        int64_t i1 = st_randomInt(0, threadNumber);
+        int64_t group = i1 / groupSize;
+        int64_t i2 = st_randomInt(group * groupSize, (group + 1) * groupSize < threadNumber ? (group + 1) * groupSize : threadNumber);
+        int64_t length = st_randomInt(1, (lengths[i1] < lengths[i2] ? lengths[i1] : lengths[i2]) / 4 + 1);
+        stPinch pinch;
+        stPinch_fillOut(&pinch, names[i1], names[i2], firstPosition + st_randomInt(0, lengths[i1] - length + 1),
+                        firstPosition + st_randomInt(0, lengths[i2] - length + 1), length, st_random() > 0.5);
+        stPinch_writeBinary(&pinch, fileHandle);
+    }
+    fclose(fileHandle);
+}
+
+/*
+ * Checks stCaf_anneal, which anneals disjoint components of the threads in parallel when run with
+ * multiple threads, makes the same graph as annealing serially.
+ */
+static void testParallelAnnealing(CuTest *testCase) {
+    char *tempFile = "tempFileForParallelAnnealingTest.bin";
+#if defined(_OPENMP)
+    // Anneal with several threads, whatever the environment asks for, so the parallel path is taken
+    int previousThreadNumber = omp_get_max_threads();
+    omp_set_num_threads(4);
+#endif
+    for (int64_t test = 0; test < 20; test++) {
+        st_logInfo("Starting parallel annealing random test %" PRIi64 "\n", test);
+        // Groups of threads, with pinches only between the threads of a group, and some groups with none
+        int64_t threadNumber = st_randomInt(2, 60), groupSize = st_randomInt(1, 6);
+        int64_t *lengths = st_malloc(sizeof(int64_t) * threadNumber);
+        Name *names = st_malloc(sizeof(Name) * threadNumber);
+        stPinchThreadSet *threadSet1 = stPinchThreadSet_construct();
+        stPinchThreadSet *threadSet2 = stPinchThreadSet_construct();
+        for (int64_t i = 0; i < threadNumber; i++) {
+            lengths[i] = st_randomInt(10, 200);
+            names[i] = i;
+            stPinchThreadSet_addThread(threadSet1, i, 0, lengths[i]);
+            stPinchThreadSet_addThread(threadSet2, i, 0, lengths[i]);
+        }
+        writeRandomPinches(tempFile, threadNumber, groupSize, names, lengths, 0, 500);
+
+        stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(tempFile);
+        stPinchIterator_reset(pinchIterator);
+        stCaf_anneal2(threadSet1, (stPinch *(*)(void *)) stPinchIterator_getNext, pinchIterator);
+        stCaf_joinTrivialBoundaries(threadSet1);
+        stCaf_anneal(threadSet2, pinchIterator, NULL, NULL);
+        checkGraphsAreEqual(testCase, threadSet1, threadSet2);
+
+        stPinchIterator_destruct(pinchIterator);
+        stPinchThreadSet_destruct(threadSet1);
+        stPinchThreadSet_destruct(threadSet2);
+        free(lengths);
+        free(names);
+    }
+    stFile_rmtree(tempFile);
+#if defined(_OPENMP)
+    omp_set_num_threads(previousThreadNumber);
+#endif
+}
+
+/*
+ * Checks stCaf_anneal with a filter, and stCaf_annealBetweenAdjacencyComponents with and without one, make
+ * the same graphs when run with multiple threads, where they anneal the components in parallel, as with one.
+ */
+static void testParallelAnnealingWithFilters(CuTest *testCase) {
+    char *tempFile = "tempFileForParallelAnnealingWithFiltersTest.bin";
+#if defined(_OPENMP)
+    int previousThreadNumber = omp_get_max_threads();
+#endif
+    for (int64_t test = 0; test < 20; test++) {
+        st_logInfo("Starting parallel annealing with filters random test %" PRIi64 "\n", test);
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        int64_t threadNumber = st_randomInt(2, 60), groupSize = st_randomInt(1, 6);
+        int64_t *lengths = st_malloc(sizeof(int64_t) * threadNumber);
+        Name *names = st_malloc(sizeof(Name) * threadNumber);
+        Flower *flower = constructFlowerWithRandomThreads(cactusDisk, threadNumber, lengths, names);
+        // Annealing with a filter, then between adjacency components without and with one
+        for (int64_t mode = 0; mode < 3; mode++) {
+            bool (*filterFn)(stPinchSegment *, stPinchSegment *, Flower *) = mode == 1 ? NULL : stCaf_filterByRepeatSpecies;
+            stPinchThreadSet *threadSets[2];
+            stPinchIterator *pinchIterator;
+            for (int64_t i = 0; i < 2; i++) {
+                threadSets[i] = stCaf_constructEmptyPinchGraph(flower);
+            }
+            if (mode > 0) {
+                // Some pinches to join the threads into adjacency components
+                writeRandomPinches(tempFile, threadNumber, groupSize, names, lengths, 2, 50);
+                pinchIterator = stPinchIterator_constructFromFile(tempFile);
+                for (int64_t i = 0; i < 2; i++) {
+                    stPinchIterator_reset(pinchIterator);
+                    stCaf_anneal2(threadSets[i], (stPinch *(*)(void *)) stPinchIterator_getNext, pinchIterator);
+                    stCaf_joinTrivialBoundaries(threadSets[i]);
+                }
+                stPinchIterator_destruct(pinchIterator);
+            }
+            writeRandomPinches(tempFile, threadNumber, groupSize, names, lengths, 2, 500);
+            pinchIterator = stPinchIterator_constructFromFile(tempFile);
+            for (int64_t i = 0; i < 2; i++) {
+#if defined(_OPENMP)
+                omp_set_num_threads(i == 0 ? 1 : 4);
+#endif
+                if (mode == 0) {
+                    stCaf_anneal(threadSets[i], pinchIterator, filterFn, flower);
+                } else {
+                    stCaf_annealBetweenAdjacencyComponents(threadSets[i], pinchIterator, filterFn, flower);
+                }
+            }
+            checkGraphsAreEqual(testCase, threadSets[0], threadSets[1]);
+
+            stPinchIterator_destruct(pinchIterator);
+            stPinchThreadSet_destruct(threadSets[0]);
+            stPinchThreadSet_destruct(threadSets[1]);
+        }
+        stCaf_destructThreadIndex();
+        free(lengths);
+        free(names);
+        cactusDisk_destruct(cactusDisk);
+    }
+    stFile_rmtree(tempFile);
+#if defined(_OPENMP)
+    omp_set_num_threads(previousThreadNumber);
+#endif
+}
+
 CuSuite* annealingTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testAnnealing);
     SUITE_ADD_TEST(suite, testAnnealingBetweenAdjacencyComponents);
+    SUITE_ADD_TEST(suite, testParallelAnnealing);
+    SUITE_ADD_TEST(suite, testParallelAnnealingWithFilters);
     return suite;
 }
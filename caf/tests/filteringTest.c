@@ -348,11 +348,128 @@ static void testHGVMFiltering(CuTest *testCase) {
     }
 }
 
+static void testThreadIndex(CuTest *testCase) {
+    setup(testCase, true);
+    Name ingroup1Seq1 = addThreadToFlower(flower, ingroup1, 100);
+    Name ingroup1Seq2 = addThreadToFlower(flower, ingroup1, 100);
+    Name ingroup2Seq1 = addThreadToFlower(flower, ingroup2, 100);
+    Name outgroup1Seq1 = addThreadToFlower(flower, outgroup1, 100);
+
+    stPinchThreadSet *threadSet = stCaf_setup(flower);
+
+    stPinchThread *ingroup1Thread1 = stPinchThreadSet_getThread(threadSet, ingroup1Seq1);
+    stPinchThread *ingroup1Thread2 = stPinchThreadSet_getThread(threadSet, ingroup1Seq2);
+    stPinchThread *ingroup2Thread1 = stPinchThreadSet_getThread(threadSet, ingroup2Seq1);
+    stPinchThread *outgroup1Thread1 = stPinchThreadSet_getThread(threadSet, outgroup1Seq1);
+
+    // Each thread is indexed with the event and sequence of its cap
+    stPinchThreadSetIt threadIt = stPinchThreadSet_getIt(threadSet);
+    stPinchThread *thread;
+    while ((thread = stPinchThreadSetIt_getNext(&threadIt)) != NULL) {
+        stPinchSegment *segment = stPinchThread_getFirst(thread);
+        Cap *cap = flower_getCap(flower, stPinchThread_getName(thread));
+        const stCafThreadInfo *info = stCaf_getThreadInfo(segment, flower);
+        CuAssertPtrEquals(testCase, cap_getEvent(cap), stCaf_getEvent(segment, flower));
+        CuAssertIntEquals(testCase, event_isOutgroup(cap_getEvent(cap)), info->outgroup);
+        CuAssertTrue(testCase, info->sequence >= 0 && info->sequence < stCaf_getSequenceNumber(flower));
+    }
+    stPinchSegment *segment1 = stPinchThread_getFirst(ingroup1Thread1);
+    stPinchSegment *segment2 = stPinchThread_getFirst(ingroup1Thread2);
+    CuAssertIntEquals(testCase, stCaf_getThreadInfo(segment1, flower)->event, stCaf_getThreadInfo(segment2, flower)->event);
+    CuAssertTrue(testCase, stCaf_getThreadInfo(segment1, flower)->sequence != stCaf_getThreadInfo(segment2, flower)->sequence);
+
+    // A block with two ingroup1 segments, one ingroup2 segment and an outgroup segment
+    stPinchThread_pinch(ingroup1Thread1, ingroup1Thread2, 10, 10, 10, true);
+    stPinchThread_pinch(ingroup1Thread1, ingroup2Thread1, 10, 10, 10, true);
+    stPinchThread_pinch(ingroup1Thread1, outgroup1Thread1, 10, 10, 10, true);
+    stPinchBlock *block = stPinchSegment_getBlock(stPinchThread_getSegment(ingroup1Thread1, 10));
+    CuAssertTrue(testCase, stCaf_containsRequiredSpecies(block, flower, 3, 1, 4, 3));
+    CuAssertTrue(testCase, !stCaf_containsRequiredSpecies(block, flower, 4, 0, 0, 0));
+    CuAssertTrue(testCase, !stCaf_containsRequiredSpecies(block, flower, 0, 2, 0, 0));
+    CuAssertTrue(testCase, !stCaf_containsRequiredSpecies(block, flower, 0, 0, 0, 4));
+
+    // Alignments between segments of the block and unaligned segments
+    stPinchSegment *blockSegment = stPinchThread_getSegment(ingroup1Thread1, 10);
+    CuAssertTrue(testCase, stCaf_filterByRepeatSpecies(blockSegment, stPinchThread_getSegment(ingroup2Thread1, 50), flower));
+    CuAssertTrue(testCase, stCaf_filterByOutgroup(blockSegment, stPinchThread_getSegment(outgroup1Thread1, 50), flower));
+    CuAssertTrue(testCase, !stCaf_filterByOutgroup(blockSegment, stPinchThread_getSegment(ingroup2Thread1, 50), flower));
+    CuAssertTrue(testCase, stCaf_singleCopyChr(blockSegment, stPinchThread_getSegment(ingroup1Thread2, 50), flower));
+
+    // A thread added to the flower after the index was built is added to it
+    Name outgroup2Seq1 = addThreadToFlower(flower, outgroup2, 100);
+    stPinchThread *outgroup2Thread1 = stPinchThreadSet_addThread(threadSet, outgroup2Seq1, 1, 102);
+    const stCafThreadInfo *info = stCaf_getThreadInfo(stPinchThread_getFirst(outgroup2Thread1), flower);
+    CuAssertTrue(testCase, info->outgroup);
+    CuAssertPtrEquals(testCase, outgroup2, stCaf_getEventByOrdinal(flower, info->event));
+
+    stCaf_destructThreadIndex();
+    stPinchThreadSet_destruct(threadSet);
+    teardown(testCase);
+}
+
+// Checks the summary of every block against its segments, and that no block has two segments of an event.
+static void checkBlockSummaries(CuTest *testCase, stPinchThreadSet *threadSet) {
+    int64_t eventNumber = stCaf_getEventNumber(flower);
+    stPinchThreadSetBlockIt blockIt = stPinchThreadSet_getBlockIt(threadSet);
+    stPinchBlock *block;
+    while ((block = stPinchThreadSetBlockIt_getNext(&blockIt)) != NULL) {
+        int64_t *eventCounts = st_calloc(eventNumber, sizeof(int64_t));
+        stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(block);
+        stPinchSegment *segment;
+        while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+            eventCounts[stCaf_getThreadInfo(segment, flower)->event]++;
+        }
+        const stCafBlockSummary *summary = stCaf_getBlockSummary(block, flower);
+        CuAssertIntEquals(testCase, stPinchBlock_getDegree(block), summary->degree);
+        for (int64_t i = 0; i < eventNumber; i++) {
+            CuAssertTrue(testCase, eventCounts[i] <= 1);
+            CuAssertIntEquals(testCase, eventCounts[i], (summary->events[i / 64] >> (i % 64)) & 1);
+        }
+        free(eventCounts);
+    }
+}
+
+static void testBlockSummaries(CuTest *testCase) {
+    for (int64_t testNum = 0; testNum < 20; testNum++) {
+        setup(testCase, true);
+        addThreadToFlower(flower, ingroup1, 100);
+        addThreadToFlower(flower, ingroup1, 100);
+        addThreadToFlower(flower, ingroup2, 100);
+        addThreadToFlower(flower, ingroup2, 100);
+        addThreadToFlower(flower, outgroup1, 100);
+        addThreadToFlower(flower, outgroup2, 100);
+
+        stPinchThreadSet *threadSet = stCaf_setup(flower);
+
+        // Pinches allowed by the filter are tracked, so the summaries of the blocks they make are built
+        // from those of the blocks merged
+        stCaf_trackPinches(flower, 1);
+        for (int64_t i = 0; i < 200; i++) {
+            stPinch pinch = stPinchThreadSet_getRandomPinch(threadSet);
+            stPinchThread_filterPinch(stPinchThreadSet_getThread(threadSet, pinch.name1),
+                                      stPinchThreadSet_getThread(threadSet, pinch.name2),
+                                      pinch.start1, pinch.start2, pinch.length, pinch.strand,
+                                      (bool(*)(stPinchSegment *, stPinchSegment *, void *))stCaf_filterByRepeatSpecies, flower);
+            if (i % 20 == 0) {
+                checkBlockSummaries(testCase, threadSet);
+            }
+        }
+        checkBlockSummaries(testCase, threadSet);
+        stCaf_trackPinches(flower, 0);
+
+        stCaf_destructThreadIndex();
+        stPinchThreadSet_destruct(threadSet);
+        teardown(testCase);
+    }
+}
+
 CuSuite* filteringTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testChainHasUnequalNumberOfIngroupCopies);
     SUITE_ADD_TEST(suite, testChainHasUnequalNumberOfIngroupCopiesOrNoOutgroup);
     SUITE_ADD_TEST(suite, testChainHasUnequalNumberOfIngroupCopiesOrNoOutgroup_noOutgroups);
     SUITE_ADD_TEST(suite, testHGVMFiltering);
+    SUITE_ADD_TEST(suite, testThreadIndex);
+    SUITE_ADD_TEST(suite, testBlockSummaries);
     return suite;
 }
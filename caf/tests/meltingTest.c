@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2009-2011 by Benedict Paten (benedictpaten@gmail.com)
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "CuTest.h"
+#include "sonLib.h"
+#include "stCaf.h"
+#include "stPinchGraphs.h"
+#include "pinchGraphsTestShared.h"
+
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+/*
+ * Checks stCaf_meltInRounds, which finds the chains once for all the rounds, melts the same blocks as
+ * calling stCaf_melt for each round.
+ */
+static void testMeltInRounds(CuTest *testCase) {
+    int64_t minimumChainLengths[] = { 2, 4, 8, 16, 32 };
+    for (int64_t test = 0; test < 20; test++) {
+        st_logInfo("Starting melting in rounds random test %" PRIi64 "\n", test);
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        eventTree_construct2(cactusDisk);
+        Flower *flower = flower_construct2(0, cactusDisk);
+        group_construct2(flower);
+
+        // Groups of threads, with pinches only between the threads of a group, so that melting splits components.
+        // The threads have distinct lengths so the thread of a component attached to the dead end component is unique.
+        int64_t threadNumber = st_randomInt(2, 30), groupSize = st_randomInt(2, 6);
+        int64_t *lengths = st_malloc(sizeof(int64_t) * threadNumber);
+        Name *names = st_malloc(sizeof(Name) * threadNumber);
+        for (int64_t i = 0; i < threadNumber; i++) {
+            lengths[i] = 20 + 10 * i + st_randomInt(0, 10);
+            char *header = stString_print("thread%" PRIi64, i);
+            names[i] = testCommon_addThreadToFlower(flower, header, lengths[i]);
+            free(header);
+        }
+        stPinchThreadSet *threadSet1 = stCaf_setup(flower);
+        stPinchThreadSet *threadSet2 = stCaf_constructEmptyPinchGraph(flower);
+        int64_t pinchNumber = st_randomInt(0, 200);
+        for (int64_t i = 0; i < pinchNumber; i++) {
+            int64_t i1 = st_randomInt(0, threadNumber);
+            int64_t group = i1 / groupSize;
+            int64_t i2 = st_randomInt(group * groupSize, (group + 1) * groupSize < threadNumber ? (group + 1) * groupSize : threadNumber);
+            int64_t length = st_randomInt(1, 6);
+            // Sequence positions run from 2 to the length of the sequence plus one, between the caps
+            int64_t start1 = st_randomInt(2, lengths[i1] - length + 2), start2 = st_randomInt(2, lengths[i2] - length + 2);
+            bool strand = st_random() > 0.5;
+            stPinchThread_pinch(stPinchThreadSet_getThread(threadSet1, names[i1]), stPinchThreadSet_getThread(threadSet1, names[i2]),
+                                start1, start2, length, strand);
+            stPinchThread_pinch(stPinchThreadSet_getThread(threadSet2, names[i1]), stPinchThreadSet_getThread(threadSet2, names[i2]),
+                                start1, start2, length, strand);
+        }
+
+        for (int64_t i = 0; i < 5; i++) {
+            stCaf_melt(flower, threadSet1, NULL, NULL, 0, minimumChainLengths[i], 0, INT64_MAX);
+        }
+        stCaf_meltInRounds(flower, threadSet2, minimumChainLengths, 5);
+        checkGraphsAreEqual(testCase, threadSet1, threadSet2);
+
+        stPinchThreadSet_destruct(threadSet1);
+        stPinchThreadSet_destruct(threadSet2);
+        stCaf_destructThreadIndex();
+        free(lengths);
+        free(names);
+        cactusDisk_destruct(cactusDisk);
+    }
+}
+
+typedef struct _speciesFilterArgs {
+    Flower *flower;
+    int64_t minimumIngroupDegree;
+    int64_t minimumOutgroupDegree;
+    int64_t minimumDegree;
+    int64_t minimumNumberOfSpecies;
+} SpeciesFilterArgs;
+
+// Filters out the blocks without the required species and degrees, as the block filter of stCaf_core does.
+static bool speciesFilterFn(stPinchBlock *block, void *extraArg) {
+    SpeciesFilterArgs *f = extraArg;
+    return !stCaf_containsRequiredSpecies(block, f->flower, f->minimumIngroupDegree, f->minimumOutgroupDegree,
+                                          f->minimumDegree, f->minimumNumberOfSpecies);
+}
+
+/*
+ * Checks stCaf_melt, which evaluates the block filter for the blocks in parallel when run with multiple
+ * threads, melts the same blocks as melting with one thread.
+ */
+static void testParallelMelting(CuTest *testCase) {
+#if defined(_OPENMP)
+    int previousThreadNumber = omp_get_max_threads();
+#endif
+    for (int64_t test = 0; test < 20; test++) {
+        st_logInfo("Starting parallel melting random test %" PRIi64 "\n", test);
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        int64_t threadNumber = st_randomInt(2, 30);
+        int64_t *lengths = st_malloc(sizeof(int64_t) * threadNumber);
+        Name *names = st_malloc(sizeof(Name) * threadNumber);
+        Flower *flower = constructFlowerWithRandomThreads(cactusDisk, threadNumber, lengths, names);
+        stPinchThreadSet *threadSet1 = stCaf_setup(flower);
+        stPinchThreadSet *threadSet2 = stCaf_constructEmptyPinchGraph(flower);
+        int64_t pinchNumber = st_randomInt(0, 300);
+        for (int64_t i = 0; i < pinchNumber; i++) {
+            int64_t i1 = st_randomInt(0, threadNumber), i2 = st_randomInt(0, threadNumber);
+            int64_t length = st_randomInt(1, 10);
+            // Sequence positions run from 2 to the length of the sequence plus one, between the caps
+            int64_t start1 = st_randomInt(2, lengths[i1] - length + 2), start2 = st_randomInt(2, lengths[i2] - length + 2);
+            bool strand = st_random() > 0.5;
+            stPinchThread_pinch(stPinchThreadSet_getThread(threadSet1, names[i1]), stPinchThreadSet_getThread(threadSet1, names[i2]),
+                                start1, start2, length, strand);
+            stPinchThread_pinch(stPinchThreadSet_getThread(threadSet2, names[i1]), stPinchThreadSet_getThread(threadSet2, names[i2]),
+                                start1, start2, length, strand);
+        }
+
+        SpeciesFilterArgs filterArgs = { flower, st_randomInt(0, 3), st_randomInt(0, 2), st_randomInt(0, 5), st_randomInt(0, 4) };
+        int64_t blockEndTrim = st_randomInt(0, 3), minimumChainLength = st_randomInt(0, 4);
+#if defined(_OPENMP)
+        omp_set_num_threads(1);
+#endif
+        stCaf_melt(flower, threadSet1, speciesFilterFn, &filterArgs, blockEndTrim, minimumChainLength, 0, INT64_MAX);
+#if defined(_OPENMP)
+        omp_set_num_threads(4);
+#endif
+        stCaf_melt(flower, threadSet2, speciesFilterFn, &filterArgs, blockEndTrim, minimumChainLength, 0, INT64_MAX);
+        checkGraphsAreEqual(testCase, threadSet1, threadSet2);
+
+        stPinchThreadSet_destruct(threadSet1);
+        stPinchThreadSet_destruct(threadSet2);
+        stCaf_destructThreadIndex();
+        free(lengths);
+        free(names);
+        cactusDisk_destruct(cactusDisk);
+    }
+#if defined(_OPENMP)
+    omp_set_num_threads(previousThreadNumber);
+#endif
+}
+
+CuSuite *meltingTestSuite(void) {
+    CuSuite *suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, testMeltInRounds);
+    SUITE_ADD_TEST(suite, testParallelMelting);
+    return suite;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2009-2011 by Benedict Paten (benedictpaten@gmail.com)
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "pinchGraphsTestShared.h"
+
+void checkGraphsAreEqual(CuTest *testCase, stPinchThreadSet *threadSet1, stPinchThreadSet *threadSet2) {
+    CuAssertIntEquals(testCase, stPinchThreadSet_getSize(threadSet1), stPinchThreadSet_getSize(threadSet2));
+    CuAssertIntEquals(testCase, stPinchThreadSet_getTotalBlockNumber(threadSet1), stPinchThreadSet_getTotalBlockNumber(threadSet2));
+    stPinchThreadSetIt threadIt = stPinchThreadSet_getIt(threadSet1);
+    stPinchThread *thread1;
+    while ((thread1 = stPinchThreadSetIt_getNext(&threadIt)) != NULL) {
+        stPinchThread *thread2 = stPinchThreadSet_getThread(threadSet2, stPinchThread_getName(thread1));
+        CuAssertTrue(testCase, thread2 != NULL);
+        stPinchSegment *segment1 = stPinchThread_getFirst(thread1);
+        stPinchSegment *segment2 = stPinchThread_getFirst(thread2);
+        while (segment1 != NULL) {
+            CuAssertTrue(testCase, segment2 != NULL);
+            CuAssertIntEquals(testCase, stPinchSegment_getStart(segment1), stPinchSegment_getStart(segment2));
+            CuAssertIntEquals(testCase, stPinchSegment_getLength(segment1), stPinchSegment_getLength(segment2));
+            stPinchBlock *block1 = stPinchSegment_getBlock(segment1);
+            stPinchBlock *block2 = stPinchSegment_getBlock(segment2);
+            CuAssertTrue(testCase, (block1 == NULL) == (block2 == NULL));
+            if (block1 != NULL) {
+                CuAssertIntEquals(testCase, stPinchBlock_getDegree(block1), stPinchBlock_getDegree(block2));
+                stPinchBlockIt segmentIt = stPinchBlock_getSegmentIterator(block1);
+                stPinchSegment *segment;
+                while ((segment = stPinchBlockIt_getNext(&segmentIt)) != NULL) {
+                    stPinchSegment *otherSegment = stPinchThread_getSegment(
+                            stPinchThreadSet_getThread(threadSet2, stPinchSegment_getName(segment)), stPinchSegment_getStart(segment));
+                    CuAssertPtrEquals(testCase, block2, stPinchSegment_getBlock(otherSegment));
+                    CuAssertIntEquals(testCase, stPinchSegment_getBlockOrientation(segment),
+                                      stPinchSegment_getBlockOrientation(otherSegment));
+                }
+            }
+            segment1 = stPinchSegment_get3Prime(segment1);
+            segment2 = stPinchSegment_get3Prime(segment2);
+        }
+        CuAssertTrue(testCase, segment2 == NULL);
+    }
+}
+
+void checkPinch(CuTest *testCase, stPinch *pinch, int64_t name1, int64_t name2, int64_t start1, int64_t start2,
+                int64_t length, bool strand) {
+    CuAssertTrue(testCase, pinch != NULL);
+    CuAssertIntEquals(testCase, name1, pinch->name1);
+    CuAssertIntEquals(testCase, name2, pinch->name2);
+    CuAssertIntEquals(testCase, start1, pinch->start1);
+    CuAssertIntEquals(testCase, start2, pinch->start2);
+    CuAssertIntEquals(testCase, length, pinch->length);
+    CuAssertIntEquals(testCase, strand, pinch->strand);
+}
+
+static Name addThreadToFlower(Flower *flower, Event *event, int64_t length) {
+    char *dna = stRandom_getRandomDNAString(length, true, true, true);
+    Sequence *sequence = sequence_construct(2, length, dna, "", event, flower_getCactusDisk(flower));
+    flower_addSequence(flower, sequence);
+
+    End *end1 = end_construct2(0, 0, flower);
+    End *end2 = end_construct2(1, 0, flower);
+    Cap *cap1 = cap_construct2(end1, 1, 1, sequence);
+    Cap *cap2 = cap_construct2(end2, length + 2, 1, sequence);
+    cap_makeAdjacent(cap1, cap2);
+
+    free(dna);
+    return cap_getName(cap1);
+}
+
+Flower *constructFlowerWithRandomThreads(CactusDisk *cactusDisk, int64_t threadNumber, int64_t *lengths, Name *names) {
+    EventTree *eventTree = eventTree_construct2(cactusDisk);
+    Flower *flower = flower_construct(cactusDisk);
+    // A group must be constructed because stCaf_setup expects a leaf group.
+    group_construct2(flower);
+    Event *rootEvent = eventTree_getRootEvent(eventTree);
+    Event *ancestor = event_construct3("ancestor", 0.2, rootEvent, eventTree);
+    Event *outgroup = event_construct3("outgroup", 0.2, rootEvent, eventTree);
+    event_setOutgroupStatus(outgroup, true);
+    Event *events[] = { event_construct3("ingroup1", 0.1, ancestor, eventTree),
+                        event_construct3("ingroup2", 0.1, ancestor, eventTree), outgroup };
+    for (int64_t i = 0; i < threadNumber; i++) {
+        lengths[i] = st_randomInt(20, 200);
+        names[i] = addThreadToFlower(flower, events[st_randomInt(0, 3)], lengths[i]);
+    }
+    return flower;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2009-2011 by Benedict Paten (benedictpaten@gmail.com)
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#ifndef PINCH_GRAPHS_TEST_SHARED_H_
+#define PINCH_GRAPHS_TEST_SHARED_H_
+
+#include "CuTest.h"
+#include "sonLib.h"
+#include "stPinchGraphs.h"
+#include "cactus.h"
+
+/*
+ * Checks the two pinch graphs have the same threads, split into the same segments, with the same segments
+ * in the same blocks, in the same orientations.
+ */
+void checkGraphsAreEqual(CuTest *testCase, stPinchThreadSet *threadSet1, stPinchThreadSet *threadSet2);
+
+/*
+ * Checks the pinch is not NULL and has the given names, starts, length and strand.
+ */
+void checkPinch(CuTest *testCase, stPinch *pinch, int64_t name1, int64_t name2, int64_t start1, int64_t start2,
+                int64_t length, bool strand);
+
+/*
+ * Constructs a flower of the event tree ((ingroup1, ingroup2)ancestor, outgroup)root; with the given number
+ * of threads of the leaf events, chosen at random, having random lengths from 20 to 200 bases. Sets the lengths
+ * of the threads and their names in the pinch graph, where the bases of a thread run from 2 to its length
+ * plus one, between its caps.
+ */
+Flower *constructFlowerWithRandomThreads(CactusDisk *cactusDisk, int64_t threadNumber, int64_t *lengths, Name *names);
+
+#endif /* PINCH_GRAPHS_TEST_SHARED_H_ */
@@ -7,8 +7,10 @@
 #include "CuTest.h"
 #include "sonLib.h"
 #include "stPinchIterator.h"
+#include "stCaf.h"
 #include "pairwiseAlignment.h"
 #include "paf.h"
+#include "pinchGraphsTestShared.h"
 #include <math.h>
 
 static void testIterator(CuTest *testCase, stPinchIterator *pinchIterator, stList *randomPairwiseAlignments) {
@@ -113,8 +115,132 @@ static void testPinchIteratorFromFile(CuTest *testCase) {
     }
 }
 
+/*
+ * Checks a binary pinch file, made from the pinches of a PAF file, gives the same pinches as the PAF file.
+ */
+static void testPinchIteratorFromBinaryFile(CuTest *testCase) {
+    for (int64_t test = 0; test < 100; test++) {
+        stList *pairwiseAlignments = getRandomPairwiseAlignments();
+        char *tempFile = "tempFileForPinchIteratorTest.cig";
+        char *binaryTempFile = "tempFileForPinchIteratorTest.bin";
+        FILE *fileHandle = fopen(tempFile, "w");
+        assert(fileHandle != NULL);
+        write_pafs(fileHandle, pairwiseAlignments);
+        fclose(fileHandle);
+        stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(tempFile);
+        fileHandle = fopen(binaryTempFile, "w");
+        assert(fileHandle != NULL);
+        stPinch_writeBinaryHeader(fileHandle);
+        stPinch pinchToFillOut, *pinch;
+        while ((pinch = stPinchIterator_getNext(pinchIterator, &pinchToFillOut)) != NULL) {
+            stPinch_writeBinary(pinch, fileHandle);
+        }
+        fclose(fileHandle);
+        stPinchIterator_destruct(pinchIterator);
+
+        pinchIterator = stPinchIterator_constructFromFile(binaryTempFile);
+        testIterator(testCase, pinchIterator, pairwiseAlignments);
+        stPinchIterator_destruct(pinchIterator);
+        stFile_rmtree(tempFile);
+        stFile_rmtree(binaryTempFile);
+        stList_destruct(pairwiseAlignments);
+    }
+}
+
+/*
+ * Checks runs of matches and mismatches are combined into one pinch, and that records without a cigar,
+ * blank lines, optional tags and a missing final newline are handled.
+ */
+static void testPinchIteratorFromFileExamples(CuTest *testCase) {
+    char *tempFile = "tempFileForPinchIteratorTest.cig";
+    FILE *fileHandle = fopen(tempFile, "w");
+    assert(fileHandle != NULL);
+    fprintf(fileHandle, "1\t100\t10\t29\t+\t20\t100\t5\t23\t0\t0\t60\ttp:A:P\tcg:Z:5M2=3X2I4M1D3M\tAS:i:7\n\n");
+    fprintf(fileHandle, "2\t100\t10\t20\t+\t4\t100\t0\t10\t0\t0\t60\n");
+    fprintf(fileHandle, "3\t100\t10\t20\t-\t4\t100\t0\t11\t0\t0\t60\tcg:Z:4M1D6M\tzz:i:1");
+    fclose(fileHandle);
+    stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(tempFile);
+    for (int64_t i = 0; i < 2; i++) { // Check the iterator can be reset
+        stPinch pinchToFillOut;
+        checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), 1, 20, 10, 5, 10, 1);
+        CuAssertIntEquals(testCase, 7, stPinchIterator_getScore(pinchIterator));
+        checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), 1, 20, 22, 15, 4, 1);
+        checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), 1, 20, 26, 20, 3, 1);
+        checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), 3, 4, 16, 0, 4, 0);
+        CuAssertIntEquals(testCase, 0, stPinchIterator_getScore(pinchIterator));
+        checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), 3, 4, 10, 5, 6, 0);
+        CuAssertPtrEquals(testCase, NULL, stPinchIterator_getNext(pinchIterator, &pinchToFillOut));
+        stPinchIterator_reset(pinchIterator);
+    }
+    stPinchIterator_destruct(pinchIterator);
+
+    // An empty file
+    fileHandle = fopen(tempFile, "w");
+    fclose(fileHandle);
+    pinchIterator = stPinchIterator_constructFromFile(tempFile);
+    stPinch pinchToFillOut;
+    CuAssertPtrEquals(testCase, NULL, stPinchIterator_getNext(pinchIterator, &pinchToFillOut));
+    stPinchIterator_destruct(pinchIterator);
+    stFile_rmtree(tempFile);
+}
+
+typedef struct _scoredPinch {
+    stPinch pinch;
+    int64_t score;
+} ScoredPinch;
+
+static int scoredPinch_cmpFn(const void *a, const void *b) {
+    // Descending by score, then by start1, which is the position of the pinch in the file
+    const ScoredPinch *pinch1 = a, *pinch2 = b;
+    if (pinch1->score != pinch2->score) {
+        return pinch1->score > pinch2->score ? -1 : 1;
+    }
+    return pinch1->pinch.start1 < pinch2->pinch.start1 ? -1 : (pinch1->pinch.start1 > pinch2->pinch.start1 ? 1 : 0);
+}
+
+/*
+ * Checks sorting a scored binary pinch file by score, with little enough memory to need many runs, gives the
+ * pinches in descending order of score, and otherwise in the order of the file.
+ */
+static void testSortAlignmentsFileByScoreInDescendingOrder(CuTest *testCase) {
+    char *tempFile = "tempFileForPinchIteratorTest.bin";
+    char *sortedTempFile = "tempFileForPinchIteratorTest.sorted.bin";
+    for (int64_t test = 0; test < 100; test++) {
+        int64_t pinchNumber = st_randomInt(0, 1000);
+        ScoredPinch *pinches = st_malloc(sizeof(ScoredPinch) * (pinchNumber + 1));
+        FILE *fileHandle = fopen(tempFile, "w");
+        assert(fileHandle != NULL);
+        stPinch_writeScoredBinaryHeader(fileHandle);
+        for (int64_t i = 0; i < pinchNumber; i++) {
+            stPinch_fillOut(&pinches[i].pinch, st_randomInt(0, 10), st_randomInt(0, 10), i, st_randomInt(0, 1000),
+                            st_randomInt(1, 100), st_random() > 0.5);
+            pinches[i].score = st_randomInt(-5, 5); // Plenty of ties
+            stPinch_writeScoredBinary(&pinches[i].pinch, pinches[i].score, fileHandle);
+        }
+        fclose(fileHandle);
+
+        stCaf_sortAlignmentsFileByScoreInDescendingOrder(tempFile, sortedTempFile, st_randomInt(0, 10000));
+        qsort(pinches, pinchNumber, sizeof(ScoredPinch), scoredPinch_cmpFn);
+        stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(sortedTempFile);
+        stPinch pinchToFillOut;
+        for (int64_t i = 0; i < pinchNumber; i++) {
+            stPinch *pinch = &pinches[i].pinch;
+            checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), pinch->name1, pinch->name2,
+                       pinch->start1, pinch->start2, pinch->length, pinch->strand);
+        }
+        CuAssertPtrEquals(testCase, NULL, stPinchIterator_getNext(pinchIterator, &pinchToFillOut));
+        stPinchIterator_destruct(pinchIterator);
+        free(pinches);
+    }
+    stFile_rmtree(tempFile);
+    stFile_rmtree(sortedTempFile);
+}
+
 CuSuite* pinchIteratorTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testPinchIteratorFromFile);
+    SUITE_ADD_TEST(suite, testPinchIteratorFromFileExamples);
+    SUITE_ADD_TEST(suite, testPinchIteratorFromBinaryFile);
+    SUITE_ADD_TEST(suite, testSortAlignmentsFileByScoreInDescendingOrder);
     return suite;
 }
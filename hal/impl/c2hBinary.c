@@ -0,0 +1,185 @@
+/*
+ * c2hBinary.c
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cactus.h"
+#include "sonLib.h"
+#include "recursiveThreadBuilder.h"
+#include "c2hBinary.h"
+
+/*
+ * Writer functions.
+ */
+
+char *c2hBinary_makeBottomSegmentRecord(int64_t segmentName, int64_t start, int64_t length) {
+    char payload[1 + 3 * RECORD_MAX_VARINT_LENGTH];
+    int64_t i = 0;
+    payload[i++] = 'b';
+    i += record_putVarint(segmentName, payload + i);
+    i += record_putVarint(start, payload + i);
+    i += record_putVarint(length, payload + i);
+    return binaryRecord_construct(payload, i);
+}
+
+char *c2hBinary_makeTopSegmentRecord(int64_t start, int64_t length, int64_t parentSegment, bool orientation) {
+    char payload[2 + 3 * RECORD_MAX_VARINT_LENGTH];
+    int64_t i = 0;
+    payload[i++] = 't';
+    i += record_putVarint(start, payload + i);
+    i += record_putVarint(length, payload + i);
+    i += record_putVarint(parentSegment, payload + i);
+    payload[i++] = orientation ? 1 : 0;
+    return binaryRecord_construct(payload, i);
+}
+
+char *c2hBinary_makeInsertionRecord(int64_t start, int64_t length) {
+    char payload[1 + 2 * RECORD_MAX_VARINT_LENGTH];
+    int64_t i = 0;
+    payload[i++] = 'i';
+    i += record_putVarint(start, payload + i);
+    i += record_putVarint(length, payload + i);
+    return binaryRecord_construct(payload, i);
+}
+
+char *c2hBinary_makeEmptyRecord() {
+    return binaryRecord_construct(NULL, 0);
+}
+
+static void writeBytes(FILE *fileHandle, const char *bytes, int64_t length) {
+    if (length > 0 && fwrite(bytes, sizeof(char), length, fileHandle) != (size_t)length) {
+        st_errAbort("Failed to write binary c2h output");
+    }
+}
+
+static void writeVarint(FILE *fileHandle, uint64_t value) {
+    char buffer[RECORD_MAX_VARINT_LENGTH];
+    writeBytes(fileHandle, buffer, record_putVarint(value, buffer));
+}
+
+static void writeString(FILE *fileHandle, const char *string) {
+    int64_t length = strlen(string);
+    writeVarint(fileHandle, length);
+    writeBytes(fileHandle, string, length);
+}
+
+void c2hBinary_writeHeader(FILE *fileHandle) {
+    writeBytes(fileHandle, C2H_BINARY_MAGIC, C2H_BINARY_MAGIC_LENGTH);
+}
+
+void c2hBinary_writeSequence(FILE *fileHandle, const char *eventHeader, const char *sequenceHeader, bool isBottom) {
+    fputc('s', fileHandle);
+    writeString(fileHandle, eventHeader);
+    writeString(fileHandle, sequenceHeader);
+    fputc(isBottom ? 1 : 0, fileHandle);
+}
+
+void c2hBinary_writeRecord(FILE *fileHandle, const char *record) {
+    assert(record_isBinary(record));
+    writeBytes(fileHandle, record, record_getLength(record));
+}
+
+/*
+ * Reader functions.
+ */
+
+struct _c2hReader {
+    FILE *fileHandle;
+    char *eventHeader;
+    char *sequenceHeader;
+};
+
+static int readByte(C2hReader *reader, bool allowEOF) {
+    int c = fgetc(reader->fileHandle);
+    if (c == EOF && !allowEOF) {
+        st_errAbort("Unexpected end of binary c2h input");
+    }
+    return c;
+}
+
+static uint64_t readVarint(C2hReader *reader) {
+    uint64_t value = 0;
+    int64_t shift = 0;
+    int c;
+    do {
+        c = readByte(reader, 0);
+        value |= ((uint64_t)(c & 0x7F)) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return value;
+}
+
+static char *readString(C2hReader *reader) {
+    int64_t length = readVarint(reader);
+    char *string = st_malloc(length + 1);
+    if (fread(string, sizeof(char), length, reader->fileHandle) != (size_t)length) {
+        st_errAbort("Unexpected end of binary c2h input");
+    }
+    string[length] = '\0';
+    return string;
+}
+
+C2hReader *c2hReader_construct(FILE *fileHandle) {
+    char magic[C2H_BINARY_MAGIC_LENGTH];
+    if (fread(magic, sizeof(char), C2H_BINARY_MAGIC_LENGTH, fileHandle) != C2H_BINARY_MAGIC_LENGTH ||
+        memcmp(magic, C2H_BINARY_MAGIC, C2H_BINARY_MAGIC_LENGTH) != 0) {
+        st_errAbort("Input is not a binary c2h file");
+    }
+    C2hReader *reader = st_calloc(1, sizeof(C2hReader));
+    reader->fileHandle = fileHandle;
+    return reader;
+}
+
+void c2hReader_destruct(C2hReader *reader) {
+    free(reader->eventHeader);
+    free(reader->sequenceHeader);
+    free(reader);
+}
+
+bool c2hReader_next(C2hReader *reader, C2hItem *item) {
+    while (1) {
+        int tag = readByte(reader, 1);
+        switch (tag) {
+            case EOF:
+                return 0;
+            case (unsigned char)RECORD_BINARY_TAG:
+                readVarint(reader); // Groups are transparent, the items they contain follow
+                break;
+            case 's':
+                free(reader->eventHeader);
+                free(reader->sequenceHeader);
+                item->type = C2H_SEQUENCE;
+                item->eventHeader = reader->eventHeader = readString(reader);
+                item->sequenceHeader = reader->sequenceHeader = readString(reader);
+                item->isBottom = readByte(reader, 0);
+                return 1;
+            case 'b':
+                item->type = C2H_BOTTOM_SEGMENT;
+                item->segmentName = readVarint(reader);
+                item->start = readVarint(reader);
+                item->length = readVarint(reader);
+                return 1;
+            case 't':
+                item->type = C2H_TOP_SEGMENT;
+                item->start = readVarint(reader);
+                item->length = readVarint(reader);
+                item->parentSegment = readVarint(reader);
+                item->orientation = readByte(reader, 0);
+                return 1;
+            case 'i':
+                item->type = C2H_INSERTION;
+                item->start = readVarint(reader);
+                item->length = readVarint(reader);
+                return 1;
+            default:
+                st_errAbort("Unrecognised item tag in binary c2h input: %i", tag);
+        }
+    }
+}
@@ -7,8 +7,16 @@
 #include "cactus.h"
 #include "sonLib.h"
 #include "recursiveThreadBuilder.h"
+#include "c2hBinary.h"
 
-static Name globalReferenceEventName;
+/*
+ * How the records are written, passed to the write functions as their extraArg, so that alignments can be
+ * written concurrently.
+ */
+typedef struct _halWriter {
+    Name referenceEventName;
+    bool binary; // If true, write the binary .c2h format (see c2hBinary.h)
+} HalWriter;
 
 /*
  * Hal encodes a hierarchical alignment format.
@@ -75,20 +83,29 @@ static Name globalReferenceEventName;
  * alignmentOrientation :
  *      0
  *      1
+ *
+ * The same information can be written in a compact binary form, described in c2hBinary.h,
+ * which avoids formatting and re-parsing the text.
  */
 
-static void writeSequenceHeader(FILE *fileHandle, Sequence *sequence) {
+static void writeSequenceHeader(FILE *fileHandle, Sequence *sequence, HalWriter *writer) {
     //s eventName sequenceName isBottom
     Event *event = sequence_getEvent(sequence);
     assert(event != NULL);
     assert(event_getHeader(event) != NULL);
     assert(sequence_getHeader(sequence) != NULL);
+    if (writer->binary) {
+        c2hBinary_writeSequence(fileHandle, event_getHeader(event), sequence_getHeader(sequence),
+                                event_getName(event) == writer->referenceEventName);
+        return;
+    }
     fprintf(fileHandle, "s\t'%s'\t'%s'\t%i\n", event_getHeader(event), sequence_getHeader(sequence),
-            event_getName(event) == globalReferenceEventName);
+            event_getName(event) == writer->referenceEventName);
 }
 
 static char *writeTerminalAdjacency(Cap *cap, void *extraArg) {
     //a start length reference-segment block-orientation
+    HalWriter *writer = extraArg;
     Cap *adjacentCap = cap_getAdjacency(cap);
     assert(adjacentCap != NULL);
     int64_t adjacencyLength = cap_getCoordinate(adjacentCap) - cap_getCoordinate(cap) - 1;
@@ -97,42 +114,58 @@ static char *writeTerminalAdjacency(Cap *cap, void *extraArg) {
         Sequence *sequence = cap_getSequence(cap);
         assert(sequence != NULL);
         assert(cap_getEvent(cap) != NULL);
-        if (event_getName(cap_getEvent(cap)) == globalReferenceEventName) {
+        if (event_getName(cap_getEvent(cap)) == writer->referenceEventName) {
+            if (writer->binary) {
+                return c2hBinary_makeBottomSegmentRecord(cap_getName(cap), cap_getCoordinate(cap) + 1 - sequence_getStart(sequence), adjacencyLength);
+            }
             return stString_print("a\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\n", cap_getName(cap), cap_getCoordinate(cap) + 1 - sequence_getStart(sequence), adjacencyLength);
         }
+        if (writer->binary) {
+            return c2hBinary_makeInsertionRecord(cap_getCoordinate(cap) + 1 - sequence_getStart(sequence), adjacencyLength);
+        }
         return stString_print("a\t%" PRIi64 "\t%" PRIi64 "\n", cap_getCoordinate(cap) + 1 - sequence_getStart(sequence), adjacencyLength);
     }
     else {
-        return stString_copy("");
+        return writer->binary ? c2hBinary_makeEmptyRecord() : stString_copy("");
     }
 }
 
 static char *writeSegment(Segment *segment, void *extraArg) {
+    HalWriter *writer = extraArg;
     Block *block = segment_getBlock(segment);
-    Segment *referenceSegment = block_getSegmentForEvent(block, globalReferenceEventName);
+    Segment *referenceSegment = block_getSegmentForEvent(block, writer->referenceEventName);
     if (referenceSegment == NULL) {
         Cap *cap5 = segment_get5Cap(segment);
         Cap *cap3 = segment_get3Cap(segment);
         Sequence *sequence = cap_getSequence(cap5);
+        if (writer->binary) {
+            return c2hBinary_makeInsertionRecord(cap_getCoordinate(cap5) - sequence_getStart(sequence), cap_getCoordinate(cap3) - cap_getCoordinate(cap5) + 1);
+        }
         return stString_print("a\t%" PRIi64 "\t%" PRIi64 "\n", cap_getCoordinate(cap5) - sequence_getStart(sequence), cap_getCoordinate(cap3) - cap_getCoordinate(cap5) + 1);
     }
     Sequence *sequence = segment_getSequence(segment);
     assert(sequence != NULL);
     Name eventName = event_getName(segment_getEvent(segment));
-    if (referenceSegment != segment && eventName != globalReferenceEventName) { //Is a top segment
+    if (referenceSegment != segment && eventName != writer->referenceEventName) { //Is a top segment
+        if (writer->binary) {
+            return c2hBinary_makeTopSegmentRecord(segment_getStart(segment) - sequence_getStart(sequence), segment_getLength(segment), segment_getName(referenceSegment), segment_getStrand(referenceSegment));
+        }
         return stString_print("a\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\n", segment_getStart(segment) - sequence_getStart(sequence), segment_getLength(segment), segment_getName(referenceSegment), segment_getStrand(referenceSegment));
     } else {
         //Is a bottom segment
+        if (writer->binary) {
+            return c2hBinary_makeBottomSegmentRecord(segment_getName(segment), segment_getStart(segment) - sequence_getStart(sequence), segment_getLength(segment));
+        }
         return stString_print("a\t%" PRIi64 "\t%" PRIi64 "\t%" PRIi64 "\n", segment_getName(segment), segment_getStart(segment) - sequence_getStart(sequence), segment_getLength(segment));
     }
 }
 
-static int compareCaps(Cap *cap, Cap *cap2) {
+static int compareCaps(Cap *cap, Cap *cap2, HalWriter *writer) {
     Event *event = cap_getEvent(cap);
     Event *event2 = cap_getEvent(cap2);
     int i = cactusMisc_nameCompare(event_getName(event), event_getName(event2));
     if (i != 0) {
-        return event_getName(event) == globalReferenceEventName ? -1 : (event_getName(event2) == globalReferenceEventName ? 1 : i);
+        return event_getName(event) == writer->referenceEventName ? -1 : (event_getName(event2) == writer->referenceEventName ? 1 : i);
     }
     Sequence *sequence = cap_getSequence(cap);
     Sequence *sequence2 = cap_getSequence(cap2);
@@ -143,14 +176,14 @@ static int compareCaps(Cap *cap, Cap *cap2) {
     return i;
 }
 
-static stList *getCaps(Flower *flower) {
+static stList *getCaps(Flower *flower, HalWriter *writer) {
     //Get the caps in order
     stList *caps = stList_construct();
     End *end;
     Flower_EndIterator *endIt = flower_getEndIterator(flower);
     while ((end = flower_getNextEnd(endIt)) != NULL) {
         if (end_isStubEnd(end)) { // && end_isAttached(end)) {
-            Cap *cap; // = end_getCapForEvent(end, globalReferenceEventName);
+            Cap *cap; // = end_getCapForEvent(end, writer->referenceEventName);
             End_InstanceIterator *capIt = end_getInstanceIterator(end);
             while ((cap = end_getNext(capIt)) != NULL) {
                 if (cap_getSequence(cap) != NULL) {
@@ -164,23 +197,23 @@ static stList *getCaps(Flower *flower) {
         }
     }
     flower_destructEndIterator(endIt);
-    stList_sort(caps, (int(*)(const void *, const void *)) compareCaps);
+    stList_sort2(caps, (int(*)(const void *, const void *, void *)) compareCaps, writer);
     return caps;
 }
 
 void makeHalFormat(Flower *flower, stKVDatabase *database, Name referenceEventName, FILE *fileHandle) {
-    globalReferenceEventName = referenceEventName;
-    stList *caps = getCaps(flower);
+    HalWriter writer = { referenceEventName, 0 };
+    stList *caps = getCaps(flower, &writer);
     if (fileHandle == NULL) {
-        buildRecursiveThreads(database, caps, writeSegment, writeTerminalAdjacency, NULL);
+        buildRecursiveThreads(database, caps, writeSegment, writeTerminalAdjacency, &writer);
     } else {
-        stList *threadStrings = buildRecursiveThreadsInList(database, caps, writeSegment, writeTerminalAdjacency, NULL);
+        stList *threadStrings = buildRecursiveThreadsInList(database, caps, writeSegment, writeTerminalAdjacency, &writer);
         assert(stList_length(threadStrings) == stList_length(caps));
         for (int64_t i = 0; i < stList_length(threadStrings); i++) {
             Cap *cap = stList_get(caps, i);
             if(!sequence_isTrivialSequence(cap_getSequence(cap))) {
                 char *threadString = stList_get(threadStrings, i);
-                writeSequenceHeader(fileHandle, cap_getSequence(cap));
+                writeSequenceHeader(fileHandle, cap_getSequence(cap), &writer);
                 fprintf(fileHandle, "%s\n", threadString);
             }
         }
@@ -189,22 +222,32 @@ void makeHalFormat(Flower *flower, stKVDatabase *database, Name referenceEventNa
 }
 
 void makeHalFormatNoDb(Flower *flower, RecordHolder *rh, Name referenceEventName, FILE *fileHandle) {
-    globalReferenceEventName = referenceEventName;
-    stList *caps = getCaps(flower);
+    makeHalFormatNoDb2(flower, rh, referenceEventName, fileHandle, 0);
+}
+
+void makeHalFormatNoDb2(Flower *flower, RecordHolder *rh, Name referenceEventName, FILE *fileHandle, bool binary) {
+    HalWriter writer = { referenceEventName, binary };
+    stList *caps = getCaps(flower, &writer);
     if (fileHandle == NULL) {
-        buildRecursiveThreadsNoDb(rh, caps, writeSegment, writeTerminalAdjacency, NULL);
+        buildRecursiveThreadsNoDb(rh, caps, writeSegment, writeTerminalAdjacency, &writer);
     } else {
-        stList *threadStrings = buildRecursiveThreadsInListNoDb(rh, caps, writeSegment, writeTerminalAdjacency, NULL);
-        assert(stList_length(threadStrings) == stList_length(caps));
-        for (int64_t i = 0; i < stList_length(threadStrings); i++) {
+        // The threads are streamed out of their ropes, so no thread is materialised as a string
+        stList *threads = buildRecursiveThreadRopesNoDb(rh, caps, writeSegment, writeTerminalAdjacency, &writer);
+        assert(stList_length(threads) == stList_length(caps));
+        if (binary) {
+            c2hBinary_writeHeader(fileHandle);
+        }
+        for (int64_t i = 0; i < stList_length(threads); i++) {
             Cap *cap = stList_get(caps, i);
             if(!sequence_isTrivialSequence(cap_getSequence(cap))) {
-                char *threadString = stList_get(threadStrings, i);
-                writeSequenceHeader(fileHandle, cap_getSequence(cap));
-                fprintf(fileHandle, "%s\n", threadString);
+                writeSequenceHeader(fileHandle, cap_getSequence(cap), &writer);
+                recordRope_write(stList_get(threads, i), fileHandle);
+                if (!binary) {
+                    fprintf(fileHandle, "\n");
+                }
             }
         }
-        stList_destruct(threadStrings);
+        stList_destruct(threads);
     }
     stList_destruct(caps);
-}
\ No newline at end of file
+}
@@ -0,0 +1,103 @@
+/*
+ * c2hBinary.h
+ *
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#ifndef C2H_BINARY_H_
+#define C2H_BINARY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A compact binary equivalent of the textual .c2h format (see hal.c).
+ *
+ * The file starts with the magic bytes C2H_BINARY_MAGIC, followed by a stream of items. Integers are
+ * unsigned LEB128 varints and strings are a varint length followed by the bytes. Each item starts
+ * with a tag byte:
+ *
+ *      's' eventHeader sequenceHeader isBottom(1 byte)   : Starts a new sequence
+ *      'b' segmentName start length                      : A bottom segment
+ *      't' start length parentSegment orientation(1 byte): A top segment with a parent
+ *      'i' start length                                  : A top segment without a parent (an insertion)
+ *      0xFF length                                       : A group of the following length bytes of items,
+ *                                                          which a streaming reader can ignore
+ *
+ * The segments following a sequence item belong to that sequence, as in the text format.
+ */
+
+#define C2H_BINARY_MAGIC "C2HB\001"
+#define C2H_BINARY_MAGIC_LENGTH 5
+
+/*
+ * Functions to make the records of segments, used as the records of the recursive thread builder.
+ * The returned records are binary records (see recursiveThreadBuilder.h) and must be freed.
+ */
+char *c2hBinary_makeBottomSegmentRecord(int64_t segmentName, int64_t start, int64_t length);
+
+char *c2hBinary_makeTopSegmentRecord(int64_t start, int64_t length, int64_t parentSegment, bool orientation);
+
+char *c2hBinary_makeInsertionRecord(int64_t start, int64_t length);
+
+char *c2hBinary_makeEmptyRecord();
+
+/*
+ * Streaming writer functions.
+ */
+
+/*
+ * Writes the magic bytes that start a binary .c2h file.
+ */
+void c2hBinary_writeHeader(FILE *fileHandle);
+
+/*
+ * Writes a sequence item.
+ */
+void c2hBinary_writeSequence(FILE *fileHandle, const char *eventHeader, const char *sequenceHeader, bool isBottom);
+
+/*
+ * Writes a binary record (as made by the functions above or the recursive thread builder).
+ */
+void c2hBinary_writeRecord(FILE *fileHandle, const char *record);
+
+/*
+ * Streaming reader.
+ */
+
+typedef enum {
+    C2H_SEQUENCE,
+    C2H_BOTTOM_SEGMENT,
+    C2H_TOP_SEGMENT,
+    C2H_INSERTION
+} C2hItemType;
+
+typedef struct _c2hItem {
+    C2hItemType type;
+    char *eventHeader; // For sequences, owned by the reader and valid until the next sequence is read
+    char *sequenceHeader; // Ditto
+    bool isBottom; // For sequences
+    int64_t segmentName; // For bottom segments
+    int64_t start; // For segments
+    int64_t length; // For segments
+    int64_t parentSegment; // For top segments
+    bool orientation; // For top segments
+} C2hItem;
+
+typedef struct _c2hReader C2hReader;
+
+/*
+ * Constructs a reader for the binary .c2h file, checking the magic bytes. Aborts if the file is not a
+ * binary .c2h file.
+ */
+C2hReader *c2hReader_construct(FILE *fileHandle);
+
+void c2hReader_destruct(C2hReader *reader);
+
+/*
+ * Reads the next item into item, returning false at the end of the file.
+ */
+bool c2hReader_next(C2hReader *reader, C2hItem *item);
+
+#endif /* C2H_BINARY_H_ */
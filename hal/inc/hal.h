@@ -17,6 +17,14 @@ void makeHalFormat(Flower *flower, stKVDatabase *database, Name referenceEventNa
 
 void makeHalFormatNoDb(Flower *flower, RecordHolder *rh, Name referenceEventName, FILE *fileHandle);
 
+/*
+ * As makeHalFormatNoDb, but if binary is non-zero the records and the output are in the binary .c2h
+ * format described in c2hBinary.h. The same setting must be used for every flower whose records are
+ * merged into the same RecordHolder. Different flowers, with their own RecordHolders, may be written
+ * concurrently.
+ */
+void makeHalFormatNoDb2(Flower *flower, RecordHolder *rh, Name referenceEventName, FILE *fileHandle, bool binary);
+
 void printFastaSequences(Flower *flower, FILE *fileHandle, Name referenceEventName);
 
 #endif /* HAL_H_ */
@@ -0,0 +1,80 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "CuTest.h"
+#include "sonLib.h"
+#include "cactus.h"
+#include "recursiveThreadBuilder.h"
+#include "c2hBinary.h"
+
+static void testC2hBinary_roundTrip(CuTest *testCase) {
+    char *tempFile = getTempFile();
+    FILE *fileHandle = fopen(tempFile, "w");
+    c2hBinary_writeHeader(fileHandle);
+    c2hBinary_writeSequence(fileHandle, "anc0", "anc0refChr0", 1);
+    char *record = c2hBinary_makeBottomSegmentRecord(10, 0, 200);
+    c2hBinary_writeRecord(fileHandle, record);
+    free(record);
+    c2hBinary_writeSequence(fileHandle, "human", "chr1", 0);
+
+    // Wrap some records in a group, as the thread builder does when concatenating records
+    char *records[3] = { c2hBinary_makeTopSegmentRecord(5, 100, 10, 1), c2hBinary_makeEmptyRecord(),
+                         c2hBinary_makeInsertionRecord(105, 1000000000000) };
+    int64_t groupLength = 0;
+    for (int64_t i = 0; i < 3; i++) {
+        groupLength += record_getLength(records[i]);
+    }
+    char *group = st_malloc(groupLength), *g = group;
+    for (int64_t i = 0; i < 3; i++) {
+        memcpy(g, records[i], record_getLength(records[i]));
+        g += record_getLength(records[i]);
+        free(records[i]);
+    }
+    record = binaryRecord_construct(group, groupLength);
+    CuAssertTrue(testCase, record_isBinary(record));
+    c2hBinary_writeRecord(fileHandle, record);
+    free(record);
+    free(group);
+    fclose(fileHandle);
+
+    fileHandle = fopen(tempFile, "r");
+    C2hReader *reader = c2hReader_construct(fileHandle);
+    C2hItem item;
+    CuAssertTrue(testCase, c2hReader_next(reader, &item));
+    CuAssertIntEquals(testCase, C2H_SEQUENCE, item.type);
+    CuAssertStrEquals(testCase, "anc0", item.eventHeader);
+    CuAssertStrEquals(testCase, "anc0refChr0", item.sequenceHeader);
+    CuAssertTrue(testCase, item.isBottom);
+    CuAssertTrue(testCase, c2hReader_next(reader, &item));
+    CuAssertIntEquals(testCase, C2H_BOTTOM_SEGMENT, item.type);
+    CuAssertIntEquals(testCase, 10, item.segmentName);
+    CuAssertIntEquals(testCase, 0, item.start);
+    CuAssertIntEquals(testCase, 200, item.length);
+    CuAssertTrue(testCase, c2hReader_next(reader, &item));
+    CuAssertIntEquals(testCase, C2H_SEQUENCE, item.type);
+    CuAssertStrEquals(testCase, "human", item.eventHeader);
+    CuAssertStrEquals(testCase, "chr1", item.sequenceHeader);
+    CuAssertTrue(testCase, !item.isBottom);
+    CuAssertTrue(testCase, c2hReader_next(reader, &item));
+    CuAssertIntEquals(testCase, C2H_TOP_SEGMENT, item.type);
+    CuAssertIntEquals(testCase, 5, item.start);
+    CuAssertIntEquals(testCase, 100, item.length);
+    CuAssertIntEquals(testCase, 10, item.parentSegment);
+    CuAssertTrue(testCase, item.orientation);
+    CuAssertTrue(testCase, c2hReader_next(reader, &item));
+    CuAssertIntEquals(testCase, C2H_INSERTION, item.type);
+    CuAssertIntEquals(testCase, 105, item.start);
+    CuAssertTrue(testCase, item.length == 1000000000000);
+    CuAssertTrue(testCase, !c2hReader_next(reader, &item));
+    c2hReader_destruct(reader);
+    fclose(fileHandle);
+    st_system("rm %s", tempFile);
+    free(tempFile);
+}
+
+CuSuite* c2hBinaryTestSuite(void) {
+    CuSuite* suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, testC2hBinary_roundTrip);
+    return suite;
+}
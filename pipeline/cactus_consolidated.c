@@ -12,6 +12,7 @@
 #include "cactusReference.h"
 #include "addReferenceCoordinates.h"
 #include "traverseFlowers.h"
+#include "treeScheduler.h"
 #include "blockMLString.h"
 #include "hal.h"
 #include "convertAlignmentCoordinates.h"
@@ -46,6 +47,11 @@ void usage() {
     fprintf(stderr, "-r --referenceEvent : [Required] The name of the reference event\n");
     fprintf(stderr, "-t --runChecks : Run cactus checks after each stage, used for debugging\n");
     fprintf(stderr, "-T --threads : (int > 0) Use up to this many threads [default: all available]\n");
+    fprintf(stderr, "-b --binaryC2h : Write the output file in the compact binary .c2h format, rather than text\n");
+    fprintf(stderr, "-m --sequenceStoreFile : Hold the packed input sequences in a memory-mapped file at this path, rather than in memory\n");
+    fprintf(stderr, "-d --recordScratchFile : Spill the records of the reference and hal phases to a scratch file at this path, rather than holding them in memory\n");
+    fprintf(stderr, "-B --barFlowerStatsFile : Write the modelled cost and the time taken of each flower aligned by bar to this file, as a TSV\n");
+    fprintf(stderr, "-M --metricsFile : Write a JSON report of the wall time, CPU time and memory of each phase, and of the work counters, to this file\n");
     fprintf(stderr, "-h --help : Print this help message\n");
 }
 
@@ -91,58 +97,94 @@ static char *convertAlignments(char *alignmentsFile, Flower *flower) {
     return tempFile;
 }
 
-static RecordHolder *getMergedRecordHolders(stHash *recordHolders, Flower *flower) {
-    stList *children = stList_construct();
-    getChildFlowers(flower, children);
-    RecordHolder *rh = recordHolder_construct();
-    for(int64_t i=0; i<stList_length(children); i++) {
-        RecordHolder *rh2 = stHash_search(recordHolders, stList_get(children, i));
-        assert(rh2 != NULL);
-        recordHolder_transferAll(rh, rh2);
+// If not NULL, the spill the record holders of the bottom-up traversals write their records to
+static RecordSpill *recordSpill = NULL;
+
+static RecordHolder *mergeRecordHolders(stList *childRecordHolders) {
+    RecordHolder *rh = recordHolder_construct2(recordSpill);
+    for(int64_t i=0; i<stList_length(childRecordHolders); i++) {
+        recordHolder_transferAll(rh, stList_get(childRecordHolders, i));
     }
-    stList_destruct(children);
     return rh;
 }
 
 static void callBottomUp(Flower *flower, RecordHolder *rh, void *extraArg) {
-    bottomUpNoDb(flower, rh, (Name)extraArg, 0, generateJukesCantorMatrix);
+    bottomUpNoDb(flower, rh, extraArg, 0);
 }
 
+// If true, write the output in the binary .c2h format
+static bool binaryC2h = 0;
+
 static void callHalFn(Flower *flower, RecordHolder *rh, void *extraArg) {
-    makeHalFormatNoDb(flower, rh, (Name)extraArg, NULL);
+    makeHalFormatNoDb2(flower, rh, (Name)extraArg, NULL, binaryC2h);
 }
 
-static RecordHolder *doBottomUpTraversal(stList *flowerLayers,
-                                         void (*bottomUpFn)(Flower *, RecordHolder *, void *), void *extraArgs) {
-    // Bottom-up reference coordinates phase
-    stHash *recordHolders = stHash_construct();
-    for(int64_t i=stList_length(flowerLayers)-1; i>0 ; i--) {
-        stList *flowers = stList_get(flowerLayers, i);
+static void getChildFlowersFn(void *flower, stList *children) {
+    getChildFlowers(flower, children);
+}
 
-        // List to keep the RecordHolder for each flower
-        stList *recordHoldersForFlowers = stList_construct3(stList_length(flowers), NULL);
+static int64_t getFlowerCost(void *flower) {
+    // The number of caps, used to start the largest flowers as early as possible
+    return flower_getCapNumber(flower);
+}
 
-#if defined(_OPENMP)
-#pragma omp parallel for schedule(dynamic)
-#endif
-        for (int64_t j = 0; j < stList_length(flowers); j++) {
-            stList_set(recordHoldersForFlowers, j, getMergedRecordHolders(recordHolders, stList_get(flowers, j)));
-            bottomUpFn(stList_get(flowers, j), stList_get(recordHoldersForFlowers, j), extraArgs);
-        }
+typedef struct _bottomUpTraversal {
+    Flower *rootFlower;
+    void (*bottomUpFn)(Flower *, RecordHolder *, void *);
+    void *extraArgs;
+} BottomUpTraversal;
 
-        // Make new map of flowers in the layer to RecordHolders
-        stHash_destruct(recordHolders);
-        recordHolders = stHash_construct();
-        for (int64_t j = 0; j < stList_length(flowers); j++) {
-            stHash_insert(recordHolders, stList_get(flowers, j), stList_get(recordHoldersForFlowers, j));
-        }
-        stList_destruct(recordHoldersForFlowers);
+static void *bottomUpTraversalFn(void *flower, stList *childRecordHolders, void *extraArg) {
+    BottomUpTraversal *traversal = extraArg;
+    RecordHolder *rh = mergeRecordHolders(childRecordHolders);
+    if (flower != traversal->rootFlower) { // The root is left to the caller
+        traversal->bottomUpFn(flower, rh, traversal->extraArgs);
     }
-    RecordHolder *rh = getMergedRecordHolders(recordHolders, stList_get(stList_get(flowerLayers, 0), 0));
-    stHash_destruct(recordHolders);
     return rh;
 }
 
+/*
+ * Runs bottomUpFn on each flower below the root, each as soon as all of its children are done, and returns
+ * the merged records of the children of the root.
+ */
+static RecordHolder *doBottomUpTraversal(TreeScheduler *flowerScheduler, Flower *rootFlower,
+                                         void (*bottomUpFn)(Flower *, RecordHolder *, void *), void *extraArgs,
+                                         const char *passName) {
+    BottomUpTraversal traversal = { rootFlower, bottomUpFn, extraArgs };
+    TreeSchedulerStats stats;
+    RecordHolder *rh = treeScheduler_runBottomUp(flowerScheduler, bottomUpTraversalFn, &traversal, &stats);
+    treeSchedulerStats_log(&stats, passName);
+    return rh;
+}
+
+typedef struct _makeReference {
+    char *referenceEventString;
+    ReferenceParameters *referenceParameters;
+} MakeReference;
+
+static void makeReferenceFn(void *flower, void *extraArg) {
+    MakeReference *makeReference = extraArg;
+    cactus_make_reference_for_flower(flower, makeReference->referenceEventString, makeReference->referenceParameters);
+}
+
+static void topDownFn(void *flower, void *extraArg) {
+    topDown(flower, (Name)extraArg);
+}
+
+static void startRecordSpill(char *recordScratchFile) {
+    if (recordScratchFile != NULL) {
+        recordSpill = recordSpill_construct(recordScratchFile);
+    }
+}
+
+static void endRecordSpill(void) {
+    if (recordSpill != NULL) {
+        st_logInfo("Spilled %" PRIi64 " bytes of records\n", recordSpill_getLength(recordSpill));
+        recordSpill_destruct(recordSpill);
+        recordSpill = NULL;
+    }
+}
+
 // check if a reference fasta was provided with the --sequences option
 // if it was, then we don't need to run the reference phase
 static bool refSequenceProvided(char *sequenceFilesAndEvents, char *referenceEventString) {
@@ -159,36 +201,6 @@ static bool refSequenceProvided(char *sequenceFilesAndEvents, char *referenceEve
     return found_ref;
 }
 
-// compute the total base lengths of each flower in parallel
-stHash *compute_flower_length_hash(stList *flowers) {
-    // compute lengths in parallel
-    stList *flower_lengths = stList_construct2(stList_length(flowers));
-#pragma omp parallel for schedule(dynamic)
-    for (int64_t i = 0; i < stList_length(flowers); ++i) {
-        stList_set(flower_lengths, i, (void*)flower_getTotalBaseLength((Flower*)stList_get(flowers, i)));
-    }
-    // add the lengths to the hash
-    stHash *flower_to_length = stHash_construct();
-    for (int64_t i = 0; i < stList_length(flowers); ++i) {
-        stHash_insert(flower_to_length, stList_get(flowers, i), stList_get(flower_lengths, i));
-    }
-    stList_destruct(flower_lengths);
-    return flower_to_length;
-}
-
-int flower_lengthCmpFn(const void *a, const void *b, void *flower_to_length_hash) {
-    // Sort by hashed length value of the flowers
-    int64_t i = (int64_t)stHash_search((stHash*)flower_to_length_hash, (void*)a);
-    int64_t j = (int64_t)stHash_search((stHash*)flower_to_length_hash, (void*)b);
-    return i < j ? 1 : (i > j ? -1 : 0); // Sort in descending order
-}
-
-int flower_sizeCmpFn(const void *a, const void *b) {
-    // Sort by number of caps the flowers contains
-    int64_t i = flower_getCapNumber((Flower *)a), j = flower_getCapNumber((Flower *)b);
-    return i < j ? 1 : (i > j ? -1 : 0); // Sort in descending order
-}
-
 int main(int argc, char *argv[]) {
     time_t startTime = time(NULL);
 
@@ -209,6 +221,10 @@ int main(int argc, char *argv[]) {
     char *outgroupEvents = NULL;
     char *referenceEventString = NULL;
     bool runChecks = 0;
+    char *sequenceStoreFile = NULL;
+    char *recordScratchFile = NULL;
+    char *metricsFile = NULL;
+    char *barFlowerStatsFile = NULL;
 
     ///////////////////////////////////////////////////////////////////////////
     // (0) Parse the inputs handed by genomeCactus.py / setup stuff.
@@ -239,11 +255,16 @@ int main(int argc, char *argv[]) {
                 { "referenceEvent", required_argument, 0, 'r' },
                 { "runChecks", no_argument, 0, 't' },
                 { "threads", required_argument, 0, 'T' }, 
+                { "sequenceStoreFile", required_argument, 0, 'm' },
+                { "binaryC2h", no_argument, 0, 'b' },
+                { "recordScratchFile", required_argument, 0, 'd' },
+                { "metricsFile", required_argument, 0, 'M' },
+                { "barFlowerStatsFile", required_argument, 0, 'B' },
                 { 0, 0, 0, 0 } };
 
         int option_index = 0;
 
-        int64_t key = getopt_long(argc, argv, "l:p:s:a:S:e:c:g:o:hr:F:G:tT:", long_options, &option_index);
+        int64_t key = getopt_long(argc, argv, "l:p:s:a:S:e:c:g:o:hr:F:G:tT:m:bd:M:B:", long_options, &option_index);
 
         if (key == -1) {
             break;
@@ -300,6 +321,21 @@ int main(int argc, char *argv[]) {
                 omp_set_num_threads(num_threads);
                 break;
             }
+            case 'm':
+                sequenceStoreFile = optarg;
+                break;
+            case 'b':
+                binaryC2h = 1;
+                break;
+            case 'd':
+                recordScratchFile = optarg;
+                break;
+            case 'M':
+                metricsFile = optarg;
+                break;
+            case 'B':
+                barFlowerStatsFile = optarg;
+                break;
             case 'h':
                 usage();
                 return 0;
@@ -356,17 +392,23 @@ int main(int argc, char *argv[]) {
     st_logInfo("Species tree: %s\n", speciesTree);
     st_logInfo("Outgroup events: %s\n", outgroupEvents);
     st_logInfo("Reference event: %s\n", referenceEventString);
+    st_logInfo("Sequence store file: %s\n", sequenceStoreFile);
+    st_logInfo("Record scratch file: %s\n", recordScratchFile);
+    st_logInfo("Metrics file: %s\n", metricsFile);
+    st_logInfo("Bar flower stats file: %s\n", barFlowerStatsFile);
 
     //////////////////////////////////////////////
     //Parse stuff
     //////////////////////////////////////////////
 
+    cactusMetrics_startPhase("setup");
+
     // Load the params file
     CactusParams *params = cactusParams_load(paramsFile);
     st_logInfo("Loaded the parameters files, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
     // Load the cactus disk
-    CactusDisk *cactusDisk = cactusDisk_construct();
+    CactusDisk *cactusDisk = cactusDisk_construct2(sequenceStoreFile);
 
     st_logInfo("Set up the cactus disk, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
@@ -397,11 +439,13 @@ int main(int argc, char *argv[]) {
 
     // Check if we got the reference sequence as input
     bool skipReferencePhase = refSequenceProvided(sequenceFilesAndEvents, referenceEventString);
+    cactusMetrics_endPhase();
 
     //////////////////////////////////////////////
     //Convert alignment coordinates
     //////////////////////////////////////////////
 
+    cactusMetrics_startPhase("convert alignment coordinates");
     alignmentsFile = convertAlignments(alignmentsFile, flower);
     if(secondaryAlignmentsFile != NULL) {
         secondaryAlignmentsFile = convertAlignments(secondaryAlignmentsFile, flower);
@@ -409,6 +453,7 @@ int main(int argc, char *argv[]) {
     if(constraintAlignmentsFile != NULL) {
         constraintAlignmentsFile = convertAlignments(constraintAlignmentsFile, flower);
     }
+    cactusMetrics_endPhase();
     st_logInfo("Converted alignment coordinates, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
     //////////////////////////////////////////////
@@ -423,7 +468,9 @@ int main(int argc, char *argv[]) {
     //////////////////////////////////////////////
 
     assert(!flower_builtBlocks(flower));
+    cactusMetrics_startPhase("caf");
     caf(flower, params, alignmentsFile, secondaryAlignmentsFile, constraintAlignmentsFile, referenceEvent);
+    cactusMetrics_endPhase();
     assert(flower_builtBlocks(flower));
     st_logInfo("Ran cactus caf, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
@@ -437,20 +484,20 @@ int main(int argc, char *argv[]) {
     //////////////////////////////////////////////
 
     if (cactusParams_get_int(params, 2, "bar", "runBar")) {
+        cactusMetrics_startPhase("bar");
         stList *leafFlowers = stList_construct();
-        extendFlowers(flower, leafFlowers, 1); // Get nested flowers to complete
-        // Sort by descending order of size, so that we start processing the
-        // largest flower as quickly as possible
-        stHash *flower_to_length = compute_flower_length_hash(leafFlowers);
-        stList_sort2(leafFlowers, flower_lengthCmpFn, flower_to_length); 
-        stHash_destruct(flower_to_length);
+        extendFlowers(flower, leafFlowers, 1); // Get nested flowers to complete, bar orders them by their modelled cost
         st_logInfo("Ran extended flowers ready for bar, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
-        bar(leafFlowers, params, cactusDisk, NULL);
+        // The flower hierarchy and input sequences are complete, so index them for lock-free lookups
+        cactusDisk_freeze(cactusDisk);
+
+        bar(leafFlowers, params, cactusDisk, NULL, barFlowerStatsFile);
         int64_t usePoa = cactusParams_get_int(params, 2, "bar", "partialOrderAlignment");
         st_logInfo("Ran cactus bar (use poa:%i), %" PRIi64 " seconds have elapsed\n", (int)usePoa, time(NULL) - startTime);
 
         stList_destruct(leafFlowers);
+        cactusMetrics_endPhase();
 
         if(runChecks) {
             flower_checkRecursive(flower);
@@ -462,44 +509,49 @@ int main(int argc, char *argv[]) {
     //Call cactus reference
     //////////////////////////////////////////////
 
-    // Get the flowers in the tree so that level 0 contains just the root flower,
-    // level 1 contains the flowers that are children of the root flower, etc.
-    stList *flowerLayers = getFlowerHierarchyInLayers(flower);
-    for(int64_t i=0; i<stList_length(flowerLayers); i++) {
-        // Sort by descending order of size, so that we start processing the
-        // largest flower as quickly as possible
-        stList_sort(stList_get(flowerLayers, i), flower_sizeCmpFn); 
-    }
-    st_logInfo("There are %" PRIi64 " layers in the flowers hierarchy\n", stList_length(flowerLayers));
+    // Schedule the work on the flowers in the tree as a graph of tasks, so that the work on a flower can start as
+    // soon as the work it depends on, on its parent or children, is done, rather than waiting for a whole layer
+    TreeScheduler *flowerScheduler = treeScheduler_construct(flower, getChildFlowersFn, getFlowerCost);
+    st_logInfo("There are %" PRIi64 " flowers in the flowers hierarchy\n", treeScheduler_size(flowerScheduler));
+    TreeSchedulerStats schedulerStats;
+
+    // (Re)index the complete flower hierarchy so the parallel reference passes can look up
+    // flowers, sequences and strings without locking
+    cactusDisk_freeze(cactusDisk);
 
     RecordHolder *rh = NULL;
     if (!skipReferencePhase) {
         // Top-down this constructs the reference sequence
-        for(int64_t i=0; i<stList_length(flowerLayers); i++) {
-            stList *flowerLayer = stList_get(flowerLayers, i);
-            st_logInfo("In the %" PRIi64 " layer there are %" PRIi64 " flowers in the flowers hierarchy\n", i,
-                       stList_length(flowerLayer));
-            cactus_make_reference(flowerLayer, referenceEventString, cactusDisk, params);
-        }
+        cactusMetrics_startPhase("make reference");
+        MakeReference makeReference = { referenceEventString, referenceParameters_construct(params) };
+        treeScheduler_runTopDown(flowerScheduler, makeReferenceFn, &makeReference, &schedulerStats);
+        treeSchedulerStats_log(&schedulerStats, "make reference");
+        referenceParameters_destruct(makeReference.referenceParameters);
+        cactusMetrics_endPhase();
         st_logInfo("Ran cactus make reference, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
         // Bottom-up reference coordinates phase
-        RecordHolder *rh = doBottomUpTraversal(flowerLayers, callBottomUp, (void *)referenceEventName);
-        bottomUpNoDb(flower, rh, referenceEventName, 1, generateJukesCantorMatrix);
+        cactusMetrics_startPhase("reference bottom up coordinates");
+        startRecordSpill(recordScratchFile);
+        // The phylogenetic tree for base calling the ancestral bases is the same for every flower, so is built once
+        // and shared by the threads
+        stTree *phylogeneticTree = getPhylogeneticTreeRootedAtGivenEvent(referenceEvent, generateJukesCantorMatrix);
+        RecordHolder *rh = doBottomUpTraversal(flowerScheduler, flower, callBottomUp, phylogeneticTree,
+                                               "reference bottom up coordinates");
+        bottomUpNoDb(flower, rh, phylogeneticTree, 1);
         assert(recordHolder_size(rh) == 0);
         recordHolder_destruct(rh);
+        releaseMaximumLikelihoodStringScratch();
+        cleanupPhylogeneticTree(phylogeneticTree);
+        endRecordSpill();
+        cactusMetrics_endPhase();
         st_logInfo("Ran cactus make reference bottom up coordinates, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
         // Top-down reference coordinates phase
-        for(int64_t i=0; i<stList_length(flowerLayers); i++) {
-            stList *flowers = stList_get(flowerLayers, i);
-#if defined(_OPENMP)
-#pragma omp parallel for schedule(dynamic)
-#endif
-            for(int64_t j=0; j<stList_length(flowers); j++) {
-                topDown(stList_get(flowers, j), referenceEventName);
-            }
-        }
+        cactusMetrics_startPhase("reference top down coordinates");
+        treeScheduler_runTopDown(flowerScheduler, topDownFn, (void *)referenceEventName, &schedulerStats);
+        cactusMetrics_endPhase();
+        treeSchedulerStats_log(&schedulerStats, "reference top down coordinates");
         st_logInfo("Ran cactus make reference top down coordinates, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
     } else {
         st_logInfo("Skipped reference phase because input sequence was provided for %s\n", referenceEventString);
@@ -514,18 +566,23 @@ int main(int argc, char *argv[]) {
     //Make c2h files, then build hal
     //////////////////////////////////////////////
 
-    rh = doBottomUpTraversal(flowerLayers, callHalFn, (void *)referenceEventName);
+    cactusMetrics_startPhase("cactus to hal");
+    startRecordSpill(recordScratchFile);
+    rh = doBottomUpTraversal(flowerScheduler, flower, callHalFn, (void *)referenceEventName, "cactus to hal");
     FILE *fileHandle = fopen(outputFile, "w");
-    makeHalFormatNoDb(flower, rh, referenceEventName, fileHandle);
+    makeHalFormatNoDb2(flower, rh, referenceEventName, fileHandle, binaryC2h);
     fclose(fileHandle);
     assert(recordHolder_size(rh) == 0);
     recordHolder_destruct(rh);
+    endRecordSpill();
+    cactusMetrics_endPhase();
     st_logInfo("Ran cactus to hal stage, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
     //////////////////////////////////////////////
     //Get reference sequences
     //////////////////////////////////////////////
 
+    cactusMetrics_startPhase("output sequences");
     if(outputHalFastaFile != NULL) {
         fileHandle = fopen(outputHalFastaFile, "w");
         printFastaSequences(flower, fileHandle, referenceEventName);
@@ -539,6 +596,7 @@ int main(int argc, char *argv[]) {
         fclose(fileHandle);
         st_logInfo("Dumped reference sequences, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
     }
+    cactusMetrics_endPhase();
 
     //////////////////////////////////////////////
     //Cleanup
@@ -551,12 +609,24 @@ int main(int argc, char *argv[]) {
     if(constraintAlignmentsFile != NULL) {
         st_system("rm %s", constraintAlignmentsFile);
     }
+    int64_t lockFreeIDs, lockedIDRequests;
+    cactusDisk_getUniqueIDCounts(cactusDisk, &lockFreeIDs, &lockedIDRequests);
+    st_logInfo("Issued %" PRIi64 " unique IDs without locking, took the disk lock %" PRIi64 " times to issue IDs\n",
+               lockFreeIDs, lockedIDRequests);
+    if (metricsFile != NULL) {
+        fileHandle = fopen(metricsFile, "w");
+        if (fileHandle == NULL) {
+            st_errnoAbort("Failed to open metrics file %s", metricsFile);
+        }
+        cactusMetrics_writeJson(fileHandle);
+        fclose(fileHandle);
+    }
     st_logInfo("Cactus consolidated is done!, %" PRIi64 " seconds have elapsed\n", time(NULL) - startTime);
 
     return 0; // Exit without cleaning
 
     // Cleanup the memory
-    stList_destruct(flowerLayers);
+    treeScheduler_destruct(flowerScheduler);
     cactusParams_destruct(params);
     cactusDisk_destruct(cactusDisk);
     if (seqFile) {
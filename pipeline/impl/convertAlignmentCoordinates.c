@@ -8,6 +8,7 @@
 #include "sonLib.h"
 #include "paf.h"
 #include "bioioC.h"
+#include "stPinchIterator.h"
 
 void stripUniqueIdsFromLeafSequences(Flower *flower) {
     Flower_SequenceIterator *flowerIt = flower_getSequenceIterator(flower);
@@ -60,7 +61,45 @@ static stHash *makeSequenceHeaderToCapHash(Flower *flower) {
     return sequenceHeaderToCapsHash;
 }
 
-static void convertCoordinates(Paf *paf, FILE *outputCigarFileHandle,
+/*
+ * Writes the pinches of the alignment, with its score, to the scored binary pinch file, combining runs of
+ * matches and mismatches into single pinches, as the PAF pinch iterator does.
+ */
+static void writePinches(Paf *paf, Name xName, Name yName, FILE *outputFileHandle) {
+    int64_t x = paf->same_strand ? paf->query_start : paf->query_end;
+    int64_t y = paf->target_start;
+    int64_t matchLength = 0; // The length of the run of matches ending at the current operation
+    stPinch pinch;
+    for (Cigar *c = paf->cigar; c != NULL; c = c->next) {
+        if (c->op == match || c->op == sequence_match || c->op == sequence_mismatch) {
+            matchLength += c->length;
+            if (c->next == NULL || !(c->next->op == match || c->next->op == sequence_match ||
+                                     c->next->op == sequence_mismatch)) {
+                if (paf->same_strand) {
+                    stPinch_fillOut(&pinch, xName, yName, x, y, matchLength, 1);
+                    x += matchLength;
+                } else {
+                    x -= matchLength;
+                    stPinch_fillOut(&pinch, xName, yName, x, y, matchLength, 0);
+                }
+                y += matchLength;
+                matchLength = 0;
+                stPinch_writeScoredBinary(&pinch, paf->score, outputFileHandle);
+            }
+            continue;
+        }
+        if (c->op != query_delete) {
+            x += paf->same_strand ? c->length : -c->length;
+        }
+        if (c->op != query_insert) {
+            y += c->length;
+        }
+    }
+    assert(paf->cigar == NULL || x == (paf->same_strand ? paf->query_end : paf->query_start)); // An alignment without a cigar has no pinches
+    assert(paf->cigar == NULL || y == paf->target_end);
+}
+
+static void convertCoordinates(Paf *paf, FILE *outputFileHandle,
                                stHash *sequenceHeaderToCapHash) {
     Cap *cap1 = stHash_search(sequenceHeaderToCapHash, paf->query_name);
     Cap *cap2 = stHash_search(sequenceHeaderToCapHash, paf->target_name);
@@ -70,11 +109,6 @@ static void convertCoordinates(Paf *paf, FILE *outputCigarFileHandle,
     if (cap2 == NULL) {
         st_errAbort("Could not match contig name in alignment to cactus cap: '%s'", paf->target_name);
     }
-    //Fix the names
-    free(paf->query_name);
-    paf->query_name = cactusMisc_nameToString(cap_getName(cap1));
-    free(paf->target_name);
-    paf->target_name = cactusMisc_nameToString(cap_getName(cap2));
     //Now fix the coordinates by adding one
     paf->query_start += 2;
     paf->target_start += 2;
@@ -93,6 +127,7 @@ static void convertCoordinates(Paf *paf, FILE *outputCigarFileHandle,
                     paf->target_start, paf->target_end,
                     cap_getCoordinate(cap2), cap_getCoordinate(cap_getAdjacency(cap2)));
     }
+    writePinches(paf, cap_getName(cap1), cap_getName(cap2), outputFileHandle);
 }
 
 void convertAlignmentCoordinates(char *inputAlignmentFile, char *outputAlignmentFile, Flower *flower) {
@@ -103,11 +138,10 @@ void convertAlignmentCoordinates(char *inputAlignmentFile, char *outputAlignment
     FILE *outputAlignmentFileHandle = fopen(outputAlignmentFile, "w");
     st_logDebug("Opened files for writing\n");
 
+    stPinch_writeScoredBinaryHeader(outputAlignmentFileHandle);
     Paf *paf;
-    while ((paf = paf_read(inputAlignmentFileHandle, 0)) != NULL) {
+    while ((paf = paf_read(inputAlignmentFileHandle, 1)) != NULL) {
         convertCoordinates(paf, outputAlignmentFileHandle, sequenceHeaderToCapHash);
-        paf_check(paf);
-        paf_write(paf, outputAlignmentFileHandle);
         paf_destruct(paf);
     }
     st_logDebug("Finished converting alignments\n");
@@ -0,0 +1,302 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include <time.h>
+#include "sonLib.h"
+#include "treeScheduler.h"
+
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+typedef struct _treeSchedulerNode {
+    void *node;
+    int64_t parent; // Index of the parent, -1 for the root
+    int64_t firstChild; // The children of a node are contiguous, starting at this index
+    int64_t childNumber;
+    int64_t cost; // The estimated cost of processing the node
+    int64_t subtreeCost; // Cost of the most expensive path from the node to a leaf, including the node
+    int64_t rootPathCost; // Cost of the path from the node to the root, including the node
+    int64_t pendingChildren; // Used by the bottom-up pass, the number of children not yet processed
+    void *result; // Used by the bottom-up pass
+    double time; // The time taken to process the node in the last pass
+} TreeSchedulerNode;
+
+struct _treeScheduler {
+    TreeSchedulerNode *nodes; // In breadth first order, so parents come before their children
+    int64_t nodeNumber;
+    int64_t *childOrder; // For each node, the indexes of its children in descending order of subtreeCost,
+                         // held at [firstChild, firstChild + childNumber)
+    int64_t *leaves; // The indexes of the leaves, in descending order of rootPathCost
+    int64_t leafNumber;
+};
+
+typedef struct _costAndIndex {
+    int64_t cost;
+    int64_t index;
+} CostAndIndex;
+
+static int costAndIndex_cmp(const void *a, const void *b) {
+    // Descending order of cost, then ascending order of index, so the order is deterministic
+    const CostAndIndex *c1 = a, *c2 = b;
+    return c1->cost > c2->cost ? -1 : (c1->cost < c2->cost ? 1 :
+           (c1->index < c2->index ? -1 : (c1->index > c2->index ? 1 : 0)));
+}
+
+static void sortByDescendingCost(CostAndIndex *costs, int64_t length, int64_t *indexes) {
+    qsort(costs, length, sizeof(CostAndIndex), costAndIndex_cmp);
+    for (int64_t i = 0; i < length; i++) {
+        indexes[i] = costs[i].index;
+    }
+}
+
+TreeScheduler *treeScheduler_construct(void *root, void (*getChildren)(void *node, stList *children),
+                                       int64_t (*getCost)(void *node)) {
+    // Get the nodes in breadth first order
+    stList *nodes = stList_construct();
+    stList *parents = stList_construct();
+    stList_append(nodes, root);
+    stList_append(parents, (void *)-1);
+    for (int64_t i = 0; i < stList_length(nodes); i++) {
+        stList *children = stList_construct();
+        getChildren(stList_get(nodes, i), children);
+        for (int64_t j = 0; j < stList_length(children); j++) {
+            stList_append(nodes, stList_get(children, j));
+            stList_append(parents, (void *)i);
+        }
+        stList_destruct(children);
+    }
+
+    TreeScheduler *treeScheduler = st_malloc(sizeof(TreeScheduler));
+    treeScheduler->nodeNumber = stList_length(nodes);
+    treeScheduler->nodes = st_calloc(treeScheduler->nodeNumber, sizeof(TreeSchedulerNode));
+    for (int64_t i = 0; i < treeScheduler->nodeNumber; i++) {
+        TreeSchedulerNode *n = &treeScheduler->nodes[i];
+        n->node = stList_get(nodes, i);
+        n->parent = (int64_t)stList_get(parents, i);
+        n->cost = getCost(n->node);
+        n->rootPathCost = n->cost + (n->parent != -1 ? treeScheduler->nodes[n->parent].rootPathCost : 0);
+        if (n->parent != -1) {
+            TreeSchedulerNode *p = &treeScheduler->nodes[n->parent];
+            if (p->childNumber++ == 0) {
+                p->firstChild = i;
+            }
+        }
+    }
+    stList_destruct(nodes);
+    stList_destruct(parents);
+
+    // Calculate the subtree costs, children before parents, and the orders in which to start the nodes
+    treeScheduler->childOrder = st_malloc(sizeof(int64_t) * treeScheduler->nodeNumber);
+    treeScheduler->leaves = st_malloc(sizeof(int64_t) * treeScheduler->nodeNumber);
+    treeScheduler->leafNumber = 0;
+    CostAndIndex *costs = st_malloc(sizeof(CostAndIndex) * treeScheduler->nodeNumber);
+    for (int64_t i = treeScheduler->nodeNumber - 1; i >= 0; i--) {
+        TreeSchedulerNode *n = &treeScheduler->nodes[i];
+        int64_t maxChildCost = 0;
+        for (int64_t j = 0; j < n->childNumber; j++) {
+            TreeSchedulerNode *c = &treeScheduler->nodes[n->firstChild + j];
+            maxChildCost = c->subtreeCost > maxChildCost ? c->subtreeCost : maxChildCost;
+            costs[j].cost = c->subtreeCost;
+            costs[j].index = n->firstChild + j;
+        }
+        n->subtreeCost = n->cost + maxChildCost;
+        sortByDescendingCost(costs, n->childNumber, &treeScheduler->childOrder[n->firstChild]);
+    }
+    for (int64_t i = 0; i < treeScheduler->nodeNumber; i++) {
+        if (treeScheduler->nodes[i].childNumber == 0) {
+            costs[treeScheduler->leafNumber].cost = treeScheduler->nodes[i].rootPathCost;
+            costs[treeScheduler->leafNumber++].index = i;
+        }
+    }
+    sortByDescendingCost(costs, treeScheduler->leafNumber, treeScheduler->leaves);
+    free(costs);
+
+    return treeScheduler;
+}
+
+void treeScheduler_destruct(TreeScheduler *treeScheduler) {
+    free(treeScheduler->nodes);
+    free(treeScheduler->childOrder);
+    free(treeScheduler->leaves);
+    free(treeScheduler);
+}
+
+int64_t treeScheduler_size(TreeScheduler *treeScheduler) {
+    return treeScheduler->nodeNumber;
+}
+
+static double getTime(void) {
+#if defined(_OPENMP)
+    return omp_get_wtime();
+#else
+    return ((double)clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+static void startPass(TreeSchedulerStats *stats, double *startTime) {
+    if (stats != NULL) {
+        stats->taskNumber = 0;
+#if defined(_OPENMP)
+        stats->threadNumber = omp_get_max_threads();
+#else
+        stats->threadNumber = 1;
+#endif
+    }
+    *startTime = getTime();
+}
+
+static void endPass(TreeScheduler *treeScheduler, TreeSchedulerStats *stats, double startTime) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->wallTime = getTime() - startTime;
+    stats->taskNumber = treeScheduler->nodeNumber;
+    stats->busyTime = 0.0;
+    // The critical path is the most expensive path from the root to a leaf, whichever direction the pass ran in,
+    // so is calculated from the children to the parents
+    double *pathTimes = st_malloc(sizeof(double) * treeScheduler->nodeNumber);
+    for (int64_t i = treeScheduler->nodeNumber - 1; i >= 0; i--) {
+        TreeSchedulerNode *n = &treeScheduler->nodes[i];
+        stats->busyTime += n->time;
+        double maxChildTime = 0.0;
+        for (int64_t j = 0; j < n->childNumber; j++) {
+            maxChildTime = pathTimes[n->firstChild + j] > maxChildTime ? pathTimes[n->firstChild + j] : maxChildTime;
+        }
+        pathTimes[i] = n->time + maxChildTime;
+    }
+    stats->criticalPathTime = pathTimes[0];
+    free(pathTimes);
+    stats->idleTime = stats->threadNumber * stats->wallTime - stats->busyTime;
+    if (stats->idleTime < 0.0) { // Possible through differences in timing
+        stats->idleTime = 0.0;
+    }
+}
+
+/*
+ * Top-down pass.
+ */
+
+static void runTopDown(TreeScheduler *treeScheduler, int64_t i, void (*fn)(void *node, void *extraArg), void *extraArg);
+
+static void startChildrenTopDown(TreeScheduler *treeScheduler, int64_t i, void (*fn)(void *node, void *extraArg), void *extraArg) {
+    // Start the children, those with the most expensive subtrees first
+    TreeSchedulerNode *n = &treeScheduler->nodes[i];
+    for (int64_t j = 0; j < n->childNumber; j++) {
+        int64_t k = treeScheduler->childOrder[n->firstChild + j];
+#if defined(_OPENMP)
+#pragma omp task firstprivate(k)
+#endif
+        runTopDown(treeScheduler, k, fn, extraArg);
+    }
+}
+
+static void runTopDown(TreeScheduler *treeScheduler, int64_t i, void (*fn)(void *node, void *extraArg), void *extraArg) {
+    TreeSchedulerNode *n = &treeScheduler->nodes[i];
+    double startTime = getTime();
+    fn(n->node, extraArg);
+    n->time = getTime() - startTime;
+    startChildrenTopDown(treeScheduler, i, fn, extraArg);
+}
+
+void treeScheduler_runTopDown(TreeScheduler *treeScheduler, void (*fn)(void *node, void *extraArg), void *extraArg,
+                              TreeSchedulerStats *stats) {
+    double startTime;
+    startPass(stats, &startTime);
+    // The root is processed outside of the parallel region, so that the parallel regions of fn have all the threads
+    TreeSchedulerNode *root = &treeScheduler->nodes[0];
+    double rootStartTime = getTime();
+    fn(root->node, extraArg);
+    root->time = getTime() - rootStartTime;
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+    startChildrenTopDown(treeScheduler, 0, fn, extraArg); // The implicit barrier at the end of single waits for all the tasks
+    endPass(treeScheduler, stats, startTime);
+}
+
+/*
+ * Bottom-up pass.
+ */
+
+static void runBottomUpNode(TreeScheduler *treeScheduler, int64_t i,
+                            void *(*fn)(void *node, stList *childResults, void *extraArg), void *extraArg) {
+    TreeSchedulerNode *n = &treeScheduler->nodes[i];
+    stList *childResults = stList_construct();
+    for (int64_t j = 0; j < n->childNumber; j++) {
+        stList_append(childResults, treeScheduler->nodes[n->firstChild + j].result);
+    }
+    double startTime = getTime();
+    n->result = fn(n->node, childResults, extraArg);
+    n->time = getTime() - startTime;
+    stList_destruct(childResults);
+}
+
+static void runBottomUp(TreeScheduler *treeScheduler, int64_t i,
+                        void *(*fn)(void *node, stList *childResults, void *extraArg), void *extraArg) {
+    TreeSchedulerNode *n = &treeScheduler->nodes[i];
+#if defined(_OPENMP)
+#pragma omp flush // Get the results of the children
+#endif
+    runBottomUpNode(treeScheduler, i, fn, extraArg);
+
+    // If this is the last child of the parent to finish then start the parent, unless the parent is the root,
+    // which is processed once the parallel region has ended
+    if (n->parent > 0) {
+        TreeSchedulerNode *p = &treeScheduler->nodes[n->parent];
+        int64_t pendingChildren;
+#if defined(_OPENMP)
+#pragma omp flush // Publish the result
+#pragma omp atomic capture
+#endif
+        pendingChildren = --p->pendingChildren;
+        if (pendingChildren == 0) {
+            int64_t k = n->parent;
+#if defined(_OPENMP)
+#pragma omp task firstprivate(k)
+#endif
+            runBottomUp(treeScheduler, k, fn, extraArg);
+        }
+    }
+}
+
+void *treeScheduler_runBottomUp(TreeScheduler *treeScheduler, void *(*fn)(void *node, stList *childResults, void *extraArg),
+                                void *extraArg, TreeSchedulerStats *stats) {
+    double startTime;
+    startPass(stats, &startTime);
+    for (int64_t i = 0; i < treeScheduler->nodeNumber; i++) {
+        treeScheduler->nodes[i].pendingChildren = treeScheduler->nodes[i].childNumber;
+        treeScheduler->nodes[i].result = NULL;
+    }
+    if (treeScheduler->nodeNumber > 1) {
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+        {
+            // Start the leaves, those on the most expensive paths to the root first
+            for (int64_t j = 0; j < treeScheduler->leafNumber; j++) {
+                int64_t k = treeScheduler->leaves[j];
+#if defined(_OPENMP)
+#pragma omp task firstprivate(k)
+#endif
+                runBottomUp(treeScheduler, k, fn, extraArg);
+            }
+        }
+    }
+    // The root is processed outside of the parallel region, so that the parallel regions of fn have all the threads
+    runBottomUpNode(treeScheduler, 0, fn, extraArg);
+    endPass(treeScheduler, stats, startTime);
+    return treeScheduler->nodes[0].result;
+}
+
+void treeSchedulerStats_log(TreeSchedulerStats *stats, const char *passName) {
+    st_logInfo("Scheduled %s over %" PRIi64 " tasks with %" PRIi64 " threads: wall time %.3f s, "
+               "busy time %.3f s, critical path %.3f s, idle time %.3f s (%.1f%% of available)\n",
+               passName, stats->taskNumber, stats->threadNumber, stats->wallTime, stats->busyTime,
+               stats->criticalPathTime, stats->idleTime,
+               stats->wallTime > 0.0 ? 100.0 * stats->idleTime / (stats->threadNumber * stats->wallTime) : 0.0);
+}
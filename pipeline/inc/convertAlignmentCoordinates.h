@@ -10,7 +10,9 @@
 #include "cactus.h"
 
 /*
- * Converts input alignments coordinates into coordinates used by cactus.
+ * Converts input alignments coordinates into coordinates used by cactus, writing the pinches of the
+ * alignments to a scored binary pinch file (see stPinchIterator.h) that can be read back cheaply in every
+ * round of annealing, and sorted by alignment score for the filters that need it.
  */
 void convertAlignmentCoordinates(char *inputAlignmentFile, char *outputAlignmentFile, Flower *flower);
 
@@ -0,0 +1,75 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#ifndef TREE_SCHEDULER_H_
+#define TREE_SCHEDULER_H_
+
+#include "sonLib.h"
+
+/*
+ * Schedules work over a tree, such as the flower hierarchy, as a graph of tasks rather than layer by layer.
+ *
+ * In a top-down pass the work on a node starts as soon as the work on its parent is done, and in a bottom-up
+ * pass as soon as the work on all its children is done, so no node waits for the slowest node of its layer.
+ * Where there is a choice, the nodes on the most expensive paths of the tree, by the cost function given to the
+ * scheduler, are started first.
+ *
+ * The passes use OpenMP tasks, and run serially if compiled without OpenMP. The root, which in the flower hierarchy
+ * is usually by far the most expensive node, is processed by the calling thread outside of the parallel region of
+ * the tasks, so any parallel region it opens gets all the threads. Every other node is processed within the tasks,
+ * where, as nested parallelism is not enabled, its parallel regions get a single thread.
+ */
+
+typedef struct _treeScheduler TreeScheduler;
+
+/*
+ * Statistics of a pass. Times are in seconds.
+ */
+typedef struct _treeSchedulerStats {
+    int64_t taskNumber; // The number of nodes processed
+    int64_t threadNumber; // The number of threads available to the pass
+    double wallTime; // The elapsed time of the pass
+    double busyTime; // The sum of the times spent processing each node
+    double criticalPathTime; // The time of the most expensive path through the tree, a lower bound on the wall time
+    double idleTime; // threadNumber * wallTime - busyTime
+} TreeSchedulerStats;
+
+/*
+ * Constructs a scheduler for the tree with the given root. getChildren appends the children of a node to the
+ * given list, and getCost returns an estimate of the cost of processing a node, used to prioritise the nodes.
+ */
+TreeScheduler *treeScheduler_construct(void *root, void (*getChildren)(void *node, stList *children),
+                                       int64_t (*getCost)(void *node));
+
+void treeScheduler_destruct(TreeScheduler *treeScheduler);
+
+/*
+ * Gets the number of nodes in the tree.
+ */
+int64_t treeScheduler_size(TreeScheduler *treeScheduler);
+
+/*
+ * Calls fn on every node of the tree, calling it on each node only once it has returned for the node's parent.
+ * Calls on different subtrees may run concurrently, after the call on the root, which runs alone.
+ * If stats is not NULL it is filled in.
+ */
+void treeScheduler_runTopDown(TreeScheduler *treeScheduler, void (*fn)(void *node, void *extraArg), void *extraArg,
+                              TreeSchedulerStats *stats);
+
+/*
+ * Calls fn on every node of the tree, calling it on each node only once it has returned for all of the node's
+ * children. fn is given the results it returned for the children, in the order given by getChildren, and the list
+ * is destructed after fn returns (but not its elements). Returns the result of fn for the root.
+ * Calls on different subtrees may run concurrently, before the call on the root, which runs alone.
+ * If stats is not NULL it is filled in.
+ */
+void *treeScheduler_runBottomUp(TreeScheduler *treeScheduler, void *(*fn)(void *node, stList *childResults, void *extraArg),
+                                void *extraArg, TreeSchedulerStats *stats);
+
+/*
+ * Logs the statistics of a pass, at the info level.
+ */
+void treeSchedulerStats_log(TreeSchedulerStats *stats, const char *passName);
+
+#endif /* TREE_SCHEDULER_H_ */
@@ -8,10 +8,14 @@
 #include "sonLib.h"
 
 CuSuite* cactusParamsTestSuite(void);
+CuSuite *treeSchedulerTestSuite(void);
+CuSuite *convertAlignmentCoordinatesTestSuite(void);
 
 int cactusPipelineRunAllTests(void) {
     CuString *output = CuStringNew();
     CuSuite* suite = CuSuiteNew();
+    CuSuiteAddSuite(suite, treeSchedulerTestSuite());
+    CuSuiteAddSuite(suite, convertAlignmentCoordinatesTestSuite());
 
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
@@ -0,0 +1,55 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "CuTest.h"
+#include "sonLib.h"
+#include "cactus.h"
+#include "stPinchIterator.h"
+#include "convertAlignmentCoordinates.h"
+#include "pinchGraphsTestShared.h"
+
+/*
+ * Converts a small PAF file and checks the pinches read back from the binary pinch file, which are named by the
+ * caps of the sequences and shifted by two to step over the caps.
+ */
+static void testConvertAlignmentCoordinates(CuTest *testCase) {
+    CactusDisk *cactusDisk = cactusDisk_construct();
+    eventTree_construct2(cactusDisk);
+    Flower *flower = flower_construct2(0, cactusDisk);
+    group_construct2(flower);
+    Name name1 = testCommon_addThreadToFlower(flower, "one", 100);
+    Name name2 = testCommon_addThreadToFlower(flower, "two", 100);
+
+    char *inputFile = "tempFileForConvertAlignmentCoordinatesTest.paf";
+    char *outputFile = "tempFileForConvertAlignmentCoordinatesTest.bin";
+    FILE *fileHandle = fopen(inputFile, "w");
+    assert(fileHandle != NULL);
+    fprintf(fileHandle, "one\t100\t10\t29\t+\ttwo\t100\t5\t23\t0\t0\t60\tcg:Z:5M2=3X2I4M1D3M\tAS:i:7\n");
+    fprintf(fileHandle, "two\t100\t10\t20\t+\tone\t100\t0\t10\t0\t0\t60\n");
+    fprintf(fileHandle, "one\t100\t10\t20\t-\ttwo\t100\t0\t11\t0\t0\t60\tcg:Z:4M1D6M\n");
+    fclose(fileHandle);
+    convertAlignmentCoordinates(inputFile, outputFile, flower);
+
+    stPinchIterator *pinchIterator = stPinchIterator_constructFromFile(outputFile);
+    stPinch pinchToFillOut;
+    checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), name1, name2, 12, 7, 10, 1);
+    CuAssertIntEquals(testCase, 7, stPinchIterator_getScore(pinchIterator));
+    checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), name1, name2, 24, 17, 4, 1);
+    checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), name1, name2, 28, 22, 3, 1);
+    // The alignment without a cigar has no pinches
+    checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), name1, name2, 18, 2, 4, 0);
+    checkPinch(testCase, stPinchIterator_getNext(pinchIterator, &pinchToFillOut), name1, name2, 12, 7, 6, 0);
+    CuAssertPtrEquals(testCase, NULL, stPinchIterator_getNext(pinchIterator, &pinchToFillOut));
+
+    stPinchIterator_destruct(pinchIterator);
+    stFile_rmtree(inputFile);
+    stFile_rmtree(outputFile);
+    cactusDisk_destruct(cactusDisk);
+}
+
+CuSuite *convertAlignmentCoordinatesTestSuite(void) {
+    CuSuite *suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, testConvertAlignmentCoordinates);
+    return suite;
+}
@@ -0,0 +1,169 @@
+/*
+ * Released under the MIT license, see LICENSE.txt
+ */
+
+#include "CuTest.h"
+#include "sonLib.h"
+#include "treeScheduler.h"
+
+// OpenMP
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+typedef struct _testNode {
+    stList *children;
+    int64_t subtreeSize;
+    int64_t visit; // The order in which the node was visited
+    int64_t visits; // The number of times the node was visited
+    struct _testNode *parent;
+} TestNode;
+
+static int64_t visitCounter;
+static bool childResultsCorrect; // Set false if fn is given the wrong child results, as CuAssert is not thread safe
+static bool rootRunAlone; // Set false if fn is called on the root within a parallel region
+
+static void getTestNodeChildren(void *node, stList *children) {
+    stList_appendAll(children, ((TestNode *)node)->children);
+}
+
+static int64_t getTestNodeCost(void *node) {
+    return ((TestNode *)node)->subtreeSize;
+}
+
+static void testNode_destruct(TestNode *node) {
+    stList_destruct(node->children);
+    free(node);
+}
+
+/*
+ * Makes a random tree, returning a list of its nodes, the first of which is the root.
+ */
+static stList *getRandomTree(void) {
+    stList *nodes = stList_construct3(0, (void (*)(void *))testNode_destruct);
+    int64_t nodeNumber = st_randomInt(1, 500);
+    for (int64_t i = 0; i < nodeNumber; i++) {
+        TestNode *node = st_calloc(1, sizeof(TestNode));
+        node->children = stList_construct();
+        if (i > 0) {
+            // Bias towards deep trees by choosing among the most recent nodes
+            node->parent = stList_get(nodes, st_randomInt(i > 10 ? i - 10 : 0, i));
+            stList_append(node->parent->children, node);
+        }
+        stList_append(nodes, node);
+    }
+    for (int64_t i = nodeNumber - 1; i >= 0; i--) { // Children come after their parents
+        TestNode *node = stList_get(nodes, i);
+        node->subtreeSize++;
+        if (node->parent != NULL) {
+            node->parent->subtreeSize += node->subtreeSize;
+        }
+    }
+    return nodes;
+}
+
+static void visitTopDown(void *node, void *extraArg) {
+    TestNode *testNode = node;
+    int64_t visit;
+#pragma omp atomic capture
+    visit = visitCounter++;
+    testNode->visit = visit;
+    testNode->visits++;
+#if defined(_OPENMP)
+    if (testNode->parent == NULL && omp_in_parallel()) {
+        rootRunAlone = 0;
+    }
+#endif
+}
+
+static void *visitBottomUp(void *node, stList *childResults, void *extraArg) {
+    TestNode *testNode = node;
+    visitTopDown(node, extraArg);
+    // The results of the children must be in the order of the children
+    if (stList_length(testNode->children) != stList_length(childResults)) {
+        childResultsCorrect = 0;
+        return NULL;
+    }
+    int64_t *subtreeSize = st_malloc(sizeof(int64_t));
+    *subtreeSize = 1;
+    for (int64_t i = 0; i < stList_length(childResults); i++) {
+        int64_t *childSubtreeSize = stList_get(childResults, i);
+        if (((TestNode *)stList_get(testNode->children, i))->subtreeSize != *childSubtreeSize) {
+            childResultsCorrect = 0;
+        }
+        *subtreeSize += *childSubtreeSize;
+        free(childSubtreeSize);
+    }
+    return subtreeSize;
+}
+
+static void checkStats(CuTest *testCase, TreeSchedulerStats *stats, int64_t nodeNumber) {
+    CuAssertIntEquals(testCase, nodeNumber, stats->taskNumber);
+    CuAssertTrue(testCase, stats->threadNumber >= 1);
+    CuAssertTrue(testCase, stats->criticalPathTime <= stats->busyTime + 1e-9);
+    CuAssertTrue(testCase, stats->idleTime >= 0.0);
+}
+
+static void test_treeScheduler_topDown(CuTest *testCase) {
+    for (int64_t test = 0; test < 100; test++) {
+        stList *nodes = getRandomTree();
+        TreeScheduler *treeScheduler = treeScheduler_construct(stList_get(nodes, 0), getTestNodeChildren,
+                                                               getTestNodeCost);
+        CuAssertIntEquals(testCase, stList_length(nodes), treeScheduler_size(treeScheduler));
+        visitCounter = 0;
+        rootRunAlone = 1;
+        TreeSchedulerStats stats;
+        treeScheduler_runTopDown(treeScheduler, visitTopDown, NULL, &stats);
+        CuAssertTrue(testCase, rootRunAlone);
+        checkStats(testCase, &stats, stList_length(nodes));
+        CuAssertIntEquals(testCase, stList_length(nodes), visitCounter);
+        for (int64_t i = 0; i < stList_length(nodes); i++) {
+            TestNode *node = stList_get(nodes, i);
+            CuAssertIntEquals(testCase, 1, node->visits);
+            if (node->parent != NULL) {
+                CuAssertTrue(testCase, node->parent->visit < node->visit);
+            }
+        }
+        treeScheduler_destruct(treeScheduler);
+        stList_destruct(nodes);
+    }
+}
+
+static void test_treeScheduler_bottomUp(CuTest *testCase) {
+    for (int64_t test = 0; test < 100; test++) {
+        stList *nodes = getRandomTree();
+        TreeScheduler *treeScheduler = treeScheduler_construct(stList_get(nodes, 0), getTestNodeChildren,
+                                                               getTestNodeCost);
+        for (int64_t pass = 0; pass < 2; pass++) { // Check the scheduler can be reused
+            visitCounter = 0;
+            for (int64_t i = 0; i < stList_length(nodes); i++) {
+                ((TestNode *)stList_get(nodes, i))->visits = 0;
+            }
+            childResultsCorrect = 1;
+            rootRunAlone = 1;
+            TreeSchedulerStats stats;
+            int64_t *rootSubtreeSize = treeScheduler_runBottomUp(treeScheduler, visitBottomUp, NULL, &stats);
+            CuAssertTrue(testCase, childResultsCorrect);
+            CuAssertTrue(testCase, rootRunAlone);
+            checkStats(testCase, &stats, stList_length(nodes));
+            CuAssertIntEquals(testCase, stList_length(nodes), *rootSubtreeSize);
+            free(rootSubtreeSize);
+            for (int64_t i = 0; i < stList_length(nodes); i++) {
+                TestNode *node = stList_get(nodes, i);
+                CuAssertIntEquals(testCase, 1, node->visits);
+                if (node->parent != NULL) {
+                    CuAssertTrue(testCase, node->parent->visit > node->visit);
+                }
+            }
+        }
+        treeScheduler_destruct(treeScheduler);
+        stList_destruct(nodes);
+    }
+}
+
+CuSuite *treeSchedulerTestSuite(void) {
+    CuSuite *suite = CuSuiteNew();
+    SUITE_ADD_TEST(suite, test_treeScheduler_topDown);
+    SUITE_ADD_TEST(suite, test_treeScheduler_bottomUp);
+    return suite;
+}
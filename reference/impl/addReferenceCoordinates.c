@@ -8,6 +8,7 @@
 #include "cactus.h"
 #include "sonLib.h"
 #include "recursiveThreadBuilder.h"
+#include "addReferenceCoordinates.h"
 #include "blockMLString.h"
 
 Cap *getCapForReferenceEvent(End *end, Name referenceEventName) {
@@ -205,26 +206,135 @@ static char *segmentWriteFn(Segment *segment, void *extraArg) {
 
 /*
  * A thread is trivial if all the segments it contains come from blocks containing only a reference segment.
- * These reference only segments represent scaffold gaps. At the same time, it processes the thread string
- * to remove the boolean values use to indicate if a thread is trivial or not.
+ * These reference only segments represent scaffold gaps. The thread string is built by passing the thread
+ * through appendThreadPiece, which drops the boolean values used to indicate if a segment is trivial or not,
+ * and the spaces that follow them. The bases of a segment are never digits or spaces.
  */
-static bool isTrivialString(char **threadString) {
-    stList *strings = stString_split(*threadString); //Split splits into individual segments.
-    bool trivialString = 1;
-    for(int64_t i=0; i<stList_length(strings); i++) {
-        char *segmentString = stList_get(strings, i);
-        int64_t j = strlen(segmentString)-1; //Location of the boolean value within a segment.
-        assert(j > 0);
-        assert(segmentString[j] == '0' || segmentString[j] == '1');
-        if(segmentString[j] == '1') { //Found a non-trivial segment, hence the thread is non-trivial.
-            trivialString = 0;
+typedef struct _threadStringBuilder {
+    char *string;
+    int64_t length;
+    bool trivialString;
+} ThreadStringBuilder;
+
+static void appendThreadPiece(const char *bytes, int64_t length, void *extraArg) {
+    ThreadStringBuilder *builder = extraArg;
+    for (int64_t i = 0; i < length; i++) {
+        char c = bytes[i];
+        if (c == '1') { //Found a non-trivial segment, hence the thread is non-trivial.
+            builder->trivialString = 0;
+        } else if (c != '0' && c != ' ') {
+            builder->string[builder->length++] = c;
         }
-        segmentString[j] = '\0';
     }
-    free(*threadString); //Free old thread string. Doing it this way is a bit more memory efficient, as we don't keep two copies of the string around.
-    *threadString = stString_join2("", strings); //Concatenation makes one sequence, now without the booleans.
-    stList_destruct(strings);
-    return trivialString;
+}
+
+static char *getThreadStringFromString(char *threadString, bool *trivialString) {
+    ThreadStringBuilder builder;
+    builder.string = threadString; //Done in place, as the thread string only gets shorter
+    builder.length = 0;
+    builder.trivialString = 1;
+    appendThreadPiece(threadString, strlen(threadString), &builder);
+    builder.string[builder.length] = '\0';
+    *trivialString = builder.trivialString;
+    return threadString;
+}
+
+static char *terminalAdjacencyWriteBinaryFn(Cap *cap, void *extraArg) {
+    return binaryRecord_construct(NULL, 0);
+}
+
+static char *segmentWriteBinaryFn(Segment *segment, void *extraArg) {
+    stTree *phylogeneticTree = extraArg;
+    Block *block = segment_getBlock(segment);
+    char *segmentString = getMaximumLikelihoodString(phylogeneticTree, block);
+    char *payload;
+    char *record = binaryRecord_allocate(1 + block_getLength(block), &payload);
+    payload[0] = block_getInstanceNumber(block) == 1 ? SEGMENT_RECORD_TRIVIAL : SEGMENT_RECORD_NON_TRIVIAL;
+    memcpy(payload + 1, segmentString, block_getLength(block));
+    free(segmentString);
+    return record;
+}
+
+/*
+ * The states of the reader of a binary thread.
+ */
+typedef enum _threadReaderState {
+    THREAD_READER_RECORD, // Expecting the tag of a record
+    THREAD_READER_LENGTH, // Reading the varint length of the payload of a record
+    THREAD_READER_PAYLOAD, // Expecting the first byte of a non-empty payload
+    THREAD_READER_BASES // Copying the bases of a segment
+} ThreadReaderState;
+
+typedef struct _binaryThreadStringBuilder {
+    ThreadStringBuilder builder;
+    ThreadReaderState state;
+    uint64_t length; // The length being read, then the number of bases left to copy
+    int64_t shift;
+} BinaryThreadStringBuilder;
+
+static void appendBinaryThreadPiece(const char *bytes, int64_t length, void *extraArg) {
+    /*
+     * Reads the records of a binary thread from the piece, which may end anywhere in a record. A non-empty payload
+     * starting with a record tag is that of a thread, whose records are read in turn, else it is that of a segment.
+     */
+    BinaryThreadStringBuilder *b = extraArg;
+    int64_t i = 0;
+    while (i < length) {
+        switch (b->state) {
+            case THREAD_READER_RECORD:
+                assert(bytes[i] == RECORD_BINARY_TAG);
+                i++;
+                b->state = THREAD_READER_LENGTH;
+                b->length = 0;
+                b->shift = 0;
+                break;
+            case THREAD_READER_LENGTH: {
+                unsigned char c = bytes[i++];
+                b->length |= ((uint64_t)(c & 0x7F)) << b->shift;
+                b->shift += 7;
+                if (!(c & 0x80)) {
+                    b->state = b->length > 0 ? THREAD_READER_PAYLOAD : THREAD_READER_RECORD;
+                }
+                break;
+            }
+            case THREAD_READER_PAYLOAD:
+                if (bytes[i] == RECORD_BINARY_TAG) { // The records of a thread, read from its first
+                    b->state = THREAD_READER_RECORD;
+                    break;
+                }
+                assert(bytes[i] == SEGMENT_RECORD_TRIVIAL || bytes[i] == SEGMENT_RECORD_NON_TRIVIAL);
+                if (bytes[i++] == SEGMENT_RECORD_NON_TRIVIAL) { //Found a non-trivial segment, hence the thread is non-trivial.
+                    b->builder.trivialString = 0;
+                }
+                b->length--;
+                b->state = b->length > 0 ? THREAD_READER_BASES : THREAD_READER_RECORD;
+                break;
+            case THREAD_READER_BASES: {
+                int64_t j = length - i < (int64_t)b->length ? length - i : (int64_t)b->length;
+                memcpy(b->builder.string + b->builder.length, bytes + i, j);
+                b->builder.length += j;
+                i += j;
+                b->length -= j;
+                if (b->length == 0) {
+                    b->state = THREAD_READER_RECORD;
+                }
+                break;
+            }
+        }
+    }
+}
+
+char *getThreadStringFromBinaryThread(RecordRope *thread, bool *trivialString) {
+    BinaryThreadStringBuilder b;
+    b.builder.string = st_malloc(recordRope_getLength(thread) + 1); //The thread string is shorter than the rope
+    b.builder.length = 0;
+    b.builder.trivialString = 1;
+    b.state = THREAD_READER_RECORD;
+    recordRope_forEachPiece(thread, appendBinaryThreadPiece, &b);
+    assert(b.state == THREAD_READER_RECORD);
+    b.builder.string[b.builder.length] = '\0';
+    *trivialString = b.builder.trivialString;
+    return b.builder.string;
 }
 
 static Sequence *addSequence(Flower *flower, Cap *cap, int64_t index, char *string, bool trivialString) {
@@ -297,7 +407,7 @@ static stList *getCaps(Flower *flower, Name referenceEventName) {
     return caps;
 }
 
-static stList *bottomUp1(Flower *flower, Name referenceEventName, stMatrix *(*generateSubstitutionMatrix)(double)) {
+static stList *bottomUp1(Flower *flower, Name referenceEventName) {
     stList *caps = getCaps(flower, referenceEventName);
     flower_setFastCapsAndEnds(flower, true);
     for (int64_t i = stList_length(caps) - 1; i >= 0; i--) { //Start from end, as we add to this list.
@@ -309,16 +419,21 @@ static stList *bottomUp1(Flower *flower, Name referenceEventName, stMatrix *(*ge
     return caps;
 }
 
-static void bottomUp2(stList *threadStrings, stList *caps) {
-    assert(stList_length(threadStrings) == stList_length(caps));
-    int64_t nonTrivialSeqIndex = 0, trivialSeqIndex = stList_length(threadStrings); //These are used as indices for the names of trivial and non-trivial sequences.
-    for (int64_t i = 0; i < stList_length(threadStrings); i++) {
+static void bottomUp2(stList *threads, stList *caps, bool threadsAreRopes) {
+    /*
+     * Adds the sequences for the threads, which are either strings or, if threadsAreRopes is non-zero, ropes of
+     * binary records.
+     */
+    assert(stList_length(threads) == stList_length(caps));
+    int64_t nonTrivialSeqIndex = 0, trivialSeqIndex = stList_length(threads); //These are used as indices for the names of trivial and non-trivial sequences.
+    for (int64_t i = 0; i < stList_length(threads); i++) {
         Cap *cap = stList_get(caps, i);
         assert(cap_getStrand(cap));
         assert(!cap_getSide(cap));
         Flower *flower = end_getFlower(cap_getEnd(cap));
-        char *threadString = stList_get(threadStrings, i);
-        bool trivialString = isTrivialString(&threadString); //This alters the original string
+        bool trivialString;
+        char *threadString = threadsAreRopes ? getThreadStringFromBinaryThread(stList_get(threads, i), &trivialString) :
+                getThreadStringFromString(stList_get(threads, i), &trivialString);
         Sequence *sequence = addSequence(flower, cap, trivialString ? trivialSeqIndex++ : nonTrivialSeqIndex++,
                                                      threadString, trivialString);
         free(threadString);
@@ -326,8 +441,10 @@ static void bottomUp2(stList *threadStrings, stList *caps) {
         (void) endCoordinate;
         assert(endCoordinate == sequence_getLength(sequence) + sequence_getStart(sequence));
     }
-    stList_setDestructor(threadStrings, NULL); //The strings are already cleaned up by the above loop
-    stList_destruct(threadStrings);
+    if (!threadsAreRopes) {
+        stList_setDestructor(threads, NULL); //The strings are already cleaned up by the above loop
+    }
+    stList_destruct(threads);
 }
 
 void bottomUp(Flower *flower, stKVDatabase *sequenceDatabase, Name referenceEventName,
@@ -338,7 +455,7 @@ void bottomUp(Flower *flower, stKVDatabase *sequenceDatabase, Name referenceEven
      * Therefore, for each flower f first identify attached stub ends present in the children of f that are
      * not present in f and copy them into f, reattaching the reference caps as needed.
      */
-    stList *caps = bottomUp1(flower, referenceEventName, generateSubstitutionMatrix);
+    stList *caps = bottomUp1(flower, referenceEventName);
 
     //Get the phylogenetic event trees for base calling.
     stTree *phylogeneticTree =
@@ -348,7 +465,7 @@ void bottomUp(Flower *flower, stKVDatabase *sequenceDatabase, Name referenceEven
     if (isTop) {
         stList *threadStrings = buildRecursiveThreadsInList(sequenceDatabase, caps, segmentWriteFn,
                 terminalAdjacencyWriteFn, phylogeneticTree);
-        bottomUp2(threadStrings, caps);
+        bottomUp2(threadStrings, caps, 0);
     } else {
         buildRecursiveThreads(sequenceDatabase, caps, segmentWriteFn, terminalAdjacencyWriteFn, phylogeneticTree);
     }
@@ -356,23 +473,20 @@ void bottomUp(Flower *flower, stKVDatabase *sequenceDatabase, Name referenceEven
     stList_destruct(caps);
 }
 
-void bottomUpNoDb(Flower *flower, RecordHolder *rh, Name referenceEventName,
-              bool isTop, stMatrix *(*generateSubstitutionMatrix)(double)) {
-    stList *caps = bottomUp1(flower, referenceEventName, generateSubstitutionMatrix);
-
-    //Get the phylogenetic event trees for base calling.
-    stTree *phylogeneticTree =
-            getPhylogeneticTreeRootedAtGivenEvent(eventTree_getEvent(flower_getEventTree(flower), referenceEventName),
-                                                  generateSubstitutionMatrix);
+void bottomUpNoDb(Flower *flower, RecordHolder *rh, stTree *phylogeneticTree, bool isTop) {
+    /*
+     * As bottomUp, but the records of the threads are kept in rh rather than a database, and the phylogenetic tree
+     * for base calling, rooted at the reference event, is given, so one tree can be shared by all the flowers.
+     */
+    stList *caps = bottomUp1(flower, event_getName(getEvent(phylogeneticTree)));
 
     if (isTop) {
-        stList *threadStrings = buildRecursiveThreadsInListNoDb(rh, caps, segmentWriteFn,
-                                                            terminalAdjacencyWriteFn, phylogeneticTree);
-        bottomUp2(threadStrings, caps);
+        stList *threads = buildRecursiveThreadRopesNoDb(rh, caps, segmentWriteBinaryFn,
+                                                        terminalAdjacencyWriteBinaryFn, phylogeneticTree);
+        bottomUp2(threads, caps, 1);
     } else {
-        buildRecursiveThreadsNoDb(rh, caps, segmentWriteFn, terminalAdjacencyWriteFn, phylogeneticTree);
+        buildRecursiveThreadsNoDb(rh, caps, segmentWriteBinaryFn, terminalAdjacencyWriteBinaryFn, phylogeneticTree);
     }
-    cleanupPhylogeneticTree(phylogeneticTree);
     stList_destruct(caps);
 }
 
@@ -15,29 +15,76 @@
 /////
 // Code to for creating a phylogenetic model of a given event tree with associated substitution matrices.
 ////
+
+/*
+ * The probabilities of A, C, G and T at a position of a block. Using a vector type the columns are transformed
+ * and multiplied with SIMD instructions where the target has them (AVX with -mavx2, NEON on ARM).
+ */
+typedef double BaseProbs __attribute__((vector_size(4 * sizeof(double))));
+
+/*
+ * The substitution matrix of a branch, as its columns, so that transforming a column v by the matrix is the sum
+ * over j of v[j] * columns[j]. Also the transformed columns of the possible leaf bases: A, C, G, T and any
+ * other character, which is treated as unknown, marginalising over all the bases.
+ */
+typedef struct _branchMatrix {
+    BaseProbs columns[4];
+    BaseProbs leafColumns[5];
+} BranchMatrix;
+
+static void getBranchMatrix(stMatrix *substitutionMatrix, BranchMatrix *branchMatrix) {
+    assert(stMatrix_n(substitutionMatrix) == 4);
+    for (int64_t j = 0; j < 4; j++) {
+        for (int64_t i = 0; i < 4; i++) {
+            branchMatrix->columns[j][i] = *stMatrix_getCell(substitutionMatrix, i, j);
+        }
+        branchMatrix->leafColumns[j] = branchMatrix->columns[j];
+    }
+    branchMatrix->leafColumns[4] = branchMatrix->columns[0] + branchMatrix->columns[1] + branchMatrix->columns[2] +
+                                   branchMatrix->columns[3];
+}
+
+/*
+ * The attributes of each node of a phylogenetic tree. The substitution matrix of the parent branch is kept both as
+ * given and as a BranchMatrix, made when the tree is built, so one tree can be shared by all the blocks and
+ * threads that are base called without anything being built per node.
+ */
+typedef struct _phylogeneticNode {
+    BranchMatrix branchMatrix; // First, as it must be aligned to the size of its columns
+    stMatrix *substitutionMatrix;
+    Event *event;
+    int64_t depth; // The number of levels of the subtree rooted at the node
+} PhylogeneticNode;
+
+static inline PhylogeneticNode *getNode(stTree *tree) {
+    return stTree_getClientData(tree);
+}
+
 stMatrix *getSubMatrix(stTree *tree) {
     /*
      * Gets back the substitution matrix for the parent branch of a given node.
      */
-    return ((void **) stTree_getClientData(tree))[0];
+    return getNode(tree)->substitutionMatrix;
 }
 
 Event *getEvent(stTree *tree) {
     /*
      * Gets the event of the event tree that this node maps to.
      */
-    return ((void **) stTree_getClientData(tree))[1];
+    return getNode(tree)->event;
 }
 
 static stTree *getPhylogeneticTree(Event *event, Event *eventToTreatAsParent,
         stMatrix *(*generateSubstitutionMatrix)(double)) {
     stTree *tree = stTree_construct();
-    stMatrix *matrix = generateSubstitutionMatrix(
+    PhylogeneticNode *node;
+    if (posix_memalign((void **) &node, sizeof(BaseProbs), sizeof(PhylogeneticNode)) != 0) {
+        st_errAbort("Failed to allocate a phylogenetic tree node");
+    }
+    node->substitutionMatrix = generateSubstitutionMatrix(
             event_getBranchLength(eventToTreatAsParent == NULL ? event : eventToTreatAsParent));
-    void **attributes = st_malloc(sizeof(void *) * 2);
-    attributes[0] = matrix;
-    attributes[1] = event;
-    stTree_setClientData(tree, attributes);
+    node->event = event;
+    stTree_setClientData(tree, node);
     for (int64_t i = 0; i < event_getChildNumber(event); i++) {
         if (eventToTreatAsParent != event_getChild(event, i)) {
             stTree_setParent(getPhylogeneticTree(event_getChild(event, i), NULL, generateSubstitutionMatrix), tree);
@@ -46,17 +93,35 @@ static stTree *getPhylogeneticTree(Event *event, Event *eventToTreatAsParent,
     return tree;
 }
 
+static void setBranchMatricesAndDepths(stTree *tree) {
+    /*
+     * Fills in the attributes of the nodes that are derived from their substitution matrices and children,
+     * once the tree has been re-rooted.
+     */
+    PhylogeneticNode *node = getNode(tree);
+    getBranchMatrix(node->substitutionMatrix, &node->branchMatrix);
+    node->depth = 0;
+    for (int64_t i = 0; i < stTree_getChildNumber(tree); i++) {
+        stTree *child = stTree_getChild(tree, i);
+        setBranchMatricesAndDepths(child);
+        node->depth = getNode(child)->depth > node->depth ? getNode(child)->depth : node->depth;
+    }
+    node->depth++;
+}
+
 stTree *getPhylogeneticTreeRootedAtGivenEvent(Event *event, stMatrix *(*generateSubstitutionMatrix)(double)) {
     /*
      * Creates a stTree isomorphic to the eventTree that 'event' is part of, but rooted at 'event'.
-     * Each node is the returned tree has two attributes, arranged in an array (see getSubMatrix and getEvent above).
+     * Each node is the returned tree has attributes (see getSubMatrix and getEvent above).
      * The first is a substitution matrix giving substitution probabilities for bases along the incident parent branch of
      * the re-rooted tree.
      * The second is the event that it maps to in the original event tree.
+     * The tree is only read by base calling, so it can be built once per reference event and shared between
+     * flowers and threads for as long as the event tree is unchanged.
      */
     stTree *tree = getPhylogeneticTree(event, NULL, generateSubstitutionMatrix); //This builds the subtree rooted at the given event
     stMatrix_destruct(getSubMatrix(tree)); //This cleans up the substitution matrix for the root of the remodeled tree.
-    ((void **) stTree_getClientData(tree))[0] = generateSubstitutionMatrix(0.0); //And this parameterizes the substitution matrix of
+    getNode(tree)->substitutionMatrix = generateSubstitutionMatrix(0.0); //And this parameterizes the substitution matrix of
     //the parent branch of the root to have zero length.
 
     //The following builds out the subtree of the eventTree not represented by tree
@@ -68,6 +133,7 @@ stTree *getPhylogeneticTreeRootedAtGivenEvent(Event *event, stMatrix *(*generate
         tree2 = tree3;
         event = pEvent;
     }
+    setBranchMatricesAndDepths(tree);
     return tree;
 }
 
@@ -76,7 +142,7 @@ void cleanupPhylogeneticTreeP(stTree *tree) {
         cleanupPhylogeneticTreeP(stTree_getChild(tree, i));
     }
     stMatrix_destruct(getSubMatrix(tree));
-    free(stTree_getClientData(tree));
+    free(getNode(tree));
 }
 
 void cleanupPhylogeneticTree(stTree *tree) {
@@ -114,14 +180,10 @@ char indexToChar(int64_t i) {
     }
 }
 
-static char *getMaxLikelihoodString(double *baseProbs, int64_t length) {
+static char *getMaxLikelihoodString(BaseProbs *baseProbs, int64_t length) {
     /*
-     * For the "baseProbs" 2d array of base probabilities generates a ML string of bases.
-     * The baseProbs array is organised as
-     * [ Prob of A at position 0, Prob of C at position 0, Prob of G at position 0, Prob of T at position 0,
-     *   Prob of A at position 1, Prob of C at position 1, Prob of G at position 1, Prob of T at position 1,
-     *   ...
-     *  etc.
+     * For the "baseProbs" array of base probabilities generates a ML string of bases.
+     * Each column of the baseProbs array holds the probabilities of A, C, G and T at a position of the block.
      *  The returned string is a an upper case string of A, C, G and T.
      *  Length is the length of the string.
      *  In case of bases at a position with equal probability a (somewhat) random base is chosen.
@@ -129,9 +191,9 @@ static char *getMaxLikelihoodString(double *baseProbs, int64_t length) {
     char *mlString = st_malloc(sizeof(char) * (length+1));
     for (int64_t i = 0; i < length; i++) {
         int64_t k = 0;
-        double m = baseProbs[i * 4];
+        double m = baseProbs[i][0];
         for (int64_t j = 1; j < 4; j++) {
-            double n = baseProbs[i * 4 + j];
+            double n = baseProbs[i][j];
             if (n > m || (n == m && st_random() > 0.5)) {
                 k = j;
                 m = n;
@@ -144,82 +206,162 @@ static char *getMaxLikelihoodString(double *baseProbs, int64_t length) {
 }
 
 ///
-// The following functions are the meat of the Felsenstein's algorithm implementation.
+// Per-thread scratch space. Felsenstein's algorithm needs a column array for each level of the tree it is
+// recursing through, which are taken from a stack of frames, and the bases of the segments are decoded into
+// a buffer, so nothing is allocated per node or per segment.
 ///
 
-static double *transformBaseProbsBySubstitutionMatrix(double *baseProbs, int64_t length, stMatrix *substitutionMatrix) {
+/*
+ * The number of bases of a segment decoded at a time.
+ */
+#define ML_STRING_BASE_CHUNK 4096
+
+typedef struct _mlScratch {
+    BaseProbs *frames; // Stack of column arrays
+    int64_t frameCapacity; // The number of columns in frames
+    char bases[ML_STRING_BASE_CHUNK + 1];
+    struct _mlScratch *next; // The scratch space of another thread, see mlScratches
+} MLScratch;
+
+/*
+ * The scratch spaces of all the threads, so they can be released together once the strings are made. Releasing
+ * them moves on the generation, which tells each thread its own pointer is stale.
+ */
+static MLScratch *mlScratches = NULL;
+static int64_t mlScratchGeneration = 0;
+
+static __thread MLScratch *mlScratch = NULL;
+static __thread int64_t mlScratchThreadGeneration = 0;
+
+static MLScratch *getScratch(int64_t frameNumber, int64_t blockLength) {
     /*
-     * Updates the array of base probs, as described in getMaxLikelihoodString by multiplying the vector of base
-     * probabilities at each position by the given substitution matrix.
-     * Returns the input array.
+     * Gets the scratch space of the thread, with room for the given number of frames of blockLength columns.
      */
-    assert(stMatrix_n(substitutionMatrix) == 4);
-    double v[4];
-    for (int64_t i = 0; i < length; i++) {
-        stMatrix_multiplySquareMatrixAndColumnVector2(substitutionMatrix, &(baseProbs[i * 4]), v);
-        memcpy(&(baseProbs[i * 4]), v, sizeof(double) * 4);
+    if (mlScratch == NULL || mlScratchThreadGeneration != mlScratchGeneration) {
+        mlScratch = st_calloc(1, sizeof(MLScratch));
+        mlScratchThreadGeneration = mlScratchGeneration;
+#if defined(_OPENMP)
+#pragma omp critical(mlScratches)
+#endif
+        {
+            mlScratch->next = mlScratches;
+            mlScratches = mlScratch;
+        }
     }
-    return baseProbs;
+    if (mlScratch->frameCapacity < frameNumber * blockLength) {
+        free(mlScratch->frames);
+        mlScratch->frameCapacity = frameNumber * blockLength;
+        if (posix_memalign((void **) &mlScratch->frames, sizeof(BaseProbs), sizeof(BaseProbs) * mlScratch->frameCapacity) != 0) {
+            st_errAbort("Failed to allocate %" PRIi64 " columns for ML base calling", mlScratch->frameCapacity);
+        }
+    }
+    return mlScratch;
 }
 
-double *getEmptyBaseProbsString(int64_t length) {
+void releaseMaximumLikelihoodStringScratch(void) {
+    while (mlScratches != NULL) {
+        MLScratch *scratch = mlScratches;
+        mlScratches = scratch->next;
+        free(scratch->frames);
+        free(scratch);
+    }
+    mlScratchGeneration++;
+}
+
+static void getSegmentWindow(Segment *segment, SequenceWindow *window) {
     /*
-     * Gets an array of base probs, as described in getMaxLikelihoodString,
-     * for a block of 'length' positions, in which each position is initialised to 1.0.
+     * Gets a window onto the bases of the segment, as given by segment_getString, without copying them.
      */
-    double *baseProbs = st_malloc(length * 4 * sizeof(double));
-    for (int64_t i = 0; i < length * 4; i++) {
-        baseProbs[i] = 1.0;
+    sequence_getWindow(segment_getSequence(segment),
+                       segment_getStart(segment_getStrand(segment) ? segment : segment_getReverse(segment)),
+                       segment_getLength(segment), segment_getStrand(segment), window);
+}
+
+///
+// The following functions are the meat of the Felsenstein's algorithm implementation.
+///
+
+static inline int64_t baseToIndex(char base) {
+    switch (base) {
+    case 'A':
+    case 'a':
+        return 0;
+    case 'C':
+    case 'c':
+        return 1;
+    case 'G':
+    case 'g':
+        return 2;
+    case 'T':
+    case 't':
+        return 3;
+    default:
+        return 4;
     }
-    return baseProbs;
 }
 
-double *getBaseProbsString(Segment *segment) {
+static void transformBaseProbsBySubstitutionMatrix(BaseProbs *baseProbs, int64_t length, BranchMatrix *branchMatrix) {
     /*
-     * Gets an array of base probs, as described in getMaxLikelihoodString, representing
-     * the input string.
+     * Updates the array of base probs by multiplying the column of base probabilities at each position by the
+     * substitution matrix of the branch.
      */
-    char *string = segment_getString(segment);
-    int64_t length = segment_getLength(segment);
-    double *baseProbs = st_calloc(length * 4, sizeof(double)); //Gets the initial array initialised to 0.0 values
+    BaseProbs c0 = branchMatrix->columns[0], c1 = branchMatrix->columns[1];
+    BaseProbs c2 = branchMatrix->columns[2], c3 = branchMatrix->columns[3];
     for (int64_t i = 0; i < length; i++) {
-        switch (toupper(string[i])) {
-        case 'A':
-            assert(baseProbs[i * 4] == 0.0);
-            baseProbs[i * 4] = 1.0;
-            break;
-        case 'C':
-            baseProbs[i * 4 + 1] = 1.0;
-            break;
-        case 'G':
-            baseProbs[i * 4 + 2] = 1.0;
-            break;
-        case 'T':
-            baseProbs[i * 4 + 3] = 1.0;
-            break;
-        default: //If N we treat marginalise over all possibilities.
-            baseProbs[i * 4] = 1.0;
-            baseProbs[i * 4 + 1] = 1.0;
-            baseProbs[i * 4 + 2] = 1.0;
-            baseProbs[i * 4 + 3] = 1.0;
-            break;
-        }
+        BaseProbs v = baseProbs[i];
+        baseProbs[i] = v[0] * c0 + v[1] * c1 + v[2] * c2 + v[3] * c3;
     }
-    free(string);
-    return baseProbs;
 }
 
-static void multiply(double *baseProbs1, double *baseProbs2, int64_t blockLength) {
+static void multiply(BaseProbs *baseProbs1, BaseProbs *baseProbs2, int64_t blockLength) {
     /*
-     * Convenience function.
      * Updates baseProbs1, so that at each position i, baseProbs1[i] = baseProbs1[i] * baseProbs2[i], each
      * being the probability of a given base at a given position whose probability if the product of the initial probabilities.
-     * Frees base probs2.
      */
-    for (int64_t j = 0; j < blockLength * 4; j++) {
-        baseProbs1[j] *= baseProbs2[j];
+    for (int64_t i = 0; i < blockLength; i++) {
+        baseProbs1[i] *= baseProbs2[i];
+    }
+}
+
+/*
+ * Columns whose largest probability falls below this are scaled up, so that deep trees and blocks with many
+ * segments of an event do not underflow. Scaling a column does not change its most likely base.
+ */
+#define ML_STRING_MIN_PROB 1e-100
+
+static void rescale(BaseProbs *baseProbs, int64_t blockLength) {
+    for (int64_t i = 0; i < blockLength; i++) {
+        BaseProbs v = baseProbs[i];
+        double m = v[0] > v[1] ? v[0] : v[1];
+        m = v[2] > m ? v[2] : m;
+        m = v[3] > m ? v[3] : m;
+        if (m < ML_STRING_MIN_PROB && m > 0.0) {
+            baseProbs[i] = v * (1.0 / m);
+        }
+    }
+}
+
+static void multiplyBySegment(BaseProbs *baseProbs, Segment *segment, BranchMatrix *branchMatrix, bool first,
+                              char *bases) {
+    /*
+     * Multiplies the base probs by the transformed columns of the bases of the segment, or sets them if first
+     * is true, decoding the bases from the sequence a chunk at a time.
+     */
+    SequenceWindow window;
+    getSegmentWindow(segment, &window);
+    for (int64_t i = 0; i < window.length; i += ML_STRING_BASE_CHUNK) {
+        int64_t length = window.length - i < ML_STRING_BASE_CHUNK ? window.length - i : ML_STRING_BASE_CHUNK;
+        sequenceWindow_copy(&window, i, length, bases);
+        if (first) {
+            for (int64_t j = 0; j < length; j++) {
+                baseProbs[i + j] = branchMatrix->leafColumns[baseToIndex(bases[j])];
+            }
+        } else {
+            for (int64_t j = 0; j < length; j++) {
+                baseProbs[i + j] *= branchMatrix->leafColumns[baseToIndex(bases[j])];
+            }
+        }
     }
-    free(baseProbs2);
 }
 
 static int getFirstSegmentMatchingEvent(const void *a, const void *b) {
@@ -228,43 +370,50 @@ static int getFirstSegmentMatchingEvent(const void *a, const void *b) {
     return e1 < e2 ? -1 : (e1 > e2 ? 1 : 0);
 }
 
-static double *computeBaseProbs(stTree *tree, stList *eventSortedSegments, int64_t blockLength) {
+static bool computeBaseProbs(stTree *tree, stList *eventSortedSegments, int64_t blockLength, BaseProbs *baseProbs,
+                             MLScratch *scratch) {
     /*
      * This is the Felsenstein's function to compute the probabilities of each base at each position of the block for the given root node of tree
      * (which is a phylogenetic tree and attached substitution matrices created by getSubstitutionTreeRootedAtGivenEvent).
+     * The probabilities are written to baseProbs, and the frames after it are used by the recursion.
+     * Returns false, leaving baseProbs undefined, if there are no segments for the events of the tree.
      */
+    BranchMatrix *branchMatrix = &getNode(tree)->branchMatrix;
     //The code is recursive.
     if (stTree_getChildNumber(tree) > 0) { //Case root is an internal node.
-        double *baseProbs = computeBaseProbs(stTree_getChild(tree, 0), eventSortedSegments, blockLength);
-        int64_t i=1;
-        // While there are no base probs, cos the subtree is empty replace base probs with those from another branch
-        while(baseProbs == NULL && i < stTree_getChildNumber(tree)) {
-            baseProbs = computeBaseProbs(stTree_getChild(tree, i++), eventSortedSegments, blockLength);
-        }
-        // Now that we have base probs combine the remaining branches
-        while(i < stTree_getChildNumber(tree)) {
-            double *baseProbs2 = computeBaseProbs(stTree_getChild(tree, i++), eventSortedSegments, blockLength);
-            if(baseProbs2 != NULL) {
-                multiply(baseProbs, baseProbs2, blockLength);
+        bool nonEmpty = 0;
+        BaseProbs *childBaseProbs = baseProbs + blockLength;
+        for (int64_t i = 0; i < stTree_getChildNumber(tree); i++) {
+            // The first non-empty subtree fills in the base probs, the remainder are multiplied in
+            if (computeBaseProbs(stTree_getChild(tree, i), eventSortedSegments, blockLength,
+                                 nonEmpty ? childBaseProbs : baseProbs, scratch)) {
+                if (nonEmpty) {
+                    multiply(baseProbs, childBaseProbs, blockLength);
+                }
+                nonEmpty = 1;
             }
         }
-        return baseProbs == NULL ? NULL : transformBaseProbsBySubstitutionMatrix(baseProbs, blockLength, getSubMatrix(tree));
+        if (nonEmpty) {
+            rescale(baseProbs, blockLength);
+            transformBaseProbsBySubstitutionMatrix(baseProbs, blockLength, branchMatrix);
+        }
+        return nonEmpty;
     } else { //Case root is a leaf
         Event *event = getEvent(tree);
         int64_t i = stList_binarySearchFirstIndex(eventSortedSegments, event, getFirstSegmentMatchingEvent);
         if(i == -1) {
-            return NULL;
+            return 0;
         }
-        double *baseProbs = transformBaseProbsBySubstitutionMatrix(getBaseProbsString(stList_get(eventSortedSegments, i)),
-                                                                   blockLength, getSubMatrix(tree));
+        multiplyBySegment(baseProbs, stList_get(eventSortedSegments, i), branchMatrix, 1, scratch->bases);
         while(++i < stList_length(eventSortedSegments)) {
             Segment *segment = stList_get(eventSortedSegments, i);
             if(segment_getEvent(segment) != event) {
                 break;
             }
-            multiply(baseProbs, transformBaseProbsBySubstitutionMatrix(getBaseProbsString(segment), blockLength, getSubMatrix(tree)), blockLength);
+            multiplyBySegment(baseProbs, segment, branchMatrix, 0, scratch->bases);
         }
-        return baseProbs;
+        rescale(baseProbs, blockLength);
+        return 1;
     }
 }
 
@@ -283,17 +432,23 @@ void maskAncestralRepeatBases(Block *block, stList *segments, char *mlString) {
     int64_t *upperCounts = st_calloc(l, sizeof(int64_t)); //Counts of upper case bases at each position of the block.
     int64_t *nCounts = st_calloc(l, sizeof(int64_t)); //Counts of Ns at each position of the block.
 
-    //Iterate through the sequences of the segments of a block and collate the number of upper case bases.
+    //Iterate through the sequences of the segments of a block and collate the number of upper case bases,
+    //decoding the bases a chunk at a time.
+    char *string = getScratch(0, 0)->bases;
     for(int64_t i=0; i<j; i++) {
         Segment *segment = stList_get(segments, i);
         assert(segment_getSequence(segment) != NULL);
-        char *string = segment_getString(segment);
-        for (int64_t k = 0; k < l; k++) {
-            char uC = toupper(string[k]);
-            upperCounts[k] += uC == string[k] ? 1 : 0;
-            nCounts[k] += (uC != 'A' && uC != 'C' && uC != 'G' && uC != 'T' ? 1 : 0);
+        SequenceWindow window;
+        getSegmentWindow(segment, &window);
+        for (int64_t m = 0; m < l; m += ML_STRING_BASE_CHUNK) {
+            int64_t length = l - m < ML_STRING_BASE_CHUNK ? l - m : ML_STRING_BASE_CHUNK;
+            sequenceWindow_copy(&window, m, length, string);
+            for (int64_t k = 0; k < length; k++) {
+                char uC = toupper(string[k]);
+                upperCounts[m + k] += uC == string[k] ? 1 : 0;
+                nCounts[m + k] += (uC != 'A' && uC != 'C' && uC != 'G' && uC != 'T' ? 1 : 0);
+            }
         }
-        free(string);
     }
 
     //Convert any upper case character to lower case if the majority of bases
@@ -356,14 +511,19 @@ char *getMaximumLikelihoodString(stTree *tree, Block *block) {
         mlString[block_getLength(block)] = '\0';
     } else {
         stList *eventSortedSegments = segmentsSortedByEvent(block);
-        double *baseProbs = computeBaseProbs(tree, eventSortedSegments, block_getLength(block));
-        if(baseProbs == NULL) {
-            baseProbs = getEmptyBaseProbsString(block_getLength(block));
+        int64_t blockLength = block_getLength(block);
+        // A frame for each level of the tree, the root's holding the result
+        MLScratch *scratch = getScratch(getNode(tree)->depth, blockLength);
+        BaseProbs *baseProbs = scratch->frames;
+        if(!computeBaseProbs(tree, eventSortedSegments, blockLength, baseProbs, scratch)) {
+            // Without any information each base is equally likely
+            for (int64_t i = 0; i < blockLength; i++) {
+                baseProbs[i] = (BaseProbs) { 1.0, 1.0, 1.0, 1.0 };
+            }
         }
-        mlString = getMaxLikelihoodString(baseProbs, block_getLength(block));
+        mlString = getMaxLikelihoodString(baseProbs, blockLength);
         maskAncestralRepeatBases(block, eventSortedSegments, mlString);
         //Cleanup
-        free(baseProbs);
         stList_destruct(eventSortedSegments);
     }
     return mlString;
@@ -5,7 +5,13 @@
 #include "stCheckEdges.h"
 #include "stMatchingAlgorithms.h"
 #include "stReferenceProblem2.h"
+#include "cactusReference.h"
 #include <math.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 // OpenMP
 #if defined(_OPENMP)
@@ -76,99 +82,6 @@ static stList *getExtraAttachedStubsFromParent(Flower *flower) {
 ////////////////////////////////////
 ////////////////////////////////////
 
-static stList *calculateZP(Cap *cap, stHash *endsToNodes) {
-    /*
-     * Get the list of caps that represent the ends of the chains and stubs within a sequence.
-     */
-    assert(!cap_getSide(cap));
-    assert(end_isStubEnd(end_getPositiveOrientation(cap_getEnd(cap))));
-    stList *caps = stList_construct();
-    bool b = 0;
-    while (1) {
-        End *end = end_getPositiveOrientation(cap_getEnd(cap));
-        if (stHash_search(endsToNodes, end) != NULL) {
-            assert(!cap_getSide(cap));
-            if (stList_length(caps) > 0) {
-                assert(b);
-            }
-            b = 0;
-            stList_append(caps, cap);
-        }
-        cap = cap_getAdjacency(cap);
-        assert(cap != NULL);
-        end = end_getPositiveOrientation(cap_getEnd(cap));
-        if (stHash_search(endsToNodes, end) != NULL) {
-            assert(cap_getSide(cap));
-            if (stList_length(caps) > 0) {
-                assert(!b);
-            }
-            b = 1;
-            stList_append(caps, cap);
-        }
-        if (end_isStubEnd(end)) {
-            return caps;
-        }
-        assert(cap != cap_getOtherSegmentCap(cap));
-        cap = cap_getOtherSegmentCap(cap);
-        assert(cap != NULL);
-    }
-    return NULL;
-}
-
-static Cap *calculateZP4(Cap *cap, stHash *endsToNodes) {
-    if (cap_getOtherSegmentCap(cap) == NULL) {
-        return NULL;
-    }
-    while (1) {
-        cap = cap_getOtherSegmentCap(cap);
-        assert(cap != NULL);
-        End *end = end_getPositiveOrientation(cap_getEnd(cap));
-        if (stHash_search(endsToNodes, end) != NULL) {
-            return cap;
-        }
-        cap = cap_getAdjacency(cap);
-        assert(cap != NULL);
-        end = end_getPositiveOrientation(cap_getEnd(cap));
-        assert(stHash_search(endsToNodes, end) == NULL);
-        if (end_isStubEnd(end)) {
-            //if(!end_isFree(end)) { //Not true is normalisation is disabled
-            //    assert(!flower_hasParentGroup(end_getFlower(end)));
-            //}
-            return NULL;
-        }
-    }
-    return NULL;
-}
-
-static int64_t calculateZP2(Cap *cap, stHash *endsToNodes) {
-    /*
-     * Calculate the length of a segment that can be traversed from a cap,
-     * before hitting the end of the sequence of one of the other ends in the set
-     * endsToNodes.
-     */
-    assert(cap_getStrand(cap));
-    Sequence *sequence = cap_getSequence(cap);
-    assert(sequence != NULL);
-    Cap *otherCap = calculateZP4(cap, endsToNodes);
-    int64_t capLength;
-    if (otherCap == NULL) {
-        //capLength = 1000000000; //make the length really long if attached, so that we don't bias toward one or the other end.
-        capLength =
-                cap_getSide(cap) ?
-                        sequence_getLength(sequence) + sequence_getStart(sequence) - cap_getCoordinate(cap) :
-                        cap_getCoordinate(cap) - sequence_getStart(sequence) + 1;
-    } else {
-        capLength =
-                cap_getSide(cap) ?
-                        cap_getCoordinate(otherCap) - cap_getCoordinate(cap) + 1 : cap_getCoordinate(cap) - cap_getCoordinate(otherCap) + 1;
-    }
-    if (capLength == 0) {
-        capLength = 1;
-    }
-    assert(capLength > 0);
-    return capLength;
-}
-
 static int64_t getBranchMultiplicitiesP(Event *pEvent, Event *event,
         stHash *branchesToMultiplicity, stSet *chosenEvents) {
     /*
@@ -293,29 +206,229 @@ static stSet *getEventsWithSequences(Flower *flower) {
     return seqSet;
 }
 
-static double calculateZScoreWeightedAdapterFn(Cap *_5Cap, int64_t length5Segment, int64_t length3Segment, int64_t gap, void *extraArgs) {
-    double theta = *((double *)((void **) extraArgs)[0]);
-    assert(theta >= 0.0);
-    assert(cap_getEvent(_5Cap) != NULL);
-    //fprintf(stderr, " hello event: %" PRIi64 "\n", cap_getEvent(_5Cap));
-    //fprintf(stderr, " hello seq: %" PRIi64 "\n", cap_getSequence(_5Cap));
-    //fprintf(stderr, " hello event name: %" PRIi64 " \n", event_getName(cap_getEvent(_5Cap)));
-    assert(stHash_search(((void **) extraArgs)[1], cap_getEvent(_5Cap)) != NULL);
-    assert(stDoubleTuple_length(stHash_search(((void **) extraArgs)[1], cap_getEvent(_5Cap))) == 1);
-    double weight = stDoubleTuple_getPosition(stHash_search(((void **) extraArgs)[1], cap_getEvent(_5Cap)), 0);
-    return calculateZScore(length5Segment, length3Segment, gap, theta) * weight;
+/*
+ * The caps of a thread, from a stub cap to the stub cap at its other end, whose ends are nodes, held as flat arrays.
+ * The caps alternate between the 3' side of a node, reached by traversing a segment (or the first cap), and the
+ * 5' side of a node, reached by traversing an adjacency.
+ */
+typedef struct _capWalk {
+    int64_t length;
+    int64_t capacity;
+    int64_t *nodes;
+    bool *sides;
+    int64_t *coordinates;
+    int64_t *sizes; // The length of sequence that can be traversed from the cap before reaching another cap of the walk
+    int64_t *unaligned; // For a 5' cap, the length of the adjacency it is the end of
+    double *weights; // For a 5' cap, the weight of its event
+} CapWalk;
+
+static void capWalk_destruct(CapWalk *walk) {
+    free(walk->nodes);
+    free(walk->sides);
+    free(walk->coordinates);
+    free(walk->sizes);
+    free(walk->unaligned);
+    free(walk->weights);
+    free(walk);
 }
 
-static double countAdapterFn(Cap *_5Cap, int64_t length5Segment, int64_t length3Segment, int64_t gap, void *extraArgs) {
-    return 1;
+static void capWalk_add(CapWalk *walk, Cap *cap, int64_t node, stHash *eventWeighting) {
+    if (walk->length == walk->capacity) {
+        walk->capacity = walk->capacity * 2 + 64;
+        walk->nodes = st_realloc(walk->nodes, sizeof(int64_t) * walk->capacity);
+        walk->sides = st_realloc(walk->sides, sizeof(bool) * walk->capacity);
+        walk->coordinates = st_realloc(walk->coordinates, sizeof(int64_t) * walk->capacity);
+        walk->sizes = st_realloc(walk->sizes, sizeof(int64_t) * walk->capacity);
+        walk->unaligned = st_realloc(walk->unaligned, sizeof(int64_t) * walk->capacity);
+        walk->weights = st_realloc(walk->weights, sizeof(double) * walk->capacity);
+    }
+    int64_t i = walk->length++;
+    walk->nodes[i] = node;
+    walk->sides[i] = cap_getSide(cap);
+    walk->coordinates[i] = cap_getCoordinate(cap);
+    walk->unaligned[i] = 0;
+    walk->weights[i] = 1.0;
+    if (walk->sides[i]) {
+        assert(cap_getAdjacency(cap) != NULL);
+        walk->unaligned[i] = cap_getCoordinate(cap) - cap_getCoordinate(cap_getAdjacency(cap)) - 1;
+        assert(walk->unaligned[i] >= 0);
+        if (eventWeighting != NULL) {
+            stDoubleTuple *weight = stHash_search(eventWeighting, cap_getEvent(cap));
+            assert(weight != NULL);
+            assert(stDoubleTuple_length(weight) == 1);
+            walk->weights[i] = stDoubleTuple_getPosition(weight, 0);
+        }
+    }
+}
+
+/*
+ * The nodes of the ends, for the walks of the threads, which look up the node of every cap they pass. Ends carry no
+ * ordinal of their own, so the nodes are held in an open addressed table over the ends, built once per flower in one
+ * contiguous array kept at most half full, so a lookup is a multiply and usually a single probe.
+ */
+typedef struct _endNodes {
+    End **ends; // NULL if the slot is empty
+    int64_t *nodes;
+    int64_t bits; // The table has 2^bits slots
+} EndNodes;
+
+static inline int64_t endNodes_getSlot(End *end, int64_t bits) {
+    return (int64_t)((((uint64_t)(uintptr_t)end) * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static EndNodes *endNodes_construct(stHash *endsToNodes) {
+    EndNodes *endNodes = st_malloc(sizeof(EndNodes));
+    endNodes->bits = 4;
+    while ((((int64_t)1) << endNodes->bits) < 2 * stHash_size(endsToNodes)) {
+        endNodes->bits++;
+    }
+    int64_t mask = (((int64_t)1) << endNodes->bits) - 1;
+    endNodes->ends = st_calloc(mask + 1, sizeof(End *));
+    endNodes->nodes = st_malloc(sizeof(int64_t) * (mask + 1));
+    stHashIterator *endIt = stHash_getIterator(endsToNodes);
+    End *end;
+    while ((end = stHash_getNext(endIt)) != NULL) {
+        int64_t i = endNodes_getSlot(end, endNodes->bits);
+        while (endNodes->ends[i] != NULL) {
+            i = (i + 1) & mask;
+        }
+        endNodes->ends[i] = end;
+        endNodes->nodes[i] = stIntTuple_get(stHash_search(endsToNodes, end), 0);
+    }
+    stHash_destructIterator(endIt);
+    return endNodes;
 }
 
-refAdjList *calculateZ(Flower *flower, stHash *endsToNodes, int64_t nodeNumber, int64_t maxWalkForCalculatingZ,
-bool ignoreUnalignedGaps, double (*zScoreFn)(Cap *, int64_t, int64_t, int64_t, void *), void *zScoreExtraArgs) {
+static void endNodes_destruct(EndNodes *endNodes) {
+    free(endNodes->ends);
+    free(endNodes->nodes);
+    free(endNodes);
+}
+
+/*
+ * Gets the node of the positively oriented end, or 0, which is not a node, if the end is not one.
+ */
+static int64_t endNodes_get(EndNodes *endNodes, End *end) {
+    int64_t mask = (((int64_t)1) << endNodes->bits) - 1;
+    for (int64_t i = endNodes_getSlot(end, endNodes->bits); endNodes->ends[i] != NULL; i = (i + 1) & mask) {
+        if (endNodes->ends[i] == end) {
+            return endNodes->nodes[i];
+        }
+    }
+    return 0;
+}
+
+static void getCapWalk(Cap *cap, EndNodes *endNodes, stHash *eventWeighting, CapWalk *walk) {
     /*
-     * Calculate the zScores between all ends.
+     * Gets the walk of the thread starting from the given stub cap, looking up each cap's node once.
      */
-    refAdjList *aL = refAdjList_construct(nodeNumber);
+    assert(!cap_getSide(cap));
+    assert(end_isStubEnd(end_getPositiveOrientation(cap_getEnd(cap))));
+    walk->length = 0;
+    Sequence *sequence = cap_getSequence(cap);
+    assert(sequence != NULL);
+    while (1) {
+        int64_t node = endNodes_get(endNodes, end_getPositiveOrientation(cap_getEnd(cap)));
+        if (node != 0) {
+            assert(walk->length == 0 || walk->sides[walk->length - 1]);
+            capWalk_add(walk, cap, node, eventWeighting);
+        }
+        cap = cap_getAdjacency(cap);
+        assert(cap != NULL);
+        End *end = end_getPositiveOrientation(cap_getEnd(cap));
+        if ((node = endNodes_get(endNodes, end)) != 0) {
+            assert(walk->length == 0 || !walk->sides[walk->length - 1]);
+            capWalk_add(walk, cap, node, eventWeighting);
+        }
+        if (end_isStubEnd(end)) {
+            break;
+        }
+        assert(cap != cap_getOtherSegmentCap(cap));
+        cap = cap_getOtherSegmentCap(cap);
+        assert(cap != NULL);
+    }
+
+    /*
+     * The length of sequence following a cap, up to the next cap of the walk traversed through a segment, which
+     * for a 3' cap is the cap before it and for a 5' cap the cap after it, else up to the end of the sequence.
+     */
+    for (int64_t i = 0; i < walk->length; i++) {
+        int64_t size;
+        if (!walk->sides[i]) {
+            size = i > 0 ? walk->coordinates[i] - walk->coordinates[i - 1] + 1 :
+                   walk->coordinates[i] - sequence_getStart(sequence) + 1;
+        } else {
+            size = i + 1 < walk->length ? walk->coordinates[i + 1] - walk->coordinates[i] + 1 :
+                   sequence_getLength(sequence) + sequence_getStart(sequence) - walk->coordinates[i];
+        }
+        walk->sizes[i] = size == 0 ? 1 : size;
+        assert(walk->sizes[i] > 0);
+    }
+}
+
+/*
+ * The scores of the adjacencies found by walking the threads of a flower, in the order they were found.
+ */
+typedef struct _adjacencyScores {
+    int64_t length;
+    int64_t capacity;
+    int64_t *nodes; // Pairs of nodes, the 3' node then the 5' node
+    double *scores;
+} AdjacencyScores;
+
+static void adjacencyScores_add(AdjacencyScores *scores, int64_t _3Node, int64_t _5Node, double score) {
+    if (scores->length == scores->capacity) {
+        scores->capacity = scores->capacity * 2 + 64;
+        scores->nodes = st_realloc(scores->nodes, sizeof(int64_t) * 2 * scores->capacity);
+        scores->scores = st_realloc(scores->scores, sizeof(double) * scores->capacity);
+    }
+    scores->nodes[2 * scores->length] = _3Node;
+    scores->nodes[2 * scores->length + 1] = _5Node;
+    scores->scores[scores->length++] = score;
+}
+
+static void scoreCapWalk(CapWalk *walk, AdjacencyScorer *scorer, AdjacencyScores *scores) {
+    /*
+     * Calculate the additions to the scores of all the pairs of 3' and 5' caps of the walk within the scorer's
+     * maximum walk of each other.
+     */
+    for (int64_t i = (walk->length > 0 && walk->sides[0]) ? 1 : 0; i < walk->length; i += 2) {
+        assert(!walk->sides[i]);
+        int64_t unaligned = 0;
+        for (int64_t k = 0; k < scorer->maxWalk; k++) {
+            int64_t j = k * 2 + i + 1;
+            if (j >= walk->length) {
+                break;
+            }
+            assert(walk->sides[j]);
+            if (scorer->ignoreUnalignedGaps) {
+                unaligned += walk->unaligned[j];
+            }
+            assert(walk->coordinates[j] - walk->coordinates[i] > 0);
+            int64_t diff = walk->coordinates[j] - walk->coordinates[i] - unaligned;
+            assert(diff >= 1);
+            double score = 1.0;
+            if (!scorer->count) {
+                if (calculateZScore(1, 1, diff, scorer->theta) * walk->weights[j] < 0.0000000001) { //no point walking when score gets too small, should be effective for theta >= 0.000001
+                    break;
+                }
+                score = calculateZScore(walk->sizes[j], walk->sizes[i], diff, scorer->theta) * walk->weights[j];
+            }
+            assert(score >= -0.0001);
+            if (score <= 0.0) {
+                score = 1e-10; //Make slightly non-zero.
+            }
+            assert(score > 0.0);
+            adjacencyScores_add(scores, walk->nodes[i], walk->nodes[j], score);
+        }
+    }
+}
+
+static stList *getStubCaps(Flower *flower) {
+    /*
+     * Gets the caps that threads start from, being the positive 3' caps of stub ends with a sequence.
+     */
+    stList *caps = stList_construct();
     Flower_EndIterator *endIt = flower_getEndIterator(flower);
     End *end;
     while ((end = flower_getNextEnd(endIt)) != NULL) {
@@ -325,67 +438,76 @@ bool ignoreUnalignedGaps, double (*zScoreFn)(Cap *, int64_t, int64_t, int64_t, v
             while ((cap = end_getNext(capIt)) != NULL) {
                 cap = cap_getStrand(cap) ? cap : cap_getReverse(cap);
                 if (!cap_getSide(cap) && cap_getSequence(cap) != NULL) {
-                    stList *caps = calculateZP(cap, endsToNodes);
-
-                    /*
-                     * Calculate the lengths of the sequences following the 3 caps, for efficiency.
-                     */
-                    int64_t *capSizes = st_malloc(sizeof(int64_t) * stList_length(caps));
-                    for (int64_t i = 0; i < stList_length(caps); i++) {
-                        Cap *cap = stList_get(caps, i);
-                        capSizes[i] = calculateZP2(cap, endsToNodes);
-                    }
-
-                    /*
-                     * Iterate through all pairs of 5' and 3' caps to calculate additions to scores.
-                     */
-                    for (int64_t i = (stList_length(caps) > 0 && cap_getSide(stList_get(caps, 0))) ? 1 : 0; i < stList_length(caps); i += 2) {
-                        Cap *_3Cap = stList_get(caps, i);
-                        assert(!cap_getSide(_3Cap));
-                        int64_t _3CapSize = capSizes[i];
-                        int64_t _3Node = stIntTuple_get(stHash_search(endsToNodes, end_getPositiveOrientation(cap_getEnd(_3Cap))), 0);
-                        int64_t unaligned = 0;
-                        for (int64_t k = 0; k < maxWalkForCalculatingZ; k++) {
-                            int64_t j = k * 2 + i + 1;
-                            if (j >= stList_length(caps)) {
-                                break;
-                            }
-                            Cap *_5Cap = stList_get(caps, j);
-                            assert(cap_getSide(_5Cap));
-                            assert(cap_getAdjacency(_5Cap) != NULL);
-                            if (ignoreUnalignedGaps) {
-                                assert(cap_getCoordinate(_5Cap) - cap_getCoordinate(cap_getAdjacency(_5Cap)) - 1 >= 0);
-                                unaligned += cap_getCoordinate(_5Cap) - cap_getCoordinate(cap_getAdjacency(_5Cap)) - 1;
-                            }
-                            int64_t _5Node = stIntTuple_get(stHash_search(endsToNodes, end_getPositiveOrientation(cap_getEnd(_5Cap))), 0);
-                            int64_t _5CapSize = capSizes[j];
-                            assert(cap_getCoordinate(_5Cap) - cap_getCoordinate(_3Cap) > 0);
-                            int64_t diff = cap_getCoordinate(_5Cap) - cap_getCoordinate(_3Cap) - unaligned;
-                            assert(diff >= 1);
-                            if (zScoreFn(_5Cap, 1, 1, diff, zScoreExtraArgs) < 0.0000000001) { //no point walking when score gets too small, should be effective for theta >= 0.000001
-                                break;
-                            }
-                            double score = zScoreFn(_5Cap, _5CapSize, _3CapSize, diff, zScoreExtraArgs);
-                            assert(score >= -0.0001);
-                            if (score <= 0.0) {
-                                score = 1e-10; //Make slightly non-zero.
-                            }
-                            assert(score > 0.0);
-                            refAdjList_addToWeight(aL, _3Node, _5Node, score);
-                            assert(refAdjList_getWeight(aL, _3Node, _5Node) == refAdjList_getWeight(aL, _5Node, _3Node));
-                            assert(refAdjList_getWeight(aL, _3Node, _5Node) >= 0.0);
-                        }
-                    }
-                    stList_destruct(caps);
-                    free(capSizes);
+                    stList_append(caps, cap);
                 }
             }
             end_destructInstanceIterator(capIt);
         }
     }
     flower_destructEndIterator(endIt);
+    return caps;
+}
 
-    return aL;
+/*
+ * The number of threads walked at a time, bounding the memory held by the scores waiting to be added.
+ */
+#define CALCULATE_Z_BATCH_SIZE 1024
+
+void calculateAdjacencyScores(Flower *flower, stHash *endsToNodes, int64_t nodeNumber, stHash *eventWeighting,
+                              AdjacencyScorer *scorers, int64_t scorerNumber) {
+    /*
+     * Calculate the zScores between all ends, for each of the scorers, walking each thread once for all of them.
+     * The threads are walked and scored in parallel, a batch at a time, and the scores are then added to the
+     * adjacency lists in the order of the threads, so the result does not depend on the number of threads.
+     */
+    for (int64_t i = 0; i < scorerNumber; i++) {
+        scorers[i].aL = refAdjList_construct(nodeNumber);
+    }
+    stList *stubCaps = getStubCaps(flower);
+    EndNodes *endNodes = endNodes_construct(endsToNodes);
+#if defined(_OPENMP)
+    // Within a parallel region, such as the tasks of the flower scheduler, the region would only get one thread
+    bool parallel = !omp_in_parallel() && stList_length(stubCaps) > 1;
+#endif
+    AdjacencyScores *scores = st_calloc(CALCULATE_Z_BATCH_SIZE * scorerNumber, sizeof(AdjacencyScores));
+    for (int64_t batchStart = 0; batchStart < stList_length(stubCaps); batchStart += CALCULATE_Z_BATCH_SIZE) {
+        int64_t batchLength = stList_length(stubCaps) - batchStart < CALCULATE_Z_BATCH_SIZE ?
+                              stList_length(stubCaps) - batchStart : CALCULATE_Z_BATCH_SIZE;
+#if defined(_OPENMP)
+#pragma omp parallel if(parallel)
+#endif
+        {
+            CapWalk *walk = st_calloc(1, sizeof(CapWalk)); // Reused for each thread walked by this OpenMP thread
+#if defined(_OPENMP)
+#pragma omp for schedule(dynamic, 1)
+#endif
+            for (int64_t i = 0; i < batchLength; i++) {
+                getCapWalk(stList_get(stubCaps, batchStart + i), endNodes, eventWeighting, walk);
+                for (int64_t j = 0; j < scorerNumber; j++) {
+                    scoreCapWalk(walk, &scorers[j], &scores[i * scorerNumber + j]);
+                }
+            }
+            capWalk_destruct(walk);
+        }
+        for (int64_t i = 0; i < batchLength * scorerNumber; i++) {
+            AdjacencyScores *s = &scores[i];
+            refAdjList *aL = scorers[i % scorerNumber].aL;
+            for (int64_t j = 0; j < s->length; j++) {
+                int64_t _3Node = s->nodes[2 * j], _5Node = s->nodes[2 * j + 1];
+                refAdjList_addToWeight(aL, _3Node, _5Node, s->scores[j]);
+                assert(refAdjList_getWeight(aL, _3Node, _5Node) == refAdjList_getWeight(aL, _5Node, _3Node));
+                assert(refAdjList_getWeight(aL, _3Node, _5Node) >= 0.0);
+            }
+            s->length = 0; // Keep the arrays for the next batch
+        }
+    }
+    for (int64_t i = 0; i < CALCULATE_Z_BATCH_SIZE * scorerNumber; i++) {
+        free(scores[i].nodes);
+        free(scores[i].scores);
+    }
+    free(scores);
+    endNodes_destruct(endNodes);
+    stList_destruct(stubCaps);
 }
 
 ////////////////////////////////////
@@ -612,9 +734,9 @@ static void getStubEdgesInTopLevelFlower(refOrdering *ref, Flower *flower, stHas
     stSet *chosenEvents = getEventsWithSequences(flower);
     stHash *eventWeighting = getEventWeighting(referenceEvent, phi, chosenEvents);
     stSet_destruct(chosenEvents);
-    void *zArgs[2] = { &theta, eventWeighting };
-    refAdjList *stubAL = calculateZ(flower, stubEndsToNodes, nodeNumber,
-    INT64_MAX, 1, calculateZScoreWeightedAdapterFn, zArgs);
+    AdjacencyScorer stubScorer = { INT64_MAX, 1, 0, theta, NULL };
+    calculateAdjacencyScores(flower, stubEndsToNodes, nodeNumber, eventWeighting, &stubScorer, 1);
+    refAdjList *stubAL = stubScorer.aL;
     stHash_destruct(eventWeighting);
     st_logInfo(
             "Building a matching for %" PRIi64 " stub nodes in the top level problem from %" PRIi64 " total stubs of which %"
@@ -967,6 +1089,292 @@ stList *getReferenceIntervalsToPreserve(refOrdering *ref, refAdjList *dAL, int64
     return referenceIntervalsToPreserve;
 }
 
+////////////////////////////////////
+////////////////////////////////////
+//Sample the reference ordering
+////////////////////////////////////
+////////////////////////////////////
+
+/*
+ * Builds the ordering of the empty reference greedily, then refines it with rounds of greedy permutation sampling
+ * and nudging. Returns the score of the ordering.
+ */
+static double sampleReference(refAdjList *aL, refAdjList *dAL, refOrdering *ref, double wiggle, int64_t permutations,
+        double maxPossibleScore, void (*log_fn)(const char *, ...)) {
+    makeReferenceGreedily2(aL, dAL, ref, wiggle);
+    int64_t badAdjacenciesAfterGreedy = getBadAdjacencyCount(dAL, ref);
+    double totalScoreAfterGreedy = getReferenceScore(aL, ref);
+    log_fn("The score of the initial solution is %f/%" PRIi64 " out of a max possible %f\n", totalScoreAfterGreedy, badAdjacenciesAfterGreedy,
+            maxPossibleScore);
+
+    updateReferenceGreedily(aL, dAL, ref, permutations);
+    int64_t badAdjacenciesAfterGreedySampling = getBadAdjacencyCount(dAL, ref);
+    double totalScoreAfterGreedySampling = getReferenceScore(aL, ref);
+    log_fn("The score of the solution after permutation sampling is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy permutation out of a max possible %f\n",
+            totalScoreAfterGreedySampling, badAdjacenciesAfterGreedySampling, permutations, maxPossibleScore);
+
+    //reorderReferenceToAvoidBreakpoints(dAL2, ref);
+    //int64_t badAdjacenciesAfterTopologicalReordering = getBadAdjacencyCount(dAL, ref);
+    //double totalScoreAfterTopologicalReordering = getReferenceScore(aL, ref);
+    //log_fn("The score of the solution after topological reordering is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy permutation out of a max possible %f\n",
+    //        totalScoreAfterTopologicalReordering, badAdjacenciesAfterTopologicalReordering, permutations, maxPossibleScore);
+
+    int64_t maxNudge = 100;
+    int64_t nudgePermutations = 100;
+    nudgeGreedily(dAL, aL, ref, nudgePermutations, maxNudge);
+    int64_t badAdjacenciesAfterNudging = getBadAdjacencyCount(dAL, ref);
+    double totalScoreAfterNudging = getReferenceScore(aL, ref);
+    log_fn("The score of the final reference solution is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy nudging out of a max possible %f\n",
+           totalScoreAfterNudging, badAdjacenciesAfterNudging, nudgePermutations, maxPossibleScore);
+    return totalScoreAfterNudging;
+}
+
+/*
+ * The length of the state of the generator a sampler is seeded into, see seedSampler.
+ */
+#define SAMPLER_STATE_LENGTH 256
+
+/*
+ * Seeds the generator the samplers draw their random numbers from, switching it to the given state array, and
+ * returns the state it had before, which can be restored with setstate. The samplers of the reference problem
+ * library use sonLib's random functions, which draw from the C library. glibc's rand draws from the state of
+ * random, and rand is also seeded for C libraries where it does not.
+ */
+static char *seedSampler(int64_t seed, char *state) {
+    char *previousState = initstate((unsigned int) seed, state, SAMPLER_STATE_LENGTH);
+    srand((unsigned int) seed);
+    return previousState;
+}
+
+/*
+ * Gets the number of permutation rounds run by the given sampler, the rounds being shared out between the samplers.
+ */
+static int64_t getSamplerPermutations(int64_t permutations, int64_t sampler, int64_t samplerNumber) {
+    return permutations / samplerNumber + (sampler < permutations % samplerNumber ? 1 : 0);
+}
+
+/*
+ * Makes a copy of a reference that only has its stub intervals.
+ */
+static refOrdering *copyEmptyReference(refOrdering *ref, int64_t nodeNumber) {
+    refOrdering *ref2 = reference_construct(nodeNumber);
+    for (int64_t i = 0; i < reference_getIntervalNumber(ref); i++) {
+        int64_t firstNode = reference_getFirstOfInterval(ref, i);
+        int64_t lastNode = reference_getLast(ref, firstNode);
+        assert(reference_getNext(ref, firstNode) == lastNode);
+        reference_makeNewInterval(ref2, firstNode, lastNode);
+    }
+    return ref2;
+}
+
+/*
+ * Gets the nodes of the reference, interval by interval, in the order they are traversed. Each interval is
+ * written as its number of nodes followed by the nodes, so the list has the interval number plus the node
+ * number entries, whose count is returned in length.
+ */
+static int64_t *getOrdering(refOrdering *ref, int64_t nodeNumber, int64_t *length) {
+    int64_t *ordering = st_malloc(sizeof(int64_t) * (reference_getIntervalNumber(ref) + nodeNumber + 1));
+    int64_t i = 0;
+    for (int64_t interval = 0; interval < reference_getIntervalNumber(ref); interval++) {
+        int64_t j = i++;
+        int64_t n = reference_getFirstOfInterval(ref, interval);
+        ordering[i++] = n;
+        while ((n = reference_getNext(ref, -n)) != INT64_MAX) {
+            ordering[i++] = n;
+        }
+        ordering[j] = i - j - 1;
+    }
+    *length = i;
+    return ordering;
+}
+
+/*
+ * Rebuilds the reference of an ordering made by getOrdering from a copy of the empty reference it was sampled
+ * from. Returns NULL if the ordering does not fit the empty reference.
+ */
+static refOrdering *getReferenceFromOrdering(refOrdering *emptyRef, int64_t nodeNumber, int64_t *ordering, int64_t length) {
+    refOrdering *ref = copyEmptyReference(emptyRef, nodeNumber);
+    int64_t i = 0;
+    for (int64_t interval = 0; interval < reference_getIntervalNumber(ref); interval++) {
+        int64_t firstNode = reference_getFirstOfInterval(ref, interval);
+        if (i >= length || ordering[i] < 2 || ordering[i] > length - i - 1 || ordering[i + 1] != firstNode
+                || ordering[i + ordering[i]] != reference_getLast(ref, firstNode)) {
+            reference_destruct(ref);
+            return NULL;
+        }
+        for (int64_t j = i + 2; j < i + ordering[i]; j++) {
+            reference_insertNode(ref, ordering[j - 1], ordering[j]);
+        }
+        i += ordering[i] + 1;
+    }
+    if (i != length) {
+        reference_destruct(ref);
+        return NULL;
+    }
+    return ref;
+}
+
+/*
+ * Writes or reads the given number of bytes to or from a pipe, returning false if they could not all be.
+ */
+static bool writeToPipe(int fd, const void *buffer, int64_t length) {
+    int64_t i = 0;
+    while (i < length) {
+        ssize_t j = write(fd, ((const char *) buffer) + i, length - i);
+        if (j < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        i += j;
+    }
+    return 1;
+}
+
+static bool readFromPipe(int fd, void *buffer, int64_t length) {
+    int64_t i = 0;
+    while (i < length) {
+        ssize_t j = read(fd, ((char *) buffer) + i, length - i);
+        if (j < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (j == 0) {
+            return 0;
+        }
+        i += j;
+    }
+    return 1;
+}
+
+/*
+ * Runs a sampler in a child process, which writes the score of its reference, then the length of its ordering
+ * and the ordering (see getOrdering), to the returned file descriptor and exits. Returns -1 if the child process
+ * could not be started.
+ */
+static int startSampler(refAdjList *aL, refAdjList *dAL, refOrdering *ref, int64_t nodeNumber, double wiggle,
+        int64_t permutations, int64_t seed, double maxPossibleScore, pid_t *pid) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        st_logInfo("Failed to create a pipe for a reference sampler: %s\n", strerror(errno));
+        return -1;
+    }
+    fflush(NULL); // So buffered output is not written by both processes
+    if ((*pid = fork()) == -1) {
+        st_logInfo("Failed to fork a reference sampler: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (*pid == 0) {
+        close(fds[0]);
+        char state[SAMPLER_STATE_LENGTH];
+        seedSampler(seed, state);
+        refOrdering *ref2 = copyEmptyReference(ref, nodeNumber);
+        double score = sampleReference(aL, dAL, ref2, wiggle, permutations, maxPossibleScore, st_logDebug);
+        int64_t length;
+        int64_t *ordering = getOrdering(ref2, nodeNumber, &length);
+        bool written = writeToPipe(fds[1], &score, sizeof(double)) && writeToPipe(fds[1], &length, sizeof(int64_t))
+                && writeToPipe(fds[1], ordering, sizeof(int64_t) * length);
+        fflush(NULL);
+        _exit(written ? 0 : 1); // The child does not clean up, as the parent owns everything it inherited
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/*
+ * Gets the score and the ordering of a sampler run in a child process, waiting for the process to exit. Returns
+ * false if the sampler failed, in which case ordering is NULL.
+ */
+static bool finishSampler(int fd, pid_t pid, double *score, int64_t **ordering, int64_t *length) {
+    *ordering = NULL;
+    bool received = readFromPipe(fd, score, sizeof(double)) && readFromPipe(fd, length, sizeof(int64_t)) && *length >= 0;
+    if (received) {
+        *ordering = st_malloc(sizeof(int64_t) * (*length + 1));
+        received = readFromPipe(fd, *ordering, sizeof(int64_t) * *length);
+    }
+    close(fd);
+    int status;
+    pid_t k;
+    while ((k = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (!received || k != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(*ordering);
+        *ordering = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+refOrdering *sampleReferenceInParallel(refAdjList *aL, refAdjList *dAL, refOrdering *ref, int64_t nodeNumber, double wiggle,
+        int64_t permutations, int64_t samplerNumber, int64_t seed, void (*log_fn)(const char *, ...)) {
+    /*
+     * The samplers of the reference problem library draw from a process-wide generator, so sampler 0 is run in this
+     * process while the others are run concurrently in child processes, which report their scores and orderings. The
+     * reference of the best sampler is rebuilt here from its ordering. A sampler whose child process can not be
+     * started, fails, or reports an ordering that does not fit the reference, is run in this process instead, as are
+     * all the samplers if this is called from within a parallel region, where forking could leave the child with
+     * locks held by other threads.
+     */
+    double maxPossibleScore = refAdjList_getMaxPossibleScore(aL);
+    bool useChildProcesses = 1;
+#if defined(_OPENMP)
+    useChildProcesses = !omp_in_parallel();
+#endif
+    refOrdering *emptyRef = copyEmptyReference(ref, nodeNumber);
+    int *fds = st_malloc(sizeof(int) * samplerNumber);
+    pid_t *pids = st_malloc(sizeof(pid_t) * samplerNumber);
+    for (int64_t i = 1; i < samplerNumber; i++) {
+        fds[i] = useChildProcesses ? startSampler(aL, dAL, emptyRef, nodeNumber, wiggle,
+                                                  getSamplerPermutations(permutations, i, samplerNumber), seed + i,
+                                                  maxPossibleScore, &pids[i]) : -1;
+    }
+    char state[SAMPLER_STATE_LENGTH];
+    char *previousState = seedSampler(seed, state);
+    double bestScore = sampleReference(aL, dAL, ref, wiggle, getSamplerPermutations(permutations, 0, samplerNumber), maxPossibleScore, log_fn);
+    refOrdering *bestRef = ref;
+    for (int64_t i = 1; i < samplerNumber; i++) {
+        double score;
+        refOrdering *ref2 = NULL;
+        bool sampled = 0;
+        int64_t *ordering, length;
+        if (fds[i] != -1 && finishSampler(fds[i], pids[i], &score, &ordering, &length)) {
+            sampled = 1;
+            // Only the ordering of a sampler that beats the best so far is rebuilt
+            if (score > bestScore && (ref2 = getReferenceFromOrdering(emptyRef, nodeNumber, ordering, length)) == NULL) {
+                log_fn("Reference sampler %" PRIi64 " reported an ordering that does not fit the reference\n", i);
+                sampled = 0;
+            }
+            free(ordering);
+        }
+        if (!sampled) {
+            log_fn("Running reference sampler %" PRIi64 " in this process\n", i);
+            ref2 = copyEmptyReference(emptyRef, nodeNumber);
+            seedSampler(seed + i, state);
+            score = sampleReference(aL, dAL, ref2, wiggle, getSamplerPermutations(permutations, i, samplerNumber),
+                                    maxPossibleScore, log_fn);
+        }
+        log_fn("Reference sampler %" PRIi64 " of %" PRIi64 " has a score of %f\n", i, samplerNumber, score);
+        if (score > bestScore) {
+            reference_destruct(bestRef);
+            bestScore = score;
+            bestRef = ref2;
+        } else if (ref2 != NULL) {
+            reference_destruct(ref2);
+        }
+    }
+    free(fds);
+    free(pids);
+    reference_destruct(emptyRef);
+    setstate(previousState); // The rest of the run draws from the generator as if the samplers had not been run
+    return bestRef;
+}
+
 ////////////////////////////////////
 ////////////////////////////////////
 //Main function
@@ -976,7 +1384,8 @@ stList *getReferenceIntervalsToPreserve(refOrdering *ref, refAdjList *dAL, int64
 void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader, int64_t permutations,
         stList *(*matchingAlgorithm)(stList *edges, int64_t nodeNumber), double (*temperature)(double),
         double theta, double phi, int64_t maxWalkForCalculatingZ,
-        bool ignoreUnalignedGaps, double wiggle, int64_t numberOfNsForScaffoldGap, int64_t minNumberOfSequencesToSupportAdjacency, bool makeScaffolds) {
+        bool ignoreUnalignedGaps, double wiggle, int64_t numberOfNsForScaffoldGap, int64_t minNumberOfSequencesToSupportAdjacency, bool makeScaffolds,
+        int64_t samplerNumber, int64_t seed) {
     /*
      * Implements a greedy algorithm and greedy update sampler to find a solution to the adjacency problem for a net.
      *
@@ -1039,23 +1448,27 @@ void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader, int
     stList *referenceIntervalsToPreserve = NULL;
     if (makeScaffolds) {
         stHash *stubEndsToNodes = makeStubEdgesToNodesHash(stubTangleEnds, endsToNodes);
-        refAdjList *stubDAL = calculateZ(flower, stubEndsToNodes, nodeNumber, 1, 1, countAdapterFn, NULL); //Gets set of adjacencies between stub ends.
+        AdjacencyScorer stubScorer = { 1, 1, 1, 0.0, NULL };
+        calculateAdjacencyScores(flower, stubEndsToNodes, nodeNumber, NULL, &stubScorer, 1); //Gets set of adjacencies between stub ends.
+        refAdjList *stubDAL = stubScorer.aL;
         stHash_destruct(stubEndsToNodes);
         referenceIntervalsToPreserve = getReferenceIntervalsToPreserve(ref, stubDAL, minNumberOfSequencesToSupportAdjacency); //List of int-tuple pairs identifying the matchings between ends that should be preserved.
         refAdjList_destruct(stubDAL);
     }
 
     /*
-     * Calculate z functions, using phylogenetic weighting.
+     * Calculate z functions, using phylogenetic weighting, together with the direct adjacencies and the counts of
+     * the sequences supporting each direct adjacency, which are used to split the reference below.
      */
     stSet *chosenEvents = getEventsWithSequences(flower);
     stHash *eventWeighting = getEventWeighting(referenceEvent, phi, chosenEvents);
     stSet_destruct(chosenEvents);
-    void *zArgs[2] = { &theta, eventWeighting };
-    refAdjList *aL = calculateZ(flower, endsToNodes, nodeNumber, maxWalkForCalculatingZ, ignoreUnalignedGaps, calculateZScoreWeightedAdapterFn, zArgs);
-    int64_t directTheta = 0.0;
-    zArgs[0] = &directTheta;
-    refAdjList *dAL = calculateZ(flower, endsToNodes, nodeNumber, 1, ignoreUnalignedGaps, calculateZScoreWeightedAdapterFn, zArgs); //Gets set of direct of direct adjacencies
+    AdjacencyScorer scorers[3] = {
+            { maxWalkForCalculatingZ, ignoreUnalignedGaps, 0, theta, NULL },
+            { 1, ignoreUnalignedGaps, 0, 0.0, NULL }, //Gets set of direct of direct adjacencies
+            { 1, 1, 1, 0.0, NULL } }; //Gets the number of sequences supporting each direct adjacency
+    calculateAdjacencyScores(flower, endsToNodes, nodeNumber, eventWeighting, scorers, 3);
+    refAdjList *aL = scorers[0].aL, *dAL = scorers[1].aL, *countDAL = scorers[2].aL;
     stHash_destruct(eventWeighting);
 
     /*
@@ -1065,32 +1478,12 @@ void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader, int
             flower_getName(flower), reference_getIntervalNumber(ref), chainNumber, nodeNumber);
 
     double maxPossibleScore = refAdjList_getMaxPossibleScore(aL);
-    makeReferenceGreedily2(aL, dAL, ref, wiggle);
-    int64_t badAdjacenciesAfterGreedy = getBadAdjacencyCount(dAL, ref);
-    double totalScoreAfterGreedy = getReferenceScore(aL, ref);
-    log_fn("The score of the initial solution is %f/%" PRIi64 " out of a max possible %f\n", totalScoreAfterGreedy, badAdjacenciesAfterGreedy,
-            maxPossibleScore);
-
-    updateReferenceGreedily(aL, dAL, ref, permutations);
-    int64_t badAdjacenciesAfterGreedySampling = getBadAdjacencyCount(dAL, ref);
-    double totalScoreAfterGreedySampling = getReferenceScore(aL, ref);
-    log_fn("The score of the solution after permutation sampling is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy permutation out of a max possible %f\n",
-            totalScoreAfterGreedySampling, badAdjacenciesAfterGreedySampling, permutations, maxPossibleScore);
-
-    //reorderReferenceToAvoidBreakpoints(dAL2, ref);
-    //int64_t badAdjacenciesAfterTopologicalReordering = getBadAdjacencyCount(dAL, ref);
-    //double totalScoreAfterTopologicalReordering = getReferenceScore(aL, ref);
-    //log_fn("The score of the solution after topological reordering is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy permutation out of a max possible %f\n",
-    //        totalScoreAfterTopologicalReordering, badAdjacenciesAfterTopologicalReordering, permutations, maxPossibleScore);
-
-    int64_t maxNudge = 100;
-    int64_t nudgePermutations = 100;
-    nudgeGreedily(dAL, aL, ref, nudgePermutations, maxNudge);
-    int64_t badAdjacenciesAfterNudging = getBadAdjacencyCount(dAL, ref);
-    double totalScoreAfterNudging = getReferenceScore(aL, ref);
-
-    log_fn("The score of the final reference solution is %f/%" PRIi64 " after %" PRIi64 " rounds of greedy nudging out of a max possible %f\n",
-           totalScoreAfterNudging, badAdjacenciesAfterNudging, nudgePermutations, maxPossibleScore);
+    if (samplerNumber > 1 && flower_getParentGroup(flower) == NULL) {
+        log_fn("Sampling the reference with %" PRIi64 " samplers from seed %" PRIi64 "\n", samplerNumber, seed);
+        ref = sampleReferenceInParallel(aL, dAL, ref, nodeNumber, wiggle, permutations, samplerNumber, seed, log_fn);
+    } else {
+        sampleReference(aL, dAL, ref, wiggle, permutations, maxPossibleScore, log_fn);
+    }
 
     //The aL and dAL arrays are no longer valid as we've added additional nodes to the reference, let's clean up the arrays explicitly.
     refAdjList_destruct(aL);
@@ -1104,7 +1497,6 @@ void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader, int
      * The function returns a list of additional extra stub nodes, which
      * must then be turned into ends in the flower.
      */
-    refAdjList *countDAL = calculateZ(flower, endsToNodes, nodeNumber, 1, 1, countAdapterFn, NULL); //Gets set of adjacencies between stub ends.
     void *extraArgs[3] = { nodesToEnds, countDAL, &minNumberOfSequencesToSupportAdjacency };
     stList *extraStubNodes = splitReferenceAtIndicatedLocations(ref, referenceSplitFn, extraArgs);
     refAdjList_destruct(countDAL);
@@ -1169,35 +1561,54 @@ void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader, int
 ////////////////////////////////////
 ////////////////////////////////////
 
-void cactus_make_reference(stList *flowers, char *referenceEventString,
-                           CactusDisk *cactusDisk, CactusParams *params) {
-    ///////////////////////////////////////////////////////////////////////////
-    // Build the reference
-    ///////////////////////////////////////////////////////////////////////////
-
-    int64_t permutations = cactusParams_get_int(params, 2, "reference", "permutations");
-    double theta = cactusParams_get_float(params, 2, "reference", "theta");
-    double phi = cactusParams_get_float(params, 2, "reference", "phi");
+struct _referenceParameters {
+    int64_t permutations;
+    double theta;
+    double phi;
+    int64_t maxWalkForCalculatingZ;
+    bool ignoreUnalignedGaps;
+    double wiggle;
+    int64_t numberOfNsForScaffoldGap;
+    int64_t minNumberOfSequencesToSupportAdjacency;
+    bool makeScaffolds;
+    int64_t samplerNumber;
+    int64_t seed;
+    stList *(*matchingAlgorithm)(stList *edges, int64_t nodeNumber);
+    double (*temperatureFn)(double);
+};
+
+ReferenceParameters *referenceParameters_construct(CactusParams *params) {
+    ReferenceParameters *rp = st_malloc(sizeof(ReferenceParameters));
+    rp->permutations = cactusParams_get_int(params, 2, "reference", "permutations");
+    rp->theta = cactusParams_get_float(params, 2, "reference", "theta");
+    rp->phi = cactusParams_get_float(params, 2, "reference", "phi");
     bool useSimulatedAnnealing = cactusParams_get_int(params, 2, "reference", "useSimulatedAnnealing");
-    int64_t maxWalkForCalculatingZ = cactusParams_get_int(params, 2, "reference", "maxWalkForCalculatingZ");
-    bool ignoreUnalignedGaps = cactusParams_get_int(params, 2, "reference", "ignoreUnalignedGaps");
-    double wiggle = cactusParams_get_float(params, 2, "reference", "wiggle");
-    int64_t numberOfNsForScaffoldGap = cactusParams_get_int(params, 2, "reference", "numberOfNs");
-    int64_t minNumberOfSequencesToSupportAdjacency = cactusParams_get_int(params, 2, "reference", "minNumberOfSequencesToSupportAdjacency");
-    bool makeScaffolds = cactusParams_get_int(params, 2, "reference", "makeScaffolds");
-
-    stList *(*matchingAlgorithm)(stList *edges, int64_t nodeNumber) = chooseMatching_greedy;
+    rp->maxWalkForCalculatingZ = cactusParams_get_int(params, 2, "reference", "maxWalkForCalculatingZ");
+    rp->ignoreUnalignedGaps = cactusParams_get_int(params, 2, "reference", "ignoreUnalignedGaps");
+    rp->wiggle = cactusParams_get_float(params, 2, "reference", "wiggle");
+    rp->numberOfNsForScaffoldGap = cactusParams_get_int(params, 2, "reference", "numberOfNs");
+    rp->minNumberOfSequencesToSupportAdjacency = cactusParams_get_int(params, 2, "reference", "minNumberOfSequencesToSupportAdjacency");
+    rp->makeScaffolds = cactusParams_get_int(params, 2, "reference", "makeScaffolds");
+    rp->samplerNumber = cactusParams_get_int(params, 2, "reference", "samplers");
+    rp->seed = cactusParams_get_int(params, 2, "reference", "seed");
+
+    rp->matchingAlgorithm = chooseMatching_greedy;
     char *matchAlgorithmString = cactusParams_get_string(params, 2, "reference", "matchingAlgorithm");
     if (strcmp("greedy", matchAlgorithmString) == 0) {
-        matchingAlgorithm = chooseMatching_greedy;
+        rp->matchingAlgorithm = chooseMatching_greedy;
     } else if (strcmp("maxCardinality", matchAlgorithmString) == 0) {
-        matchingAlgorithm = chooseMatching_maximumCardinalityMatching;
+        rp->matchingAlgorithm = chooseMatching_maximumCardinalityMatching;
     } else if (strcmp("maxWeight", matchAlgorithmString) == 0) {
-        matchingAlgorithm = chooseMatching_maximumWeightMatching;
+        rp->matchingAlgorithm = chooseMatching_maximumWeightMatching;
     } else if (strcmp("blossom5", matchAlgorithmString) == 0) {
-        matchingAlgorithm = chooseMatching_blossom5;
+        rp->matchingAlgorithm = chooseMatching_blossom5;
     } else {
-        stThrowNew(REFERENCE_BUILDING_EXCEPTION, "Input error: unrecognized matching algorithm: %s", matchAlgorithmString);
+        // The message is formatted before the string it names is freed
+        stExcept *except = stExcept_new(REFERENCE_BUILDING_EXCEPTION, "Input error: unrecognized matching algorithm: %s",
+                                        matchAlgorithmString);
+        free(matchAlgorithmString);
+        free(rp);
+        stThrow(except);
     }
     free(matchAlgorithmString);
 
@@ -1214,15 +1625,34 @@ void cactus_make_reference(stList *flowers, char *referenceEventString,
             minNumberOfSequencesToSupportAdjacency);
     st_logDebug("Make scaffolds is: %i\n", makeScaffolds);*/
 
-    double (*temperatureFn)(double) = useSimulatedAnnealing ? exponentiallyDecreasingTemperatureFn : constantTemperatureFn;
+    rp->temperatureFn = useSimulatedAnnealing ? exponentiallyDecreasingTemperatureFn : constantTemperatureFn;
+    return rp;
+}
+
+void referenceParameters_destruct(ReferenceParameters *rp) {
+    free(rp);
+}
+
+void cactus_make_reference_for_flower(Flower *flower, char *referenceEventString, ReferenceParameters *rp) {
+    st_logDebug("Processing flower %" PRIi64 "\n", flower_getName(flower));
+    buildReferenceTopDown(flower, referenceEventString, rp->permutations, rp->matchingAlgorithm, rp->temperatureFn,
+                          rp->theta, rp->phi, rp->maxWalkForCalculatingZ, rp->ignoreUnalignedGaps, rp->wiggle,
+                          rp->numberOfNsForScaffoldGap, rp->minNumberOfSequencesToSupportAdjacency, rp->makeScaffolds,
+                          rp->samplerNumber, rp->seed);
+}
+
+void cactus_make_reference(stList *flowers, char *referenceEventString,
+                           CactusDisk *cactusDisk, CactusParams *params) {
+    ///////////////////////////////////////////////////////////////////////////
+    // Build the reference
+    ///////////////////////////////////////////////////////////////////////////
+
+    ReferenceParameters *rp = referenceParameters_construct(params);
 
 #pragma omp parallel for schedule(dynamic, 1)
     for(int64_t i=0; i<stList_length(flowers); i++) {
-        Flower *flower = stList_get(flowers, i);
-        st_logDebug("Processing flower %" PRIi64 "\n", flower_getName(flower));
-        buildReferenceTopDown(flower, referenceEventString, permutations, matchingAlgorithm, temperatureFn, theta,
-                              phi, maxWalkForCalculatingZ, ignoreUnalignedGaps, wiggle, numberOfNsForScaffoldGap,
-                              minNumberOfSequencesToSupportAdjacency, makeScaffolds);
+        cactus_make_reference_for_flower(stList_get(flowers, i), referenceEventString, rp);
     }
-}
 
+    referenceParameters_destruct(rp);
+}
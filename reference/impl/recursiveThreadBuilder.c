@@ -8,52 +8,441 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "cactus.h"
 #include "sonLib.h"
 #include "recursiveThreadBuilder.h"
 
+int64_t record_putVarint(uint64_t value, char *buffer) {
+    int64_t i = 0;
+    while (value >= 0x80) {
+        buffer[i++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[i++] = (char)value;
+    return i;
+}
+
+uint64_t record_getVarint(const char **buffer) {
+    const unsigned char *b = (const unsigned char *)*buffer;
+    uint64_t value = 0;
+    int64_t shift = 0;
+    do {
+        value |= ((uint64_t)(*b & 0x7F)) << shift;
+        shift += 7;
+    } while (*b++ & 0x80);
+    *buffer = (const char *)b;
+    return value;
+}
+
+bool record_isBinary(const char *record) {
+    return record[0] == RECORD_BINARY_TAG;
+}
+
+int64_t record_getLength(const char *record) {
+    if (!record_isBinary(record)) {
+        return strlen(record);
+    }
+    const char *payload = record + 1;
+    int64_t payloadLength = record_getVarint(&payload);
+    return (payload - record) + payloadLength;
+}
+
+char *binaryRecord_allocate(int64_t payloadLength, char **payload) {
+    char prefix[RECORD_MAX_VARINT_LENGTH];
+    int64_t prefixLength = record_putVarint(payloadLength, prefix);
+    char *record = st_malloc(1 + prefixLength + payloadLength);
+    record[0] = RECORD_BINARY_TAG;
+    memcpy(record + 1, prefix, prefixLength);
+    *payload = record + 1 + prefixLength;
+    return record;
+}
+
+char *binaryRecord_construct(const char *payload, int64_t payloadLength) {
+    char *p;
+    char *record = binaryRecord_allocate(payloadLength, &p);
+    if (payloadLength > 0) {
+        memcpy(p, payload, payloadLength);
+    }
+    return record;
+}
+
+/*
+ * Record spills.
+ */
+
+/*
+ * The default number of bytes of records written to a spill at a time, and read back at a time.
+ */
+#define RECORD_SPILL_BUFFER_SIZE 1048576
+
+struct _recordSpill {
+    char *file;
+    int fileDescriptor;
+    int64_t length; // The number of bytes reserved in the file, updated atomically
+    int64_t bufferSize; // The number of bytes of records written at a time, and read back at a time
+};
+
+RecordSpill *recordSpill_construct(const char *file) {
+    return recordSpill_construct2(file, RECORD_SPILL_BUFFER_SIZE);
+}
+
+RecordSpill *recordSpill_construct2(const char *file, int64_t bufferSize) {
+    assert(bufferSize > 0);
+    RecordSpill *spill = st_calloc(1, sizeof(RecordSpill));
+    spill->file = stString_copy(file);
+    spill->bufferSize = bufferSize;
+    spill->fileDescriptor = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (spill->fileDescriptor < 0) {
+        st_errnoAbort("Failed to open record spill file %s", file);
+    }
+    // Unlink straight away, the open descriptor keeps the file alive until we are done,
+    // and it is cleaned up however the process exits
+    unlink(file);
+    return spill;
+}
+
+void recordSpill_destruct(RecordSpill *spill) {
+    close(spill->fileDescriptor);
+    free(spill->file);
+    free(spill);
+}
+
+int64_t recordSpill_getLength(RecordSpill *spill) {
+    int64_t length;
+#if defined(_OPENMP)
+#pragma omp atomic read
+#endif
+    length = spill->length;
+    return length;
+}
+
+/*
+ * Appends the bytes to the spill, returning the offset they were written at. Space is reserved
+ * atomically, so concurrent writers do not need to lock.
+ */
+static int64_t recordSpill_write(RecordSpill *spill, const char *bytes, int64_t length) {
+    int64_t offset;
+#if defined(_OPENMP)
+#pragma omp atomic capture
+#endif
+    { offset = spill->length; spill->length += length; }
+    int64_t written = 0;
+    while (written < length) {
+        ssize_t i = pwrite(spill->fileDescriptor, bytes + written, length - written, offset + written);
+        if (i < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            st_errnoAbort("Failed to write records to spill file %s", spill->file);
+        }
+        written += i;
+    }
+    return offset;
+}
+
+static void recordSpill_read(RecordSpill *spill, int64_t offset, int64_t length, char *buffer) {
+    int64_t read = 0;
+    while (read < length) {
+        ssize_t i = pread(spill->fileDescriptor, buffer + read, length - read, offset + read);
+        if (i <= 0) {
+            if (i < 0 && errno == EINTR) {
+                continue;
+            }
+            st_errnoAbort("Failed to read records from spill file %s", spill->file);
+        }
+        read += i;
+    }
+}
+
+/*
+ * Record ropes.
+ */
+
+typedef struct _recordFragment RecordFragment;
+
+struct _recordFragment {
+    RecordFragment *next;
+    int64_t length;
+    int64_t offset; // The offset of the bytes in the spill, or -1 if they are held in bytes
+    int64_t capacity; // The number of bytes allocated for bytes
+    char bytes[];
+};
+
+struct _recordRope {
+    RecordFragment *first;
+    RecordFragment *last;
+    RecordFragment **lastLink; // The link to last, either first or the next of the fragment before it
+    int64_t length;
+    bool binary; // If non-zero the rope is a binary record
+    RecordSpill *spill;
+};
+
+static RecordRope *recordRope_construct(RecordSpill *spill) {
+    RecordRope *rope = st_calloc(1, sizeof(RecordRope));
+    rope->lastLink = &rope->first;
+    rope->spill = spill;
+    return rope;
+}
+
+void recordRope_destruct(RecordRope *rope) {
+    RecordFragment *fragment = rope->first;
+    while (fragment != NULL) {
+        RecordFragment *next = fragment->next;
+        free(fragment);
+        fragment = next;
+    }
+    free(rope);
+}
+
+int64_t recordRope_getLength(RecordRope *rope) {
+    return rope->length;
+}
+
+static RecordFragment *recordFragment_construct(const char *bytes, int64_t length) {
+    RecordFragment *fragment = st_malloc(sizeof(RecordFragment) + length);
+    fragment->next = NULL;
+    fragment->length = length;
+    fragment->offset = -1;
+    fragment->capacity = length;
+    memcpy(fragment->bytes, bytes, length);
+    return fragment;
+}
+
+static RecordFragment *recordFragment_constructSpilled(int64_t offset, int64_t length) {
+    RecordFragment *fragment = st_malloc(sizeof(RecordFragment));
+    fragment->next = NULL;
+    fragment->length = length;
+    fragment->offset = offset;
+    fragment->capacity = 0;
+    return fragment;
+}
+
+/*
+ * Copies the in memory fragment onto the end of the last fragment of the rope, which must also be in
+ * memory, growing it geometrically so that a run of appends copies each byte a constant number of times
+ * on average.
+ */
+static void recordRope_extendLast(RecordRope *rope, RecordFragment *fragment) {
+    RecordFragment *last = rope->last;
+    assert(last->offset == -1 && fragment->offset == -1);
+    if (last->length + fragment->length > last->capacity) {
+        last->capacity = 2 * (last->length + fragment->length);
+        last = st_realloc(last, sizeof(RecordFragment) + last->capacity);
+        *rope->lastLink = last;
+        rope->last = last;
+    }
+    memcpy(last->bytes + last->length, fragment->bytes, fragment->length);
+    last->length += fragment->length;
+}
+
+/*
+ * Appends the fragments of rope2 to rope and destructs rope2. Spilled fragments that are adjacent
+ * in the spill are merged, which, as the records of a thread are mostly spilled in order, keeps the
+ * number of fragments small, as are in memory fragments, so that without a spill a thread is held
+ * in a single fragment.
+ */
+static void recordRope_append(RecordRope *rope, RecordRope *rope2) {
+    assert(rope->spill == rope2->spill || rope2->spill == NULL || rope->spill == NULL);
+    RecordFragment *fragment = rope2->first;
+    while (fragment != NULL && rope->last != NULL &&
+           ((rope->last->offset == -1 && fragment->offset == -1) ||
+            (rope->last->offset != -1 && fragment->offset != -1 &&
+             rope->last->offset + rope->last->length == fragment->offset))) {
+        if (fragment->offset == -1) {
+            recordRope_extendLast(rope, fragment);
+        } else {
+            rope->last->length += fragment->length;
+        }
+        RecordFragment *next = fragment->next;
+        free(fragment);
+        fragment = next;
+    }
+    if (fragment != NULL) {
+        RecordFragment **link = rope->last == NULL ? &rope->first : &rope->last->next;
+        *link = fragment;
+        rope->lastLink = fragment == rope2->last ? link : rope2->lastLink;
+        rope->last = rope2->last;
+    }
+    rope->length += rope2->length;
+    free(rope2);
+}
+
+/*
+ * Adds the bytes to the front of the rope.
+ */
+static void recordRope_prepend(RecordRope *rope, const char *bytes, int64_t length) {
+    RecordFragment *fragment = recordFragment_construct(bytes, length);
+    fragment->next = rope->first;
+    rope->first = fragment;
+    if (rope->last == NULL) {
+        rope->last = fragment;
+    } else if (rope->lastLink == &rope->first) {
+        rope->lastLink = &fragment->next;
+    }
+    rope->length += length;
+}
+
+void recordRope_forEachPiece(RecordRope *rope, void (*fn)(const char *bytes, int64_t length, void *extraArg),
+        void *extraArg) {
+    char *buffer = NULL;
+    for (RecordFragment *fragment = rope->first; fragment != NULL; fragment = fragment->next) {
+        if (fragment->offset == -1) {
+            fn(fragment->bytes, fragment->length, extraArg);
+            continue;
+        }
+        int64_t bufferSize = rope->spill->bufferSize;
+        if (buffer == NULL) {
+            buffer = st_malloc(bufferSize);
+        }
+        for (int64_t i = 0; i < fragment->length; i += bufferSize) {
+            int64_t j = fragment->length - i < bufferSize ? fragment->length - i : bufferSize;
+            recordSpill_read(rope->spill, fragment->offset + i, j, buffer);
+            fn(buffer, j, extraArg);
+        }
+    }
+    free(buffer);
+}
+
+static void writePiece(const char *bytes, int64_t length, void *extraArg) {
+    if (fwrite(bytes, sizeof(char), length, (FILE *)extraArg) != (size_t)length) {
+        st_errAbort("Failed to write records");
+    }
+}
+
+void recordRope_write(RecordRope *rope, FILE *fileHandle) {
+    recordRope_forEachPiece(rope, writePiece, fileHandle);
+}
+
+static void copyPiece(const char *bytes, int64_t length, void *extraArg) {
+    char **string = extraArg;
+    memcpy(*string, bytes, length);
+    *string += length;
+}
+
+char *recordRope_getString(RecordRope *rope) {
+    char *string = st_malloc(rope->length + 1);
+    char *end = string;
+    recordRope_forEachPiece(rope, copyPiece, &end);
+    *end = '\0';
+    return string;
+}
+
+/*
+ * Record holders.
+ */
+
+struct _recordHolder {
+    stHash *ropes;
+    RecordSpill *spill;
+};
+
 RecordHolder *recordHolder_construct() {
-    return stHash_construct2(NULL, free);
+    return recordHolder_construct2(NULL);
+}
+
+RecordHolder *recordHolder_construct2(RecordSpill *spill) {
+    RecordHolder *rh = st_malloc(sizeof(RecordHolder));
+    rh->ropes = stHash_construct2(NULL, (void (*)(void *))recordRope_destruct);
+    rh->spill = spill;
+    return rh;
 }
 
 void recordHolder_destruct(RecordHolder *rh) {
-    stHash_destruct(rh);
+    stHash_destruct(rh->ropes);
+    free(rh);
 }
 
 int64_t recordHolder_size(RecordHolder *rh) {
-    return stHash_size(rh);
+    return stHash_size(rh->ropes);
 }
 
-static void recordHolder_add(RecordHolder *rh, Name name, char *string) {
-    assert(stHash_search(rh, (void *)name) == NULL);
-    stHash_insert(rh, (void *)name, string);
+static void recordHolder_addRope(RecordHolder *rh, Name name, RecordRope *rope) {
+    assert(stHash_search(rh->ropes, (void *)name) == NULL);
+    stHash_insert(rh->ropes, (void *)name, rope);
 }
 
-static char *recordHolder_remove(RecordHolder *rh, Name name) {
-    char *string = stHash_remove(rh, (void *)name);
-    return string;
+/*
+ * Adds the record to the holder, taking ownership of it. The record is held in memory, if it is to be
+ * spilled the returned rope should be passed to recordHolder_spill.
+ */
+static RecordRope *recordHolder_add(RecordHolder *rh, Name name, char *record) {
+    RecordRope *rope = recordRope_construct(rh->spill);
+    rope->binary = record_isBinary(record);
+    int64_t length = record_getLength(record);
+    if (length > 0) {
+        rope->first = rope->last = recordFragment_construct(record, length);
+        rope->length = length;
+    }
+    free(record);
+    recordHolder_addRope(rh, name, rope);
+    return rope;
+}
+
+static RecordRope *recordHolder_remove(RecordHolder *rh, Name name) {
+    return stHash_remove(rh->ropes, (void *)name);
+}
+
+/*
+ * Writes the in memory ropes in the list to the spill of the holder, in order, with as few writes as
+ * possible, and replaces their fragments with spilled fragments. Empties the list.
+ */
+static void recordHolder_spill(RecordHolder *rh, stList *ropes) {
+    int64_t length = 0;
+    for (int64_t i = 0; i < stList_length(ropes); i++) {
+        length += recordRope_getLength(stList_get(ropes, i));
+    }
+    char *buffer = st_malloc(length);
+    char *end = buffer;
+    for (int64_t i = 0; i < stList_length(ropes); i++) {
+        RecordRope *rope = stList_get(ropes, i);
+        if (rope->first != NULL) {
+            assert(rope->first == rope->last && rope->first->offset == -1);
+            memcpy(end, rope->first->bytes, rope->length);
+            end += rope->length;
+        }
+    }
+    int64_t offset = recordSpill_write(rh->spill, buffer, length);
+    for (int64_t i = 0; i < stList_length(ropes); i++) {
+        RecordRope *rope = stList_get(ropes, i);
+        if (rope->first != NULL) {
+            free(rope->first);
+            rope->first = rope->last = recordFragment_constructSpilled(offset, rope->length);
+            offset += rope->length;
+        }
+    }
+    free(buffer);
+    while (stList_length(ropes) > 0) {
+        stList_pop(ropes);
+    }
 }
 
 void recordHolder_transferAll(RecordHolder *rhToAddTo, RecordHolder *rhToAdd) {
-    stHashIterator *it = stHash_getIterator(rhToAdd);
+    assert(rhToAddTo->spill == rhToAdd->spill);
+    stHashIterator *it = stHash_getIterator(rhToAdd->ropes);
     void *name;
     while((name = stHash_getNext(it)) != NULL) {
-        char *string = stHash_remove(rhToAdd, name);
-        assert(string != NULL);
-        assert(stHash_search(rhToAddTo, name) == NULL);
-        stHash_insert(rhToAddTo, name, string);
+        RecordRope *rope = stHash_remove(rhToAdd->ropes, name);
+        assert(rope != NULL);
+        recordHolder_addRope(rhToAddTo, (Name)name, rope);
     }
     stHash_destructIterator(it);
-    assert(stHash_size(rhToAdd) == 0);
-    stHash_destruct(rhToAdd);
+    assert(stHash_size(rhToAdd->ropes) == 0);
+    recordHolder_destruct(rhToAdd);
 }
 
 static void cacheNonNestedRecords(RecordHolder *rh, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
         char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg) {
     /*
      * Caches the set of terminal adjacency and segment records present in the threads.
+     * If the holder has a spill the records are written to it in batches, in thread order, so
+     * that the records of each thread are mostly contiguous in the spill.
      */
+    stList *toSpill = stList_construct();
+    int64_t toSpillLength = 0;
     for (int64_t i = 0; i < stList_length(caps); i++) {
         Cap *cap = stList_get(caps, i);
         //int64_t recordSize;
@@ -63,15 +452,27 @@ static void cacheNonNestedRecords(RecordHolder *rh, stList *caps, char *(*segmen
             Group *group = end_getGroup(cap_getEnd(cap));
             assert(group != NULL);
             if (group_isLeaf(group)) { //Record must not be in the database already
-                recordHolder_add(rh, cap_getName(cap), terminalAdjacencyWriteFn(cap, extraArg));
+                RecordRope *rope = recordHolder_add(rh, cap_getName(cap), terminalAdjacencyWriteFn(cap, extraArg));
+                stList_append(toSpill, rope);
+                toSpillLength += recordRope_getLength(rope);
             }
             if ((cap = cap_getOtherSegmentCap(adjacentCap)) == NULL) {
                 break;
             }
             Segment *segment = cap_getSegment(adjacentCap);
-            recordHolder_add(rh, segment_getName(segment), segmentWriteFn(segment, extraArg));
+            RecordRope *rope = recordHolder_add(rh, segment_getName(segment), segmentWriteFn(segment, extraArg));
+            stList_append(toSpill, rope);
+            toSpillLength += recordRope_getLength(rope);
         }
+        if (rh->spill != NULL && toSpillLength >= rh->spill->bufferSize) {
+            recordHolder_spill(rh, toSpill);
+            toSpillLength = 0;
+        }
+    }
+    if (rh->spill != NULL && toSpillLength > 0) {
+        recordHolder_spill(rh, toSpill);
     }
+    stList_destruct(toSpill);
 }
 
 static stList *getNestedRecordNames(stList *caps) {
@@ -167,16 +568,19 @@ static void deleteNestedRecords(stKVDatabase *database, stList *caps) {
     stList_destruct(deleteRequests);
 }
 
-static char *getThread(RecordHolder *rh, Cap *startCap, bool deleteUsedRecords) {
+static RecordRope *getThread(RecordHolder *rh, Cap *startCap, bool deleteUsedRecords) {
     /*
-     * Iterate through, first calculating the length of the final record, then concatenating the results.
+     * Iterate through, splicing together the ropes of the records of the thread. If the records are
+     * binary the result is a binary record wrapping them.
      */
     Cap *cap = startCap;
-    stList *strings = stList_construct3(0, free);
-    while (1) { //Calculate the size of the entries in the DB that represent the thread.
-        char *s = recordHolder_remove(rh, cap_getName(cap));
-        assert(s != NULL);
-        stList_append(strings, s);
+    RecordRope *thread = recordRope_construct(rh->spill);
+    while (1) {
+        RecordRope *rope = recordHolder_remove(rh, cap_getName(cap));
+        assert(rope != NULL);
+        assert(rope->binary || !thread->binary); // Binary and string records can not be mixed
+        thread->binary = rope->binary;
+        recordRope_append(thread, rope);
 
         Cap *adjacentCap = cap_getAdjacency(cap);
         assert(adjacentCap != NULL);
@@ -184,13 +588,17 @@ static char *getThread(RecordHolder *rh, Cap *startCap, bool deleteUsedRecords)
         if ((cap = cap_getOtherSegmentCap(adjacentCap)) == NULL) {
             break;
         }
-        s = recordHolder_remove(rh, segment_getName(cap_getSegment(adjacentCap)));
-        assert(s != NULL);
-        stList_append(strings, s);
+        rope = recordHolder_remove(rh, segment_getName(cap_getSegment(adjacentCap)));
+        assert(rope != NULL);
+        assert(rope->binary == thread->binary);
+        recordRope_append(thread, rope);
     }
-    char *string = stString_join2("", strings);
-    stList_destruct(strings);
-    return string;
+    if (thread->binary) {
+        char prefix[1 + RECORD_MAX_VARINT_LENGTH];
+        prefix[0] = RECORD_BINARY_TAG;
+        recordRope_prepend(thread, prefix, 1 + record_putVarint(thread->length, prefix + 1));
+    }
+    return thread;
 }
 
 void buildRecursiveThreads(stKVDatabase *database, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
@@ -202,8 +610,9 @@ void buildRecursiveThreads(stKVDatabase *database, stList *caps, char *(*segment
     stList *records = stList_construct3(stList_length(caps), (void(*)(void *)) stKVDatabaseBulkRequest_destruct);
     for (int64_t i = 0; i < stList_length(caps); i++) {
         Cap *cap = stList_get(caps, i);
-        char *string = getThread(rh, cap, 0);
-        assert(string != NULL);
+        RecordRope *thread = getThread(rh, cap, 0);
+        char *string = recordRope_getString(thread);
+        recordRope_destruct(thread);
         stList_set(records, i, stKVDatabaseBulkRequest_constructInsertRequest(cap_getName(cap),
                                                                               string, sizeof(char)*(strlen(string)+1)));
         free(string);
@@ -224,13 +633,23 @@ void buildRecursiveThreads(stKVDatabase *database, stList *caps, char *(*segment
     stList_destruct(records);
 }
 
-stList *buildRecursiveThreadsInListP(RecordHolder *rh, stList *caps, bool deleteUsedRecords) {
+static stList *buildRecursiveThreadRopesP(RecordHolder *rh, stList *caps, bool deleteUsedRecords) {
     //Build new threads
-    stList *threadStrings = stList_construct3(stList_length(caps), free);
+    stList *threads = stList_construct3(stList_length(caps), (void (*)(void *))recordRope_destruct);
     for (int64_t i = 0; i < stList_length(caps); i++) {
         Cap *cap = stList_get(caps, i);
-        stList_set(threadStrings, i, getThread(rh, cap, deleteUsedRecords));
+        stList_set(threads, i, getThread(rh, cap, deleteUsedRecords));
     }
+    return threads;
+}
+
+stList *buildRecursiveThreadsInListP(RecordHolder *rh, stList *caps, bool deleteUsedRecords) {
+    stList *threads = buildRecursiveThreadRopesP(rh, caps, deleteUsedRecords);
+    stList *threadStrings = stList_construct3(stList_length(caps), free);
+    for (int64_t i = 0; i < stList_length(threads); i++) {
+        stList_set(threadStrings, i, recordRope_getString(stList_get(threads, i)));
+    }
+    stList_destruct(threads);
     return threadStrings;
 }
 
@@ -251,9 +670,7 @@ void buildRecursiveThreadsNoDb(RecordHolder *rh, stList *caps, char *(*segmentWr
     //Build new threads and add to cache
     for (int64_t i = 0; i < stList_length(caps); i++) {
         Cap *cap = stList_get(caps, i);
-        char *string = getThread(rh, cap, 1);
-        assert(string != NULL);
-        recordHolder_add(rh, cap_getName(cap), string);
+        recordHolder_addRope(rh, cap_getName(cap), getThread(rh, cap, 1));
     }
 }
 
@@ -264,3 +681,9 @@ stList *buildRecursiveThreadsInListNoDb(RecordHolder *rh, stList *caps, char *(*
 }
 
 
+
+stList *buildRecursiveThreadRopesNoDb(RecordHolder *rh, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
+                                      char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg) {
+    cacheNonNestedRecords(rh, caps, segmentWriteFn, terminalAdjacencyWriteFn, extraArg);
+    return buildRecursiveThreadRopesP(rh, caps, 1);
+}
@@ -15,9 +15,23 @@ Cap *getCapForReferenceEvent(End *end, Name referenceEventName);
 
 void bottomUp(Flower *flower, stKVDatabase *sequenceDatabase, Name referenceEventName, bool isTop, stMatrix *(*generateSubstitutionMatrix)(double));
 
-void bottomUpNoDb(Flower *flower, RecordHolder *rh, Name referenceEventName,
-                  bool isTop, stMatrix *(*generateSubstitutionMatrix)(double));
+void bottomUpNoDb(Flower *flower, RecordHolder *rh, stTree *phylogeneticTree, bool isTop);
 
 void topDown(Flower *flower, Name referenceEventName);
 
+/*
+ * Without a database the records are binary (see recursiveThreadBuilder.h). The payload of a segment record is
+ * a tag, saying if the segment is part of a block containing only a reference segment, followed by the bases of
+ * the segment. Terminal adjacencies have empty records. A thread is then a binary record wrapping those of its
+ * segments and adjacencies, which the bases are streamed out of into the string of the sequence.
+ */
+#define SEGMENT_RECORD_TRIVIAL 'g'
+#define SEGMENT_RECORD_NON_TRIVIAL 'b'
+
+/*
+ * Returns the string of the bases of the binary thread, setting *trivialString to non-zero if all its segments
+ * are trivial.
+ */
+char *getThreadStringFromBinaryThread(RecordRope *thread, bool *trivialString);
+
 #endif /* ADDREFERENCECOORDINATES_H_ */
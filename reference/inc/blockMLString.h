@@ -10,6 +10,12 @@
 
 char *getMaximumLikelihoodString(stTree *tree, Block *block);
 
+/*
+ * Frees the scratch space the threads that called getMaximumLikelihoodString keep for it. Must not be called while
+ * any thread is in getMaximumLikelihoodString; a thread that calls it again afterwards gets new scratch space.
+ */
+void releaseMaximumLikelihoodStringScratch(void);
+
 stMatrix *generateJukesCantorMatrix(double distance);
 
 stTree *getPhylogeneticTreeRootedAtGivenEvent(Event *event, stMatrix *(*generateSubstitutionMatrix)(double));
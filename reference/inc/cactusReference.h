@@ -18,6 +18,7 @@
 
 #include "cactus.h"
 #include "stMatchingAlgorithms.h"
+#include "stReferenceProblem2.h"
 
 extern const char *REFERENCE_BUILDING_EXCEPTION;
 
@@ -27,7 +28,23 @@ extern const char *REFERENCE_BUILDING_EXCEPTION;
 void cactus_make_reference(stList *flowers, char *referenceEventString, CactusDisk *cactusDisk, CactusParams *params);
 
 /*
- * Construct a reference for the flower, top down.
+ * The reference building parameters, as read from the cactus params.
+ */
+typedef struct _referenceParameters ReferenceParameters;
+
+ReferenceParameters *referenceParameters_construct(CactusParams *params);
+
+void referenceParameters_destruct(ReferenceParameters *rp);
+
+/*
+ * Builds the reference for a single flower. The reference of the flower's parent must already have been built.
+ * Flowers in different subtrees of the hierarchy can be processed concurrently.
+ */
+void cactus_make_reference_for_flower(Flower *flower, char *referenceEventString, ReferenceParameters *rp);
+
+/*
+ * Construct a reference for the flower, top down. If samplerNumber is greater than one the ordering of the top-level
+ * flower is sampled by that many concurrent samplers, seeded from seed, and the best scoring ordering is kept.
  */
 void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader,
         int64_t permutations,
@@ -37,9 +54,39 @@ void buildReferenceTopDown(Flower *flower, const char *referenceEventHeader,
         double phi,
         int64_t maxWalkForCalculatingZ, bool ignoreUnalignedGaps,
         double wiggle, int64_t numberOfNsForScaffoldGap,
-        int64_t minNumberOfSequencesToSupportAdjacency, bool makeScaffolds);
+        int64_t minNumberOfSequencesToSupportAdjacency, bool makeScaffolds,
+        int64_t samplerNumber, int64_t seed);
 
-double *calculateZ(Flower *flower, stHash *endsToNodes, double theta);
+/*
+ * A set of adjacency scores to calculate, see calculateAdjacencyScores.
+ */
+typedef struct _adjacencyScorer {
+    int64_t maxWalk; // The number of 5' caps following each 3' cap in a thread to score against it
+    bool ignoreUnalignedGaps; // If non-zero the unaligned sequence between the caps does not count to their distance
+    bool count; // If non-zero each adjacency scores one, counting the sequences supporting it
+    double theta; // Else the adjacencies are z-scored with this theta, weighted by event
+    refAdjList *aL; // The calculated scores
+} AdjacencyScorer;
+
+/*
+ * Calculates the scores of the adjacencies between the nodes of the flower for each of the scorers, filling in
+ * their adjacency lists, walking each thread of the flower once for all of them. endsToNodes maps the ends of
+ * the flower to the nodes they represent. eventWeighting maps the events of the sequences to their weights,
+ * and may be NULL if all the scorers count.
+ */
+void calculateAdjacencyScores(Flower *flower, stHash *endsToNodes, int64_t nodeNumber, stHash *eventWeighting,
+                              AdjacencyScorer *scorers, int64_t scorerNumber);
+
+/*
+ * Samples the ordering of the empty reference ref with the given number of samplers, each seeded by the given seed
+ * plus its index, sharing out the permutation rounds between them, and keeps the ordering with the highest score,
+ * ties going to the sampler with the lowest index. The result therefore depends only on the seed and the number of
+ * samplers. The samplers other than the first are run concurrently in child processes where possible. The state of
+ * the C library's generator is restored afterwards. Returns the reference holding the chosen ordering, which
+ * replaces ref.
+ */
+refOrdering *sampleReferenceInParallel(refAdjList *aL, refAdjList *dAL, refOrdering *ref, int64_t nodeNumber, double wiggle,
+        int64_t permutations, int64_t samplerNumber, int64_t seed, void (*log_fn)(const char *, ...));
 
 /*
  * Weights events by how informative they are for inferring the
@@ -16,22 +16,143 @@ stList *buildRecursiveThreadsInList(stKVDatabase *database, stList *caps,
         char *(*segmentWriteFn)(Segment *, void *),
         char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg);
 
-typedef stHash RecordHolder;
+typedef struct _recordHolder RecordHolder;
 
+/*
+ * The records held for a thread, as a rope of fragments. Building a thread from the records of its segments
+ * and adjacencies splices their ropes together, rather than copying the bytes, so a thread is only ever
+ * materialised if asked for.
+ */
+typedef struct _recordRope RecordRope;
+
+/*
+ * An append-only scratch file that record holders can spill their records to, so that only the offsets
+ * of the records are held in memory. A spill may be shared by any number of record holders and threads.
+ */
+typedef struct _recordSpill RecordSpill;
+
+/*
+ * Records are normally null terminated strings. A record may instead be binary, in which case it
+ * starts with RECORD_BINARY_TAG, followed by the varint encoded length of its payload and then the
+ * payload, which may contain zero bytes. A thread built from binary records is itself a binary record
+ * whose payload is the concatenation of the records, so readers can treat the wrapper as transparent.
+ */
+#define RECORD_BINARY_TAG ((char)0xFF)
+
+/*
+ * The maximum number of bytes needed to varint encode a 64 bit integer.
+ */
+#define RECORD_MAX_VARINT_LENGTH 10
+
+/*
+ * Allocates a binary record with space for the given payload length, setting *payload to where
+ * the payload should be written.
+ */
+char *binaryRecord_allocate(int64_t payloadLength, char **payload);
+
+/*
+ * Constructs a binary record with a copy of the given payload.
+ */
+char *binaryRecord_construct(const char *payload, int64_t payloadLength);
+
+/*
+ * Returns non-zero if the record is binary.
+ */
+bool record_isBinary(const char *record);
+
+/*
+ * Gets the length of a record in bytes, for a binary record including the tag and length prefix,
+ * for a string not including the terminating zero.
+ */
+int64_t record_getLength(const char *record);
+
+/*
+ * Writes the unsigned LEB128 (varint) encoding of value to buffer, returning the number of bytes written.
+ */
+int64_t record_putVarint(uint64_t value, char *buffer);
+
+/*
+ * Reads a varint from *buffer, advancing *buffer past it.
+ */
+uint64_t record_getVarint(const char **buffer);
+
+/*
+ * Constructs a spill backed by the given file. The file is unlinked as soon as it is opened, so it does not
+ * outlive the process.
+ */
+RecordSpill *recordSpill_construct(const char *file);
+
+/*
+ * As recordSpill_construct, but records are written to and read back from the file bufferSize bytes at a time,
+ * rather than a megabyte at a time.
+ */
+RecordSpill *recordSpill_construct2(const char *file, int64_t bufferSize);
+
+/*
+ * Destructs the spill. Must only be called once the record holders and ropes using it are destructed.
+ */
+void recordSpill_destruct(RecordSpill *spill);
+
+/*
+ * Gets the number of bytes written to the spill.
+ */
+int64_t recordSpill_getLength(RecordSpill *spill);
+
+void recordRope_destruct(RecordRope *rope);
+
+/*
+ * Gets the length in bytes of the rope.
+ */
+int64_t recordRope_getLength(RecordRope *rope);
+
+/*
+ * Calls fn on the bytes of the rope in order, in one or more pieces. Spilled bytes are read back in
+ * bounded pieces, so the rope is never held in memory as a whole.
+ */
+void recordRope_forEachPiece(RecordRope *rope, void (*fn)(const char *bytes, int64_t length, void *extraArg),
+        void *extraArg);
+
+/*
+ * Writes the bytes of the rope to the file.
+ */
+void recordRope_write(RecordRope *rope, FILE *fileHandle);
+
+/*
+ * Returns a newly allocated, null terminated copy of the rope.
+ */
+char *recordRope_getString(RecordRope *rope);
+
+/*
+ * Constructs a record holder that holds its records in memory.
+ */
 RecordHolder *recordHolder_construct();
 
+/*
+ * Constructs a record holder that writes the records it is given to the spill, if not NULL, holding only
+ * their offsets.
+ */
+RecordHolder *recordHolder_construct2(RecordSpill *spill);
+
 void recordHolder_destruct(RecordHolder *rh);
 
 int64_t recordHolder_size(RecordHolder *rh);
 
 /*
- * Removes the records from rhToAdd and puts them in rhToAddTo, leaving rhToAdd empty.
+ * Removes the records from rhToAdd and puts them in rhToAddTo, then destructs rhToAdd. The two
+ * record holders must use the same spill.
  */
 void recordHolder_transferAll(RecordHolder *rhToAddTo, RecordHolder *rhToAdd);
 
 void buildRecursiveThreadsNoDb(RecordHolder *rh, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
                                char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg);
 
+/*
+ * As buildRecursiveThreadsInListNoDb, but returns the threads as a list of ropes, so they can be streamed out
+ * without being materialised.
+ */
+stList *buildRecursiveThreadRopesNoDb(RecordHolder *rh, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
+                                      char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg);
+
 stList *buildRecursiveThreadsInListNoDb(RecordHolder *rh, stList *caps, char *(*segmentWriteFn)(Segment *, void *),
                                         char *(*terminalAdjacencyWriteFn)(Cap *, void *), void *extraArg);
 
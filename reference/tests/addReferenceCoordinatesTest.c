@@ -128,6 +128,114 @@ static void testMLStringRandom(CuTest *testCase) {
     }
 }
 
+static bool getReferenceBaseProbs(stTree *tree, Block *block, double *baseProbs) {
+    /*
+     * A plain implementation of Felsenstein's algorithm, to check the ML strings against. Fills in the
+     * probabilities of each base at each position of the block, four per position, returning false if no
+     * leaf of the tree has a segment in the block.
+     */
+    int64_t length = block_getLength(block);
+    bool nonEmpty = 0;
+    double *childBaseProbs = st_malloc(sizeof(double) * 4 * length);
+    if (stTree_getChildNumber(tree) > 0) {
+        for (int64_t i = 0; i < stTree_getChildNumber(tree); i++) {
+            if (getReferenceBaseProbs(stTree_getChild(tree, i), block, childBaseProbs)) {
+                for (int64_t j = 0; j < 4 * length; j++) {
+                    baseProbs[j] = nonEmpty ? baseProbs[j] * childBaseProbs[j] : childBaseProbs[j];
+                }
+                nonEmpty = 1;
+            }
+        }
+    } else {
+        Block_InstanceIterator *segmentIt = block_getInstanceIterator(block);
+        Segment *segment;
+        while ((segment = block_getNext(segmentIt)) != NULL) {
+            if (segment_getSequence(segment) == NULL || segment_getEvent(segment) != getEvent(tree)) {
+                continue;
+            }
+            char *string = segment_getString(segment);
+            for (int64_t j = 0; j < length; j++) {
+                const char *bases = "ACGT";
+                double v[4];
+                for (int64_t k = 0; k < 4; k++) {
+                    double p = strchr(bases, toupper(string[j])) == NULL || toupper(string[j]) == bases[k] ? 1.0 : 0.0;
+                    childBaseProbs[j * 4 + k] = p;
+                }
+                stMatrix_multiplySquareMatrixAndColumnVector2(getSubMatrix(tree), &childBaseProbs[j * 4], v);
+                for (int64_t k = 0; k < 4; k++) {
+                    baseProbs[j * 4 + k] = nonEmpty ? baseProbs[j * 4 + k] * v[k] : v[k];
+                }
+            }
+            free(string);
+            nonEmpty = 1;
+        }
+        block_destructInstanceIterator(segmentIt);
+        free(childBaseProbs);
+        return nonEmpty; // Leaves are transformed base by base
+    }
+    if (nonEmpty) {
+        for (int64_t j = 0; j < length; j++) {
+            stMatrix_multiplySquareMatrixAndColumnVector2(getSubMatrix(tree), &baseProbs[j * 4], &childBaseProbs[j * 4]);
+        }
+        memcpy(baseProbs, childBaseProbs, sizeof(double) * 4 * length);
+    }
+    free(childBaseProbs);
+    return nonEmpty;
+}
+
+static void testMLStringMatchesFelsenstein(CuTest *testCase) {
+    /*
+     * Checks the most likely bases of the ML strings are those given by a plain implementation of Felsenstein's
+     * algorithm, wherever the most likely base is clear.
+     */
+    for (int64_t test = 0; test < 100; test++) {
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        eventTree_construct2(cactusDisk);
+        Flower *flower = flower_construct(cactusDisk);
+        stList *events = stList_construct();
+        stList_append(events, eventTree_getRootEvent(flower_getEventTree(flower)));
+        while (st_random() > 0.1) {
+            stList_append(events, event_construct3("Boo", st_random(), st_randomChoice(events), flower_getEventTree(flower)));
+        }
+        Block *block = block_construct(st_randomInt(1, 5000), flower);
+        int64_t segmentNumber = st_randomInt(1, 50);
+        for (int64_t i = 0; i < segmentNumber; i++) {
+            Sequence *seq = sequence_construct(0, block_getLength(block),
+                    stRandom_getRandomDNAString(block_getLength(block), 1, 0, 1),
+                    "boo", st_randomChoice(events), cactusDisk);
+            flower_addSequence(flower, seq);
+            segment_construct2(block, 0, st_random() > 0.5, seq);
+        }
+        Event *refEvent = st_randomChoice(events);
+        stTree *tree = getPhylogeneticTreeRootedAtGivenEvent(refEvent, generateJukesCantorMatrix);
+
+        char *mlString = getMaximumLikelihoodString(tree, block);
+        double *baseProbs = st_malloc(sizeof(double) * 4 * block_getLength(block));
+        if (getReferenceBaseProbs(tree, block, baseProbs) && !(block_getInstanceNumber(block) == 1
+                && segment_getEvent(block_getFirst(block)) == refEvent)) {
+            for (int64_t i = 0; i < block_getLength(block); i++) {
+                int64_t k = 0;
+                for (int64_t j = 1; j < 4; j++) {
+                    k = baseProbs[i * 4 + j] > baseProbs[i * 4 + k] ? j : k;
+                }
+                bool clear = 1;
+                for (int64_t j = 0; j < 4; j++) {
+                    clear = clear && (j == k || baseProbs[i * 4 + j] < baseProbs[i * 4 + k] * (1.0 - 1e-9));
+                }
+                if (clear && toupper(mlString[i]) != 'N') {
+                    CuAssertIntEquals(testCase, "ACGT"[k], toupper(mlString[i]));
+                }
+            }
+        }
+
+        free(baseProbs);
+        free(mlString);
+        cleanupPhylogeneticTree(tree);
+        stList_destruct(events);
+        cactusDisk_destruct(cactusDisk);
+    }
+}
+
 static void testMLStringMakesScaffoldGaps(CuTest *testCase) {
     /*
      * Simply test that scaffold gaps created where the reference does
@@ -162,6 +270,7 @@ static void testMLStringMakesScaffoldGaps(CuTest *testCase) {
 CuSuite* addReferenceCoordinatesTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testMLStringRandom);
+    SUITE_ADD_TEST(suite, testMLStringMatchesFelsenstein);
     SUITE_ADD_TEST(suite, testMLStringMakesScaffoldGaps);
 
     return suite;
@@ -84,8 +84,306 @@ static void testEventWeighting(CuTest *testCase) {
     stSet_destruct(chosenEvents);
 }
 
+/*
+ * Makes a random flower whose threads run through chains of blocks, each thread traversing whole chains in either
+ * direction, with gaps of unaligned sequence between the blocks. The ends at the two ends of each chain, and some
+ * of the stub ends, are mapped to nodes, as the chain nodes and tangle stub nodes of a flower are.
+ */
+static Flower *getRandomFlower(CactusDisk *cactusDisk, stHash *endsToNodes, int64_t *nodeNumber, stHash *eventWeighting) {
+    Flower *flower = flower_construct(cactusDisk);
+    stList *events = stList_construct();
+    stList_append(events, eventTree_getRootEvent(flower_getEventTree(flower)));
+    while (st_random() > 0.3) {
+        stList_append(events, event_construct3("event", st_random(), st_randomChoice(events), flower_getEventTree(flower)));
+    }
+    for (int64_t i = 0; i < stList_length(events); i++) {
+        stHash_insert(eventWeighting, stList_get(events, i), stDoubleTuple_construct(1, st_random()));
+    }
+
+    int64_t node = 1;
+    stList *chains = stList_construct3(0, (void (*)(void *)) stList_destruct);
+    for (int64_t i = st_randomInt(1, 6); i > 0; i--) {
+        stList *blocks = stList_construct();
+        for (int64_t j = st_randomInt(1, 4); j > 0; j--) {
+            stList_append(blocks, block_construct(st_randomInt(1, 5), flower));
+        }
+        stHash_insert(endsToNodes, block_get5End(stList_get(blocks, 0)), stIntTuple_construct1(node));
+        stHash_insert(endsToNodes, block_get3End(stList_peek(blocks)), stIntTuple_construct1(-node));
+        node++;
+        stList_append(chains, blocks);
+    }
+
+    for (int64_t i = st_randomInt(1, 10); i > 0; i--) {
+        // Choose the chains of the thread, their orientations and the gaps between the blocks
+        stList *blocks = stList_construct(), *strands = stList_construct(), *gaps = stList_construct();
+        int64_t length = 0;
+        for (int64_t j = st_randomInt(0, 6); j >= 0; j--) {
+            int64_t gap = st_randomInt(j == 0 ? 1 : 0, 20); // The final gap is not empty, so neither is the sequence
+            stList_append(gaps, (void *) gap);
+            length += gap;
+            if (j == 0) {
+                break;
+            }
+            stList *chain = st_randomChoice(chains);
+            bool strand = st_random() > 0.5;
+            for (int64_t k = 0; k < stList_length(chain); k++) {
+                Block *block = stList_get(chain, strand ? k : stList_length(chain) - 1 - k);
+                stList_append(blocks, block);
+                stList_append(strands, (void *) (int64_t) strand);
+                length += block_getLength(block);
+                if (k + 1 < stList_length(chain)) {
+                    gap = st_randomInt(0, 20);
+                    stList_append(gaps, (void *) gap);
+                    length += gap;
+                }
+            }
+        }
+
+        // Make the thread, from a stub cap just before the sequence to one just after it
+        char *string = stRandom_getRandomDNAString(length, 1, 0, 1);
+        Sequence *sequence = sequence_construct(2, length, string, "thread", st_randomChoice(events), cactusDisk);
+        free(string);
+        flower_addSequence(flower, sequence);
+        End *end = end_construct2(0, 0, flower);
+        if (st_random() > 0.5) {
+            stHash_insert(endsToNodes, end, stIntTuple_construct1(node++));
+        }
+        Cap *cap = cap_construct2(end, 1, 1, sequence);
+        int64_t coordinate = 2;
+        for (int64_t j = 0; j < stList_length(blocks); j++) {
+            coordinate += (int64_t) stList_get(gaps, j);
+            Segment *segment = segment_construct2(stList_get(blocks, j), coordinate, stList_get(strands, j) != NULL, sequence);
+            segment = stList_get(strands, j) != NULL ? segment : segment_getReverse(segment);
+            cap_makeAdjacent(cap, segment_get5Cap(segment));
+            cap = segment_get3Cap(segment);
+            coordinate += segment_getLength(segment);
+        }
+        coordinate += (int64_t) stList_peek(gaps);
+        assert(coordinate == length + 2);
+        end = end_construct2(1, 0, flower);
+        if (st_random() > 0.5) {
+            stHash_insert(endsToNodes, end, stIntTuple_construct1(node++));
+        }
+        cap_makeAdjacent(cap, cap_construct2(end, coordinate, 1, sequence));
+        stList_destruct(blocks);
+        stList_destruct(strands);
+        stList_destruct(gaps);
+    }
+    *nodeNumber = node - 1;
+    stList_destruct(chains);
+    stList_destruct(events);
+    return flower;
+}
+
+/*
+ * A straightforward calculation of the adjacency scores of a flower, to check calculateAdjacencyScores against,
+ * which for each thread lists the caps of the nodes, then finds the length of sequence following each cap before
+ * another cap of a node is reached through a segment.
+ */
+
+static stList *getThreadCaps(Cap *cap, stHash *endsToNodes) {
+    stList *caps = stList_construct();
+    while (1) {
+        if (stHash_search(endsToNodes, end_getPositiveOrientation(cap_getEnd(cap))) != NULL) {
+            stList_append(caps, cap);
+        }
+        cap = cap_getAdjacency(cap);
+        End *end = end_getPositiveOrientation(cap_getEnd(cap));
+        if (stHash_search(endsToNodes, end) != NULL) {
+            stList_append(caps, cap);
+        }
+        if (end_isStubEnd(end)) {
+            return caps;
+        }
+        cap = cap_getOtherSegmentCap(cap);
+    }
+}
+
+static int64_t getCapSize(Cap *cap, stHash *endsToNodes) {
+    Sequence *sequence = cap_getSequence(cap);
+    Cap *otherCap = cap;
+    while (1) {
+        otherCap = cap_getOtherSegmentCap(otherCap);
+        if (otherCap == NULL || stHash_search(endsToNodes, end_getPositiveOrientation(cap_getEnd(otherCap))) != NULL) {
+            break;
+        }
+        otherCap = cap_getAdjacency(otherCap);
+        if (end_isStubEnd(cap_getEnd(otherCap))) {
+            otherCap = NULL;
+            break;
+        }
+    }
+    int64_t size;
+    if (otherCap == NULL) {
+        size = cap_getSide(cap) ? sequence_getLength(sequence) + sequence_getStart(sequence) - cap_getCoordinate(cap) :
+               cap_getCoordinate(cap) - sequence_getStart(sequence) + 1;
+    } else {
+        size = cap_getSide(cap) ? cap_getCoordinate(otherCap) - cap_getCoordinate(cap) + 1 :
+               cap_getCoordinate(cap) - cap_getCoordinate(otherCap) + 1;
+    }
+    return size == 0 ? 1 : size;
+}
+
+static int64_t getNode(Cap *cap, stHash *endsToNodes) {
+    return stIntTuple_get(stHash_search(endsToNodes, end_getPositiveOrientation(cap_getEnd(cap))), 0);
+}
+
+static refAdjList *calculateAdjacencyScoresStraightforwardly(Flower *flower, stHash *endsToNodes, int64_t nodeNumber,
+                                                             stHash *eventWeighting, AdjacencyScorer *scorer) {
+    refAdjList *aL = refAdjList_construct(nodeNumber);
+    Flower_EndIterator *endIt = flower_getEndIterator(flower);
+    End *end;
+    while ((end = flower_getNextEnd(endIt)) != NULL) {
+        if (!end_isStubEnd(end)) {
+            continue;
+        }
+        End_InstanceIterator *capIt = end_getInstanceIterator(end);
+        Cap *cap;
+        while ((cap = end_getNext(capIt)) != NULL) {
+            cap = cap_getStrand(cap) ? cap : cap_getReverse(cap);
+            if (cap_getSide(cap) || cap_getSequence(cap) == NULL) {
+                continue;
+            }
+            stList *caps = getThreadCaps(cap, endsToNodes);
+            for (int64_t i = (stList_length(caps) > 0 && cap_getSide(stList_get(caps, 0))) ? 1 : 0; i < stList_length(caps); i += 2) {
+                Cap *_3Cap = stList_get(caps, i);
+                int64_t unaligned = 0;
+                for (int64_t k = 0; k < scorer->maxWalk && k * 2 + i + 1 < stList_length(caps); k++) {
+                    Cap *_5Cap = stList_get(caps, k * 2 + i + 1);
+                    if (scorer->ignoreUnalignedGaps) {
+                        unaligned += cap_getCoordinate(_5Cap) - cap_getCoordinate(cap_getAdjacency(_5Cap)) - 1;
+                    }
+                    int64_t diff = cap_getCoordinate(_5Cap) - cap_getCoordinate(_3Cap) - unaligned;
+                    double score = 1.0;
+                    if (!scorer->count) {
+                        double weight = stDoubleTuple_getPosition(stHash_search(eventWeighting, cap_getEvent(_5Cap)), 0);
+                        if (calculateZScore(1, 1, diff, scorer->theta) * weight < 0.0000000001) {
+                            break;
+                        }
+                        score = calculateZScore(getCapSize(_5Cap, endsToNodes), getCapSize(_3Cap, endsToNodes), diff, scorer->theta) * weight;
+                    }
+                    refAdjList_addToWeight(aL, getNode(_3Cap, endsToNodes), getNode(_5Cap, endsToNodes), score <= 0.0 ? 1e-10 : score);
+                }
+            }
+            stList_destruct(caps);
+        }
+        end_destructInstanceIterator(capIt);
+    }
+    flower_destructEndIterator(endIt);
+    return aL;
+}
+
+static void testCalculateAdjacencyScores(CuTest *testCase) {
+    /*
+     * Checks the scores calculated together, as the reference is built, against those calculated one at a time by
+     * the straightforward calculation.
+     */
+    for (int64_t test = 0; test < 100; test++) {
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        eventTree_construct2(cactusDisk);
+        stHash *endsToNodes = stHash_construct2(NULL, (void (*)(void *)) stIntTuple_destruct);
+        stHash *eventWeighting = stHash_construct2(NULL, (void (*)(void *)) stDoubleTuple_destruct);
+        int64_t nodeNumber;
+        Flower *flower = getRandomFlower(cactusDisk, endsToNodes, &nodeNumber, eventWeighting);
+        bool ignoreUnalignedGaps = st_random() > 0.5;
+        AdjacencyScorer scorers[4] = {
+                { st_random() > 0.2 ? st_randomInt(1, 5) : INT64_MAX, ignoreUnalignedGaps, 0, st_random() * 0.2, NULL },
+                { 1, ignoreUnalignedGaps, 0, 0.0, NULL },
+                { 1, 1, 1, 0.0, NULL },
+                { INT64_MAX, 0, 1, 0.0, NULL } };
+        calculateAdjacencyScores(flower, endsToNodes, nodeNumber, eventWeighting, scorers, 4);
+        for (int64_t i = 0; i < 4; i++) {
+            refAdjList *aL = calculateAdjacencyScoresStraightforwardly(flower, endsToNodes, nodeNumber, eventWeighting, &scorers[i]);
+            for (int64_t node1 = -nodeNumber; node1 <= nodeNumber; node1++) {
+                for (int64_t node2 = -nodeNumber; node2 <= nodeNumber; node2++) {
+                    if (node1 != 0 && node2 != 0) {
+                        CuAssertDblEquals(testCase, refAdjList_getWeight(aL, node1, node2),
+                                          refAdjList_getWeight(scorers[i].aL, node1, node2), 1e-9);
+                    }
+                }
+            }
+            refAdjList_destruct(aL);
+            refAdjList_destruct(scorers[i].aL);
+        }
+        stHash_destruct(endsToNodes);
+        stHash_destruct(eventWeighting);
+        cactusDisk_destruct(cactusDisk);
+    }
+}
+
+static refOrdering *getEmptyReference(int64_t chainNumber, int64_t stubPairNumber) {
+    refOrdering *ref = reference_construct(chainNumber + 2 * stubPairNumber);
+    for (int64_t i = 0; i < stubPairNumber; i++) {
+        reference_makeNewInterval(ref, -(chainNumber + 2 * i + 1), chainNumber + 2 * i + 2);
+    }
+    return ref;
+}
+
+static stList *getOrdering(refOrdering *ref) {
+    /*
+     * Gets the nodes of the reference, interval by interval, in the order they are traversed.
+     */
+    stList *ordering = stList_construct3(0, (void (*)(void *)) stIntTuple_destruct);
+    for (int64_t i = 0; i < reference_getIntervalNumber(ref); i++) {
+        int64_t n = reference_getFirstOfInterval(ref, i);
+        stList_append(ordering, stIntTuple_construct1(n));
+        while ((n = reference_getNext(ref, -n)) != INT64_MAX) {
+            stList_append(ordering, stIntTuple_construct1(n));
+        }
+    }
+    return ordering;
+}
+
+static void testSampleReferenceInParallel(CuTest *testCase) {
+    /*
+     * Checks that sampling with several samplers and a fixed seed gives the same ordering each time and leaves the
+     * state of the C library's generator as it found it.
+     */
+    for (int64_t test = 0; test < 10; test++) {
+        int64_t chainNumber = st_randomInt(1, 30);
+        int64_t stubPairNumber = st_randomInt(1, 4);
+        int64_t nodeNumber = chainNumber + 2 * stubPairNumber;
+        refAdjList *aL = refAdjList_construct(nodeNumber);
+        refAdjList *dAL = refAdjList_construct(nodeNumber);
+        for (int64_t i = 0; i < 5 * nodeNumber; i++) {
+            int64_t node1 = st_randomInt(1, nodeNumber + 1) * (st_random() > 0.5 ? 1 : -1);
+            int64_t node2 = st_randomInt(1, nodeNumber + 1) * (st_random() > 0.5 ? 1 : -1);
+            double weight = st_random();
+            refAdjList_addToWeight(aL, node1, node2, weight);
+            if (st_random() > 0.7) {
+                refAdjList_addToWeight(dAL, node1, node2, weight);
+            }
+        }
+        int64_t samplerNumber = st_randomInt(2, 5);
+        int64_t seed = st_randomInt(0, 1000000);
+
+        stList *orderings[2];
+        for (int64_t run = 0; run < 2; run++) {
+            srandom(seed);
+            int64_t expectedRandom = random();
+            srandom(seed);
+            refOrdering *ref = getEmptyReference(chainNumber, stubPairNumber);
+            ref = sampleReferenceInParallel(aL, dAL, ref, nodeNumber, 2.0, 10, samplerNumber, seed, st_logDebug);
+            CuAssertIntEquals(testCase, expectedRandom, random());
+            orderings[run] = getOrdering(ref);
+            reference_destruct(ref);
+        }
+        CuAssertIntEquals(testCase, stList_length(orderings[0]), stList_length(orderings[1]));
+        for (int64_t i = 0; i < stList_length(orderings[0]); i++) {
+            CuAssertIntEquals(testCase, stIntTuple_get(stList_get(orderings[0], i), 0),
+                              stIntTuple_get(stList_get(orderings[1], i), 0));
+        }
+        stList_destruct(orderings[0]);
+        stList_destruct(orderings[1]);
+        refAdjList_destruct(aL);
+        refAdjList_destruct(dAL);
+    }
+}
+
 CuSuite* buildReferenceTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, testEventWeighting);
+    SUITE_ADD_TEST(suite, testCalculateAdjacencyScores);
+    SUITE_ADD_TEST(suite, testSampleReferenceInParallel);
     return suite;
 }
@@ -11,6 +11,7 @@
 #include "cactus.h"
 #include "CuTest.h"
 #include "recursiveThreadBuilder.h"
+#include "addReferenceCoordinates.h"
 
 static char *writeSegment(Segment *segment, void *extraArg) {
     return stString_print("%" PRIi64 " %s ", segment_getStart(segment), segment_getString(segment));
@@ -25,7 +26,7 @@ static char *writeTerminalAdjacency(Cap *cap, void *extraArg) {
     return stString_print("%" PRIi64 " %s ", cap_getCoordinate(cap), sequence_getString(sequence, cap_getCoordinate(cap)+1, cap_getCoordinate(cap_getAdjacency(cap)) - cap_getCoordinate(cap) - 1, 1));
 }
 
-static void recursiveFileBuilder_test(CuTest *testCase) {
+static void recursiveFileBuilderTest(CuTest *testCase, bool spillRecords) {
     //Make flower with two ends and 2 blocks, and one child, one empty adjacency and two containing additional blocks.
 
     const char *tempDir = "recursiveFileBuilderTestTempDir";
@@ -75,7 +76,8 @@ static void recursiveFileBuilder_test(CuTest *testCase) {
     flower_destructEndIterator(endIt);
 
     //Create the sequence database
-    RecordHolder *rh = recordHolder_construct();
+    RecordSpill *spill = spillRecords ? recordSpill_construct("recursiveFileBuilderTestTempDir/spill") : NULL;
+    RecordHolder *rh = recordHolder_construct2(spill);
     stList *caps = stList_construct();
     stList_append(caps, flower_getCap(nestedFlower, cap_getName(cap1)));
     buildRecursiveThreadsNoDb(rh, caps, writeSegment, writeTerminalAdjacency, NULL);
@@ -87,13 +89,222 @@ static void recursiveFileBuilder_test(CuTest *testCase) {
 
     CuAssertIntEquals(testCase, 1, stList_length(threadStrings));
     CuAssertStrEquals(testCase, "1 ACG 3 TA ", stList_get(threadStrings, 0));
+    stList_destruct(threadStrings);
+    CuAssertIntEquals(testCase, 0, recordHolder_size(rh));
 
+    //Build the threads again, this time streaming the thread out of its rope
+    stList_pop(caps);
+    stList_append(caps, flower_getCap(nestedFlower, cap_getName(cap1)));
+    buildRecursiveThreadsNoDb(rh, caps, writeSegment, writeTerminalAdjacency, NULL);
+    stList_pop(caps);
+    stList_append(caps, cap1);
+    stList *threads = buildRecursiveThreadRopesNoDb(rh, caps, writeSegment, writeTerminalAdjacency, NULL);
+    CuAssertIntEquals(testCase, 1, stList_length(threads));
+    CuAssertIntEquals(testCase, strlen("1 ACG 3 TA "), recordRope_getLength(stList_get(threads, 0)));
+    FILE *fileHandle = tmpfile();
+    recordRope_write(stList_get(threads, 0), fileHandle);
+    rewind(fileHandle);
+    char buffer[32];
+    CuAssertTrue(testCase, fgets(buffer, sizeof(buffer), fileHandle) != NULL);
+    CuAssertStrEquals(testCase, "1 ACG 3 TA ", buffer);
+    fclose(fileHandle);
+    if (spill != NULL) {
+        CuAssertTrue(testCase, recordSpill_getLength(spill) > 0);
+    }
+
+    stList_destruct(threads);
+    stList_destruct(caps);
     recordHolder_destruct(rh);
+    if (spill != NULL) {
+        recordSpill_destruct(spill);
+    }
+    cactusDisk_destruct(cactusDisk);
     stFile_rmtree(tempDir);
 }
 
+static void recursiveFileBuilder_test(CuTest *testCase) {
+    recursiveFileBuilderTest(testCase, 0);
+}
+
+static void recursiveFileBuilder_testSpilled(CuTest *testCase) {
+    recursiveFileBuilderTest(testCase, 1);
+}
+
+static char *writeBinarySegment(Segment *segment, void *extraArg) {
+    Block *block = segment_getBlock(segment);
+    char *segmentString = segment_getString(segment);
+    char *payload;
+    char *record = binaryRecord_allocate(1 + block_getLength(block), &payload);
+    payload[0] = block_getInstanceNumber(block) == 1 ? SEGMENT_RECORD_TRIVIAL : SEGMENT_RECORD_NON_TRIVIAL;
+    memcpy(payload + 1, segmentString, block_getLength(block));
+    free(segmentString);
+    return record;
+}
+
+static char *writeBinaryTerminalAdjacency(Cap *cap, void *extraArg) {
+    return binaryRecord_construct(NULL, 0);
+}
+
+static int64_t getBinaryRecordLength(int64_t payloadLength) {
+    char buffer[RECORD_MAX_VARINT_LENGTH];
+    return 1 + record_putVarint(payloadLength, buffer) + payloadLength;
+}
+
+static Segment *addBinaryThreadBlock(Flower *flower, int64_t start, int64_t length, Sequence *sequence,
+                                     Sequence *otherSequence, bool trivial) {
+    Block *block = block_construct(length, flower);
+    Segment *segment = segment_construct2(block, start, 1, sequence);
+    if (!trivial) { // A second segment makes the block non-trivial
+        segment_construct2(block, start, 1, otherSequence);
+    }
+    return segment;
+}
+
+static void binaryThreadTest(CuTest *testCase, bool spillRecords) {
+    /*
+     * Makes a flower with one thread, passing through a block and a group whose nested flower contains further
+     * blocks, then builds the binary thread, wrapping that of the nested flower, and checks the string and
+     * triviality read back from it. The segments are long enough that their payloads need varints of more than one
+     * byte. With a spill the thread is read back a few bytes at a time, so the pieces break at arbitrary offsets.
+     */
+    const char *tempDir = "recursiveFileBuilderTestTempDir";
+    if(stFile_exists(tempDir)) {
+        stFile_rmtree(tempDir);
+    }
+    stFile_mkdir(tempDir);
+    for (int64_t test = 0; test < 100; test++) {
+        CactusDisk *cactusDisk = cactusDisk_construct();
+        eventTree_construct2(cactusDisk);
+        Flower *flower = flower_construct(cactusDisk);
+        End *end1 = end_construct2(0, 1, flower);
+        End *end2 = end_construct2(1, 1, flower);
+        Event *referenceEvent = eventTree_getRootEvent(flower_getEventTree(flower));
+
+        //Lay out the blocks of the nested flower, then the block of the top flower, with gaps between them
+        int64_t nestedBlockNumber = st_randomInt(1, 5);
+        int64_t starts[5], lengths[5];
+        bool trivials[5];
+        int64_t coordinate = 1;
+        for (int64_t i = 0; i <= nestedBlockNumber; i++) {
+            starts[i] = coordinate + st_randomInt(0, 4);
+            lengths[i] = st_randomInt(1, 300);
+            trivials[i] = st_random() > 0.3;
+            coordinate = starts[i] + lengths[i];
+        }
+        int64_t sequenceLength = coordinate - 1 + st_randomInt(0, 4);
+        char *string = st_malloc(sequenceLength + 1);
+        for (int64_t i = 0; i < sequenceLength; i++) {
+            string[i] = "ACGT"[st_randomInt(0, 4)];
+        }
+        string[sequenceLength] = '\0';
+
+        //Make the sequences and the thread of the top flower
+        Sequence *sequence1 = sequence_construct(1, sequenceLength, string, "ref sequence", referenceEvent, cactusDisk);
+        flower_addSequence(flower, sequence1);
+        Sequence *sequence2 = sequence_construct(1, sequenceLength, string, "other sequence", referenceEvent, cactusDisk);
+        flower_addSequence(flower, sequence2);
+        Cap *cap1 = cap_construct2(end1, 0, 1, sequence1);
+        Cap *cap2 = cap_construct2(end2, sequenceLength + 1, 1, sequence1);
+        Segment *segment = addBinaryThreadBlock(flower, starts[nestedBlockNumber], lengths[nestedBlockNumber],
+                                                sequence1, sequence2, trivials[nestedBlockNumber]);
+        Block *block = segment_getBlock(segment);
+        cap_makeAdjacent(cap1, segment_get5Cap(segment));
+        cap_makeAdjacent(segment_get3Cap(segment), cap2);
+
+        //Make the groups, the first nested, the second a leaf
+        Group *group1 = group_construct2(flower);
+        end_setGroup(end1, group1);
+        end_setGroup(block_get5End(block), group1);
+        Group *group2 = group_construct2(flower);
+        end_setGroup(block_get3End(block), group2);
+        end_setGroup(end2, group2);
+        Flower *nestedFlower = group_makeNestedFlower(group1);
+        if (flower_getSequence(nestedFlower, sequence_getName(sequence2)) == NULL) {
+            flower_addSequence(nestedFlower, sequence2);
+        }
+
+        //Fill in the blocks of the nested flower
+        Cap *cap = flower_getCap(nestedFlower, cap_getName(cap1));
+        for (int64_t i = 0; i < nestedBlockNumber; i++) {
+            Segment *nestedSegment = addBinaryThreadBlock(nestedFlower, starts[i], lengths[i],
+                    flower_getSequence(nestedFlower, sequence_getName(sequence1)), sequence2, trivials[i]);
+            cap_makeAdjacent(cap, segment_get5Cap(nestedSegment));
+            cap = segment_get3Cap(nestedSegment);
+        }
+        cap_makeAdjacent(cap, flower_getCap(nestedFlower, cap_getName(segment_get5Cap(segment))));
+        Group *nestedGroup = group_construct2(nestedFlower);
+        End *end;
+        Flower_EndIterator *endIt = flower_getEndIterator(nestedFlower);
+        while((end = flower_getNextEnd(endIt)) != NULL) {
+            end_setGroup(end, nestedGroup);
+        }
+        flower_destructEndIterator(endIt);
+
+        //Work out the expected thread
+        char *expectedString = st_malloc(sequenceLength + 1);
+        int64_t expectedStringLength = 0;
+        bool expectedTrivialString = 1;
+        int64_t nestedPayloadLength = getBinaryRecordLength(0);
+        for (int64_t i = 0; i <= nestedBlockNumber; i++) {
+            memcpy(expectedString + expectedStringLength, string + starts[i] - 1, lengths[i]);
+            expectedStringLength += lengths[i];
+            expectedTrivialString = expectedTrivialString && trivials[i];
+            if (i < nestedBlockNumber) {
+                nestedPayloadLength += getBinaryRecordLength(1 + lengths[i]) + getBinaryRecordLength(0);
+            }
+        }
+        expectedString[expectedStringLength] = '\0';
+        int64_t payloadLength = getBinaryRecordLength(nestedPayloadLength) +
+                getBinaryRecordLength(1 + lengths[nestedBlockNumber]) + getBinaryRecordLength(0);
+
+        //Build the nested thread, then the thread wrapping it, and read it back
+        RecordSpill *spill = spillRecords ?
+                recordSpill_construct2("recursiveFileBuilderTestTempDir/spill", st_randomInt(1, 20)) : NULL;
+        RecordHolder *rh = recordHolder_construct2(spill);
+        stList *caps = stList_construct();
+        stList_append(caps, flower_getCap(nestedFlower, cap_getName(cap1)));
+        buildRecursiveThreadsNoDb(rh, caps, writeBinarySegment, writeBinaryTerminalAdjacency, NULL);
+        stList_pop(caps);
+        stList_append(caps, cap1);
+        stList *threads = buildRecursiveThreadRopesNoDb(rh, caps, writeBinarySegment, writeBinaryTerminalAdjacency, NULL);
+        CuAssertIntEquals(testCase, 1, stList_length(threads));
+        CuAssertIntEquals(testCase, 0, recordHolder_size(rh));
+        CuAssertIntEquals(testCase, getBinaryRecordLength(payloadLength), recordRope_getLength(stList_get(threads, 0)));
+        bool trivialString;
+        char *threadString = getThreadStringFromBinaryThread(stList_get(threads, 0), &trivialString);
+        CuAssertStrEquals(testCase, expectedString, threadString);
+        CuAssertIntEquals(testCase, expectedTrivialString, trivialString);
+        if (spill != NULL) {
+            CuAssertTrue(testCase, recordSpill_getLength(spill) > 0);
+        }
+
+        free(threadString);
+        free(expectedString);
+        free(string);
+        stList_destruct(threads);
+        stList_destruct(caps);
+        recordHolder_destruct(rh);
+        if (spill != NULL) {
+            recordSpill_destruct(spill);
+        }
+        cactusDisk_destruct(cactusDisk);
+    }
+    stFile_rmtree(tempDir);
+}
+
+static void recursiveFileBuilder_testBinary(CuTest *testCase) {
+    binaryThreadTest(testCase, 0);
+}
+
+static void recursiveFileBuilder_testBinarySpilled(CuTest *testCase) {
+    binaryThreadTest(testCase, 1);
+}
+
 CuSuite* recursiveThreadBuilderTestSuite(void) {
     CuSuite* suite = CuSuiteNew();
     SUITE_ADD_TEST(suite, recursiveFileBuilder_test);
+    SUITE_ADD_TEST(suite, recursiveFileBuilder_testSpilled);
+    SUITE_ADD_TEST(suite, recursiveFileBuilder_testBinary);
+    SUITE_ADD_TEST(suite, recursiveFileBuilder_testBinarySpilled);
     return suite;
 }
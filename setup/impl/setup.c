@@ -248,6 +248,12 @@ Flower *cactus_setup_first_flower(CactusDisk *cactusDisk, CactusParams *params,
         stList_destruct(outgroupEventsList);
     }
 
+    //////////////////////////////////////////////
+    //The event tree is now complete, so index it for common ancestor queries.
+    //////////////////////////////////////////////
+
+    eventTree_freeze(eventTree);
+
     //////////////////////////////////////////////
     //Construct the terminal group.
     //////////////////////////////////////////////